@@ -0,0 +1,524 @@
+"""Benchmark suite for the L2CAP programs, run over several nodes.
+
+Starts l2cap-server on one node and l2cap-client on the others over ssh,
+once for every combination of the swept parameters, and collects the
+summaries the programs print into one table of results, as JSON and CSV.
+"""
+from typing import Dict, List, Tuple, Union
+import argparse
+import csv
+import itertools
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import threading
+import time
+from datetime import datetime
+
+# ------ [ Constants ] --------------------------------------------------------
+
+RE_NUMBER: str = r"(-?\d+(?:\.\d+)?)"
+RE_BT_ADDR: str = r"[A-F\d]{2}:[A-F\d]{2}:[A-F\d]{2}:[A-F\d]{2}:[A-F\d]{2}:" \
+                  r"[A-F\d]{2}"
+
+# Lines the server prints once it listens
+RE_SERVER_READY: str = r"^(Running benchmark, waiting for payloads|" \
+                       r"Echoing packets back to the clients)\.$"
+
+# Summary of a histogram, see print_histogram() in libl2capx
+RE_HISTOGRAM: str = r" \(us\): min " + RE_NUMBER + r", mean " + RE_NUMBER + \
+                    r", p50 " + RE_NUMBER + r", p90 " + RE_NUMBER + \
+                    r", p99 " + RE_NUMBER + r", p99\.9 " + RE_NUMBER + \
+                    r", max " + RE_NUMBER + r"$"
+HISTOGRAM_FIELDS: Tuple[str, ...] = \
+    ("min", "mean", "p50", "p90", "p99", "p99_9", "max")
+
+# Lines of the client's summary and the fields they fill, the last match of
+# a line wins
+CLIENT_SUMMARY: List[Tuple[str, Tuple[str, ...]]] = [
+    (r"^Negotiated MTU: incoming (\d+) bytes, outgoing (\d+) bytes$",
+     ("imtu", "omtu")),
+    (r"^L2CAP mode: (\w+)", ("l2cap_mode",)),
+    (r"LE connection parameters: interval " + RE_NUMBER + r" ms, latency "
+     r"(\d+), supervision timeout (\d+) ms$",
+     ("interval_ms", "latency", "supervision_timeout_ms")),
+    (r"^LE PHY: tx (\S+), rx (\S+)$", ("tx_phy", "rx_phy")),
+    (r"^Benchmark sent (\d+) bytes in (\d+) packets",
+     ("sent_bytes", "sent_packets")),
+    (r"^Benchmark throughput: " + RE_NUMBER + r" MB/s \(" + RE_NUMBER +
+     r" kbit/s\), " + RE_NUMBER + r" packets/s$",
+     ("throughput_mb_s", "throughput_kbit_s", "packets_s")),
+    (r"^Benchmark cpu: " + RE_NUMBER + r" s with the (\w+) engine, " +
+     RE_NUMBER + r" ms per MB$", ("cpu_s", "engine", "cpu_ms_per_mb")),
+    (r"^Benchmark requests: (\d+) replies, (\d+) timeouts$",
+     ("replies", "timeouts")),
+    (r"^Benchmark schedule lag" + RE_HISTOGRAM,
+     tuple("lag_" + field + "_us" for field in HISTOGRAM_FIELDS)),
+    (r"^Benchmark RTT" + RE_HISTOGRAM,
+     tuple("rtt_" + field + "_us" for field in HISTOGRAM_FIELDS)),
+    (r"^HCI: sent (\d+) ACL packets \((\d+) bytes\), received (\d+) ACL "
+     r"packets \((\d+) bytes\), (\d+) tx errors, (\d+) rx errors$",
+     ("hci_tx_packets", "hci_tx_bytes", "hci_rx_packets", "hci_rx_bytes",
+      "hci_tx_errors", "hci_rx_errors")),
+]
+
+# Lines the server prints for a connection, after the prefix of its address
+SERVER_SUMMARY: List[Tuple[str, Tuple[str, ...]]] = [
+    (r"received (\d+) bytes in (\d+) packets",
+     ("server_received_bytes", "server_received_packets")),
+    (r"throughput: " + RE_NUMBER + r" MB/s",
+     ("server_throughput_mb_s",)),
+    (r"sequence: (\d+) payloads lost, (\d+) out of order$",
+     ("server_lost", "server_out_of_order")),
+    (r"cpu: " + RE_NUMBER + r" s with the \w+ engine, " + RE_NUMBER +
+     r" ms per MB$", ("server_cpu_s", "server_cpu_ms_per_mb")),
+]
+
+# Columns of the results, in the order of the CSV file
+PARAMETER_FIELDS: Tuple[str, ...] = \
+    ("run", "repeat", "client", "mtu", "conn_interval", "phy", "mode",
+     "profile", "status")
+RESULT_FIELDS: Tuple[str, ...] = PARAMETER_FIELDS + tuple(itertools.chain(
+    *(fields for _, fields in CLIENT_SUMMARY),
+    *(fields for _, fields in SERVER_SUMMARY)))
+
+# How long to wait for the server to listen, and for it to report the
+# connections after the clients are done
+SERVER_START_TIMEOUT_S: float = 15.0
+SERVER_REPORT_WAIT_S: float = 2.0
+
+
+# ------ [ Helper Methods ] ---------------------------------------------------
+
+
+def parse_summary(lines: List[str],
+                  patterns: List[Tuple[str, Tuple[str, ...]]],
+                  prefix: str = "") -> Dict[str, Union[int, float, str]]:
+    """Get the fields of a summary from the output of a program.
+
+    :param lines: The lines of output.
+    :param patterns: The summary lines to look for and the fields they fill.
+    :param prefix: The prefix the summary lines start with.
+    :return: The fields found.
+    """
+    fields = {}
+
+    for line in lines:
+        if not line.startswith(prefix):
+            continue
+
+        for pattern, names in patterns:
+            match = re.search(pattern, line[len(prefix):])
+            if match is None:
+                continue
+
+            for name, value in zip(names, match.groups()):
+                fields[name] = to_number(value)
+
+    return fields
+
+
+def to_number(value: str) -> Union[int, float, str]:
+    """Turn a field of a summary into a number when it is one.
+
+    :param value: The field as printed.
+    :return: The field as an int or a float, or the text.
+    """
+    for kind in (int, float):
+        try:
+            return kind(value)
+        except ValueError:
+            pass
+
+    return value
+
+
+def server_prefixes(lines: List[str]) -> List[str]:
+    """Get the prefixes the server printed its connections with.
+
+    :param lines: The lines of output of the server.
+    :return: One prefix per connection, in the order they were accepted.
+    """
+    prefixes = []
+
+    for line in lines:
+        match = re.match(r"^\[(" + RE_BT_ADDR + r")\] ", line)
+        if match is not None and match.group(0) not in prefixes:
+            prefixes.append(match.group(0))
+
+    return prefixes
+
+
+def parse_client_spec(spec: str) -> Tuple[str, Union[str, None]]:
+    """Split a client given as HOST or HOST=ADDRESS.
+
+    :param spec: The client.
+    :return: The ssh host and the Bluetooth address, if given.
+    """
+    host, _, address = spec.partition("=")
+    return host, address.upper() if address else None
+
+
+# ------ [ Nodes ] ------------------------------------------------------------
+
+
+class Node:
+    """A node reached over ssh, with the repository at a directory."""
+
+    def __init__(self, ssh: List[str], host: str, directory: str,
+                 sudo: bool) -> None:
+        """
+        :param ssh: The ssh command and its options.
+        :param host: The host to log in to.
+        :param directory: The directory of the repository on the node.
+        :param sudo: Whether to run the programs as root.
+        """
+        self.ssh = ssh
+        self.host = host
+        self.directory = directory
+        self.sudo = sudo
+
+    def command(self, program: str, arguments: List[str]) -> List[str]:
+        """Get the command line to run a program of the repository.
+
+        :param program: The program, relative to the directory.
+        :param arguments: The arguments of the program.
+        :return: The local command line.
+        """
+        remote = ["stdbuf", "-oL", "-eL", program] + arguments
+        if self.sudo:
+            remote.insert(0, "sudo")
+
+        return self.ssh + [self.host,
+                           "cd " + shlex.quote(self.directory) + " && exec " +
+                           " ".join(shlex.quote(word) for word in remote)]
+
+    def start(self, program: str, arguments: List[str]) -> subprocess.Popen:
+        """Start a program of the repository.
+
+        :param program: The program, relative to the directory.
+        :param arguments: The arguments of the program.
+        :return: The process, its output merged into stdout.
+        """
+        return subprocess.Popen(self.command(program, arguments),
+                                stdin=subprocess.DEVNULL,
+                                stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT, text=True)
+
+    def run(self, shell_command: str) -> int:
+        """Run a shell command in the directory.
+
+        :param shell_command: The command.
+        :return: The exit status.
+        """
+        prefix = "sudo " if self.sudo else ""
+        return subprocess.call(
+            self.ssh + [self.host, "cd " + shlex.quote(self.directory) +
+                        " && " + prefix + shell_command],
+            stdin=subprocess.DEVNULL)
+
+
+class OutputReader(threading.Thread):
+    """Collects the output of a process as it arrives."""
+
+    def __init__(self, process: subprocess.Popen) -> None:
+        """
+        :param process: The process.
+        """
+        super().__init__(daemon=True)
+        self.process = process
+        self.lines = []
+        self.ready = threading.Event()
+
+    def run(self) -> None:
+        """Read lines until the process closes its output.
+
+        :return: Nothing
+        """
+        for line in self.process.stdout:
+            line = line.rstrip("\n")
+            self.lines.append(line)
+            if re.match(RE_SERVER_READY, line):
+                self.ready.set()
+
+        self.ready.set()
+
+
+# ------ [ Benchmark Suite ] --------------------------------------------------
+
+
+def build_arguments(args: argparse.Namespace, mtu: Union[int, None],
+                    mode: Union[str, None]) -> List[str]:
+    """Get the arguments both programs are given for a run.
+
+    :param args: The arguments of the suite.
+    :param mtu: The MTU of the run, None for the default.
+    :param mode: The BR/EDR channel mode of the run, None for the default.
+    :return: The arguments.
+    """
+    arguments = []
+
+    if args.le:
+        arguments.append("--le")
+    if mtu is not None:
+        arguments += ["--mtu", str(mtu)]
+    if mode is not None:
+        arguments += ["--mode", mode]
+    if args.engine is not None:
+        arguments += ["--engine", args.engine]
+
+    return arguments
+
+
+def run_combination(args: argparse.Namespace, server: Node,
+                    clients: List[Tuple[Node, Union[str, None]]],
+                    parameters: Dict[str, Union[int, float, str, None]],
+                    log_path: str) -> List[Dict]:
+    """Run the server and the clients once with a set of parameters.
+
+    :param args: The arguments of the suite.
+    :param server: The server node.
+    :param clients: The client nodes and their Bluetooth addresses.
+    :param parameters: The swept parameters of the run.
+    :param log_path: The path to store the output of the programs at,
+    without an extension.
+    :return: One row of results per client.
+    """
+    common = build_arguments(args, parameters["mtu"], parameters["mode"])
+    profile = parameters["profile"]
+
+    # Request/response needs the echoes, the other profiles the loss count
+    echo = args.echo or profile.startswith("rr")
+    server_arguments = common + ["--echo" if echo else "--bench"]
+
+    client_arguments = common + ["--bench", "--bench-time",
+                                 str(args.bench_time)]
+    if profile != "saturate":
+        client_arguments += ["--bench-profile", profile]
+    if args.bench_sizes is not None:
+        client_arguments += ["--bench-sizes", args.bench_sizes]
+    if parameters["conn_interval"] is not None:
+        client_arguments += ["--conn-interval",
+                             str(parameters["conn_interval"])]
+    if parameters["phy"] is not None:
+        client_arguments += ["--phy", parameters["phy"]]
+    client_arguments.append(args.server_address)
+
+    server_process = server.start("./build/l2cap-server", server_arguments)
+    server_output = OutputReader(server_process)
+    server_output.start()
+
+    rows = []
+    if not server_output.ready.wait(SERVER_START_TIMEOUT_S) or \
+            server_process.poll() is not None:
+        server.run("pkill -INT -x l2cap-server")
+        server_process.wait()
+        server_output.join()
+        status = "server failed"
+    else:
+        processes = [(node, address,
+                      node.start("./build/l2cap-client", client_arguments))
+                     for node, address in clients]
+        outputs = [(node, address, process, OutputReader(process))
+                   for node, address, process in processes]
+        for _, _, _, output in outputs:
+            output.start()
+
+        for node, address, process, output in outputs:
+            process.wait()
+            output.join()
+            rows.append((node, address, process.returncode, output.lines))
+
+        time.sleep(SERVER_REPORT_WAIT_S)
+        server.run("pkill -INT -x l2cap-server")
+        server_process.wait()
+        server_output.join()
+        status = "ok"
+
+    with open(log_path + "-server.log", "w") as file:
+        file.write("\n".join(server_output.lines) + "\n")
+
+    prefixes = server_prefixes(server_output.lines)
+    results = []
+    for index, (node, address, returncode, lines) in enumerate(rows):
+        with open(log_path + "-client" + str(index) + ".log", "w") as file:
+            file.write("\n".join(lines) + "\n")
+
+        row = dict(parameters, client=node.host,
+                   status=status if returncode == 0 else
+                   "client failed (exit " + str(returncode) + ")")
+        row.update(parse_summary(lines, CLIENT_SUMMARY))
+
+        # A client that did not get to its summary did not run the benchmark
+        if row["status"] == "ok" and "throughput_mb_s" not in row:
+            row["status"] = "client failed (no summary)"
+
+        # Without its address a client's connection is only known for sure
+        # when it was the only one
+        prefix = None
+        if address is not None:
+            prefix = "[" + address + "] "
+        elif len(clients) == 1 and len(prefixes) == 1:
+            prefix = prefixes[0]
+        if prefix is not None:
+            row.update(parse_summary(server_output.lines, SERVER_SUMMARY,
+                                     prefix))
+
+        results.append(row)
+
+    if not rows:
+        results = [dict(parameters, client=node.host, status=status)
+                   for node, _ in clients]
+
+    return results
+
+
+def write_results(output_directory: str, started: str,
+                  arguments: List[str], results: List[Dict]) -> None:
+    """Write the results of the suite as JSON and CSV.
+
+    :param output_directory: The directory to write the files to.
+    :param started: When the suite started.
+    :param arguments: The command line of the suite.
+    :param results: The rows of results.
+    :return: Nothing
+    """
+    with open(os.path.join(output_directory, "results.json"), "w") as file:
+        json.dump({"started": started, "arguments": arguments,
+                   "results": results}, file, indent=2)
+        file.write("\n")
+
+    with open(os.path.join(output_directory, "results.csv"), "w",
+              newline="") as file:
+        writer = csv.DictWriter(file, fieldnames=RESULT_FIELDS,
+                                extrasaction="ignore")
+        writer.writeheader()
+        writer.writerows(results)
+
+
+def run_suite(args: argparse.Namespace) -> None:
+    """Run every combination of the swept parameters.
+
+    :param args: The arguments of the suite.
+    :return: Nothing
+    """
+    ssh = shlex.split(args.ssh)
+
+    # The LE link parameters need root on the client
+    sudo_client = args.sudo or args.conn_interval != [None] or \
+        args.phy != [None]
+    server = Node(ssh, args.server, args.directory, args.sudo)
+    clients = [(Node(ssh, host, args.directory, sudo_client), address)
+               for host, address in map(parse_client_spec, args.client)]
+
+    if args.build:
+        for node in [server] + [node for node, _ in clients]:
+            print(f"Building on {node.host}")
+            if node.run("make") != 0:
+                print(f"Build failed on {node.host}")
+                sys.exit(1)
+
+    combinations = list(itertools.product(
+        range(1, args.repeat + 1), args.mtu, args.conn_interval, args.phy,
+        args.mode, args.profile))
+
+    started = datetime.now().isoformat(timespec="seconds")
+    log_directory = os.path.join(args.output, "logs")
+    os.makedirs(log_directory, exist_ok=True)
+
+    results = []
+    for run, (repeat, mtu, interval, phy, mode, profile) in \
+            enumerate(combinations, 1):
+        parameters = {"run": run, "repeat": repeat, "mtu": mtu,
+                      "conn_interval": interval, "phy": phy, "mode": mode,
+                      "profile": profile}
+        print(f"Run {run} of {len(combinations)}: " +
+              ", ".join(f"{name} {value}" for name, value in
+                        parameters.items()
+                        if name not in ("run",) and value is not None))
+
+        rows = run_combination(args, server, clients, parameters,
+                               os.path.join(log_directory, "run" + str(run)))
+        for row in rows:
+            print(f"    {row['client']}: {row['status']}, " +
+                  (f"{row['throughput_mb_s']} MB/s"
+                   if "throughput_mb_s" in row else "no throughput"))
+
+        # Written after every run, so an aborted suite keeps what it had
+        results += rows
+        write_results(args.output, started, sys.argv[1:], results)
+
+    print(f"Results of {len(combinations)} runs in "
+          f"{os.path.join(args.output, 'results.json')} and "
+          f"{os.path.join(args.output, 'results.csv')}")
+
+
+if __name__ == '__main__':
+    # Arguments
+    parser = argparse.ArgumentParser(
+        description="Sweep the L2CAP benchmark over several nodes")
+    parser.add_argument("--server", help="ssh host of the server node",
+                        required=True, type=str)
+    parser.add_argument("--server-address",
+                        help="Bluetooth address of the server node",
+                        required=True, type=str)
+    parser.add_argument("--client",
+                        help="ssh host of a client node, as HOST or "
+                             "HOST=ADDRESS to match it with the server's "
+                             "report when there are several, repeat for "
+                             "more clients", action="append", required=True,
+                        type=str)
+    parser.add_argument("--directory",
+                        help="Directory of the repository on the nodes",
+                        default="ik2560-bluetooth-le-experiment", type=str)
+    parser.add_argument("--ssh", help="Command to reach the nodes",
+                        default="ssh -o BatchMode=yes", type=str)
+    parser.add_argument("--sudo", help="Run both programs as root",
+                        action="store_true")
+    parser.add_argument("--build", help="Run make on every node first",
+                        action="store_true")
+    parser.add_argument("--output", help="Directory for the results",
+                        default="bench-results", type=str)
+    parser.add_argument("--le", help="Benchmark over LE CoC",
+                        action="store_true")
+    parser.add_argument("--mtu", help="MTUs to sweep", nargs="+",
+                        default=[None], type=int)
+    parser.add_argument("--conn-interval",
+                        help="LE connection intervals to sweep, in ms",
+                        nargs="+", default=[None], type=float)
+    parser.add_argument("--phy", help="LE PHYs to sweep", nargs="+",
+                        choices=["1m", "2m", "coded"], default=[None],
+                        type=str)
+    parser.add_argument("--mode", help="BR/EDR channel modes to sweep",
+                        nargs="+", choices=["basic", "ertm", "streaming"],
+                        default=[None], type=str)
+    parser.add_argument("--profile",
+                        help="Traffic profiles to sweep, as for "
+                             "--bench-profile", nargs="+",
+                        default=["saturate"], type=str)
+    parser.add_argument("--bench-sizes",
+                        help="Payload sizes of every run, as for "
+                             "--bench-sizes", default=None, type=str)
+    parser.add_argument("--bench-time", help="Seconds per run", default=10,
+                        type=int)
+    parser.add_argument("--engine", help="Engine of both programs",
+                        choices=["batch", "single", "uring"], default=None,
+                        type=str)
+    parser.add_argument("--echo",
+                        help="Run the server with --echo to measure the RTT "
+                             "of every paced profile", action="store_true")
+    parser.add_argument("--repeat", help="Runs of every combination",
+                        default=1, type=int)
+    args = parser.parse_args()
+
+    if not args.le and (args.conn_interval != [None] or args.phy != [None]):
+        parser.error("--conn-interval and --phy need --le")
+    if args.le and args.mode != [None]:
+        parser.error("--mode is for BR/EDR, it cannot be combined with --le")
+    if args.bench_time <= 0 or args.repeat <= 0:
+        parser.error("--bench-time and --repeat must be positive")
+
+    run_suite(args)
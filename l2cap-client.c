@@ -2,73 +2,730 @@
  * Code is modified from:
  * https://people.csail.mit.edu/albert/bluez-intro/x559.html#l2cap-client.c
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
 #include <pthread.h>
+#include <sched.h>
+
+#include "libl2capx/l2capx.h"
 
-int FLAG_QUIT = 0;
-pthread_mutex_t flag_quit_lock;
 pthread_t thread_receiver_id, thread_sender_id;
 
+// Address type of the server on LE (see --le-random)
+uint8_t LE_ADDR_TYPE = BDADDR_LE_PUBLIC;
+
+// LE connection parameters in effect, the interval stays 0 when they were
+// not changed
+struct conn_params CONN_PARAMS = { 0 };
+
+// LE PHY and data length in effect, when --phy or --data-length was given
+struct link_settings LINK = { 0 };
+
+// Packets queued for sending at once (see --window)
+long SEND_WINDOW = 16;
+
+// Text messages coalesced into framed SDUs, and how long the first message
+// of an SDU waits for more (see --frame)
+int FRAME_MODE = 0;
+double FRAME_FLUSH_MS = 2;
+
+struct frame_stats {
+    unsigned long long messages;
+    unsigned long long sdus;
+    unsigned long long deadline_flushes;
+    uint64_t time_first;
+    uint64_t time_last;
+};
+
+struct frame_stats FRAME_STATS = { 0 };
+
+// Reconnect when the link drops and resume the session, waiting between the
+// attempts from RECONNECT_BACKOFF_MS up to the maximum (see --reconnect)
+int RECONNECT_MODE = 0;
+long RECONNECT_MAX_MS = 5000;
+#define RECONNECT_BACKOFF_MS 100
+
+// Time to wait for the server to answer a resume
+#define RESUME_TIMEOUT_MS 2000
+
+// Why the data threads stopped: the link dropped, or the user wants to quit,
+// which also ends the reconnecting
+atomic_int LINK_LOST = 0;
+atomic_int INTERRUPTED = 0;
+
+/**
+ * Resumable session with the server: its token, the SDUs sent last for
+ * sending them again, and what the reconnects cost. recovery is the time
+ * from the link drop to the resumed session.
+ */
+struct session {
+    uint64_t token;
+    struct resume_buffer sent;
+    unsigned long long reconnects;
+    unsigned long long resent;
+    unsigned long long lost;
+    unsigned long long expired;
+    struct latency_histogram recovery;
+};
+
+struct session SESSION = { 0 };
+
+// Framed SDUs compressed before sending, unless they shrink by less than
+// the minimum saving in percent (see --compress)
+int COMPRESS_MODE = 0;
+long COMPRESS_MIN_SAVING = 10;
+struct compressor COMPRESSOR;
+
+// Benchmark settings (see --bench)
+int BENCH_MODE = 0;
+long BENCH_SIZE = 0;
+long BENCH_SECONDS = 10;
+long long BENCH_BYTES = 0;
+
+// Traffic generator of the benchmark and its payload sizes, fixed at
+// --bench-size unless set (see --bench-profile and --bench-sizes)
+struct traffic_profile PROFILE = { .kind = PROFILE_SATURATE };
+int SIZES_SET = 0;
+
+/**
+ * What a paced benchmark measured: how late the payloads left against the
+ * schedule of the profile, and the round-trip times of those an echo server
+ * returned.
+ */
+struct load_stats {
+    unsigned long long replies;
+    unsigned long long timeouts;
+    struct latency_histogram lag;
+    struct latency_histogram rtt;
+};
+
+struct load_stats LOAD_STATS = { 0 };
+
+// Request a request/response benchmark waits for
+uint32_t LOAD_OUTSTANDING = 0;
+sem_t load_reply;
+
+// Adapters a striped benchmark sends from, one channel each (see --stripe)
+int STRIPE_DEVS[STRIPE_MAX];
+int STRIPE_COUNT = 0;
+
+// File transfer settings (see --send-file)
+const char *SEND_FILE_PATH = NULL;
+int FILE_CHECKSUM = 0;
+
+// Time to wait for the receiver to acknowledge a file
+#define FILE_ACK_TIMEOUT_MS 10000
+
+// Ping settings (see --ping)
+int PING_MODE = 0;
+long PING_COUNT = 1000;
+long PING_INTERVAL_MS = 0;
+long PING_SIZE = 24;
+long PING_TIMEOUT_MS = 1000;
+
+struct ping_stats {
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long late;
+    unsigned long long timeouts;
+    struct latency_histogram rtt;
+    struct latency_histogram stack_rtt;
+    struct latency_histogram tx_delay;
+    struct latency_histogram rx_delay;
+};
+
+struct ping_stats PING_STATS = {0};
+
+/**
+ * Timestamps of a ping, realtime nanoseconds, 0 until known. The sender fills
+ * in the slot before writing the ping, the receiver thread adds the kernel
+ * timestamps once they arrive.
+ */
+struct ping_stamps {
+    uint32_t seq;
+    uint64_t tx_app;
+    uint64_t tx_kernel;
+    uint64_t rx_kernel;
+};
+
+// Pings whose timestamps are kept, older ones are overwritten
+#define PING_STAMP_SLOTS 256
+struct ping_stamps PING_STAMPS[PING_STAMP_SLOTS];
+
+// Control message space for a timestamp from the error queue
+#define ERRQUEUE_CONTROL_SIZE \
+    (CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+     CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_l2)))
+
+#ifndef BT_SCM_ERROR
+#define BT_SCM_ERROR 0x04
+#endif
+
+// Log queues of the receiver and sender threads
+#define LOG_QUEUE_RECEIVER 0
+#define LOG_QUEUE_SENDER 1
+
+// CPUs of the sender and receiver threads, -1 lets a thread run anywhere
+// (see --sender-cpu and --receiver-cpu)
+long SENDER_CPU = -1;
+long RECEIVER_CPU = -1;
+
+/**
+ * File mapped for sending, the chunks are sent straight from the mapping.
+ */
+struct mapped_file {
+    char *data;
+    size_t size;
+};
+
+struct mapped_file SEND_FILE = { 0 };
+
+/**
+ * Connection shared by the sender and receiver threads, the send buffer is
+ * sized from the MTU negotiated for the channel.
+ */
+struct connection_info {
+    struct connection channel;
+    char *send_buf;
+    uint32_t rx_seq;
+    uint32_t tx_seq;
+};
+
+/**
+ * Channel of a striped benchmark, opened from its own adapter.
+ */
+struct stripe_channel {
+    struct connection_info conn;
+    int dev_id;
+    bdaddr_t local;
+    pthread_t thread;
+    int hci_stats;
+    struct hci_dev_stats hci_before;
+    uint64_t time_start;
+    uint64_t time_end;
+    unsigned long long bytes_sent;
+    unsigned long long packets_sent;
+};
+
+// Channels of a striped benchmark, they share the sequence numbers
+struct stripe_channel STRIPE_CHANNELS[STRIPE_MAX];
+uint32_t STRIPE_STREAM = 0;
+atomic_uint STRIPE_SEQ = 0;
+
+uint32_t PING_OUTSTANDING = 0;
+uint64_t PING_LAST_RTT = 0;
+sem_t ping_reply;
+
 /**
- * Get status of global quit flag.
- * @return THe status of the quit flag.
+ * Print where the sender, receiver and log writer threads run and how they
+ * are scheduled, so runs with and without isolation can be compared.
+ *
+ * @param prefix The start of the line.
  */
-int get_flag_quit() {
-    int result = 0;
-    pthread_mutex_lock(&flag_quit_lock);
-    result = FLAG_QUIT == 1;
-    pthread_mutex_unlock(&flag_quit_lock);
-    return result;
+void print_scheduling(const char *prefix) {
+    char sender[24], receiver[24], writer[24], policy[40];
+
+    if (RT_PRIORITY > 0)
+        snprintf(policy, sizeof(policy), "SCHED_FIFO priority %ld",
+                 RT_PRIORITY);
+    else
+        snprintf(policy, sizeof(policy), "SCHED_OTHER");
+
+    printf("%sscheduling: sender on %s, receiver on %s, log writer on %s, "
+           "%s, memory %slocked\n", prefix,
+           cpu_name(SENDER_CPU, sender, sizeof(sender)),
+           cpu_name(RECEIVER_CPU, receiver, sizeof(receiver)),
+           cpu_name(LOG_CPU, writer, sizeof(writer)), policy,
+           MEMORY_LOCK ? "" : "not ");
 }
 
 /**
- * Set status of global quit flag.
+ * Map a file for sending. The kernel is told it is read once from start to
+ * end, so it reads ahead and drops the pages behind.
+ *
+ * @param path The file.
+ * @param file Set to the mapping, data stays NULL for an empty file.
+ * @return 0 on success, -1 on failure.
  */
-int set_flag_quit(int status) {
-    pthread_mutex_lock(&flag_quit_lock);
-    FLAG_QUIT = status;
-    pthread_mutex_unlock(&flag_quit_lock);
+int map_file(const char *path, struct mapped_file *file) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    file->data = NULL;
+    file->size = st.st_size;
+    if (file->size > 0) {
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) {
+            file->data = NULL;
+            close(fd);
+            return -1;
+        }
+        madvise(file->data, file->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+
+    // The mapping keeps the file open
+    close(fd);
+    return 0;
 }
 
 /**
- * Thread to receive messages from the server.
+ * Unmap a file mapped with map_file().
+ * @param file The mapping.
+ */
+void unmap_file(struct mapped_file *file) {
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+/**
+ * Grow the send buffer of a socket so it holds at least the given number of
+ * bytes, smaller values keep the current size.
  *
- * @param th_args The thread argument.
- * @return Nothing
+ * @param s The socket.
+ * @param size The size to hold.
+ * @return 0 on success, -1 on failure.
  */
-void *thread_receiver(void *th_args) {
+int grow_send_buffer(int s, int size) {
+    int current;
+    socklen_t optlen = sizeof(current);
+
+    if (getsockopt(s, SOL_SOCKET, SO_SNDBUF, &current, &optlen) < 0)
+        return -1;
+
+    if (current >= size)
+        return 0;
+
+    return setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/**
+ * Set up the channel of a connected socket and allocate the send buffer from
+ * the MTU negotiated for it.
+ *
+ * @param conn The connection, with the socket set.
+ * @return 0 on success, -1 on failure.
+ */
+int setup_connection_buffers(struct connection_info *conn) {
+    if (connection_setup(&conn->channel) < 0)
+        return -1;
+
+    // One extra byte so text messages can always be null terminated
+    conn->send_buf = pool_get(&BUFFER_POOL, conn->channel.omtu + 1);
+    if (conn->send_buf == NULL)
+        return -1;
+    memset(conn->send_buf, 0, conn->channel.omtu + 1);
+
+    return 0;
+}
+
+/**
+ * Create an L2CAP socket with the requested channel mode and MTU. LE sockets
+ * are bound to an LE address before anything else so the kernel applies the
+ * LE socket options, BR/EDR sockets only when they have to leave from a
+ * given adapter.
+ *
+ * @param local The address of the adapter, BDADDR_ANY for any adapter.
+ * @return The socket, -1 on failure with the reason printed.
+ */
+int open_socket(const bdaddr_t *local) {
+    struct sockaddr_l2 loc_addr = { 0 };
+    int s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+
+    if (s < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    if (LE_MODE || bacmp(local, BDADDR_ANY) != 0) {
+        loc_addr.l2_family = AF_BLUETOOTH;
+        loc_addr.l2_bdaddr = *local;
+        loc_addr.l2_bdaddr_type = LE_MODE ? BDADDR_LE_PUBLIC : BDADDR_BREDR;
+
+        if (bind(s, (struct sockaddr *)&loc_addr, sizeof(loc_addr)) < 0 ||
+            (LE_MODE && set_le_flowctl_mode(s) < 0)) {
+            perror(LE_MODE ? "Error setting up LE socket" :
+                   "Error binding to adapter");
+            close(s);
+            return -1;
+        }
+    }
+
+    if (CHANNEL_MODE_SET && set_channel_mode(s) < 0) {
+        perror("Error selecting channel mode");
+        close(s);
+        return -1;
+    }
+
+    if (set_socket_mtu(s, REQUEST_IMTU, REQUEST_OMTU) < 0) {
+        perror("Error requesting MTU");
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/**
+ * Connect a socket to the server on PSM.
+ *
+ * @param s The socket.
+ * @param dest The address of the server.
+ * @param peer Set to the address of the server.
+ * @return 0 on success, -1 on failure.
+ */
+int connect_socket(int s, const char *dest, bdaddr_t *peer) {
+    struct sockaddr_l2 addr = { 0 };
+
+    addr.l2_family = AF_BLUETOOTH;
+    addr.l2_psm = htobs(PSM);
+    addr.l2_bdaddr_type = LE_MODE ? LE_ADDR_TYPE : BDADDR_BREDR;
+    str2ba(dest, &addr.l2_bdaddr);
+    *peer = addr.l2_bdaddr;
+
+    return connect(s, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+/**
+ * Wait until a file descriptor is ready or the quit flag is set.
+ *
+ * @param fd The file descriptor, -1 to only wait for the timeout.
+ * @param events The poll events to wait for.
+ * @param timeout_ms The timeout, -1 to wait forever.
+ * @return 1 if ready, 0 on timeout or -1 when quitting or on failure.
+ */
+int wait_for_fd(int fd, short events, int timeout_ms) {
+    struct pollfd fds[2] = {
+        { .fd = QUIT_EVENT_FD, .events = POLLIN },
+        { .fd = fd, .events = events }
+    };
+    int result;
+
+    do {
+        result = poll(fds, 2, timeout_ms);
+    } while (result < 0 && errno == EINTR && !get_flag_quit());
+
+    if (result < 0 || fds[0].revents != 0 || get_flag_quit())
+        return -1;
+
+    return result > 0;
+}
+
+/**
+ * Record the kernel timestamps of a ping, the round trip between the kernel
+ * timestamps is known once both have arrived.
+ *
+ * @param seq The number of the ping.
+ * @param tx_kernel The send timestamp, 0 if not known yet.
+ * @param rx_kernel The receive timestamp of the echo, 0 if not known yet.
+ */
+void record_ping_stamps(uint32_t seq, uint64_t tx_kernel, uint64_t rx_kernel) {
+    struct ping_stamps *stamps = &PING_STAMPS[seq % PING_STAMP_SLOTS];
+
+    // Overwritten by a newer ping
+    if (stamps->seq != seq)
+        return;
+
+    if (tx_kernel > 0)
+        stamps->tx_kernel = tx_kernel;
+    if (rx_kernel > 0)
+        stamps->rx_kernel = rx_kernel;
+
+    if (stamps->tx_kernel > 0 && stamps->rx_kernel > stamps->tx_kernel)
+        histogram_record(&PING_STATS.stack_rtt,
+                         stamps->rx_kernel - stamps->tx_kernel);
+}
+
+/**
+ * Read the send timestamps queued on the error queue of a socket. The
+ * number of the packet in the timestamp is the ping sequence number.
+ *
+ * @param s The socket.
+ */
+void read_tx_timestamps(int s) {
+    char control[ERRQUEUE_CONTROL_SIZE];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping stamps;
+    struct sock_extended_err err;
+    uint64_t stamp, tx_app;
+    int have_err;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        stamp = 0;
+        have_err = 0;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                stamp = (uint64_t)stamps.ts[0].tv_sec * 1000000000ULL +
+                        stamps.ts[0].tv_nsec;
+            }
+            else if (cmsg->cmsg_level == SOL_BLUETOOTH &&
+                     cmsg->cmsg_type == BT_SCM_ERROR &&
+                     cmsg->cmsg_len >= CMSG_LEN(sizeof(err))) {
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                have_err = err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+                           err.ee_info == SCM_TSTAMP_SND;
+            }
+        }
+
+        if (!have_err || stamp == 0)
+            continue;
+
+        tx_app = PING_STAMPS[err.ee_data % PING_STAMP_SLOTS].tx_app;
+        if (PING_STAMPS[err.ee_data % PING_STAMP_SLOTS].seq == err.ee_data &&
+            stamp > tx_app) {
+            histogram_record(&PING_STATS.tx_delay, stamp - tx_app);
+            if (LOG_PACKETS)
+                log_packet(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_TX_STAMP,
+                           err.ee_data, NULL, 0, 0, now_ns(), stamp - tx_app);
+        }
+
+        record_ping_stamps(err.ee_data, stamp, 0);
+    }
+}
+
+/**
+ * Receive a batch of packets and pass it to a consumer. Waits in poll() for
+ * the first packet, then lets the engine of the connection take whatever
+ * else has been received up to the size of the ring.
+ *
+ * @param conn The connection.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure or when quitting.
+ */
+long receive_blocking(struct connection *conn, receive_callback callback,
+                      void *ctx) {
+    long received;
+
+    for (;;) {
+        received = connection_receive(conn, callback, ctx);
+        if (received >= 0)
+            return received;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+
+        // Queued send timestamps also wake up poll(), take them first
+        if (TIMESTAMPS && PING_MODE)
+            read_tx_timestamps(conn->socket);
+
+        if (wait_for_fd(conn->receive_fd, POLLIN, -1) < 0)
+            return -1;
+    }
+}
+
+/**
+ * Write a packet to a socket, waiting in poll() while the socket is full.
+ *
+ * @param s The socket.
+ * @param buf The packet.
+ * @param len The size of the packet.
+ * @return The number of bytes written or -1 on failure or when quitting.
+ */
+long write_packet(int s, const char *buf, size_t len) {
+    long status;
+
+    for (;;) {
+        status = send(s, buf, len, MSG_DONTWAIT);
+
+        if (status >= 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return status;
+
+        if (wait_for_fd(s, POLLOUT, -1) < 0)
+            return -1;
+    }
+}
+
+/**
+ * Stop the data threads because the link dropped. Unless the client is
+ * already quitting, --reconnect then connects again.
+ */
+void link_lost() {
+    if (RECONNECT_MODE && !get_flag_quit())
+        atomic_store(&LINK_LOST, 1);
+
+    set_flag_quit(1);
+}
+
+/**
+ * Quit on SIGINT and SIGTERM, also while reconnecting.
+ * @param sig The signal.
+ */
+void handler_client_interrupt(int sig) {
+    atomic_store(&INTERRUPTED, 1);
+    handler_signal_interrupt(sig);
+}
+
+/**
+ * Send an SDU of a text session, with --reconnect it is kept for sending it
+ * again after the link dropped.
+ *
+ * @param conn The connection.
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @return The number of bytes written or -1 on failure or when quitting.
+ */
+long send_sdu(struct connection_info *conn, const char *sdu, size_t length) {
+    if (RECONNECT_MODE)
+        resume_buffer_push(&SESSION.sent, sdu, length);
+
+    return write_packet(conn->channel.socket, sdu, length);
+}
+
+/**
+ * Read a line from stdin without trailing newline, lines that do not fit
+ * the buffer are split.
+ *
+ * @param line The buffer for the line.
+ * @param size The size of the buffer, including the terminating null.
+ * @param timeout_ms How long to wait for the line, -1 to wait forever.
+ * @return 0 on success, 1 when no complete line arrived in time, -1 at the
+ * end of the input or when quitting.
+ */
+int read_stdin_line(char *line, size_t size, int timeout_ms) {
+    static char input[STDIN_LINE_MAX];
+    static size_t input_len = 0;
+    char *end;
+    size_t length, consumed;
     long bytes_read;
-    char receive_msg_buf[673] = {0};
-    int *s = (int *)th_args;
-    int quit = 0;
+    int status;
 
-    while(!quit) {
-        if (get_flag_quit())
+    for (;;) {
+        end = memchr(input, '\n', input_len);
+
+        if (end != NULL || input_len >= size - 1 ||
+            input_len == sizeof(input)) {
+            length = end != NULL ? (size_t)(end - input) : input_len;
+            consumed = end != NULL ? length + 1 : length;
+            if (length > size - 1)
+                length = consumed = size - 1;
             break;
+        }
 
-        memset(receive_msg_buf, 0, sizeof(receive_msg_buf));
-        bytes_read = read(*s, receive_msg_buf, sizeof(receive_msg_buf));
+        status = wait_for_fd(STDIN_FILENO, POLLIN, timeout_ms);
+        if (status <= 0)
+            return status < 0 ? -1 : 1;
 
-        quit = strcmp(receive_msg_buf, "bye") == 0;
+        bytes_read = read(STDIN_FILENO, input + input_len,
+                          sizeof(input) - input_len);
 
-        if( bytes_read > 0 )
-            printf("Server: %s\n", receive_msg_buf);
-        else
-            quit = 1;
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
 
-        if (quit) {
-            set_flag_quit(1);
-            pthread_cancel(thread_sender_id);
+        if (bytes_read <= 0) {
+            if (input_len == 0)
+                return -1;
+
+            // Last line without newline
+            length = consumed = input_len < size - 1 ? input_len : size - 1;
+            break;
         }
 
+        input_len += bytes_read;
+    }
+
+    memcpy(line, input, length);
+    line[length] = '\0';
+    input_len -= consumed;
+    memmove(input, input + consumed, input_len);
+
+    // Remove trailing carriage returns
+    line[strcspn(line, "\r")] = '\0';
+
+    return 0;
+}
+
+/**
+ * Log a batch of messages from the server, quit when the server says bye.
+ *
+ * @param ctx The connection.
+ * @param msgs The received packets.
+ * @param count The number of packets.
+ */
+void consume_messages(void *ctx, struct mmsghdr *msgs, unsigned int count) {
+    struct connection_info *conn = ctx;
+    uint64_t time_now = now_ns();
+    uint64_t realtime_now = TIMESTAMPS ? realtime_ns() : 0;
+    char *message;
+    unsigned int index;
+
+    for (index = 0; index < count; index++) {
+        message = msgs[index].msg_hdr.msg_iov->iov_base;
+        message[msgs[index].msg_len] = '\0';
+
+        if (LOG_MESSAGES)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_RX,
+                       conn->rx_seq, message, msgs[index].msg_len, 1,
+                       time_now, packet_stack_ns(&msgs[index].msg_hdr,
+                                                 realtime_now));
+        conn->rx_seq++;
+
+        if (strcmp(message, "bye") == 0)
+            set_flag_quit(1);
+    }
+}
+
+/**
+ * Thread to receive messages from the server.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_receiver(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+
+    while(!get_flag_quit()) {
+        if (receive_blocking(&conn->channel, consume_messages, conn) <= 0)
+            break;
     }
 
+    link_lost();
+
     pthread_exit(NULL);
 }
 
@@ -79,78 +736,2373 @@ void *thread_receiver(void *th_args) {
  * @return Nothing
  */
 void *thread_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
     long status;
-    int max_send = 672, quit = 0;
-    char send_msg[673] = {0};
-    int *s = (int *)th_args;
+    int quit = 0;
+    char *send_msg = conn->send_buf;
 
     while(quit != 1) {
         if (get_flag_quit())
             break;
 
-        memset(send_msg, 0, sizeof(send_msg));
-        fgets(send_msg, max_send, stdin);
-
-        // Remove trailing newlines
-        send_msg[strcspn(send_msg, "\n\r")] = 0;
+        // The receiver keeps running after the end of the input
+        if (read_stdin_line(send_msg, conn->channel.omtu + 1, -1) < 0)
+            break;
 
-        status = write(*s, send_msg, strlen(send_msg));
+        status = send_sdu(conn, send_msg, strlen(send_msg));
 
         if (status < 0) {
-            perror("Error sending message");
-            quit = 1;
+            if (!get_flag_quit() && !RECONNECT_MODE)
+                perror("Error sending message");
+            if (RECONNECT_MODE)
+                link_lost();
+            break;
         }
 
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX, conn->tx_seq,
+                       send_msg, status, 1, now_ns(), 0);
+        conn->tx_seq++;
+
         quit = strcmp(send_msg, "bye") == 0;
 
         // Set global quit
-        if (quit) {
+        if (quit)
             set_flag_quit(1);
-            pthread_cancel(thread_receiver_id);
-        }
 
     }
 
     pthread_exit(NULL);
 }
 
-int main(int argc, char **argv)
-{
-    struct sockaddr_l2 addr = { 0 };
-    int s;
-    long status;
-    char dest[18] = "01:23:45:67:89:AB";
+/**
+ * Send the messages coalesced in an SDU, compressed with --compress, and log
+ * each of them.
+ *
+ * @param conn The connection.
+ * @param writer The SDU.
+ * @return 0 on success, -1 on failure or when quitting.
+ */
+int frame_flush(struct connection_info *conn, struct frame_writer *writer) {
+    uint64_t time_now;
+    const char *message, *sdu = writer->buf;
+    size_t offset, sdu_len = writer->length;
+    long length;
 
-    if(argc < 2)
-    {
-        fprintf(stderr, "usage: %s <bt_addr>\n", argv[0]);
-        exit(2);
+    if (writer->count == 0)
+        return 0;
+
+    if (COMPRESS_MODE &&
+        (length = compressor_pack(&COMPRESSOR, writer->buf,
+                                  writer->length)) > 0) {
+        sdu = COMPRESSOR.buf;
+        sdu_len = length;
     }
 
-    strncpy(dest, argv[1], 18);
+    if (send_sdu(conn, sdu, sdu_len) < 0)
+        return -1;
 
-    // allocate a socket
-    s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    time_now = now_ns();
+    if (FRAME_STATS.sdus == 0)
+        FRAME_STATS.time_first = time_now;
+    FRAME_STATS.time_last = time_now;
 
-    // set the connection parameters (who to connect to)
-    addr.l2_family = AF_BLUETOOTH;
-    addr.l2_psm = htobs(0x1001);
-    str2ba( dest, &addr.l2_bdaddr );
+    if (LOG_PACKETS) {
+        offset = frame_start(writer->buf, writer->length);
+        while ((length = frame_next(writer->buf, writer->length, &offset,
+                                    &message)) >= 0)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX,
+                       conn->tx_seq++, message, length, 1, time_now, 0);
+    }
+    else {
+        conn->tx_seq += writer->count;
+    }
 
-    // connect to server
-    status = connect(s, (struct sockaddr *)&addr, sizeof(addr));
+    FRAME_STATS.messages += writer->count;
+    FRAME_STATS.sdus++;
+    frame_writer_reset(writer);
+    return 0;
+}
 
-    if (status == 0) {
-        printf("Connected to %s, begin sending messages below.\n", dest);
+/**
+ * Thread to send messages to the server coalesced into framed SDUs. An SDU
+ * is sent when the next message does not fit, when the first message has
+ * waited FRAME_FLUSH_MS or after "bye".
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_frame_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+    struct frame_writer writer;
+    size_t message_max = frame_message_max(conn->channel.omtu);
+    uint64_t time_now, flush_ns = (uint64_t)(FRAME_FLUSH_MS * 1e6);
+    char *send_msg = conn->send_buf;
+    int status, timeout_ms, quit = 0, failed = 0;
 
-        // Start threads to send and receive data
-        pthread_create(&thread_receiver_id, NULL, thread_receiver, (void *)&s);
-        pthread_create(&thread_sender_id, NULL, thread_sender, (void *)&s);
+    // The compressor and its counters last across reconnects
+    if (frame_writer_init(&writer, conn->channel.omtu) < 0 ||
+        (COMPRESS_MODE && COMPRESSOR.buf == NULL &&
+         compressor_init(&COMPRESSOR, conn->channel.omtu,
+                         COMPRESS_MIN_SAVING) < 0)) {
+        perror("Error allocating framed SDU");
+        set_flag_quit(1);
+        pthread_exit(NULL);
+    }
 
-        // Wait for threads to finish
-        pthread_join(thread_receiver_id, NULL);
-        pthread_join(thread_sender_id, NULL);
+    while (!quit && !get_flag_quit()) {
+        // Wait for the next message until the SDU is due
+        timeout_ms = -1;
+        if (writer.count > 0) {
+            time_now = now_ns();
+            timeout_ms = writer.deadline_ns > time_now ?
+                         (writer.deadline_ns - time_now + 999999) / 1000000 :
+                         0;
+        }
+
+        // The receiver keeps running after the end of the input
+        status = read_stdin_line(send_msg, message_max + 1, timeout_ms);
+        if (status < 0)
+            break;
+
+        // A message that does not fit behind the others starts the next SDU
+        if (status == 0 &&
+            frame_append(&writer, send_msg, strlen(send_msg),
+                         now_ns() + flush_ns) < 0) {
+            if (frame_flush(conn, &writer) < 0) {
+                failed = 1;
+                break;
+            }
+            frame_append(&writer, send_msg, strlen(send_msg),
+                         now_ns() + flush_ns);
+        }
+
+        if (status == 0)
+            quit = strcmp(send_msg, "bye") == 0;
+
+        if (status == 1 || now_ns() >= writer.deadline_ns)
+            FRAME_STATS.deadline_flushes++;
+        else if (!quit && frame_room(&writer) > 0)
+            continue;
+
+        if (frame_flush(conn, &writer) < 0) {
+            failed = 1;
+            break;
+        }
     }
 
+    // What is left at the end of the input, or kept to send it again
+    if (!failed && (!get_flag_quit() || atomic_load(&LINK_LOST)) &&
+        frame_flush(conn, &writer) < 0)
+        failed = 1;
+
+    if (failed && !get_flag_quit() && !RECONNECT_MODE)
+        perror("Error sending message");
+    if (failed && RECONNECT_MODE)
+        link_lost();
+
+    if (quit)
+        set_flag_quit(1);
+
+    frame_writer_free(&writer);
+    pthread_exit(NULL);
+}
+
+/**
+ * Print what a benchmark sent.
+ *
+ * @param elapsed_ns The duration of the benchmark.
+ * @param bytes_sent The bytes sent.
+ * @param packets_sent The payloads sent.
+ */
+void print_bench_sent(uint64_t elapsed_ns, unsigned long long bytes_sent,
+                      unsigned long long packets_sent) {
+    double seconds = elapsed_ns / 1e9;
+
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    if (PROFILE.kind != PROFILE_REPLAY && PROFILE.sizes.kind == SIZES_FIXED)
+        printf("Benchmark sent %llu bytes in %llu packets of %ld bytes "
+               "during %.3f s\n", bytes_sent, packets_sent,
+               PROFILE.sizes.min, seconds);
+    else
+        printf("Benchmark sent %llu bytes in %llu packets of %.1f bytes on "
+               "average during %.3f s\n", bytes_sent, packets_sent,
+               packets_sent > 0 ? (double)bytes_sent / packets_sent : 0,
+               seconds);
+    printf("Benchmark throughput: %.3f MB/s (%.1f kbit/s), %.1f packets/s\n",
+           bytes_sent / seconds / 1e6, bytes_sent * 8 / seconds / 1e3,
+           packets_sent / seconds);
+}
+
+/**
+ * Wait until a monotonic time. Most of the wait can be cut short by the quit
+ * event, the last 2 ms are slept precisely.
+ *
+ * @param due_ns The time, 0 or a past time returns at once.
+ * @return 0 at the time, -1 when quitting.
+ */
+int wait_until(uint64_t due_ns) {
+    uint64_t time_now = now_ns();
+    struct timespec due;
+
+    if (due_ns > time_now + 2000000 &&
+        wait_for_fd(-1, 0, (due_ns - time_now) / 1000000 - 1) < 0)
+        return -1;
+
+    due.tv_sec = due_ns / 1000000000ULL;
+    due.tv_nsec = due_ns % 1000000000ULL;
+    while (due_ns > now_ns() &&
+           clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) ==
+           EINTR) {
+        if (get_flag_quit())
+            return -1;
+    }
+
+    return get_flag_quit() ? -1 : 0;
+}
+
+/**
+ * Thread to send benchmark payloads to the server as fast as possible until
+ * the configured duration or byte count is reached, their sizes drawn from
+ * --bench-sizes. The send queue is kept full and submitted in batches, when
+ * the socket does not take all of it the thread waits for POLLOUT.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_bench_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+    long sent;
+    char *send_msg = conn->send_buf;
+    struct send_queue queue = { 0 };
+    struct iovec payload = { .iov_base = send_msg, .iov_len = BENCH_SIZE };
+    struct iovec stamped[2];
+    struct bench_header *headers = NULL, *header;
+    unsigned long long bytes_sent = 0, packets_sent = 0, bytes_queued = 0;
+    unsigned long long bytes;
+    uint64_t time_start, time_end, time_now, cpu_start;
+    long index, length, *lengths = NULL;
+
+    // Recognizable filler so payloads can be told apart in a capture
+    for (long i = 0; i < PROFILE.sizes.max; i++)
+        send_msg[i] = (char)('a' + i % 26);
+
+    // A queued packet keeps its header and length until it is sent, packet
+    // n of the window uses header n % window
+    headers = calloc(SEND_WINDOW, sizeof(*headers));
+    lengths = calloc(SEND_WINDOW, sizeof(*lengths));
+
+    if (send_queue_init(&queue, SEND_WINDOW) < 0 || !headers || !lengths) {
+        perror("Error allocating send queue");
+        free(headers);
+        free(lengths);
+        set_flag_quit(1);
+        pthread_exit(NULL);
+    }
+
+    stamped[1].iov_base = send_msg + sizeof(*header);
+
+    // Let the kernel take a whole window at once, it doubles the size for
+    // its bookkeeping
+    if (grow_send_buffer(conn->channel.socket, SEND_WINDOW * BENCH_SIZE) < 0)
+        perror("Error setting send buffer size");
+
+    time_start = now_ns();
+    time_end = time_start + (uint64_t)BENCH_SECONDS * 1000000000ULL;
+    time_now = time_start;
+    cpu_start = cpu_ns();
+
+    while(!get_flag_quit()) {
+        if (BENCH_SECONDS > 0 && time_now >= time_end)
+            break;
+
+        // Every queued packet shares the same payload after its header
+        while (queue.count < queue.capacity &&
+               (BENCH_BYTES == 0 ||
+                bytes_queued < (unsigned long long)BENCH_BYTES)) {
+            index = (conn->tx_seq + queue.count) % queue.capacity;
+            length = profile_size(&PROFILE);
+            lengths[index] = length;
+
+            if (length >= (long)sizeof(*header)) {
+                header = &headers[index];
+                header->magic = BENCH_MAGIC;
+                header->seq = conn->tx_seq + queue.count;
+                stamped[0].iov_base = header;
+                stamped[0].iov_len = sizeof(*header);
+                stamped[1].iov_len = length - sizeof(*header);
+                send_queue_push(&queue, stamped, 2);
+            }
+            else {
+                payload.iov_len = length;
+                send_queue_push(&queue, &payload, 1);
+            }
+            bytes_queued += length;
+        }
+
+        if (queue.count == 0)
+            break;
+
+        sent = connection_submit(&conn->channel, &queue, &bytes);
+
+        if (sent < 0) {
+            if (!get_flag_quit())
+                perror("Error sending benchmark payload");
+            break;
+        }
+
+        bytes_sent += bytes;
+        packets_sent += sent;
+
+        if (LOG_PACKETS) {
+            for (index = 0; index < sent; index++)
+                log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX,
+                           conn->tx_seq + index, send_msg,
+                           lengths[(conn->tx_seq + index) % queue.capacity],
+                           0, time_now, 0);
+        }
+        conn->tx_seq += sent;
+
+        // Socket is full, wait until it takes more
+        if (queue.count > 0 &&
+            wait_for_fd(conn->channel.socket, POLLOUT, -1) < 0)
+            break;
+
+        time_now = now_ns();
+    }
+
+    send_queue_free(&queue);
+    free(headers);
+    free(lengths);
+    log_sync();
+
+    print_bench_sent(time_now - time_start, bytes_sent, packets_sent);
+    print_cpu_usage("Benchmark ", conn->channel.engine, cpu_ns() - cpu_start,
+                    bytes_sent);
+    if (CONN_PARAMS.interval > 0)
+        print_conn_params("Benchmark ", &CONN_PARAMS);
+    if (LINK_PHY || LINK_DATA_LENGTH)
+        print_link_settings("Benchmark ", &LINK);
+    print_scheduling("Benchmark ");
+
+    set_flag_quit(1);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Thread to send benchmark payloads paced by a generator profile, one per
+ * system call at the time the profile has it due. A payload that leaves late
+ * because the link or the CPU cannot keep up records the lag. Payloads of
+ * at least a load_header carry their send time, for the round-trip time
+ * through an echo server. Request/response waits for the echo of every
+ * request, at most --ping-timeout.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_load_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+    struct load_header header = { .magic = BENCH_MAGIC };
+    char *send_msg = conn->send_buf;
+    unsigned long long bytes_sent = 0, packets_sent = 0;
+    uint64_t time_start, time_end, time_now, due_ns, cpu_start;
+    struct timespec deadline;
+    long length, status;
+    int result;
+
+    for (long i = 0; i < conn->channel.omtu; i++)
+        send_msg[i] = (char)('a' + i % 26);
+
+    // Sleeps end on time instead of up to 50 us later
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    time_start = now_ns();
+    time_end = time_start + (uint64_t)BENCH_SECONDS * 1000000000ULL;
+    time_now = time_start;
+    cpu_start = cpu_ns();
+    profile_start(&PROFILE, time_start);
+
+    while (!get_flag_quit()) {
+        if ((BENCH_SECONDS > 0 && time_now >= time_end) ||
+            (BENCH_BYTES > 0 && bytes_sent >= (unsigned long long)BENCH_BYTES))
+            break;
+
+        length = profile_next(&PROFILE, &due_ns);
+        if (length < 0)
+            break;
+        if (length > conn->channel.omtu)
+            length = conn->channel.omtu;
+
+        // A request has to carry its header to be recognized in the echo
+        if (PROFILE.kind == PROFILE_RR && length < (long)sizeof(header))
+            length = sizeof(header);
+
+        if (BENCH_SECONDS > 0 && due_ns >= time_end)
+            break;
+        if (wait_until(due_ns) < 0)
+            break;
+
+        time_now = now_ns();
+        histogram_record(&LOAD_STATS.lag,
+                         time_now > due_ns ? time_now - due_ns : 0);
+
+        header.seq = conn->tx_seq;
+        header.timestamp_ns = time_now;
+        memcpy(send_msg, &header, (size_t)length < sizeof(header) ?
+                                  (size_t)length : sizeof(header));
+
+        if (PROFILE.kind == PROFILE_RR) {
+            // Forget replies that arrived after their timeout
+            while (sem_trywait(&load_reply) == 0);
+            __atomic_store_n(&LOAD_OUTSTANDING, header.seq, __ATOMIC_RELEASE);
+        }
+
+        status = write_packet(conn->channel.socket, send_msg, length);
+
+        if (status < 0) {
+            if (!get_flag_quit())
+                perror("Error sending benchmark payload");
+            break;
+        }
+
+        bytes_sent += status;
+        packets_sent++;
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX, conn->tx_seq,
+                       send_msg, status, 0, time_now, 0);
+        conn->tx_seq++;
+
+        if (PROFILE.kind == PROFILE_RR) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += PING_TIMEOUT_MS / 1000;
+            deadline.tv_nsec += (PING_TIMEOUT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            while ((result = sem_timedwait(&load_reply, &deadline)) == -1 &&
+                   errno == EINTR);
+
+            if (result == -1 && !get_flag_quit())
+                LOAD_STATS.timeouts++;
+            profile_restart(&PROFILE, now_ns());
+        }
+
+        time_now = now_ns();
+    }
+
+    log_sync();
+
+    print_bench_sent(time_now - time_start, bytes_sent, packets_sent);
+    print_cpu_usage("Benchmark ", conn->channel.engine, cpu_ns() - cpu_start,
+                    bytes_sent);
+    if (CONN_PARAMS.interval > 0)
+        print_conn_params("Benchmark ", &CONN_PARAMS);
+    if (LINK_PHY || LINK_DATA_LENGTH)
+        print_link_settings("Benchmark ", &LINK);
+    print_scheduling("Benchmark ");
+
+    set_flag_quit(1);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Record the round-trip times of a batch of echoed benchmark payloads, and
+ * quit when the server says bye.
+ *
+ * @param ctx The connection.
+ * @param msgs The received packets.
+ * @param count The number of packets.
+ */
+void consume_load_echoes(void *ctx, struct mmsghdr *msgs, unsigned int count) {
+    struct connection_info *conn = ctx;
+    struct load_header header;
+    uint64_t time_now = now_ns();
+    unsigned int index;
+    char *packet;
+
+    for (index = 0; index < count; index++) {
+        packet = msgs[index].msg_hdr.msg_iov->iov_base;
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_RX,
+                       conn->rx_seq, packet, msgs[index].msg_len, 0,
+                       time_now, 0);
+        conn->rx_seq++;
+
+        if (msgs[index].msg_len == 3 && memcmp(packet, "bye", 3) == 0) {
+            set_flag_quit(1);
+            continue;
+        }
+
+        if (msgs[index].msg_len < sizeof(header))
+            continue;
+
+        memcpy(&header, packet, sizeof(header));
+        if (header.magic != BENCH_MAGIC || header.timestamp_ns > time_now)
+            continue;
+
+        histogram_record(&LOAD_STATS.rtt, time_now - header.timestamp_ns);
+        LOAD_STATS.replies++;
+
+        if (PROFILE.kind == PROFILE_RR &&
+            header.seq == __atomic_load_n(&LOAD_OUTSTANDING, __ATOMIC_ACQUIRE))
+            sem_post(&load_reply);
+    }
+}
+
+/**
+ * Thread to receive the echoes of a paced benchmark.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_load_receiver(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+
+    while(!get_flag_quit()) {
+        if (receive_blocking(&conn->channel, consume_load_echoes,
+                             conn) <= 0) {
+            set_flag_quit(1);
+            break;
+        }
+    }
+
+    // Wake the sender if it is waiting for a reply
+    sem_post(&load_reply);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Print the profile of a benchmark with what it measured under that load.
+ */
+void print_load_report() {
+    print_profile("Benchmark ", &PROFILE);
+
+    if (PROFILE.kind == PROFILE_SATURATE)
+        return;
+
+    if (LOAD_STATS.lag.count > 0)
+        print_histogram("Benchmark schedule lag", &LOAD_STATS.lag);
+
+    if (PROFILE.kind == PROFILE_RR)
+        printf("Benchmark requests: %llu replies, %llu timeouts\n",
+               LOAD_STATS.replies, LOAD_STATS.timeouts);
+
+    if (LOAD_STATS.rtt.count > 0)
+        print_histogram("Benchmark RTT", &LOAD_STATS.rtt);
+    else
+        printf("Benchmark RTT: no echoes, start the server with --echo to "
+               "measure it\n");
+}
+
+/**
+ * Thread to send benchmark payloads on one channel of a striped benchmark.
+ * The channels take the sequence numbers from STRIPE_SEQ as they queue
+ * payloads, so a faster channel carries a bigger share of the stream. A
+ * channel that reached the end still sends what it has queued, otherwise
+ * the server would count those payloads as lost.
+ *
+ * @param th_args The channel.
+ * @return Nothing
+ */
+void *thread_stripe_sender(void *th_args) {
+    struct stripe_channel *channel = (struct stripe_channel *)th_args;
+    struct connection_info *conn = &channel->conn;
+    struct send_queue queue = { 0 };
+    struct stripe_header *headers, *header;
+    struct iovec stamped[2];
+    unsigned long long bytes;
+    uint64_t time_end, seq_limit = 0;
+    uint32_t seq;
+    int more = 1;
+    long sent;
+
+    for (long i = 0; i < BENCH_SIZE; i++)
+        conn->send_buf[i] = (char)('a' + i % 26);
+
+    headers = calloc(SEND_WINDOW, sizeof(*headers));
+
+    if (send_queue_init(&queue, SEND_WINDOW) < 0 || !headers) {
+        perror("Error allocating send queue");
+        free(headers);
+        set_flag_quit(1);
+        pthread_exit(NULL);
+    }
+
+    stamped[1].iov_base = conn->send_buf + sizeof(*header);
+    stamped[1].iov_len = BENCH_SIZE - sizeof(*header);
+
+    if (grow_send_buffer(conn->channel.socket, SEND_WINDOW * BENCH_SIZE) < 0)
+        perror("Error setting send buffer size");
+
+    // The byte limit is for the whole stream
+    if (BENCH_BYTES > 0)
+        seq_limit = (BENCH_BYTES + BENCH_SIZE - 1) / BENCH_SIZE;
+
+    channel->time_start = now_ns();
+    channel->time_end = channel->time_start;
+    time_end = channel->time_start + (uint64_t)BENCH_SECONDS * 1000000000ULL;
+
+    while(!get_flag_quit()) {
+        if (BENCH_SECONDS > 0 && channel->time_end >= time_end)
+            more = 0;
+
+        while (more && queue.count < queue.capacity) {
+            seq = atomic_fetch_add(&STRIPE_SEQ, 1);
+            if (seq_limit > 0 && seq >= seq_limit) {
+                more = 0;
+                break;
+            }
+
+            header = &headers[(conn->tx_seq + queue.count) % queue.capacity];
+            header->magic = STRIPE_MAGIC;
+            header->seq = seq;
+            header->stream = STRIPE_STREAM;
+            header->channel = channel - STRIPE_CHANNELS;
+            header->channels = STRIPE_COUNT;
+            stamped[0].iov_base = header;
+            stamped[0].iov_len = sizeof(*header);
+            send_queue_push(&queue, stamped, 2);
+        }
+
+        if (queue.count == 0)
+            break;
+
+        sent = connection_submit(&conn->channel, &queue, &bytes);
+
+        if (sent < 0) {
+            if (!get_flag_quit())
+                fprintf(stderr, "Error sending benchmark payload from "
+                        "hci%d: %s\n", channel->dev_id, strerror(errno));
+            set_flag_quit(1);
+            break;
+        }
+
+        channel->bytes_sent += bytes;
+        channel->packets_sent += sent;
+        conn->tx_seq += sent;
+
+        if (queue.count > 0 &&
+            wait_for_fd(conn->channel.socket, POLLOUT, -1) < 0)
+            break;
+
+        channel->time_end = now_ns();
+    }
+
+    send_queue_free(&queue);
+    free(headers);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Wait for the receiver to acknowledge a file.
+ *
+ * @param s The socket.
+ * @param ack Set to the acknowledgement.
+ * @return 0 on success, -1 on timeout, failure or when quitting.
+ */
+int wait_for_file_ack(int s, struct file_ack *ack) {
+    uint64_t deadline = now_ns() + FILE_ACK_TIMEOUT_MS * 1000000ULL;
+    uint64_t time_now;
+    long received;
+
+    for (;;) {
+        received = recv(s, ack, sizeof(*ack), MSG_DONTWAIT);
+
+        // Anything else the receiver sends is skipped
+        if (received == sizeof(*ack) && ack->magic == FILE_ACK_MAGIC)
+            return 0;
+
+        if (received == 0 || (received < 0 && errno != EAGAIN &&
+                              errno != EWOULDBLOCK && errno != EINTR))
+            return -1;
+
+        if (received > 0)
+            continue;
+
+        time_now = now_ns();
+        if (time_now >= deadline ||
+            wait_for_fd(s, POLLIN, (deadline - time_now) / 1000000 + 1) <= 0)
+            return -1;
+    }
+}
+
+/**
+ * Thread to send SEND_FILE in chunks of the outgoing MTU. The chunks are
+ * queued straight from the mapping, so the file is only copied by the
+ * kernel. The throughput counts until the receiver acknowledged the file.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_file_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+    struct file_header header = { .magic = FILE_MAGIC };
+    struct chunk_header *headers = NULL, *chunk;
+    struct send_queue queue = { 0 };
+    struct iovec parts[2];
+    struct file_ack ack;
+    unsigned long long bytes, bytes_sent = 0;
+    uint64_t queued = 0, chunks_sent = 0, chunks_queued = 0;
+    uint64_t time_start, time_end, time_now;
+    size_t chunk_size, length;
+    double seconds;
+    long status, sent = 0, index;
+    int count, acked = 0;
+
+    chunk_size = conn->channel.omtu - (FILE_CHECKSUM ? sizeof(*chunk) : 0);
+
+    // A queued chunk keeps its header until it is sent, chunk n uses header
+    // n % window
+    if (FILE_CHECKSUM)
+        headers = calloc(SEND_WINDOW, sizeof(*headers));
+
+    if (send_queue_init(&queue, SEND_WINDOW) < 0 ||
+        (FILE_CHECKSUM && !headers)) {
+        perror("Error allocating send queue");
+        free(headers);
+        set_flag_quit(1);
+        pthread_exit(NULL);
+    }
+
+    if (grow_send_buffer(conn->channel.socket,
+                         SEND_WINDOW * conn->channel.omtu) < 0)
+        perror("Error setting send buffer size");
+
+    header.flags = FILE_CHECKSUM ? FILE_FLAG_CHECKSUM : 0;
+    header.size = SEND_FILE.size;
+    header.chunk_size = chunk_size;
+
+    time_start = now_ns();
+    time_now = time_start;
+
+    status = write_packet(conn->channel.socket, (const char *)&header,
+                          sizeof(header));
+
+    if (status < 0) {
+        if (!get_flag_quit())
+            perror("Error sending file header");
+    }
+    else {
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX, conn->tx_seq,
+                       (const char *)&header, sizeof(header), 0, time_now, 0);
+        conn->tx_seq++;
+    }
+
+    while (status >= 0 && !get_flag_quit()) {
+        while (queue.count < queue.capacity && queued < SEND_FILE.size) {
+            length = SEND_FILE.size - queued < chunk_size ?
+                     SEND_FILE.size - queued : chunk_size;
+            count = 0;
+
+            if (FILE_CHECKSUM) {
+                chunk = &headers[chunks_queued % queue.capacity];
+                chunk->index = chunks_queued;
+                chunk->crc = crc32(SEND_FILE.data + queued, length);
+                parts[count].iov_base = chunk;
+                parts[count++].iov_len = sizeof(*chunk);
+            }
+
+            parts[count].iov_base = SEND_FILE.data + queued;
+            parts[count++].iov_len = length;
+            send_queue_push(&queue, parts, count);
+
+            queued += length;
+            chunks_queued++;
+        }
+
+        if (queue.count == 0)
+            break;
+
+        sent = connection_submit(&conn->channel, &queue, &bytes);
+
+        if (sent < 0) {
+            if (!get_flag_quit())
+                perror("Error sending file");
+            break;
+        }
+
+        bytes_sent += bytes;
+
+        // Logged without the chunk header, the data is the chunk itself
+        if (LOG_PACKETS) {
+            for (index = 0; index < sent; index++)
+                log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX,
+                           conn->tx_seq + index,
+                           SEND_FILE.data + (chunks_sent + index) * chunk_size,
+                           queue.msgs[index].msg_len -
+                           (FILE_CHECKSUM ? sizeof(*chunk) : 0),
+                           0, time_now, 0);
+        }
+        conn->tx_seq += sent;
+        chunks_sent += sent;
+
+        // Socket is full, wait until it takes more
+        if (queue.count > 0 &&
+            wait_for_fd(conn->channel.socket, POLLOUT, -1) < 0)
+            break;
+
+        time_now = now_ns();
+    }
+
+    if (status >= 0 && sent >= 0 && !get_flag_quit())
+        acked = wait_for_file_ack(conn->channel.socket, &ack) == 0;
+    time_end = now_ns();
+
+    send_queue_free(&queue);
+    free(headers);
+    log_sync();
+
+    seconds = (double)(time_end - time_start) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("File sent %llu bytes in %llu chunks of %zu bytes during %.3f s\n",
+           bytes_sent, (unsigned long long)chunks_sent, chunk_size, seconds);
+    if (acked) {
+        printf("File stored by the server: %llu of %zu bytes, %u bad chunks\n",
+               (unsigned long long)ack.bytes, SEND_FILE.size, ack.bad_chunks);
+        if (SEND_FILE.size > 0)
+            printf("File throughput: %.3f MB/s (%.1f kbit/s)\n",
+                   SEND_FILE.size / seconds / 1e6,
+                   SEND_FILE.size * 8 / seconds / 1e3);
+    }
+    else if (!get_flag_quit()) {
+        fprintf(stderr, "The server did not acknowledge the file\n");
+    }
+
+    set_flag_quit(1);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Thread to send ping packets to the server. Every packet is stamped with a
+ * sequence number and the send time, the next packet is sent when the echo
+ * has been received or the timeout has passed.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_ping_sender(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+    long status;
+    char *send_msg = conn->send_buf;
+    struct ping_header header = { .magic = PING_MAGIC };
+    struct ping_stamps *stamps;
+    struct timespec deadline;
+    int result;
+
+    memset(send_msg, 0, PING_SIZE);
+
+    for (header.seq = 0; !get_flag_quit(); header.seq++) {
+        if (PING_COUNT > 0 && header.seq >= (uint32_t)PING_COUNT)
+            break;
+
+        // Forget replies that arrived after their timeout
+        while (sem_trywait(&ping_reply) == 0);
+
+        __atomic_store_n(&PING_OUTSTANDING, header.seq, __ATOMIC_RELEASE);
+        header.last_rtt_ns = __atomic_load_n(&PING_LAST_RTT, __ATOMIC_RELAXED);
+        header.timestamp_ns = now_ns();
+        memcpy(send_msg, &header, sizeof(header));
+
+        if (TIMESTAMPS) {
+            stamps = &PING_STAMPS[header.seq % PING_STAMP_SLOTS];
+            stamps->seq = header.seq;
+            stamps->tx_kernel = 0;
+            stamps->rx_kernel = 0;
+            stamps->tx_app = realtime_ns();
+        }
+
+        status = write_packet(conn->channel.socket, send_msg, PING_SIZE);
+
+        if (status < 0) {
+            if (!get_flag_quit())
+                perror("Error sending ping");
+            break;
+        }
+
+        PING_STATS.sent++;
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_SENDER], 0, LOG_TX, conn->tx_seq,
+                       send_msg, status, 0, header.timestamp_ns, 0);
+        conn->tx_seq++;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PING_TIMEOUT_MS / 1000;
+        deadline.tv_nsec += (PING_TIMEOUT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while ((result = sem_timedwait(&ping_reply, &deadline)) == -1 &&
+               errno == EINTR);
+
+        if (result == -1 && !get_flag_quit())
+            PING_STATS.timeouts++;
+
+        if (PING_INTERVAL_MS > 0 && wait_for_fd(-1, 0, PING_INTERVAL_MS) < 0)
+            break;
+    }
+
+    set_flag_quit(1);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Record the round-trip time of a batch of echoed ping packets. All packets
+ * of a batch are stamped with the time the batch was received, with
+ * --timestamps the time spent in the stack is recorded apart from it.
+ *
+ * @param ctx The connection.
+ * @param msgs The received packets.
+ * @param count The number of packets.
+ */
+void consume_pings(void *ctx, struct mmsghdr *msgs, unsigned int count) {
+    struct connection_info *conn = ctx;
+    struct ping_header header;
+    uint64_t time_now = now_ns();
+    uint64_t realtime_now = TIMESTAMPS ? realtime_ns() : 0;
+    uint64_t rx_kernel, stack_ns;
+    unsigned int index;
+
+    for (index = 0; index < count; index++) {
+        rx_kernel = packet_timestamp(&msgs[index].msg_hdr);
+        stack_ns = rx_kernel > 0 && rx_kernel < realtime_now ?
+                   realtime_now - rx_kernel : 0;
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_RX,
+                       conn->rx_seq, msgs[index].msg_hdr.msg_iov->iov_base,
+                       msgs[index].msg_len, 0, time_now, stack_ns);
+        conn->rx_seq++;
+
+        if (msgs[index].msg_len < sizeof(header))
+            continue;
+
+        memcpy(&header, msgs[index].msg_hdr.msg_iov->iov_base, sizeof(header));
+        if (header.magic != PING_MAGIC)
+            continue;
+
+        histogram_record(&PING_STATS.rtt, time_now - header.timestamp_ns);
+        __atomic_store_n(&PING_LAST_RTT, time_now - header.timestamp_ns,
+                         __ATOMIC_RELAXED);
+        PING_STATS.received++;
+
+        if (rx_kernel > 0) {
+            histogram_record(&PING_STATS.rx_delay, stack_ns);
+            record_ping_stamps(header.seq, 0, rx_kernel);
+        }
+
+        if (header.seq == __atomic_load_n(&PING_OUTSTANDING, __ATOMIC_ACQUIRE))
+            sem_post(&ping_reply);
+        else
+            PING_STATS.late++;
+    }
+}
+
+/**
+ * Thread to receive echoed ping packets from the server and record the
+ * round-trip time.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+void *thread_ping_receiver(void *th_args) {
+    struct connection_info *conn = (struct connection_info *)th_args;
+
+    while(!get_flag_quit()) {
+        if (receive_blocking(&conn->channel, consume_pings, conn) <= 0) {
+            set_flag_quit(1);
+            break;
+        }
+    }
+
+    // Wake the sender if it is waiting for a reply
+    sem_post(&ping_reply);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Print the result of the ping benchmark.
+ */
+void print_ping_report() {
+    const struct latency_histogram *rtt = &PING_STATS.rtt;
+
+    printf("Ping: %llu sent, %llu received, %llu late, %llu timed out\n",
+           PING_STATS.sent, PING_STATS.received, PING_STATS.late,
+           PING_STATS.timeouts);
+
+    if (CONN_PARAMS.interval > 0)
+        print_conn_params("Ping ", &CONN_PARAMS);
+    if (LINK_PHY || LINK_DATA_LENGTH)
+        print_link_settings("Ping ", &LINK);
+    print_scheduling("Ping ");
+
+    if (rtt->count == 0)
+        return;
+
+    print_histogram("RTT", rtt);
+
+    if (PING_STATS.stack_rtt.count > 0)
+        print_histogram("Stack RTT", &PING_STATS.stack_rtt);
+    if (PING_STATS.tx_delay.count > 0)
+        print_histogram("Send delay", &PING_STATS.tx_delay);
+    if (PING_STATS.rx_delay.count > 0)
+        print_histogram("Receive delay", &PING_STATS.rx_delay);
+}
+
+/**
+ * Print how many messages the framed text sender coalesced per SDU, and
+ * with --compress the raw against the wire bytes.
+ */
+void print_frame_report() {
+    double seconds;
+
+    printf("Framing: %llu messages in %llu SDUs, %.1f per SDU, %llu SDUs "
+           "sent at the deadline\n", FRAME_STATS.messages, FRAME_STATS.sdus,
+           FRAME_STATS.sdus > 0 ?
+           (double)FRAME_STATS.messages / FRAME_STATS.sdus : 0,
+           FRAME_STATS.deadline_flushes);
+
+    if (!COMPRESS_MODE || COMPRESSOR.raw_bytes == 0)
+        return;
+
+    seconds = (double)(FRAME_STATS.time_last - FRAME_STATS.time_first) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("Compression: %llu SDUs compressed, %llu sent raw, %llu bytes "
+           "sent as %llu (%.1f %% saved)\n", COMPRESSOR.compressed,
+           COMPRESSOR.bypassed, COMPRESSOR.raw_bytes, COMPRESSOR.wire_bytes,
+           100.0 - 100.0 * COMPRESSOR.wire_bytes / COMPRESSOR.raw_bytes);
+    if (FRAME_STATS.sdus > 1)
+        printf("Compression throughput: %.3f MB/s raw, %.3f MB/s on the "
+               "wire\n", COMPRESSOR.raw_bytes / seconds / 1e6,
+               COMPRESSOR.wire_bytes / seconds / 1e6);
+}
+
+/**
+ * Close the channels of a striped benchmark and free their buffers.
+ */
+void stripe_close() {
+    struct linger lin = { .l_onoff = 1, .l_linger = 5 };
+    struct connection_info *conn;
+    int index;
+
+    for (index = 0; index < STRIPE_COUNT; index++) {
+        conn = &STRIPE_CHANNELS[index].conn;
+        if (conn->channel.socket < 0)
+            continue;
+
+        // Let queued payloads drain before the channel is torn down
+        setsockopt(conn->channel.socket, SOL_SOCKET, SO_LINGER, &lin,
+                   sizeof(lin));
+        close(conn->channel.socket);
+        connection_free(&conn->channel);
+        pool_put(&BUFFER_POOL, conn->send_buf);
+        conn->channel.socket = -1;
+    }
+}
+
+/**
+ * Open a channel from every adapter in STRIPE_DEVS to the server, with the
+ * requested settings applied to each.
+ *
+ * @param dest The address of the server.
+ * @return 0 on success, -1 on failure with the reason printed.
+ */
+int stripe_open(const char *dest) {
+    struct stripe_channel *channel;
+    struct connection_info *conn;
+    uint16_t omtu_min = UINT16_MAX;
+    char prefix[16];
+    int index;
+
+    for (index = 0; index < STRIPE_COUNT; index++)
+        STRIPE_CHANNELS[index].conn.channel.socket = -1;
+
+    for (index = 0; index < STRIPE_COUNT; index++) {
+        channel = &STRIPE_CHANNELS[index];
+        conn = &channel->conn;
+        channel->dev_id = STRIPE_DEVS[index];
+        snprintf(prefix, sizeof(prefix), "[hci%d] ", channel->dev_id);
+
+        if (hci_devba(channel->dev_id, &channel->local) < 0) {
+            fprintf(stderr, "%sError reading adapter address: %s\n", prefix,
+                    strerror(errno));
+            return -1;
+        }
+
+        conn->channel.socket = open_socket(&channel->local);
+        if (conn->channel.socket < 0)
+            return -1;
+
+        if (connect_socket(conn->channel.socket, dest,
+                           &conn->channel.peer) < 0) {
+            fprintf(stderr, "%sError connecting: %s\n", prefix,
+                    strerror(errno));
+            return -1;
+        }
+
+        if (setup_connection_buffers(conn) < 0) {
+            fprintf(stderr, "%sError reading negotiated MTU: %s\n", prefix,
+                    strerror(errno));
+            return -1;
+        }
+
+        printf("%sNegotiated MTU: incoming %u bytes, outgoing %u bytes\n",
+               prefix, conn->channel.imtu, conn->channel.omtu);
+        if (CHANNEL_MODE_SET)
+            print_channel_mode(prefix, conn->channel.socket);
+
+        if (CONN_REQUEST.interval > 0) {
+            CONN_PARAMS = CONN_REQUEST;
+            if (update_conn_params(conn->channel.socket, &CONN_PARAMS) < 0) {
+                fprintf(stderr, "%sError updating connection parameters: "
+                        "%s\n", prefix, strerror(errno));
+                return -1;
+            }
+            print_conn_params(prefix, &CONN_PARAMS);
+        }
+
+        if (LINK_PHY || LINK_DATA_LENGTH) {
+            if (update_link_settings(conn->channel.socket, &LINK) < 0)
+                return -1;
+            print_link_settings(prefix, &LINK);
+        }
+
+        channel->hci_stats =
+            read_hci_stats(channel->dev_id, &channel->hci_before) == 0;
+
+        if (conn->channel.omtu < omtu_min)
+            omtu_min = conn->channel.omtu;
+    }
+
+    // Every channel carries payloads of the same size
+    if (BENCH_SIZE == 0)
+        BENCH_SIZE = omtu_min;
+
+    if (BENCH_SIZE > omtu_min) {
+        fprintf(stderr, "benchmark payload size %ld exceeds outgoing MTU "
+                "%u\n", BENCH_SIZE, omtu_min);
+        return -1;
+    }
+
+    if (BENCH_SIZE < (long)sizeof(struct stripe_header)) {
+        fprintf(stderr, "striped benchmark payloads must be at least %zu "
+                "bytes\n", sizeof(struct stripe_header));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Print the report of a striped benchmark: the share of every channel and
+ * the throughput of the whole stream.
+ */
+void print_stripe_report() {
+    struct stripe_channel *channel;
+    struct hci_dev_stats hci_after;
+    unsigned long long bytes_sent = 0, packets_sent = 0;
+    uint64_t time_start = UINT64_MAX, time_end = 0;
+    char prefix[16];
+    double seconds;
+    int index;
+
+    for (index = 0; index < STRIPE_COUNT; index++) {
+        channel = &STRIPE_CHANNELS[index];
+        bytes_sent += channel->bytes_sent;
+        packets_sent += channel->packets_sent;
+        if (channel->time_start < time_start)
+            time_start = channel->time_start;
+        if (channel->time_end > time_end)
+            time_end = channel->time_end;
+    }
+
+    seconds = time_end > time_start ? (double)(time_end - time_start) / 1e9 :
+              1e-9;
+
+    for (index = 0; index < STRIPE_COUNT; index++) {
+        channel = &STRIPE_CHANNELS[index];
+        snprintf(prefix, sizeof(prefix), "[hci%d] ", channel->dev_id);
+
+        printf("%ssent %llu bytes in %llu packets, %.1f %% of the stream, "
+               "%.3f MB/s\n", prefix, channel->bytes_sent,
+               channel->packets_sent,
+               bytes_sent > 0 ? 100.0 * channel->bytes_sent / bytes_sent : 0,
+               channel->bytes_sent / seconds / 1e6);
+        if (channel->hci_stats &&
+            read_hci_stats(channel->dev_id, &hci_after) == 0)
+            print_hci_stats(prefix, &channel->hci_before, &hci_after);
+    }
+
+    printf("Benchmark sent %llu bytes in %llu packets of %ld bytes over %d "
+           "channels during %.3f s\n", bytes_sent, packets_sent, BENCH_SIZE,
+           STRIPE_COUNT, seconds);
+    printf("Benchmark throughput: %.3f MB/s (%.1f kbit/s), %.1f packets/s\n",
+           bytes_sent / seconds / 1e6, bytes_sent * 8 / seconds / 1e3,
+           packets_sent / seconds);
+    print_scheduling("Benchmark ");
+}
+
+/**
+ * Run a benchmark striped over a channel from every adapter in STRIPE_DEVS
+ * to the same server, one sender thread per channel.
+ *
+ * @param dest The address of the server.
+ * @param attr The attributes of the sender threads.
+ * @return 0 on success, -1 on failure.
+ */
+int run_stripe_bench(const char *dest, pthread_attr_t *attr) {
+    int index;
+
+    // Tells this stream apart from the streams of other clients
+    STRIPE_STREAM = (uint32_t)(realtime_ns() ^ ((uint64_t)getpid() << 16));
+
+    if (stripe_open(dest) < 0) {
+        stripe_close();
+        return -1;
+    }
+
+    printf("Connected to %s over %d channels, running benchmark.\n", dest,
+           STRIPE_COUNT);
+
+    for (index = 0; index < STRIPE_COUNT; index++)
+        pthread_create(&STRIPE_CHANNELS[index].thread, attr,
+                       thread_stripe_sender, &STRIPE_CHANNELS[index]);
+
+    for (index = 0; index < STRIPE_COUNT; index++)
+        pthread_join(STRIPE_CHANNELS[index].thread, NULL);
+
+    print_stripe_report();
+    stripe_close();
+
+    return 0;
+}
+
+/**
+ * Open or resume the session on a new connection: send the token with what
+ * was received so far, take the server's answer and send the SDUs again
+ * that the server did not receive. A server that lost the session starts a
+ * new one, what was in flight then is not known and not counted as lost.
+ *
+ * @param conn The connection, before its buffers are set up.
+ * @return 0 on success, -1 on failure.
+ */
+int session_resume(struct connection_info *conn) {
+    static char sdu[65536];
+    struct resume_header request = { .magic = RESUME_MAGIC }, answer;
+    int s = conn->channel.socket;
+    uint32_t seq;
+    long length;
+
+    request.rx_seq = conn->rx_seq;
+    request.keep_seq = resume_buffer_first(&SESSION.sent);
+    request.token = SESSION.token;
+
+    if (write_packet(s, (const char *)&request, sizeof(request)) < 0)
+        return -1;
+
+    if (wait_for_fd(s, POLLIN, RESUME_TIMEOUT_MS) <= 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    if (recv(s, &answer, sizeof(answer), 0) != sizeof(answer) ||
+        answer.magic != RESUME_MAGIC) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (answer.token != SESSION.token) {
+        if (SESSION.token != 0) {
+            SESSION.expired++;
+            fprintf(stderr, "The server no longer had the session, "
+                    "starting a new one\n");
+        }
+
+        SESSION.token = answer.token;
+        resume_buffer_reset(&SESSION.sent);
+        conn->rx_seq = 0;
+        return 0;
+    }
+
+    // The server no longer has what this side did not receive
+    if (conn->rx_seq < answer.keep_seq) {
+        SESSION.lost += answer.keep_seq - conn->rx_seq;
+        conn->rx_seq = answer.keep_seq;
+    }
+
+    for (seq = answer.rx_seq; seq < SESSION.sent.next_seq; seq++) {
+        length = resume_buffer_get(&SESSION.sent, seq, sdu, sizeof(sdu));
+        if (length < 0 || write_packet(s, sdu, length) < 0)
+            return -1;
+        SESSION.resent++;
+    }
+
+    return 0;
+}
+
+/**
+ * Connect to the server and open or resume the text session on the new
+ * connection.
+ *
+ * @param conn The connection, rx_seq counts the SDUs received in the
+ * session.
+ * @param dest The address of the server.
+ * @return 0 on success, -1 on failure with the reason printed.
+ */
+int session_connect(struct connection_info *conn, const char *dest) {
+    int s = open_socket(BDADDR_ANY);
+
+    if (s < 0)
+        return -1;
+    conn->channel.socket = s;
+
+    if (connect_socket(s, dest, &conn->channel.peer) < 0) {
+        perror("Error connecting");
+        return -1;
+    }
+
+    // Answered before the engine takes over the socket
+    if (session_resume(conn) < 0) {
+        perror("Error resuming session");
+        return -1;
+    }
+
+    if (setup_connection_buffers(conn) < 0) {
+        perror("Error reading negotiated MTU");
+        return -1;
+    }
+
+    printf("Negotiated MTU: incoming %u bytes, outgoing %u bytes\n",
+           conn->channel.imtu, conn->channel.omtu);
+
+    if (TIMESTAMPS && enable_timestamps(s, 0) < 0) {
+        perror("Error enabling timestamps");
+        return -1;
+    }
+
+    if (CONN_REQUEST.interval > 0) {
+        CONN_PARAMS = CONN_REQUEST;
+        if (update_conn_params(s, &CONN_PARAMS) < 0) {
+            perror("Error updating connection parameters");
+            return -1;
+        }
+        print_conn_params("", &CONN_PARAMS);
+    }
+
+    if (LINK_PHY || LINK_DATA_LENGTH) {
+        if (update_link_settings(s, &LINK) < 0)
+            return -1;
+        print_link_settings("", &LINK);
+    }
+
+    return 0;
+}
+
+/**
+ * Close the connection of a session, the session itself stays.
+ * @param conn The connection.
+ */
+void session_disconnect(struct connection_info *conn) {
+    if (conn->channel.socket < 0)
+        return;
+
+    connection_free(&conn->channel);
+    pool_put(&BUFFER_POOL, conn->send_buf);
+    conn->send_buf = NULL;
+    close(conn->channel.socket);
+    conn->channel.socket = -1;
+}
+
+/**
+ * Print what the reconnects of a session cost.
+ */
+void print_session_report() {
+    printf("Reconnect: %llu reconnects, %llu SDUs sent again, %llu lost, "
+           "%llu sessions expired\n", SESSION.reconnects, SESSION.resent,
+           SESSION.lost, SESSION.expired);
+
+    if (SESSION.recovery.count > 0)
+        print_histogram("Recovery", &SESSION.recovery);
+}
+
+/**
+ * Run a text session that survives link drops: when the link drops the
+ * client connects again, with a backoff that doubles up to
+ * RECONNECT_MAX_MS, and resumes the session where it stopped.
+ *
+ * @param dest The address of the server.
+ * @param sender_attr The attributes of the sender thread.
+ * @param receiver_attr The attributes of the receiver thread.
+ * @return 0 on success, -1 on failure.
+ */
+int run_reconnecting(const char *dest, pthread_attr_t *sender_attr,
+                     pthread_attr_t *receiver_attr) {
+    static struct connection_info conn = { .channel.socket = -1 };
+    uint64_t time_lost = 0, recovery;
+    long backoff = RECONNECT_BACKOFF_MS, cleared;
+    int connected = 0;
+
+    if (resume_buffer_init(&SESSION.sent) < 0) {
+        perror("Error allocating session");
+        return -1;
+    }
+
+    while (!atomic_load(&INTERRUPTED)) {
+        if (session_connect(&conn, dest) < 0) {
+            session_disconnect(&conn);
+
+            // The first connection has to work
+            if (!connected ||
+                wait_for_fd(-1, 0, backoff) < 0)
+                break;
+
+            backoff = backoff * 2 < RECONNECT_MAX_MS ?
+                      backoff * 2 : RECONNECT_MAX_MS;
+            continue;
+        }
+
+        if (!connected) {
+            if (CAPTURE_PATH != NULL &&
+                capture_open(CAPTURE_ROLE_CLIENT, CAPTURE_MODE_TEXT,
+                             &conn.channel.peer, conn.channel.imtu,
+                             conn.channel.omtu) < 0) {
+                perror("Error creating capture file");
+                break;
+            }
+
+            if (log_start(CAPTURE_ROLE_CLIENT) < 0) {
+                perror("Error starting log writer");
+                break;
+            }
+
+            printf("Connected to %s, begin sending messages below.\n", dest);
+        }
+        else {
+            recovery = now_ns() - time_lost;
+            histogram_record(&SESSION.recovery, recovery);
+            SESSION.reconnects++;
+            printf("Reconnected to %s after %.1f ms\n", dest,
+                   recovery / 1e6);
+        }
+
+        connected = 1;
+        backoff = RECONNECT_BACKOFF_MS;
+        log_connection(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_CONNECT,
+                       &conn.channel.peer, conn.channel.imtu,
+                       conn.channel.omtu, now_ns());
+
+        pthread_create(&thread_receiver_id, receiver_attr, thread_receiver,
+                       (void *)&conn);
+        pthread_create(&thread_sender_id, sender_attr,
+                       FRAME_MODE ? thread_frame_sender : thread_sender,
+                       (void *)&conn);
+        pthread_join(thread_receiver_id, NULL);
+        pthread_join(thread_sender_id, NULL);
+
+        log_connection(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_DISCONNECT,
+                       &conn.channel.peer, conn.channel.imtu,
+                       conn.channel.omtu, now_ns());
+        session_disconnect(&conn);
+
+        if (!atomic_load(&LINK_LOST) || atomic_load(&INTERRUPTED))
+            break;
+
+        // Wake-ups of this connection must not end the next one
+        time_lost = now_ns();
+        fprintf(stderr, "Link to %s lost, reconnecting\n", dest);
+        atomic_store(&LINK_LOST, 0);
+        set_flag_quit(0);
+        while (read(QUIT_EVENT_FD, &cleared, sizeof(cleared)) > 0)
+            ;
+    }
+
+    log_stop();
+    session_disconnect(&conn);
+
+    if (FRAME_MODE)
+        print_frame_report();
+    print_session_report();
+
+    resume_buffer_free(&SESSION.sent);
+    compressor_free(&COMPRESSOR);
+
+    return connected ? 0 : -1;
+}
+
+/**
+ * Print information about how to execute the program.
+ *
+ * @param program The name of the program.
+ */
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options] <bt_addr>\n"
+            "options:\n"
+            "  --le                 use LE credit based flow control "
+            "instead of BR/EDR\n"
+            "  --le-random          the server uses a random LE address\n"
+            "  --psm PSM            PSM to use (default: 0x1001, LE: 0x0080)\n"
+            "  --credits N          LE credits to give the peer (needs "
+            "root, host-wide\n"
+            "                       until the program exits)\n"
+            "  --mps BYTES          LE MPS to use (needs root, host-wide "
+            "until the\n"
+            "                       program exits)\n"
+            "  --mtu BYTES          request this incoming and outgoing MTU\n"
+            "  --imtu BYTES         request this incoming MTU\n"
+            "  --omtu BYTES         request this outgoing MTU\n"
+            "  --mode MODE          BR/EDR channel mode: basic, ertm or "
+            "streaming\n"
+            "                       (default: basic)\n"
+            "  --tx-window N        ERTM transmit window, 1-16383 "
+            "(default: kernel default)\n"
+            "  --max-transmit N     ERTM transmissions of a frame before "
+            "giving up, 1-255\n"
+            "  --conn-interval MS   LE connection interval to apply after "
+            "connecting\n"
+            "                       (needs root)\n"
+            "  --conn-latency N     LE connection events the peripheral may "
+            "skip (default: 0)\n"
+            "  --supervision-timeout MS\n"
+            "                       LE supervision timeout (default: 420 or "
+            "what the interval\n"
+            "                       and latency need)\n"
+            "  --phy PHY            LE PHY to switch to after connecting: "
+            "1m, 2m or coded\n"
+            "                       (needs root)\n"
+            "  --data-length BYTES  LE link-layer payload size to request, "
+            "27-251 (needs root)\n"
+            "  --batch N            packets received per system call "
+            "(default: 16)\n"
+            "  --engine ENGINE      how packets are moved: batch "
+            "(recvmmsg/sendmmsg),\n"
+            "                       single (one system call per packet) or "
+            "uring (io_uring,\n"
+            "                       Linux 6.0 or later, default: batch)\n"
+            "  --bench              send fixed-size payloads as fast as "
+            "possible\n"
+            "  --bench-size BYTES   payload size in benchmark mode "
+            "(default: outgoing MTU)\n"
+            "  --bench-profile PROFILE\n"
+            "                       when payloads are sent: saturate "
+            "(default), cbr:RATE,\n"
+            "                       poisson:RATE, onoff:RATE,ON_MS,OFF_MS, "
+            "rr[:RATE] or\n"
+            "                       replay:CAPTURE, rates in payloads per "
+            "second\n"
+            "  --bench-sizes SIZES  payload sizes: BYTES, uniform:MIN,MAX or "
+            "exp:MEAN\n"
+            "  --bench-time SECS    benchmark duration, 0 for no limit "
+            "(default: 10)\n"
+            "  --bench-bytes BYTES  stop after sending this many bytes "
+            "(default: no limit)\n"
+            "  --window N           payloads queued per system call in "
+            "benchmark mode (default: 16)\n"
+            "  --stripe ADAPTERS    stripe the benchmark over a channel from "
+            "every adapter,\n"
+            "                       \"all\" or a list such as hci0,hci1\n"
+            "  --send-file FILE     send FILE to a server started with "
+            "--recv-file\n"
+            "  --checksum           send a CRC-32 with every chunk of the "
+            "file\n"
+            "  --frame              coalesce text messages into SDUs of up "
+            "to the outgoing MTU\n"
+            "  --frame-flush MS     longest a message waits for more to "
+            "coalesce (default: 2)\n"
+            "  --compress           compress the coalesced SDUs with LZ4, "
+            "implies --frame\n"
+            "  --compress-min PERCENT\n"
+            "                       smallest saving worth compressing for, "
+            "SDUs that save less\n"
+            "                       are sent raw (default: 10)\n"
+            "  --reconnect          connect again when the link drops and "
+            "resume the session\n"
+            "  --reconnect-max MS   longest wait between two attempts to "
+            "connect again\n"
+            "                       (default: 5000)\n"
+            "  --sender-cpu CPU     pin the sender thread to CPU\n"
+            "  --receiver-cpu CPU   pin the receiver thread to CPU\n"
+            "  --log-cpu CPU        pin the log writer thread to CPU\n"
+            "  --rt-prio N          run the sender and receiver with "
+            "SCHED_FIFO priority N\n"
+            "  --mlock              lock all memory so it is never paged "
+            "out\n"
+            "  --ping               measure round-trip time against a server "
+            "started with --echo\n"
+            "  --ping-count N       number of pings, 0 for no limit "
+            "(default: 1000)\n"
+            "  --ping-interval MS   pause between pings (default: 0)\n"
+            "  --ping-size BYTES    ping packet size (default: 24)\n"
+            "  --ping-timeout MS    time to wait for an echo "
+            "(default: 1000)\n"
+            "  --timestamps         report the time packets spend in the "
+            "kernel apart from\n"
+            "                       the round-trip time\n"
+            "  --verbosity LEVEL    0: no per-packet output, 1: messages "
+            "from the server,\n"
+            "                       2: every packet (default: 1)\n"
+            "  --log-file FILE      write per-packet output to FILE instead "
+            "of stdout\n"
+            "  --capture FILE       record every packet in a binary capture "
+            "file\n"
+            "  --capture-payload BYTES\n"
+            "                       payload bytes to keep per packet in the "
+            "capture (default: 0)\n",
+            program);
+}
+
+/**
+ * Add an adapter to STRIPE_DEVS, called for every adapter that is up.
+ *
+ * @param s Not used.
+ * @param dev_id The device id of the adapter.
+ * @param arg Not used.
+ * @return 0 to continue with the next adapter.
+ */
+static int add_stripe_adapter(int s, int dev_id, long arg)
+{
+    if (STRIPE_COUNT < STRIPE_MAX)
+        STRIPE_DEVS[STRIPE_COUNT++] = dev_id;
+    return 0;
+}
+
+/**
+ * Parse the adapters of a striped benchmark into STRIPE_DEVS. Exits with the
+ * usage on invalid input.
+ *
+ * @param program The name of the program.
+ * @param arg "all" for every adapter that is up, or a comma separated list
+ * of adapters, e.g. "hci0,hci1".
+ */
+void parse_stripe(const char *program, const char *arg) {
+    char list[256], *name, *rest;
+    int dev_id;
+
+    STRIPE_COUNT = 0;
+
+    if (strcmp(arg, "all") == 0) {
+        hci_for_each_dev(HCI_UP, add_stripe_adapter, 0);
+        return;
+    }
+
+    snprintf(list, sizeof(list), "%s", arg);
+    for (name = strtok_r(list, ",", &rest); name != NULL;
+         name = strtok_r(NULL, ",", &rest)) {
+        dev_id = hci_devid(name);
+        if (dev_id < 0 || STRIPE_COUNT >= STRIPE_MAX) {
+            fprintf(stderr, "invalid adapter: %s\n", name);
+            print_usage(program);
+            exit(2);
+        }
+        STRIPE_DEVS[STRIPE_COUNT++] = dev_id;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct connection_info conn = { 0 };
+    struct sigaction signal_action = { 0 };
+    struct hci_dev_stats hci_before, hci_after;
+    pthread_attr_t sender_attr, receiver_attr;
+    int s, opt, hci_dev = -1;
+    uint16_t handle;
+    long status, cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    char dest[18] = "01:23:45:67:89:AB";
+    static struct option long_options[] = {
+        {"le",                  no_argument,       0, 'L'},
+        {"le-random",           no_argument,       0, 'R'},
+        {"psm",                 required_argument, 0, 'P'},
+        {"credits",             required_argument, 0, 'C'},
+        {"mps",                 required_argument, 0, 'M'},
+        {"mtu",                 required_argument, 0, 'm'},
+        {"imtu",                required_argument, 0, 'I'},
+        {"omtu",                required_argument, 0, 'O'},
+        {"mode",                required_argument, 0, 'E'},
+        {"tx-window",           required_argument, 0, 'x'},
+        {"max-transmit",        required_argument, 0, 'A'},
+        {"conn-interval",       required_argument, 0, 'K'},
+        {"conn-latency",        required_argument, 0, 'l'},
+        {"supervision-timeout", required_argument, 0, 'T'},
+        {"phy",                 required_argument, 0, 'H'},
+        {"data-length",         required_argument, 0, 'D'},
+        {"batch",               required_argument, 0, 'B'},
+        {"engine",              required_argument, 0, 'g'},
+        {"bench",               no_argument,       0, 'b'},
+        {"bench-size",          required_argument, 0, 's'},
+        {"bench-time",          required_argument, 0, 't'},
+        {"bench-bytes",         required_argument, 0, 'n'},
+        {"bench-profile",       required_argument, 0, 'y'},
+        {"bench-sizes",         required_argument, 0, 'u'},
+        {"window",              required_argument, 0, 'W'},
+        {"stripe",              required_argument, 0, 'a'},
+        {"ping",                no_argument,       0, 'p'},
+        {"ping-count",          required_argument, 0, 'c'},
+        {"ping-interval",       required_argument, 0, 'i'},
+        {"ping-size",           required_argument, 0, 'z'},
+        {"ping-timeout",        required_argument, 0, 'w'},
+        {"timestamps",          no_argument,       0, 'S'},
+        {"send-file",           required_argument, 0, 'f'},
+        {"checksum",            no_argument,       0, 'k'},
+        {"frame",               no_argument,       0, 'J'},
+        {"frame-flush",         required_argument, 0, 'j'},
+        {"compress",            no_argument,       0, 'Z'},
+        {"compress-min",        required_argument, 0, 'q'},
+        {"reconnect",           no_argument,       0, 'r'},
+        {"reconnect-max",       required_argument, 0, 'o'},
+        {"sender-cpu",          required_argument, 0, 'U'},
+        {"receiver-cpu",        required_argument, 0, 'V'},
+        {"log-cpu",             required_argument, 0, 'G'},
+        {"rt-prio",             required_argument, 0, 'Q'},
+        {"mlock",               no_argument,       0, 'N'},
+        {"verbosity",           required_argument, 0, 'v'},
+        {"log-file",            required_argument, 0, 'F'},
+        {"capture",             required_argument, 0, 'X'},
+        {"capture-payload",     required_argument, 0, 'Y'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'L':
+                LE_MODE = 1;
+                break;
+            case 'R':
+                LE_MODE = 1;
+                LE_ADDR_TYPE = BDADDR_LE_RANDOM;
+                break;
+            case 'P':
+                PSM = parse_number(argv[0], optarg);
+                break;
+            case 'C':
+                LE_CREDITS = parse_number(argv[0], optarg);
+                break;
+            case 'M':
+                LE_MPS = parse_number(argv[0], optarg);
+                break;
+            case 'm':
+                REQUEST_IMTU = REQUEST_OMTU = parse_number(argv[0], optarg);
+                break;
+            case 'I':
+                REQUEST_IMTU = parse_number(argv[0], optarg);
+                break;
+            case 'O':
+                REQUEST_OMTU = parse_number(argv[0], optarg);
+                break;
+            case 'E':
+                CHANNEL_MODE = parse_channel_mode(argv[0], optarg);
+                CHANNEL_MODE_SET = 1;
+                break;
+            case 'x':
+                TX_WINDOW = parse_number(argv[0], optarg);
+                break;
+            case 'A':
+                MAX_TRANSMIT = parse_number(argv[0], optarg);
+                break;
+            case 'K':
+                CONN_INTERVAL_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'l':
+                CONN_LATENCY = parse_number(argv[0], optarg);
+                break;
+            case 'T':
+                CONN_TIMEOUT_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'H':
+                LINK_PHY = parse_phy(argv[0], optarg);
+                break;
+            case 'D':
+                LINK_DATA_LENGTH = parse_number(argv[0], optarg);
+                break;
+            case 'B':
+                RECV_BATCH = parse_number(argv[0], optarg);
+                break;
+            case 'g':
+                ENGINE = parse_engine(argv[0], optarg);
+                break;
+            case 'b':
+                BENCH_MODE = 1;
+                break;
+            case 's':
+                BENCH_SIZE = parse_number(argv[0], optarg);
+                break;
+            case 't':
+                BENCH_SECONDS = parse_number(argv[0], optarg);
+                break;
+            case 'n':
+                BENCH_BYTES = parse_number(argv[0], optarg);
+                break;
+            case 'y':
+                parse_profile(argv[0], optarg, &PROFILE);
+                break;
+            case 'u':
+                parse_sizes(argv[0], optarg, &PROFILE.sizes);
+                SIZES_SET = 1;
+                break;
+            case 'W':
+                SEND_WINDOW = parse_number(argv[0], optarg);
+                break;
+            case 'a':
+                parse_stripe(argv[0], optarg);
+                if (STRIPE_COUNT == 0) {
+                    fprintf(stderr, "no adapter to stripe over\n");
+                    exit(2);
+                }
+                break;
+            case 'p':
+                PING_MODE = 1;
+                break;
+            case 'c':
+                PING_COUNT = parse_number(argv[0], optarg);
+                break;
+            case 'i':
+                PING_INTERVAL_MS = parse_number(argv[0], optarg);
+                break;
+            case 'z':
+                PING_SIZE = parse_number(argv[0], optarg);
+                break;
+            case 'w':
+                PING_TIMEOUT_MS = parse_number(argv[0], optarg);
+                break;
+            case 'S':
+                TIMESTAMPS = 1;
+                break;
+            case 'f':
+                SEND_FILE_PATH = optarg;
+                break;
+            case 'k':
+                FILE_CHECKSUM = 1;
+                break;
+            case 'J':
+                FRAME_MODE = 1;
+                break;
+            case 'j':
+                FRAME_FLUSH_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'Z':
+                COMPRESS_MODE = 1;
+                FRAME_MODE = 1;
+                break;
+            case 'q':
+                COMPRESS_MIN_SAVING = parse_number(argv[0], optarg);
+                break;
+            case 'r':
+                RECONNECT_MODE = 1;
+                break;
+            case 'o':
+                RECONNECT_MAX_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'U':
+                SENDER_CPU = parse_number(argv[0], optarg);
+                break;
+            case 'V':
+                RECEIVER_CPU = parse_number(argv[0], optarg);
+                break;
+            case 'G':
+                LOG_CPU = parse_number(argv[0], optarg);
+                break;
+            case 'Q':
+                RT_PRIORITY = parse_number(argv[0], optarg);
+                break;
+            case 'N':
+                MEMORY_LOCK = 1;
+                break;
+            case 'v':
+                VERBOSITY = parse_number(argv[0], optarg);
+                break;
+            case 'F':
+                LOG_PATH = optarg;
+                break;
+            case 'X':
+                CAPTURE_PATH = optarg;
+                break;
+            case 'Y':
+                CAPTURE_SNAPLEN = parse_number(argv[0], optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(2);
+        }
+    }
+
+    if(optind >= argc)
+    {
+        print_usage(argv[0]);
+        exit(2);
+    }
+
+    if (REQUEST_IMTU > 65535 || REQUEST_OMTU > 65535) {
+        fprintf(stderr, "MTU must be at most 65535 bytes\n");
+        exit(2);
+    }
+
+    if (RECV_BATCH < 1 || RECV_BATCH > 1024) {
+        fprintf(stderr, "batch size must be between 1 and 1024\n");
+        exit(2);
+    }
+
+    // Multishot receives carry no control messages
+    if (ENGINE == &ENGINE_URING && TIMESTAMPS) {
+        fprintf(stderr, "--timestamps needs the batch or single engine\n");
+        exit(2);
+    }
+
+    if (SENDER_CPU >= cpu_count || RECEIVER_CPU >= cpu_count ||
+        LOG_CPU >= cpu_count) {
+        fprintf(stderr, "CPU must be below %ld\n", cpu_count);
+        exit(2);
+    }
+
+    if (RT_PRIORITY > sched_get_priority_max(SCHED_FIFO)) {
+        fprintf(stderr, "real-time priority must be between 1 and %d\n",
+                sched_get_priority_max(SCHED_FIFO));
+        exit(2);
+    }
+
+    if (SEND_WINDOW < 1 || SEND_WINDOW > 1024) {
+        fprintf(stderr, "window must be between 1 and 1024 packets\n");
+        exit(2);
+    }
+
+    if (VERBOSITY > VERBOSITY_PACKETS) {
+        fprintf(stderr, "verbosity must be at most %d\n", VERBOSITY_PACKETS);
+        exit(2);
+    }
+
+    if (CAPTURE_SNAPLEN > 65535) {
+        fprintf(stderr, "capture payload must be at most 65535 bytes\n");
+        exit(2);
+    }
+
+    if (PSM == 0)
+        PSM = LE_MODE ? PSM_LE_DEFAULT : PSM_BREDR_DEFAULT;
+
+    if (PSM > 0xffff) {
+        fprintf(stderr, "PSM must be at most 0xffff\n");
+        exit(2);
+    }
+
+    if ((LE_CREDITS > 0 || LE_MPS > 0) && !LE_MODE) {
+        fprintf(stderr, "--credits and --mps need --le\n");
+        exit(2);
+    }
+
+    if (LE_CREDITS > 0xffff || LE_MPS > 0xffff) {
+        fprintf(stderr, "credits and MPS must be at most 65535\n");
+        exit(2);
+    }
+
+    if ((CONN_INTERVAL_MS > 0 || CONN_LATENCY > 0 || CONN_TIMEOUT_MS > 0) &&
+        !LE_MODE) {
+        fprintf(stderr, "--conn-interval, --conn-latency and "
+                "--supervision-timeout need --le\n");
+        exit(2);
+    }
+
+    if ((CONN_LATENCY > 0 || CONN_TIMEOUT_MS > 0) && CONN_INTERVAL_MS == 0) {
+        fprintf(stderr, "--conn-latency and --supervision-timeout need "
+                "--conn-interval\n");
+        exit(2);
+    }
+
+    if ((LINK_PHY || LINK_DATA_LENGTH) && !LE_MODE) {
+        fprintf(stderr, "--phy and --data-length need --le\n");
+        exit(2);
+    }
+
+    if (LINK_DATA_LENGTH &&
+        (LINK_DATA_LENGTH < DATA_LENGTH_MIN ||
+         LINK_DATA_LENGTH > DATA_LENGTH_MAX)) {
+        fprintf(stderr, "data length must be between %d and %d bytes\n",
+                DATA_LENGTH_MIN, DATA_LENGTH_MAX);
+        exit(2);
+    }
+
+    if ((CHANNEL_MODE_SET || TX_WINDOW > 0 || MAX_TRANSMIT > 0) && LE_MODE) {
+        fprintf(stderr, "--mode, --tx-window and --max-transmit are for "
+                "BR/EDR, they cannot be combined with --le\n");
+        exit(2);
+    }
+
+    if ((TX_WINDOW > 0 || MAX_TRANSMIT > 0) &&
+        CHANNEL_MODE != L2CAP_MODE_ERTM) {
+        fprintf(stderr, "--tx-window and --max-transmit need --mode ertm\n");
+        exit(2);
+    }
+
+    if (TX_WINDOW > TX_WINDOW_MAX || MAX_TRANSMIT > MAX_TRANSMIT_MAX) {
+        fprintf(stderr, "tx window must be at most %d and max transmit at "
+                "most %d\n", TX_WINDOW_MAX, MAX_TRANSMIT_MAX);
+        exit(2);
+    }
+
+    if (CONN_INTERVAL_MS > 0 && make_conn_params(&CONN_REQUEST) < 0)
+        exit(2);
+
+    if (LE_MODE) {
+        // The knobs apply to the whole host, put them back on every exit
+        atexit(restore_le_flow_control);
+        if (set_le_flow_control(LE_CREDITS, LE_MPS) < 0)
+            exit(1);
+    }
+
+    if (PING_SIZE < (long)sizeof(struct ping_header)) {
+        fprintf(stderr, "ping packet size must be at least %zu bytes\n",
+                sizeof(struct ping_header));
+        exit(2);
+    }
+
+    if (BENCH_MODE && PING_MODE) {
+        fprintf(stderr, "--bench and --ping cannot be combined\n");
+        exit(2);
+    }
+
+    if (STRIPE_COUNT > 0 && !BENCH_MODE) {
+        fprintf(stderr, "--stripe needs --bench\n");
+        exit(2);
+    }
+
+    if ((PROFILE.kind != PROFILE_SATURATE || SIZES_SET) &&
+        (!BENCH_MODE || STRIPE_COUNT > 0)) {
+        fprintf(stderr, "--bench-profile and --bench-sizes need --bench, "
+                "they cannot be combined with --stripe\n");
+        exit(2);
+    }
+
+    if (SIZES_SET && (BENCH_SIZE > 0 || PROFILE.kind == PROFILE_REPLAY)) {
+        fprintf(stderr, "--bench-sizes cannot be combined with --bench-size "
+                "or a replay\n");
+        exit(2);
+    }
+
+    if (profile_open(&PROFILE) < 0) {
+        perror("Error opening capture to replay");
+        exit(1);
+    }
+
+    if (STRIPE_COUNT > 0 && (CAPTURE_PATH != NULL ||
+                             VERBOSITY >= VERBOSITY_PACKETS)) {
+        fprintf(stderr, "--stripe cannot be combined with --capture or "
+                "--verbosity %d\n", VERBOSITY_PACKETS);
+        exit(2);
+    }
+
+    if (SEND_FILE_PATH != NULL && (BENCH_MODE || PING_MODE)) {
+        fprintf(stderr, "--send-file cannot be combined with --bench or "
+                "--ping\n");
+        exit(2);
+    }
+
+    if (FRAME_MODE && (BENCH_MODE || PING_MODE || SEND_FILE_PATH != NULL)) {
+        fprintf(stderr, "--frame and --compress are for text messages, they "
+                "cannot be combined with --bench, --ping or --send-file\n");
+        exit(2);
+    }
+
+    if (RECONNECT_MODE && (BENCH_MODE || PING_MODE ||
+                           SEND_FILE_PATH != NULL || STRIPE_COUNT > 0)) {
+        fprintf(stderr, "--reconnect resumes text sessions, it cannot be "
+                "combined with --bench, --ping or --send-file\n");
+        exit(2);
+    }
+
+    if (RECONNECT_MAX_MS < RECONNECT_BACKOFF_MS) {
+        fprintf(stderr, "reconnect wait must be at least %d ms\n",
+                RECONNECT_BACKOFF_MS);
+        exit(2);
+    }
+
+    if (COMPRESS_MIN_SAVING > 99) {
+        fprintf(stderr, "compression saving must be at most 99 %%\n");
+        exit(2);
+    }
+
+    if (FRAME_FLUSH_MS > 1000) {
+        fprintf(stderr, "frame flush deadline must be at most 1000 ms\n");
+        exit(2);
+    }
+
+    if (SEND_FILE_PATH != NULL && map_file(SEND_FILE_PATH, &SEND_FILE) < 0) {
+        perror("Error opening file to send");
+        exit(1);
+    }
+
+    // Mapped before --mlock, which then locks it as well
+    if (buffer_pool_init(&BUFFER_POOL, pool_block_size(),
+                         pool_block_count(STRIPE_COUNT > 0 ?
+                                          STRIPE_COUNT : 1)) < 0) {
+        perror("Error allocating buffer pool");
+        exit(1);
+    }
+
+    if (setup_scheduling() < 0)
+        exit(1);
+
+    thread_attr_init(&sender_attr, SENDER_CPU);
+    thread_attr_init(&receiver_attr, RECEIVER_CPU);
+
+    strncpy(dest, argv[optind], 18);
+
+    // Non-blocking, so a reconnect can empty it
+    QUIT_EVENT_FD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (QUIT_EVENT_FD < 0) {
+        perror("Error creating quit event");
+        exit(1);
+    }
+
+    signal_action.sa_handler = handler_client_interrupt;
+    sigemptyset(&signal_action.sa_mask);
+    sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGTERM, &signal_action, NULL);
+
+    // A striped benchmark has a channel per adapter instead
+    if (STRIPE_COUNT > 0) {
+        status = run_stripe_bench(dest, &sender_attr);
+        print_pool_stats("", &BUFFER_POOL);
+        buffer_pool_free(&BUFFER_POOL);
+        pthread_attr_destroy(&sender_attr);
+        pthread_attr_destroy(&receiver_attr);
+        close(QUIT_EVENT_FD);
+        return status == 0 ? 0 : 1;
+    }
+
+    // A reconnecting session opens its connections itself
+    if (RECONNECT_MODE) {
+        status = run_reconnecting(dest, &sender_attr, &receiver_attr);
+        print_pool_stats("", &BUFFER_POOL);
+        buffer_pool_free(&BUFFER_POOL);
+        pthread_attr_destroy(&sender_attr);
+        pthread_attr_destroy(&receiver_attr);
+        close(QUIT_EVENT_FD);
+        return status == 0 ? 0 : 1;
+    }
+
+    // allocate a socket
+    s = open_socket(BDADDR_ANY);
+    if (s < 0)
+        exit(1);
+
+    // connect to server
+    status = connect_socket(s, dest, &conn.channel.peer);
+
+    if (status == 0) {
+        conn.channel.socket = s;
+        if (setup_connection_buffers(&conn) < 0) {
+            perror("Error reading negotiated MTU");
+            status = -1;
+        }
+        else {
+            printf("Negotiated MTU: incoming %u bytes, outgoing %u bytes\n",
+                   conn.channel.imtu, conn.channel.omtu);
+            if (LE_MODE)
+                print_le_flow_control();
+            if (CHANNEL_MODE_SET)
+                print_channel_mode("", s);
+            if (ENGINE != &ENGINE_BATCH)
+                printf("Engine: %s\n", conn.channel.engine->name);
+        }
+    }
+    else {
+        perror("Error connecting");
+    }
+
+    if (status == 0 && TIMESTAMPS && enable_timestamps(s, PING_MODE) < 0) {
+        perror("Error enabling timestamps");
+        status = -1;
+    }
+
+    // Adapter counters for the summary, they are not available everywhere
+    if (status == 0) {
+        hci_dev = link_dev_id(s, &handle);
+        if (read_hci_stats(hci_dev, &hci_before) < 0)
+            hci_dev = -1;
+    }
+
+    if (status == 0 && CONN_REQUEST.interval > 0) {
+        CONN_PARAMS = CONN_REQUEST;
+        if (update_conn_params(s, &CONN_PARAMS) < 0) {
+            perror("Error updating connection parameters");
+            status = -1;
+        }
+        else {
+            print_conn_params("", &CONN_PARAMS);
+        }
+    }
+
+    if (status == 0 && (LINK_PHY || LINK_DATA_LENGTH)) {
+        if (update_link_settings(s, &LINK) < 0)
+            status = -1;
+        else
+            print_link_settings("", &LINK);
+    }
+
+    if (status == 0 && BENCH_SIZE == 0)
+        BENCH_SIZE = conn.channel.omtu;
+
+    // --bench-size is the size of every payload, exponential sizes are
+    // cut off at the MTU
+    if (!SIZES_SET) {
+        PROFILE.sizes.kind = SIZES_FIXED;
+        PROFILE.sizes.min = BENCH_SIZE;
+        PROFILE.sizes.max = BENCH_SIZE;
+    }
+    else if (PROFILE.sizes.kind == SIZES_EXP) {
+        PROFILE.sizes.max = conn.channel.omtu;
+    }
+
+    if (status == 0 && BENCH_MODE && PROFILE.sizes.max > conn.channel.omtu) {
+        fprintf(stderr, "benchmark payload size %ld exceeds outgoing MTU "
+                "%u\n", PROFILE.sizes.max, conn.channel.omtu);
+        status = -1;
+    }
+
+    if (status == 0 && PING_MODE && PING_SIZE > conn.channel.omtu) {
+        fprintf(stderr, "ping packet size %ld exceeds outgoing MTU %u\n",
+                PING_SIZE, conn.channel.omtu);
+        status = -1;
+    }
+
+    if (status == 0 && CAPTURE_PATH != NULL &&
+        capture_open(CAPTURE_ROLE_CLIENT,
+                     BENCH_MODE ? CAPTURE_MODE_BENCH :
+                     PING_MODE ? CAPTURE_MODE_PING :
+                     SEND_FILE_PATH ? CAPTURE_MODE_FILE : CAPTURE_MODE_TEXT,
+                     &conn.channel.peer, conn.channel.imtu,
+                     conn.channel.omtu) < 0) {
+        perror("Error creating capture file");
+        status = -1;
+    }
+
+    if (status == 0 && log_start(CAPTURE_ROLE_CLIENT) < 0) {
+        perror("Error starting log writer");
+        status = -1;
+    }
+
+    // Logged before the threads start, which then own the queues
+    if (status == 0)
+        log_connection(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_CONNECT,
+                       &conn.channel.peer, conn.channel.imtu,
+                       conn.channel.omtu, now_ns());
+
+    if (status == 0 && BENCH_MODE && PROFILE.kind != PROFILE_SATURATE) {
+        printf("Connected to %s, running benchmark.\n", dest);
+
+        sem_init(&load_reply, 0, 0);
+
+        pthread_create(&thread_receiver_id, &receiver_attr,
+                       thread_load_receiver, (void *)&conn);
+        pthread_create(&thread_sender_id, &sender_attr, thread_load_sender,
+                       (void *)&conn);
+
+        pthread_join(thread_receiver_id, NULL);
+        pthread_join(thread_sender_id, NULL);
+
+        sem_destroy(&load_reply);
+
+        struct linger lin = { .l_onoff = 1, .l_linger = 5 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+    else if (status == 0 && BENCH_MODE) {
+        printf("Connected to %s, running benchmark.\n", dest);
+
+        // Receiver stays active so the server can end the benchmark early
+        pthread_create(&thread_receiver_id, &receiver_attr, thread_receiver,
+                       (void *)&conn);
+        pthread_create(&thread_sender_id, &sender_attr, thread_bench_sender,
+                       (void *)&conn);
+
+        pthread_join(thread_receiver_id, NULL);
+        pthread_join(thread_sender_id, NULL);
+
+        // Let queued payloads drain before the channel is torn down
+        struct linger lin = { .l_onoff = 1, .l_linger = 5 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+    else if (status == 0 && SEND_FILE_PATH != NULL) {
+        printf("Connected to %s, sending %s (%zu bytes).\n", dest,
+               SEND_FILE_PATH, SEND_FILE.size);
+
+        pthread_create(&thread_sender_id, &sender_attr, thread_file_sender,
+                       (void *)&conn);
+        pthread_join(thread_sender_id, NULL);
+    }
+    else if (status == 0 && PING_MODE) {
+        printf("Connected to %s, measuring round-trip time.\n", dest);
+
+        sem_init(&ping_reply, 0, 0);
+
+        pthread_create(&thread_receiver_id, &receiver_attr,
+                       thread_ping_receiver, (void *)&conn);
+        pthread_create(&thread_sender_id, &sender_attr, thread_ping_sender,
+                       (void *)&conn);
+
+        pthread_join(thread_receiver_id, NULL);
+        pthread_join(thread_sender_id, NULL);
+
+        sem_destroy(&ping_reply);
+    }
+    else if (status == 0) {
+        printf("Connected to %s, begin sending messages below.\n", dest);
+
+        // Start threads to send and receive data
+        pthread_create(&thread_receiver_id, &receiver_attr, thread_receiver,
+                       (void *)&conn);
+        pthread_create(&thread_sender_id, &sender_attr,
+                       FRAME_MODE ? thread_frame_sender : thread_sender,
+                       (void *)&conn);
+
+        // Wait for threads to finish
+        pthread_join(thread_receiver_id, NULL);
+        pthread_join(thread_sender_id, NULL);
+    }
+
+    if (LOG_RUNNING)
+        log_connection(&LOG_QUEUES[LOG_QUEUE_RECEIVER], 0, LOG_DISCONNECT,
+                       &conn.channel.peer, conn.channel.imtu,
+                       conn.channel.omtu, now_ns());
+    log_stop();
+
+    if (status == 0 && PING_MODE)
+        print_ping_report();
+
+    if (status == 0 && BENCH_MODE)
+        print_load_report();
+
+    if (status == 0 && FRAME_MODE)
+        print_frame_report();
+
+    if (hci_dev >= 0 && read_hci_stats(hci_dev, &hci_after) == 0)
+        print_hci_stats("", &hci_before, &hci_after);
+
+    connection_free(&conn.channel);
+    pool_put(&BUFFER_POOL, conn.send_buf);
+    unmap_file(&SEND_FILE);
+    compressor_free(&COMPRESSOR);
+    profile_close(&PROFILE);
+    print_pool_stats("", &BUFFER_POOL);
+    buffer_pool_free(&BUFFER_POOL);
+    pthread_attr_destroy(&sender_attr);
+    pthread_attr_destroy(&receiver_attr);
     close(s);
+    close(QUIT_EVENT_FD);
+    return status == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -2,145 +2,2360 @@
  * Code is modified from:
  * https://people.csail.mit.edu/albert/bluez-intro/x559.html#l2cap-server.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
 
-int FLAG_QUIT = 0;
-pthread_mutex_t flag_quit_lock;
-pthread_t thread_receiver_id, thread_sender_id;
+#include "libl2capx/l2capx.h"
+
+// Benchmark settings (see --bench and --echo)
+int BENCH_MODE = 0;
+int ECHO_MODE = 0;
+
+// Where received files are stored (see --recv-file)
+const char *RECV_FILE_PATH = NULL;
+
+// Seconds between per-connection reports, 0 reports on disconnect only
+long REPORT_INTERVAL = 0;
+
+// Unix socket serving the counters in the Prometheus text format, and how
+// often the throughput is sampled for it (see --metrics)
+const char *METRICS_PATH = NULL;
+#define METRICS_SAMPLE_SECONDS 1
+#define METRICS_BUFFER_SIZE (64 << 10)
+
+// Metrics requests waiting for an answer, each is answered once its request
+// arrived
+#define METRICS_CLIENTS 4
+int METRICS_CLIENT_FDS[METRICS_CLIENTS] = { -1, -1, -1, -1 };
+
+// Payload size distribution buckets, bucket n counts sizes [2^n, 2^(n+1))
+#define BENCH_SIZE_BUCKETS 17
+
+// Connections served at the same time
+#define MAX_CLIENTS 16
+
+// Event loop tokens for the file descriptors that are not connections,
+// connections use their index in CLIENTS
+#define TOKEN_LISTEN MAX_CLIENTS
+#define TOKEN_STDIN (MAX_CLIENTS + 1)
+#define TOKEN_REPORT (MAX_CLIENTS + 2)
+#define TOKEN_QUIT (MAX_CLIENTS + 3)
+#define TOKEN_METRICS (MAX_CLIENTS + 4)
+#define TOKEN_METRICS_SAMPLE (MAX_CLIENTS + 5)
+#define TOKEN_METRICS_CLIENT (MAX_CLIENTS + 6)
+#define TOKEN_COUNT (MAX_CLIENTS + 6 + METRICS_CLIENTS)
+
+// Compressed SDUs are decompressed here, one buffer serves every connection
+// since the event loop consumes one SDU at a time (see the client's
+// --compress)
+char INFLATE_BUF[65536];
+
+// Batches read from one connection per wake-up, so a saturating peer cannot
+// starve the others
+#define READ_BUDGET 8
+
+// Payloads a striped stream may run ahead of the next one in order. A
+// payload still missing when the window moves past it counts as lost.
+#define REORDER_WINDOW 4096
+
+/**
+ * Counters kept for every connection.
+ */
+struct connection_stats {
+    uint64_t time_connected;
+    uint64_t cpu_connected;
+    uint64_t time_first_rx;
+    uint64_t time_last_rx;
+    unsigned long long bytes_received;
+    unsigned long long packets_received;
+    unsigned long long bytes_sent;
+    unsigned long long packets_sent;
+    unsigned long long interval_bytes;
+    unsigned long long interval_packets;
+    unsigned long long size_buckets[BENCH_SIZE_BUCKETS];
+    long size_min;
+    long size_max;
+    uint32_t seq_next;
+    unsigned long long seq_skipped;
+    unsigned long long seq_late;
+    struct latency_histogram rtt;
+    struct latency_histogram rx_delay;
+    unsigned long long read_errors;
+    unsigned long long write_errors;
+    unsigned long long frames_received;
+    unsigned long long frame_messages;
+    unsigned long long compressed_received;
+    unsigned long long compressed_bytes;
+    unsigned long long inflated_bytes;
+    unsigned long long sampled_bytes_received;
+    unsigned long long sampled_bytes_sent;
+    double rx_rate;
+    double rx_peak;
+    double tx_rate;
+    double tx_peak;
+};
+
+/**
+ * Striped benchmark stream, put back in order from the connections that
+ * carry it. Benchmark payloads are only filler, so the reorder buffer keeps
+ * track of the payloads instead of holding them: bit n % REORDER_WINDOW of
+ * held is set while payload n waits for the ones before it. A slot in
+ * STRIPES is free while it has no members.
+ */
+struct stripe_group {
+    int members;
+    int joined;
+    uint32_t stream;
+    uint16_t channels;
+    uint32_t seq_next;
+    uint64_t held[REORDER_WINDOW / 64];
+    unsigned int held_count;
+    unsigned int held_max;
+    unsigned long long in_order;
+    unsigned long long reordered;
+    unsigned long long lost;
+    unsigned long long late;
+    unsigned long long bytes_received;
+    unsigned long long packets_received;
+    uint64_t time_first_rx;
+    uint64_t time_last_rx;
+    unsigned long long channel_bytes[STRIPE_MAX];
+    char channel_address[STRIPE_MAX][18];
+};
+
+/**
+ * File being received on a connection. The chunks are received straight
+ * into a shared mapping of the output file, the receive ring only lends its
+ * message headers. Every slot gets an iovec for the chunk header and one
+ * for the chunk.
+ */
+struct file_transfer {
+    int active;
+    int done;
+    int fd;
+    char *map;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t chunk_size;
+    uint32_t flags;
+    uint32_t chunks;
+    unsigned long long bad_chunks;
+    uint64_t time_start;
+    uint64_t time_end;
+    struct iovec *iovs;
+    struct chunk_header *headers;
+};
+
+/**
+ * Resumable session of a text client (see the client's --reconnect). The
+ * connection holds it while the client is connected, after the link drops
+ * it waits in PARKED for the client to come back. A free slot has a token
+ * of 0.
+ */
+struct session {
+    uint64_t token;
+    uint32_t rx_seq;
+    struct resume_buffer sent;
+    uint64_t time_parked;
+};
+
+/**
+ * A connected client. Echoes that could not be written yet stay in the
+ * receive ring of the channel, the echo queue points at them. watch_fd is
+ * the descriptor the event loop waits on for it. A free slot in CLIENTS has
+ * the socket set to -1.
+ */
+struct connection_info {
+    struct connection channel;
+    struct send_queue echo;
+    int watch_fd;
+    char address[18];
+    int waiting_writable;
+    int closing;
+    struct conn_params params;
+    struct link_settings link;
+    int hci_dev;
+    struct hci_dev_stats hci_before;
+    struct connection_stats stats;
+    struct file_transfer file;
+    struct stripe_group *stripe;
+    uint16_t stripe_channel;
+    struct session session;
+};
+
+struct connection_info CLIENTS[MAX_CLIENTS];
+
+// Sessions waiting for their client to reconnect, dropped after
+// RESUME_PARK_SECONDS
+#define RESUME_PARK_SECONDS 60
+
+// Longest a resent SDU waits for the socket to take it
+#define RESUME_WRITE_TIMEOUT_MS 100
+struct session PARKED[MAX_CLIENTS];
+
+/**
+ * Counters of the resumed sessions, recovery is the time from the link drop
+ * to the resume.
+ */
+struct resume_stats {
+    unsigned long long resumed;
+    unsigned long long expired;
+    unsigned long long resent;
+    unsigned long long lost;
+    struct latency_histogram recovery;
+};
+
+struct resume_stats RESUME_STATS = { 0 };
+
+// Striped streams, every connection carries at most one
+struct stripe_group STRIPES[MAX_CLIENTS];
+
+// Log queue of the event loop, the only thread that logs packets
+#define LOG_QUEUE_LOOP 0
+
+// Connections are identified in the log by their index in CLIENTS
+_Static_assert(MAX_CLIENTS <= LOG_CONN_COUNT, "too many clients to log");
+
+// CPU of the event loop, -1 lets it run anywhere (see --cpu)
+long LOOP_CPU = -1;
+
+/**
+ * From https://github.com/pauloborges/bluez/blob/master/tools/hcitool.c#L77
+ * Display addresses for the Bluetooth adapters on the device.
+ */
+static int dev_info(int s, int dev_id, long arg)
+{
+    struct hci_dev_info di = { .dev_id = dev_id };
+    char addr[18];
+
+    if (ioctl(s, HCIGETDEVINFO, (void *) &di))
+    return 0;
+
+    ba2str(&di.bdaddr, addr);
+    printf("\t%s\t%s\n", di.name, addr);
+    return 0;
+}
+
+/**
+ * Print where the event loop and the log writer run and how they are
+ * scheduled, so runs with and without isolation can be compared.
+ *
+ * @param prefix The start of the line.
+ */
+void print_scheduling(const char *prefix) {
+    char loop[24], writer[24], policy[40];
+
+    if (RT_PRIORITY > 0)
+        snprintf(policy, sizeof(policy), "SCHED_FIFO priority %ld",
+                 RT_PRIORITY);
+    else
+        snprintf(policy, sizeof(policy), "SCHED_OTHER");
+
+    printf("%sscheduling: event loop on %s, log writer on %s, %s, "
+           "memory %slocked\n", prefix,
+           cpu_name(LOOP_CPU, loop, sizeof(loop)),
+           cpu_name(LOG_CPU, writer, sizeof(writer)), policy,
+           MEMORY_LOCK ? "" : "not ");
+}
+
+/**
+ * Set up the channel of a connected socket and allocate the echo queue.
+ *
+ * @param conn The connection, with the socket set.
+ * @return 0 on success, -1 on failure.
+ */
+int setup_connection_buffers(struct connection_info *conn) {
+    if (connection_setup(&conn->channel) < 0 ||
+        send_queue_init(&conn->echo, RECV_BATCH) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Set a file descriptor to non-blocking mode.
+ *
+ * @param fd The file descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Update the receive counters of a connection.
+ *
+ * @param conn The connection.
+ * @param bytes The size of the received packet.
+ * @param time_now The time the packet was received.
+ */
+void record_received(struct connection_info *conn, long bytes,
+                     uint64_t time_now) {
+    struct connection_stats *stats = &conn->stats;
+    int bucket;
+
+    stats->time_last_rx = time_now;
+    if (stats->packets_received == 0) {
+        stats->time_first_rx = stats->time_last_rx;
+        stats->size_min = bytes;
+    }
+
+    stats->bytes_received += bytes;
+    stats->packets_received++;
+    stats->interval_bytes += bytes;
+    stats->interval_packets++;
+
+    if (bytes < stats->size_min)
+        stats->size_min = bytes;
+    if (bytes > stats->size_max)
+        stats->size_max = bytes;
+
+    bucket = 63 - __builtin_clzll((unsigned long long)bytes);
+    if (bucket >= BENCH_SIZE_BUCKETS)
+        bucket = BENCH_SIZE_BUCKETS - 1;
+    stats->size_buckets[bucket]++;
+}
+
+/**
+ * Count the gaps in the sequence numbers of benchmark payloads. A payload
+ * that arrives after a later one first counts as skipped, then as late.
+ *
+ * @param stats The counters of the connection.
+ * @param seq The sequence number of the payload.
+ */
+void record_sequence(struct connection_stats *stats, uint32_t seq) {
+    if (seq >= stats->seq_next) {
+        stats->seq_skipped += seq - stats->seq_next;
+        stats->seq_next = seq + 1;
+    }
+    else {
+        stats->seq_late++;
+    }
+}
+
+/**
+ * Add a connection to the stream its striped payloads belong to, the first
+ * connection of a stream takes a free slot.
+ *
+ * @param conn The connection.
+ * @param header The header of a payload of the connection.
+ * @return The stream.
+ */
+struct stripe_group *stripe_join(struct connection_info *conn,
+                                 const struct stripe_header *header) {
+    struct stripe_group *group = NULL;
+    int index;
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (STRIPES[index].members > 0 &&
+            STRIPES[index].stream == header->stream) {
+            group = &STRIPES[index];
+            break;
+        }
+        if (group == NULL && STRIPES[index].members == 0)
+            group = &STRIPES[index];
+    }
+
+    // Every connection has a slot, so there always is one
+    if (group->members == 0) {
+        memset(group, 0, sizeof(*group));
+        group->stream = header->stream;
+        group->channels = header->channels;
+    }
+
+    group->members++;
+    group->joined++;
+    conn->stripe = group;
+    conn->stripe_channel = header->channel % STRIPE_MAX;
+    strcpy(group->channel_address[conn->stripe_channel], conn->address);
+
+    return group;
+}
+
+/**
+ * Move a stream past its next payload in order, releasing the payload if
+ * it was held back or counting it as lost.
+ *
+ * @param group The stream.
+ */
+void stripe_step(struct stripe_group *group) {
+    uint32_t slot = group->seq_next % REORDER_WINDOW;
+    uint64_t bit = 1ULL << (slot % 64);
+
+    if (group->held[slot / 64] & bit) {
+        group->held[slot / 64] &= ~bit;
+        group->held_count--;
+        group->reordered++;
+    }
+    else {
+        group->lost++;
+    }
+
+    group->seq_next++;
+}
+
+/**
+ * Check whether a payload of a stream is held back.
+ *
+ * @param group The stream.
+ * @param seq The sequence number of the payload.
+ * @return Non-zero if it is held.
+ */
+int stripe_held(const struct stripe_group *group, uint32_t seq) {
+    uint32_t slot = seq % REORDER_WINDOW;
+
+    return (group->held[slot / 64] >> (slot % 64)) & 1;
+}
+
+/**
+ * Put a striped payload in its place in the stream. A payload that is next
+ * in order releases the held payloads that follow it, a later one is held
+ * until the gap before it is filled or the window moves past the gap.
+ *
+ * @param conn The connection the payload arrived on.
+ * @param header The header of the payload.
+ * @param bytes The size of the payload.
+ * @param time_now The time the payload was received.
+ */
+void stripe_record(struct connection_info *conn,
+                   const struct stripe_header *header, long bytes,
+                   uint64_t time_now) {
+    struct stripe_group *group = conn->stripe;
+    uint32_t seq = header->seq, target, slot;
+
+    if (group == NULL)
+        group = stripe_join(conn, header);
+
+    if (group->packets_received == 0)
+        group->time_first_rx = time_now;
+    group->time_last_rx = time_now;
+    group->bytes_received += bytes;
+    group->packets_received++;
+    group->channel_bytes[conn->stripe_channel] += bytes;
+
+    // Delivered already, or given up on
+    if ((int32_t)(seq - group->seq_next) < 0) {
+        group->late++;
+        return;
+    }
+
+    // Too far ahead, give up on the oldest gaps. Once nothing is held the
+    // rest of the way is lost at once.
+    if (seq - group->seq_next >= REORDER_WINDOW) {
+        target = seq - REORDER_WINDOW + 1;
+        while (group->held_count > 0 && group->seq_next != target)
+            stripe_step(group);
+        group->lost += target - group->seq_next;
+        group->seq_next = target;
+    }
+
+    if (seq == group->seq_next) {
+        group->in_order++;
+        group->seq_next++;
+        while (group->held_count > 0 && stripe_held(group, group->seq_next))
+            stripe_step(group);
+    }
+    else if (stripe_held(group, seq)) {
+        group->late++;
+    }
+    else {
+        slot = seq % REORDER_WINDOW;
+        group->held[slot / 64] |= 1ULL << (slot % 64);
+        group->held_count++;
+        if (group->held_count > group->held_max)
+            group->held_max = group->held_count;
+    }
+}
+
+/**
+ * Print the report for a connection: throughput, payload sizes in benchmark
+ * mode and the round-trip times that a pinging client reported.
+ *
+ * @param conn The connection.
+ */
+void print_connection_report(const struct connection_info *conn) {
+    const struct connection_stats *stats = &conn->stats;
+    const struct latency_histogram *rtt = &stats->rtt;
+    struct hci_dev_stats hci_after;
+    unsigned long long raw_bytes;
+    char prefix[24], label[64];
+    double seconds;
+    int bucket;
+
+    // Throughput is measured from the first to the last received packet
+    seconds = (double)(stats->time_last_rx - stats->time_first_rx) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("[%s] received %llu bytes in %llu packets during %.3f s, "
+           "sent %llu bytes in %llu packets\n", conn->address,
+           stats->bytes_received, stats->packets_received, seconds,
+           stats->bytes_sent, stats->packets_sent);
+    if (stats->packets_received > 1)
+        printf("[%s] throughput: %.3f MB/s (%.1f kbit/s), %.1f packets/s\n",
+               conn->address, stats->bytes_received / seconds / 1e6,
+               stats->bytes_received * 8 / seconds / 1e3,
+               stats->packets_received / seconds);
+
+    if (BENCH_MODE && stats->packets_received > 0) {
+        printf("[%s] payload sizes: min %ld, max %ld, mean %.1f bytes\n",
+               conn->address, stats->size_min, stats->size_max,
+               (double)stats->bytes_received / stats->packets_received);
+        for (bucket = 0; bucket < BENCH_SIZE_BUCKETS; bucket++) {
+            if (stats->size_buckets[bucket] == 0)
+                continue;
+            printf("\t%6ld - %6ld bytes: %llu packets (%.1f %%)\n",
+                   1L << bucket, (1L << (bucket + 1)) - 1,
+                   stats->size_buckets[bucket],
+                   100.0 * stats->size_buckets[bucket] /
+                   stats->packets_received);
+        }
+    }
+
+    if (stats->frames_received > 0)
+        printf("[%s] framing: %llu messages in %llu SDUs, %.1f per SDU\n",
+               conn->address, stats->frame_messages, stats->frames_received,
+               (double)stats->frame_messages / stats->frames_received);
+
+    // Raw counts the compressed SDUs at their size before compression
+    if (stats->compressed_received > 0) {
+        raw_bytes = stats->bytes_received - stats->compressed_bytes +
+                    stats->inflated_bytes;
+        printf("[%s] compression: %llu of %llu SDUs compressed, %llu bytes "
+               "received as %llu (%.1f %% saved)\n", conn->address,
+               stats->compressed_received, stats->frames_received,
+               raw_bytes, stats->bytes_received,
+               100.0 - 100.0 * stats->bytes_received / raw_bytes);
+        printf("[%s] compression throughput: %.3f MB/s raw, %.3f MB/s on "
+               "the wire\n", conn->address, raw_bytes / seconds / 1e6,
+               stats->bytes_received / seconds / 1e6);
+    }
+
+    if (rtt->count > 0) {
+        snprintf(label, sizeof(label), "[%s] RTT reported by client",
+                 conn->address);
+        print_histogram(label, rtt);
+    }
+
+    if (stats->rx_delay.count > 0) {
+        snprintf(label, sizeof(label), "[%s] receive delay", conn->address);
+        print_histogram(label, &stats->rx_delay);
+    }
+
+    if (BENCH_MODE && stats->seq_next > 0)
+        printf("[%s] sequence: %llu payloads lost, %llu out of order\n",
+               conn->address, stats->seq_skipped - stats->seq_late,
+               stats->seq_late);
+
+    // The whole server while it was connected, run one client to compare
+    if (BENCH_MODE || ECHO_MODE) {
+        snprintf(prefix, sizeof(prefix), "[%s] ", conn->address);
+        print_cpu_usage(prefix, conn->channel.engine,
+                        cpu_ns() - stats->cpu_connected,
+                        stats->bytes_received + stats->bytes_sent);
+    }
+
+    if (conn->file.active) {
+        seconds = (double)(conn->file.time_end - conn->file.time_start) / 1e9;
+        if (seconds <= 0)
+            seconds = 1e-9;
+
+        printf("[%s] file: stored %llu of %llu bytes in %s, %u chunks, "
+               "%llu bad\n", conn->address,
+               (unsigned long long)conn->file.offset,
+               (unsigned long long)conn->file.size, RECV_FILE_PATH,
+               conn->file.chunks, conn->file.bad_chunks);
+        if (conn->file.offset > 0)
+            printf("[%s] file throughput: %.3f MB/s (%.1f kbit/s)\n",
+                   conn->address, conn->file.offset / seconds / 1e6,
+                   conn->file.offset * 8 / seconds / 1e3);
+    }
+
+    snprintf(prefix, sizeof(prefix), "[%s] ", conn->address);
+    if (conn->hci_dev >= 0 &&
+        read_hci_stats(conn->hci_dev, &hci_after) == 0)
+        print_hci_stats(prefix, &conn->hci_before, &hci_after);
+    if (conn->params.interval > 0)
+        print_conn_params(prefix, &conn->params);
+    if (LINK_PHY || LINK_DATA_LENGTH)
+        print_link_settings(prefix, &conn->link);
+    print_scheduling(prefix);
+}
+
+/**
+ * Print the report for a striped stream: the throughput of the whole
+ * stream, the share of every channel and how much had to be reordered.
+ *
+ * @param group The stream.
+ */
+void print_stripe_report(const struct stripe_group *group) {
+    double seconds;
+    int channel;
+
+    seconds = (double)(group->time_last_rx - group->time_first_rx) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("[stripe %08x] received %llu bytes in %llu packets over %d of %u "
+           "channels during %.3f s\n", group->stream, group->bytes_received,
+           group->packets_received, group->joined, group->channels, seconds);
+    printf("[stripe %08x] throughput: %.3f MB/s (%.1f kbit/s), "
+           "%.1f packets/s\n", group->stream,
+           group->bytes_received / seconds / 1e6,
+           group->bytes_received * 8 / seconds / 1e3,
+           group->packets_received / seconds);
+
+    for (channel = 0; channel < STRIPE_MAX; channel++) {
+        if (group->channel_bytes[channel] == 0)
+            continue;
+        printf("[stripe %08x] channel %d [%s]: %llu bytes, %.1f %%\n",
+               group->stream, channel, group->channel_address[channel],
+               group->channel_bytes[channel],
+               100.0 * group->channel_bytes[channel] / group->bytes_received);
+    }
+
+    printf("[stripe %08x] order: %llu payloads in order, %llu held back "
+           "(at most %u at once), %llu lost, %llu late\n", group->stream,
+           group->in_order, group->reordered, group->held_max, group->lost,
+           group->late);
+}
+
+/**
+ * Remove a connection from its striped stream. The last connection to
+ * leave releases what is still held and prints the report.
+ *
+ * @param conn The connection.
+ */
+void stripe_leave(struct connection_info *conn) {
+    struct stripe_group *group = conn->stripe;
+
+    conn->stripe = NULL;
+    if (group == NULL || --group->members > 0)
+        return;
+
+    while (group->held_count > 0)
+        stripe_step(group);
+
+    print_stripe_report(group);
+}
+
+/**
+ * Print the throughput of every connection since the previous interval
+ * report.
+ *
+ * @param seconds The length of the interval.
+ */
+void print_interval_report(double seconds) {
+    struct connection_info *conn;
+    int index;
+
+    log_sync();
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        conn = &CLIENTS[index];
+        if (conn->channel.socket < 0)
+            continue;
+
+        printf("[%s] %.3f MB/s, %.1f packets/s\n", conn->address,
+               conn->stats.interval_bytes / seconds / 1e6,
+               conn->stats.interval_packets / seconds);
+
+        conn->stats.interval_bytes = 0;
+        conn->stats.interval_packets = 0;
+    }
+}
+
+/**
+ * Sample the throughput of every connection for the metrics, keeping the
+ * peak.
+ *
+ * @param seconds The time since the previous sample.
+ */
+void metrics_sample(double seconds) {
+    struct connection_stats *stats;
+    int index;
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (CLIENTS[index].channel.socket < 0)
+            continue;
+
+        stats = &CLIENTS[index].stats;
+        stats->rx_rate = (stats->bytes_received -
+                          stats->sampled_bytes_received) / seconds;
+        stats->tx_rate = (stats->bytes_sent - stats->sampled_bytes_sent) /
+                         seconds;
+        stats->sampled_bytes_received = stats->bytes_received;
+        stats->sampled_bytes_sent = stats->bytes_sent;
+
+        if (stats->rx_rate > stats->rx_peak)
+            stats->rx_peak = stats->rx_rate;
+        if (stats->tx_rate > stats->tx_peak)
+            stats->tx_peak = stats->tx_rate;
+    }
+}
+
+/**
+ * Text being built for a metrics request, text that does not fit is cut.
+ */
+struct metrics_buffer {
+    char data[METRICS_BUFFER_SIZE];
+    size_t length;
+};
+
+/**
+ * Append formatted text to a metrics buffer.
+ *
+ * @param buf The buffer.
+ * @param format The printf() format.
+ */
+__attribute__((format(printf, 2, 3)))
+void metrics_printf(struct metrics_buffer *buf, const char *format, ...) {
+    va_list args;
+    int written;
+
+    if (buf->length >= sizeof(buf->data))
+        return;
+
+    va_start(args, format);
+    written = vsnprintf(buf->data + buf->length,
+                        sizeof(buf->data) - buf->length, format, args);
+    va_end(args);
+
+    if (written > 0)
+        buf->length += written;
+    if (buf->length > sizeof(buf->data))
+        buf->length = sizeof(buf->data);
+}
+
+/**
+ * Per-connection counters in connection_stats, exported as is.
+ */
+struct metric_counter {
+    const char *name;
+    const char *help;
+    size_t offset;
+};
+
+static const struct metric_counter METRIC_COUNTERS[] = {
+    { "l2cap_received_bytes_total", "Bytes received from the client.",
+      offsetof(struct connection_stats, bytes_received) },
+    { "l2cap_received_packets_total", "Packets received from the client.",
+      offsetof(struct connection_stats, packets_received) },
+    { "l2cap_sent_bytes_total", "Bytes sent to the client.",
+      offsetof(struct connection_stats, bytes_sent) },
+    { "l2cap_sent_packets_total", "Packets sent to the client.",
+      offsetof(struct connection_stats, packets_sent) },
+    { "l2cap_read_errors_total", "Failed reads from the socket.",
+      offsetof(struct connection_stats, read_errors) },
+    { "l2cap_write_errors_total", "Failed writes to the socket.",
+      offsetof(struct connection_stats, write_errors) },
+};
+
+/**
+ * Per-connection throughput samples in connection_stats.
+ */
+static const struct metric_counter METRIC_RATES[] = {
+    { "l2cap_receive_bytes_per_second",
+      "Bytes per second received in the last sample.",
+      offsetof(struct connection_stats, rx_rate) },
+    { "l2cap_receive_peak_bytes_per_second",
+      "Highest receive rate sampled.",
+      offsetof(struct connection_stats, rx_peak) },
+    { "l2cap_send_bytes_per_second",
+      "Bytes per second sent in the last sample.",
+      offsetof(struct connection_stats, tx_rate) },
+    { "l2cap_send_peak_bytes_per_second",
+      "Highest send rate sampled.",
+      offsetof(struct connection_stats, tx_peak) },
+};
+
+/**
+ * Render the metrics of all connections in the Prometheus text format.
+ * Connections are labeled with their slot and peer address.
+ *
+ * @param buf The buffer to render into.
+ */
+void metrics_render(struct metrics_buffer *buf) {
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    const struct connection_stats *stats;
+    const struct latency_histogram *rtt, *recovery;
+    char labels[MAX_CLIENTS][48];
+    size_t metric, quantile;
+    int index, active = 0;
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (CLIENTS[index].channel.socket < 0)
+            continue;
+
+        active++;
+        snprintf(labels[index], sizeof(labels[index]),
+                 "conn=\"%d\",peer=\"%s\"", index, CLIENTS[index].address);
+    }
+
+    metrics_printf(buf, "# HELP l2cap_connections Connected clients.\n"
+                   "# TYPE l2cap_connections gauge\n"
+                   "l2cap_connections %d\n", active);
+
+    for (metric = 0; metric < sizeof(METRIC_COUNTERS) /
+                              sizeof(METRIC_COUNTERS[0]); metric++) {
+        metrics_printf(buf, "# HELP %s %s\n# TYPE %s counter\n",
+                       METRIC_COUNTERS[metric].name,
+                       METRIC_COUNTERS[metric].help,
+                       METRIC_COUNTERS[metric].name);
+
+        for (index = 0; index < MAX_CLIENTS; index++) {
+            if (CLIENTS[index].channel.socket < 0)
+                continue;
+
+            stats = &CLIENTS[index].stats;
+            metrics_printf(buf, "%s{%s} %llu\n", METRIC_COUNTERS[metric].name,
+                           labels[index], *(const unsigned long long *)
+                           ((const char *)stats +
+                            METRIC_COUNTERS[metric].offset));
+        }
+    }
+
+    for (metric = 0; metric < sizeof(METRIC_RATES) /
+                              sizeof(METRIC_RATES[0]); metric++) {
+        metrics_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n",
+                       METRIC_RATES[metric].name, METRIC_RATES[metric].help,
+                       METRIC_RATES[metric].name);
+
+        for (index = 0; index < MAX_CLIENTS; index++) {
+            if (CLIENTS[index].channel.socket < 0)
+                continue;
+
+            stats = &CLIENTS[index].stats;
+            metrics_printf(buf, "%s{%s} %.1f\n", METRIC_RATES[metric].name,
+                           labels[index], *(const double *)
+                           ((const char *)stats +
+                            METRIC_RATES[metric].offset));
+        }
+    }
+
+    metrics_printf(buf, "# HELP l2cap_rtt_seconds Round-trip time reported "
+                   "by the client's ping.\n"
+                   "# TYPE l2cap_rtt_seconds summary\n");
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (CLIENTS[index].channel.socket < 0)
+            continue;
+
+        rtt = &CLIENTS[index].stats.rtt;
+        if (rtt->count == 0)
+            continue;
+
+        for (quantile = 0; quantile < sizeof(quantiles) / sizeof(quantiles[0]);
+             quantile++)
+            metrics_printf(buf, "l2cap_rtt_seconds{%s,quantile=\"%g\"} "
+                           "%.9f\n", labels[index], quantiles[quantile] / 100,
+                           histogram_percentile(rtt, quantiles[quantile]) /
+                           1e9);
+        metrics_printf(buf, "l2cap_rtt_seconds_sum{%s} %.9f\n"
+                       "l2cap_rtt_seconds_count{%s} %llu\n", labels[index],
+                       rtt->sum / 1e9, labels[index],
+                       (unsigned long long)rtt->count);
+    }
+
+    for (index = 0, active = 0; index < MAX_CLIENTS; index++)
+        active += PARKED[index].token != 0;
+
+    metrics_printf(buf, "# HELP l2cap_sessions_parked Sessions waiting for "
+                   "their client to reconnect.\n"
+                   "# TYPE l2cap_sessions_parked gauge\n"
+                   "l2cap_sessions_parked %d\n"
+                   "# HELP l2cap_session_resumes_total Sessions resumed "
+                   "after a reconnect.\n"
+                   "# TYPE l2cap_session_resumes_total counter\n"
+                   "l2cap_session_resumes_total %llu\n"
+                   "# HELP l2cap_session_expired_total Parked sessions "
+                   "dropped before their client came back.\n"
+                   "# TYPE l2cap_session_expired_total counter\n"
+                   "l2cap_session_expired_total %llu\n"
+                   "# HELP l2cap_session_resent_total SDUs sent again on "
+                   "resumed sessions.\n"
+                   "# TYPE l2cap_session_resent_total counter\n"
+                   "l2cap_session_resent_total %llu\n"
+                   "# HELP l2cap_session_lost_total SDUs of resumed sessions "
+                   "that were no longer kept.\n"
+                   "# TYPE l2cap_session_lost_total counter\n"
+                   "l2cap_session_lost_total %llu\n"
+                   "# HELP l2cap_session_recovery_seconds Time from the link "
+                   "drop to the resume.\n"
+                   "# TYPE l2cap_session_recovery_seconds summary\n",
+                   active, RESUME_STATS.resumed, RESUME_STATS.expired,
+                   RESUME_STATS.resent, RESUME_STATS.lost);
+
+    recovery = &RESUME_STATS.recovery;
+    if (recovery->count > 0) {
+        for (quantile = 0; quantile < sizeof(quantiles) / sizeof(quantiles[0]);
+             quantile++)
+            metrics_printf(buf, "l2cap_session_recovery_seconds"
+                           "{quantile=\"%g\"} %.9f\n",
+                           quantiles[quantile] / 100,
+                           histogram_percentile(recovery,
+                                                quantiles[quantile]) / 1e9);
+        metrics_printf(buf, "l2cap_session_recovery_seconds_sum %.9f\n"
+                       "l2cap_session_recovery_seconds_count %llu\n",
+                       recovery->sum / 1e9,
+                       (unsigned long long)recovery->count);
+    }
+
+    metrics_printf(buf, "# HELP l2cap_pool_blocks Packet buffers of the "
+                   "buffer pool.\n"
+                   "# TYPE l2cap_pool_blocks gauge\n"
+                   "l2cap_pool_blocks %u\n"
+                   "# HELP l2cap_pool_in_use Packet buffers handed out, "
+                   "including those from the heap.\n"
+                   "# TYPE l2cap_pool_in_use gauge\n"
+                   "l2cap_pool_in_use %u\n"
+                   "# HELP l2cap_pool_high_water Most packet buffers handed "
+                   "out at the same time.\n"
+                   "# TYPE l2cap_pool_high_water gauge\n"
+                   "l2cap_pool_high_water %u\n"
+                   "# HELP l2cap_pool_heap_fallbacks_total Packet buffers "
+                   "that came from the heap.\n"
+                   "# TYPE l2cap_pool_heap_fallbacks_total counter\n"
+                   "l2cap_pool_heap_fallbacks_total %llu\n",
+                   BUFFER_POOL.count, atomic_load(&BUFFER_POOL.in_use),
+                   atomic_load(&BUFFER_POOL.high_water),
+                   atomic_load(&BUFFER_POOL.heap_fallbacks));
+}
+
+/**
+ * Create the Unix socket serving the metrics, replacing a stale one.
+ *
+ * @param path The path of the socket.
+ * @return The listening socket or -1 on failure.
+ */
+int metrics_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int s;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s, 8) < 0) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/**
+ * Accept every pending metrics request, they are answered once the request
+ * was read. Requests beyond METRICS_CLIENTS are closed unanswered.
+ *
+ * @param epfd The event loop.
+ * @param listener The metrics socket.
+ */
+void metrics_accept(int epfd, int listener) {
+    struct epoll_event event = { .events = EPOLLIN };
+    int client, slot;
+
+    while ((client = accept4(listener, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (slot = 0; slot < METRICS_CLIENTS; slot++)
+            if (METRICS_CLIENT_FDS[slot] < 0)
+                break;
+
+        event.data.u64 = TOKEN_METRICS_CLIENT + slot;
+        if (slot == METRICS_CLIENTS ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, client, &event) < 0) {
+            close(client);
+            continue;
+        }
+
+        METRICS_CLIENT_FDS[slot] = client;
+    }
+}
+
+/**
+ * Answer a metrics request. The reply is an HTTP response, so a scraper can
+ * read it as well as a plain socket client, and the connection is closed
+ * after it. The request itself is not looked at. The reply is written
+ * without waiting, a reader too slow to take it at once gets it cut.
+ *
+ * @param slot The request, an index in METRICS_CLIENT_FDS.
+ */
+void metrics_answer(int slot) {
+    static struct metrics_buffer buf;
+    static const char header[] = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "\r\n";
+    char request[4096];
+    int client = METRICS_CLIENT_FDS[slot];
+
+    // Answered by an earlier event in this batch
+    if (client < 0)
+        return;
+
+    // Closing with unread data would reset the connection
+    while (recv(client, request, sizeof(request), MSG_DONTWAIT) > 0);
+
+    buf.length = 0;
+    metrics_printf(&buf, "%s", header);
+    metrics_render(&buf);
+
+    if (send(client, buf.data, buf.length, MSG_DONTWAIT) < 0)
+        perror("Error sending metrics");
+
+    // Closing removes it from the event loop
+    close(client);
+    METRICS_CLIENT_FDS[slot] = -1;
+}
+
+/**
+ * Release the mapping, the file and the buffers of a file transfer.
+ * @param file The transfer.
+ */
+void file_release(struct file_transfer *file) {
+    if (file->map != NULL)
+        munmap(file->map, file->size);
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file->iovs);
+    free(file->headers);
+    file->map = NULL;
+    file->fd = -1;
+    file->iovs = NULL;
+    file->headers = NULL;
+}
+
+/**
+ * Start receiving a file into RECV_FILE_PATH. The whole file is allocated
+ * and mapped up front, only one file is received at a time.
+ *
+ * @param conn The connection.
+ * @param header The file header sent by the client.
+ * @return 0 on success, -1 on failure.
+ */
+int file_start(struct connection_info *conn,
+               const struct file_header *header) {
+    struct file_transfer *file = &conn->file;
+    size_t header_size = header->flags & FILE_FLAG_CHECKSUM ?
+                         sizeof(struct chunk_header) : 0;
+    int index, error;
+
+    if (header->chunk_size == 0 ||
+        header->chunk_size + header_size > conn->channel.imtu) {
+        fprintf(stderr, "[%s] file chunks of %u bytes do not fit the MTU\n",
+                conn->address, header->chunk_size);
+        return -1;
+    }
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (CLIENTS[index].channel.socket >= 0 &&
+            CLIENTS[index].file.active && !CLIENTS[index].file.done) {
+            fprintf(stderr, "[%s] refused file, already receiving one from "
+                    "%s\n", conn->address, CLIENTS[index].address);
+            return -1;
+        }
+    }
+
+    memset(file, 0, sizeof(*file));
+    file->size = header->size;
+    file->chunk_size = header->chunk_size;
+    file->flags = header->flags;
+    file->fd = open(RECV_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    file->iovs = calloc(conn->channel.ring.count * 2, sizeof(*file->iovs));
+    file->headers = calloc(conn->channel.ring.count, sizeof(*file->headers));
+
+    if (file->fd < 0 || file->iovs == NULL || file->headers == NULL) {
+        perror("Error creating received file");
+        file_release(file);
+        return -1;
+    }
+
+    if (file->size > 0) {
+        // Allocate the blocks now, a full disk would kill a mapping later
+        error = posix_fallocate(file->fd, 0, file->size);
+        if (error == 0)
+            file->map = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, file->fd, 0);
+        else
+            errno = error;
+
+        if (error != 0 || file->map == MAP_FAILED) {
+            perror("Error allocating received file");
+            file->map = NULL;
+            file_release(file);
+            return -1;
+        }
+    }
+
+    file->active = 1;
+    file->time_start = now_ns();
+    return 0;
+}
+
+/**
+ * End a file transfer. A file that was not received completely is cut to
+ * the bytes received, a complete one is acknowledged to the client.
+ *
+ * @param conn The connection.
+ */
+void file_finish(struct connection_info *conn) {
+    struct file_transfer *file = &conn->file;
+    struct file_ack ack = { .magic = FILE_ACK_MAGIC };
+
+    file->done = 1;
+    file->time_end = now_ns();
+
+    if (file->offset < file->size && ftruncate(file->fd, file->offset) < 0)
+        perror("Error truncating received file");
+
+    // The page cache writes the mapped chunks back
+    file_release(file);
+
+    if (file->offset < file->size)
+        return;
+
+    ack.bad_chunks = file->bad_chunks;
+    ack.bytes = file->offset;
+    if (send(conn->channel.socket, &ack, sizeof(ack), MSG_DONTWAIT) < 0) {
+        fprintf(stderr, "Error acknowledging file to %s: %s\n",
+                conn->address, strerror(errno));
+        conn->stats.write_errors++;
+        return;
+    }
+
+    if (LOG_PACKETS)
+        log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_TX,
+                   conn->stats.packets_sent, (const char *)&ack, sizeof(ack),
+                   0, file->time_end, 0);
+
+    conn->stats.bytes_sent += sizeof(ack);
+    conn->stats.packets_sent++;
+}
+
+/**
+ * Receive the file header, on its own so the chunks that follow it are
+ * received straight into the file.
+ *
+ * @param conn The connection.
+ * @return 1 if the transfer started, 0 if the connection was closed or -1 on
+ * failure, errno is EAGAIN when nothing was queued.
+ */
+long file_receive_header(struct connection_info *conn) {
+    struct file_header header;
+    char *packet = conn->channel.ring.iovs[0].iov_base;
+    uint64_t time_now;
+    long received;
+
+    received = recv(conn->channel.socket, packet,
+                    conn->channel.ring.iovs[0].iov_len, MSG_DONTWAIT);
+
+    if (received <= 0)
+        return received < 0 ? -1 : 0;
+
+    time_now = now_ns();
+    if (LOG_PACKETS)
+        log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_RX,
+                   conn->stats.packets_received, packet, received, 0,
+                   time_now, 0);
+    record_received(conn, received, time_now);
+
+    memcpy(&header, packet, sizeof(header));
+    if (received != sizeof(header) || header.magic != FILE_MAGIC) {
+        fprintf(stderr, "[%s] expected a file header, got %ld bytes\n",
+                conn->address, received);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (file_start(conn, &header) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (header.size == 0)
+        file_finish(conn);
+
+    return 1;
+}
+
+/**
+ * Receive the next chunks of a file straight into its mapping. Every slot
+ * of the batch is pointed at the place of its chunk in the file, so the
+ * kernel copies the chunks where they belong. Chunks with a CRC that does
+ * not match or that arrive out of order are counted as bad.
+ *
+ * @param conn The connection.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure, errno is EAGAIN when nothing was queued.
+ */
+long file_receive(struct connection_info *conn) {
+    struct file_transfer *file = &conn->file;
+    struct receive_ring *ring = &conn->channel.ring;
+    struct chunk_header *chunk;
+    struct msghdr *hdr;
+    struct iovec *iov;
+    uint64_t offset = file->offset, time_now, realtime_now, stack_ns;
+    size_t header_size, length;
+    unsigned int count;
+    int index, received, status;
+
+    if (!file->active)
+        return file_receive_header(conn);
+
+    header_size = file->flags & FILE_FLAG_CHECKSUM ? sizeof(*chunk) : 0;
+
+    for (count = 0; count < ring->count && offset < file->size; count++) {
+        length = file->size - offset < file->chunk_size ?
+                 file->size - offset : file->chunk_size;
+        iov = &file->iovs[count * 2];
+        hdr = &ring->msgs[count].msg_hdr;
+        hdr->msg_iov = iov;
+        hdr->msg_iovlen = 0;
+
+        if (header_size > 0) {
+            iov[hdr->msg_iovlen].iov_base = &file->headers[count];
+            iov[hdr->msg_iovlen++].iov_len = header_size;
+        }
+        iov[hdr->msg_iovlen].iov_base = file->map + offset;
+        iov[hdr->msg_iovlen++].iov_len = length;
+        offset += length;
+    }
+
+    receive_ring_reset_control(ring);
+    received = recvmmsg(conn->channel.socket, ring->msgs, count, MSG_DONTWAIT,
+                        NULL);
+    time_now = now_ns();
+    realtime_now = TIMESTAMPS ? realtime_ns() : 0;
+    status = received;
+
+    for (index = 0; index < received; index++) {
+        hdr = &ring->msgs[index].msg_hdr;
+        length = hdr->msg_iov[hdr->msg_iovlen - 1].iov_len;
+
+        // A zero-length packet marks the end of the connection
+        if (ring->msgs[index].msg_len == 0) {
+            status = 0;
+            break;
+        }
+
+        if (ring->msgs[index].msg_len != header_size + length ||
+            (hdr->msg_flags & MSG_TRUNC)) {
+            fprintf(stderr, "[%s] file chunk %u has %u bytes, expected "
+                    "%zu\n", conn->address, file->chunks,
+                    ring->msgs[index].msg_len, header_size + length);
+            errno = EPROTO;
+            status = -1;
+            break;
+        }
+
+        if (header_size > 0) {
+            chunk = &file->headers[index];
+            if (chunk->index != file->chunks ||
+                chunk->crc != crc32(file->map + file->offset, length))
+                file->bad_chunks++;
+        }
+
+        stack_ns = packet_stack_ns(hdr, realtime_now);
+        if (stack_ns > 0)
+            histogram_record(&conn->stats.rx_delay, stack_ns);
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_RX,
+                       conn->stats.packets_received,
+                       file->map + file->offset, length, 0, time_now,
+                       stack_ns);
+        record_received(conn, ring->msgs[index].msg_len, time_now);
+
+        file->offset += length;
+        file->chunks++;
+    }
+
+    // Give the slots back their own buffers
+    for (index = 0; index < (int)count; index++) {
+        ring->msgs[index].msg_hdr.msg_iov = &ring->iovs[index];
+        ring->msgs[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (file->offset == file->size)
+        file_finish(conn);
+
+    return status;
+}
+
+/**
+ * Release a session.
+ * @param session The session.
+ */
+void session_free(struct session *session) {
+    resume_buffer_free(&session->sent);
+    session->token = 0;
+}
+
+/**
+ * Drop the parked sessions whose clients did not come back in time.
+ * @param time_now The current time.
+ */
+void session_expire(uint64_t time_now) {
+    int index;
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (PARKED[index].token != 0 && time_now - PARKED[index].time_parked >
+                                        RESUME_PARK_SECONDS * 1000000000ULL) {
+            session_free(&PARKED[index]);
+            RESUME_STATS.expired++;
+        }
+    }
+}
+
+/**
+ * Keep the session of a connection whose link dropped, so its client can
+ * resume it. When every slot is taken the oldest session makes room.
+ *
+ * @param conn The connection.
+ */
+void session_park(struct connection_info *conn) {
+    uint64_t time_now = now_ns();
+    int index, slot = 0;
+
+    if (conn->session.token == 0)
+        return;
+
+    session_expire(time_now);
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (PARKED[index].token == 0) {
+            slot = index;
+            break;
+        }
+        if (PARKED[index].time_parked < PARKED[slot].time_parked)
+            slot = index;
+    }
+
+    if (PARKED[slot].token != 0) {
+        session_free(&PARKED[slot]);
+        RESUME_STATS.expired++;
+    }
+
+    PARKED[slot] = conn->session;
+    PARKED[slot].time_parked = time_now;
+    memset(&conn->session, 0, sizeof(conn->session));
+}
+
+/**
+ * Write an SDU of a resumed session. Resent SDUs have to arrive in order and
+ * all of them, so a full socket gets a short wait.
+ *
+ * @param s The socket.
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @return 0 on success, -1 on failure.
+ */
+int write_resent(int s, const char *sdu, size_t length) {
+    struct pollfd fd = { .fd = s, .events = POLLOUT };
+
+    for (;;) {
+        if (write(s, sdu, length) >= 0)
+            return 0;
+
+        if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ||
+            (errno != EINTR && poll(&fd, 1, RESUME_WRITE_TIMEOUT_MS) <= 0))
+            return -1;
+    }
+}
+
+/**
+ * Answer the first packet of a resumable session. A parked session with the
+ * client's token is taken over and the SDUs the client missed are sent
+ * again, any other token starts a new session.
+ *
+ * @param conn The connection.
+ * @param request The client's resume header.
+ */
+void session_resume(struct connection_info *conn,
+                    const struct resume_header *request) {
+    static char sdu[65536];
+    struct resume_header answer = { .magic = RESUME_MAGIC };
+    uint64_t time_now = now_ns(), recovery = 0;
+    uint32_t seq, start = 0, resent = 0;
+    long length;
+    int index;
+
+    // Already has one
+    if (conn->session.token != 0)
+        return;
+
+    session_expire(time_now);
+
+    for (index = 0; request->token != 0 && index < MAX_CLIENTS; index++) {
+        if (PARKED[index].token == request->token)
+            break;
+    }
+
+    if (request->token != 0 && index < MAX_CLIENTS) {
+        conn->session = PARKED[index];
+        PARKED[index].token = 0;
+        PARKED[index].sent.data = NULL;
+
+        recovery = time_now - conn->session.time_parked;
+        histogram_record(&RESUME_STATS.recovery, recovery);
+        RESUME_STATS.resumed++;
+
+        // What the client no longer has is lost
+        if (conn->session.rx_seq < request->keep_seq) {
+            RESUME_STATS.lost += request->keep_seq - conn->session.rx_seq;
+            conn->session.rx_seq = request->keep_seq;
+        }
+
+        start = resume_buffer_first(&conn->session.sent);
+        if (start < request->rx_seq)
+            start = request->rx_seq;
+        RESUME_STATS.lost += start - request->rx_seq;
+    }
+    else {
+        if (resume_buffer_init(&conn->session.sent) < 0) {
+            perror("Error allocating session");
+            return;
+        }
+
+        // Random enough to tell the sessions of the server apart, never 0
+        conn->session.token = (realtime_ns() << 8 ^ (conn - CLIENTS) ^
+                               (uint64_t)getpid() << 40) | 1;
+    }
+
+    answer.rx_seq = conn->session.rx_seq;
+    answer.keep_seq = start;
+    answer.token = conn->session.token;
+    if (write(conn->channel.socket, &answer, sizeof(answer)) < 0) {
+        conn->stats.write_errors++;
+        return;
+    }
+
+    for (seq = start; seq < conn->session.sent.next_seq; seq++) {
+        length = resume_buffer_get(&conn->session.sent, seq, sdu,
+                                   sizeof(sdu));
+        if (length > conn->channel.omtu)
+            length = conn->channel.omtu;
+
+        if (write_resent(conn->channel.socket, sdu, length) < 0) {
+            // The client counts what it got, it resumes from there again
+            conn->stats.write_errors++;
+            shutdown(conn->channel.socket, SHUT_RDWR);
+            break;
+        }
+
+        resent++;
+        conn->stats.bytes_sent += length;
+        conn->stats.packets_sent++;
+    }
+
+    RESUME_STATS.resent += resent;
+    if (recovery > 0)
+        printf("[%s] resumed session after %.3f s, sent %u SDUs again\n",
+               conn->address, recovery / 1e9, resent);
+}
 
 /**
- * From https://github.com/pauloborges/bluez/blob/master/tools/hcitool.c#L77
- * Display addresses for the Bluetooth adapters on the device.
+ * Point the event loop at what a connection waits for: received packets, or
+ * the socket becoming writable while echoes wait for it. With the io_uring
+ * engine the packets are signalled by its ring instead of the socket.
+ *
+ * @param epfd The event loop.
+ * @param conn The connection.
+ * @param writable Whether to wait for the socket to become writable.
+ * @return 0 on success, -1 on failure.
  */
-static int dev_info(int s, int dev_id, long arg)
-{
-    struct hci_dev_info di = { .dev_id = dev_id };
-    char addr[18];
+int connection_watch(int epfd, struct connection_info *conn, int writable) {
+    struct epoll_event event = { .data.u64 = conn - CLIENTS };
+    int fd = writable ? conn->channel.socket : conn->channel.receive_fd;
 
-    if (ioctl(s, HCIGETDEVINFO, (void *) &di))
-    return 0;
+    event.events = writable ? EPOLLOUT : EPOLLIN;
+    if (fd == conn->watch_fd)
+        return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        return -1;
+
+    if (conn->watch_fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->watch_fd, NULL);
+    conn->watch_fd = fd;
 
-    ba2str(&di.bdaddr, addr);
-    printf("\t%s\t%s\n", di.name, addr);
     return 0;
 }
 
 /**
- * Get status of global quit flag.
- * @return THe status of the quit flag.
+ * Accept all pending connections on the listening socket and add them to
+ * the event loop.
+ *
+ * @param epfd The event loop.
+ * @param listener The listening socket.
  */
-int get_flag_quit() {
-    int result = 0;
-    pthread_mutex_lock(&flag_quit_lock);
-    result = FLAG_QUIT == 1;
-    pthread_mutex_unlock(&flag_quit_lock);
-    return result;
+void connection_accept(int epfd, int listener) {
+    struct sockaddr_l2 rem_addr = { 0 };
+    struct connection_info *conn;
+    socklen_t opt = sizeof(rem_addr);
+    char address[18], prefix[24];
+    uint16_t handle;
+    int client, index;
+
+    while ((client = accept4(listener, (struct sockaddr *)&rem_addr, &opt,
+                             SOCK_NONBLOCK)) >= 0) {
+        opt = sizeof(rem_addr);
+        ba2str(&rem_addr.l2_bdaddr, address);
+
+        for (index = 0; index < MAX_CLIENTS; index++) {
+            if (CLIENTS[index].channel.socket < 0)
+                break;
+        }
+
+        if (index == MAX_CLIENTS) {
+            fprintf(stderr, "rejected connection from %s, already serving "
+                    "%d clients\n", address, MAX_CLIENTS);
+            close(client);
+            continue;
+        }
+
+        conn = &CLIENTS[index];
+        memset(conn, 0, sizeof(*conn));
+        conn->channel.socket = client;
+        strcpy(conn->address, address);
+        conn->channel.peer = rem_addr.l2_bdaddr;
+
+        if (setup_connection_buffers(conn) < 0) {
+            perror("Error reading negotiated MTU");
+            connection_free(&conn->channel);
+            send_queue_free(&conn->echo);
+            close(client);
+            conn->channel.socket = -1;
+            continue;
+        }
+
+        // The connection is still served without them
+        if (TIMESTAMPS && enable_timestamps(client, 0) < 0)
+            perror("Error enabling timestamps");
+
+        conn->watch_fd = -1;
+        if (connection_watch(epfd, conn, 0) < 0) {
+            perror("Error adding connection to event loop");
+            connection_free(&conn->channel);
+            send_queue_free(&conn->echo);
+            close(client);
+            conn->channel.socket = -1;
+            continue;
+        }
+
+        conn->stats.time_connected = now_ns();
+        conn->stats.cpu_connected = cpu_ns();
+        log_connection(&LOG_QUEUES[LOG_QUEUE_LOOP], index, LOG_CONNECT,
+                       &conn->channel.peer, conn->channel.imtu,
+                       conn->channel.omtu, conn->stats.time_connected);
+
+        fprintf(stderr, "accepted connection from %s\n", conn->address);
+        printf("[%s] negotiated MTU: incoming %u bytes, outgoing %u bytes\n",
+               conn->address, conn->channel.imtu, conn->channel.omtu);
+        if (LE_MODE)
+            print_le_flow_control();
+        if (CHANNEL_MODE_SET) {
+            snprintf(prefix, sizeof(prefix), "[%s] ", conn->address);
+            print_channel_mode(prefix, client);
+        }
+        if (ENGINE != &ENGINE_BATCH)
+            printf("[%s] engine: %s\n", conn->address,
+                   conn->channel.engine->name);
+
+        // Adapter counters at the start, for the report
+        conn->hci_dev = link_dev_id(client, &handle);
+        if (read_hci_stats(conn->hci_dev, &conn->hci_before) < 0)
+            conn->hci_dev = -1;
+
+        // Blocks the event loop until the update is in effect, a refused
+        // update leaves the connection as it is
+        if (CONN_REQUEST.interval > 0) {
+            conn->params = CONN_REQUEST;
+            if (update_conn_params(client, &conn->params) < 0) {
+                perror("Error updating connection parameters");
+                conn->params.interval = 0;
+            }
+            else {
+                snprintf(prefix, sizeof(prefix), "[%s] ", conn->address);
+                print_conn_params(prefix, &conn->params);
+            }
+        }
+
+        if ((LINK_PHY || LINK_DATA_LENGTH) &&
+            update_link_settings(client, &conn->link) == 0) {
+            snprintf(prefix, sizeof(prefix), "[%s] ", conn->address);
+            print_link_settings(prefix, &conn->link);
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error accepting connection");
 }
 
 /**
- * Set status of global quit flag.
+ * Close a connection, print its report and free its slot.
+ *
+ * @param epfd The event loop.
+ * @param conn The connection.
  */
- int set_flag_quit(int status) {
-    pthread_mutex_lock(&flag_quit_lock);
-    FLAG_QUIT = status;
-    pthread_mutex_unlock(&flag_quit_lock);
- }
+void connection_close(int epfd, struct connection_info *conn) {
+    if (conn->file.active && !conn->file.done)
+        file_finish(conn);
+
+    log_connection(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_DISCONNECT,
+                   &conn->channel.peer, conn->channel.imtu, conn->channel.omtu,
+                   now_ns());
+    log_sync();
+    fprintf(stderr, "connection from %s closed after %.1f s\n", conn->address,
+            (double)(now_ns() - conn->stats.time_connected) / 1e9);
+    print_connection_report(conn);
+    stripe_leave(conn);
+
+    // Kept for the client to resume unless it said bye
+    if (!conn->closing && !get_flag_quit())
+        session_park(conn);
+    else if (conn->session.token != 0)
+        session_free(&conn->session);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->watch_fd, NULL);
+    close(conn->channel.socket);
+    connection_free(&conn->channel);
+    send_queue_free(&conn->echo);
+
+    conn->channel.socket = -1;
+}
 
 /**
- * Thread to receive messages from the client.
+ * Write the pending echoes of a connection. While the socket is not writable
+ * the connection waits for EPOLLOUT instead of reading more packets, so the
+ * echoes stay in the receive ring until they have been written.
  *
- * @param th_args The thread argument.
- * @return Nothing
+ * @param epfd The event loop.
+ * @param conn The connection.
+ * @return 0 on success or when waiting, -1 if the connection failed.
  */
-void *thread_receiver(void *th_args) {
-    long bytes_read;
-    char receive_msg_buf[673] = {0};
-    int *s = (int *)th_args;
-    int quit = 0;
+int connection_flush(int epfd, struct connection_info *conn) {
+    unsigned long long bytes;
+    uint64_t time_now;
+    long sent, index;
 
-    while(!quit) {
-        if (get_flag_quit())
-            break;
+    sent = connection_submit(&conn->channel, &conn->echo, &bytes);
 
-        memset(receive_msg_buf, 0, sizeof(receive_msg_buf));
-        bytes_read = read(*s, receive_msg_buf, sizeof(receive_msg_buf));
+    if (sent < 0) {
+        perror("Error echoing message");
+        conn->stats.write_errors++;
+        return -1;
+    }
 
-        quit = strcmp(receive_msg_buf, "bye") == 0;
+    if (LOG_PACKETS) {
+        time_now = now_ns();
+        for (index = 0; index < sent; index++)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_TX,
+                       conn->stats.packets_sent + index, NULL,
+                       conn->echo.msgs[index].msg_len, 0, time_now, 0);
+    }
 
-        if( bytes_read > 0 )
-            printf("Client: %s\n", receive_msg_buf);
-        else
-            quit = 1;
+    conn->stats.bytes_sent += bytes;
+    conn->stats.packets_sent += sent;
 
-        if (quit) {
-            set_flag_quit(1);
-            pthread_cancel(thread_sender_id);
+    if (conn->echo.count > 0) {
+        if (!conn->waiting_writable) {
+            connection_watch(epfd, conn, 1);
+            conn->waiting_writable = 1;
         }
+        return 0;
+    }
 
+    if (conn->waiting_writable) {
+        connection_watch(epfd, conn, 0);
+        conn->waiting_writable = 0;
     }
 
-    pthread_exit(NULL);
+    return 0;
 }
 
 /**
- * Thread to send messages to the client.
+ * Log the text messages a client coalesced into one SDU, they are read
+ * where they are in the receive ring.
  *
- * @param th_args The thread argument.
- * @return Nothing
+ * @param conn The connection.
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @param offset The offset of the first message.
+ * @param time_now When the SDU was received.
+ * @param stack_ns The time the SDU spent in the kernel, 0 when unknown.
  */
-void *thread_sender(void *th_args) {
-    long status;
-    int max_send = 672, quit = 0;
-    char send_msg[673] = {0};
-    int *s = (int *)th_args;
+void consume_frame(struct connection_info *conn, const char *sdu,
+                   size_t length, size_t offset, uint64_t time_now,
+                   uint64_t stack_ns) {
+    const char *message;
+    long message_len;
 
-    while(quit != 1) {
-        if (get_flag_quit())
-            break;
+    conn->stats.frames_received++;
+
+    while (!conn->closing &&
+           (message_len = frame_next(sdu, length, &offset, &message)) >= 0) {
+        if (LOG_MESSAGES)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_RX,
+                       conn->stats.frame_messages, message, message_len, 1,
+                       time_now, stack_ns);
+        conn->stats.frame_messages++;
+
+        if (message_len == 3 && memcmp(message, "bye", 3) == 0)
+            conn->closing = 1;
+    }
+}
+
+/**
+ * Consume a batch of packets from a connection: count them, print text
+ * messages, also those coalesced into framed SDUs, and queue echoes. A
+ * "bye" message marks the connection for closing.
+ *
+ * @param ctx The connection.
+ * @param msgs The received packets.
+ * @param count The number of packets.
+ */
+void consume_packets(void *ctx, struct mmsghdr *msgs, unsigned int count) {
+    struct connection_info *conn = ctx;
+    struct ping_header header;
+    struct bench_header bench;
+    struct stripe_header stripe;
+    struct iovec echo;
+    uint64_t time_now = now_ns();
+    uint64_t realtime_now = TIMESTAMPS ? realtime_ns() : 0;
+    struct resume_header resume;
+    uint64_t stack_ns;
+    unsigned int index;
+    size_t offset;
+    long inflated;
+    char *packet;
+
+    for (index = 0; index < count; index++) {
+        packet = msgs[index].msg_hdr.msg_iov->iov_base;
+        stack_ns = packet_stack_ns(&msgs[index].msg_hdr, realtime_now);
+        if (stack_ns > 0)
+            histogram_record(&conn->stats.rx_delay, stack_ns);
+
+        if (LOG_PACKETS && (ECHO_MODE || BENCH_MODE))
+            log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS, LOG_RX,
+                       conn->stats.packets_received, packet,
+                       msgs[index].msg_len, 0, time_now, stack_ns);
+        record_received(conn, msgs[index].msg_len, time_now);
+
+        if (BENCH_MODE && msgs[index].msg_len >= sizeof(bench)) {
+            memcpy(&bench, packet, sizeof(bench));
+            if (bench.magic == BENCH_MAGIC)
+                record_sequence(&conn->stats, bench.seq);
+        }
+
+        // Striped payloads are put in order across the channels instead
+        if (BENCH_MODE && msgs[index].msg_len >= sizeof(stripe)) {
+            memcpy(&stripe, packet, sizeof(stripe));
+            if (stripe.magic == STRIPE_MAGIC)
+                stripe_record(conn, &stripe, msgs[index].msg_len, time_now);
+        }
+
+        if (ECHO_MODE) {
+            if (msgs[index].msg_len >= sizeof(header)) {
+                memcpy(&header, packet, sizeof(header));
+                if (header.magic == PING_MAGIC && header.last_rtt_ns > 0)
+                    histogram_record(&conn->stats.rtt, header.last_rtt_ns);
+            }
+
+            echo.iov_base = packet;
+            echo.iov_len = msgs[index].msg_len;
+            send_queue_push(&conn->echo, &echo, 1);
+        }
+        else if (!BENCH_MODE && !conn->closing) {
+            if (msgs[index].msg_len == sizeof(resume)) {
+                memcpy(&resume, packet, sizeof(resume));
+                if (resume.magic == RESUME_MAGIC) {
+                    session_resume(conn, &resume);
+                    continue;
+                }
+            }
+
+            if (conn->session.token != 0)
+                conn->session.rx_seq++;
+
+            offset = frame_start(packet, msgs[index].msg_len);
+            if (offset > 0) {
+                consume_frame(conn, packet, msgs[index].msg_len, offset,
+                              time_now, stack_ns);
+                continue;
+            }
+
+            inflated = frame_inflate(packet, msgs[index].msg_len, INFLATE_BUF,
+                                     sizeof(INFLATE_BUF));
+            if (inflated < 0) {
+                conn->stats.read_errors++;
+                continue;
+            }
+            if (inflated > 0) {
+                conn->stats.compressed_received++;
+                conn->stats.compressed_bytes += msgs[index].msg_len;
+                conn->stats.inflated_bytes += inflated;
+
+                offset = frame_start(INFLATE_BUF, inflated);
+                if (offset > 0)
+                    consume_frame(conn, INFLATE_BUF, inflated, offset,
+                                  time_now, stack_ns);
+                continue;
+            }
+
+            packet[msgs[index].msg_len] = '\0';
+            if (LOG_MESSAGES)
+                log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], conn - CLIENTS,
+                           LOG_RX, conn->stats.packets_received - 1, packet,
+                           msgs[index].msg_len, 1, time_now, stack_ns);
+
+            if (strcmp(packet, "bye") == 0)
+                conn->closing = 1;
+        }
+    }
+}
+
+/**
+ * Read the packets waiting on a connection in batches, at most READ_BUDGET
+ * of them so other connections get their turn.
+ *
+ * @param epfd The event loop.
+ * @param conn The connection.
+ * @return 0 to keep the connection, -1 to close it.
+ */
+int connection_read(int epfd, struct connection_info *conn) {
+    long received;
+    int budget;
+
+    for (budget = 0; budget < READ_BUDGET; budget++) {
+        if (RECV_FILE_PATH != NULL && !conn->file.done)
+            received = file_receive(conn);
+        else
+            received = connection_receive(&conn->channel, consume_packets,
+                                          conn);
+
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        if (received < 0)
+            conn->stats.read_errors++;
+
+        if (conn->echo.count > 0 && connection_flush(epfd, conn) < 0)
+            return -1;
 
-        memset(send_msg, 0, sizeof(send_msg));
-        fgets(send_msg, max_send, stdin);
+        if (received <= 0 || conn->closing)
+            return -1;
 
-        // Remove trailing newlines
-        send_msg[strcspn(send_msg, "\n\r")] = 0;
+        // Socket is full, continue when the echoes have been written
+        if (conn->echo.count > 0)
+            return 0;
 
-        status = write(*s, send_msg, strlen(send_msg));
+        // Nothing more queued
+        if ((unsigned long)received < conn->channel.ring.count)
+            return 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Send a message to all connected clients. Clients that cannot take the
+ * message right away miss it, so one slow client cannot block the others.
+ *
+ * @param msg The message.
+ */
+void send_to_all(const char *msg) {
+    struct connection_info *conn;
+    size_t length;
+    long status;
+    int index;
+
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        conn = &CLIENTS[index];
+        if (conn->channel.socket < 0)
+            continue;
+
+        length = strlen(msg);
+        if (length > conn->channel.omtu)
+            length = conn->channel.omtu;
+
+        status = write(conn->channel.socket, msg, length);
 
         if (status < 0) {
-            perror("Error sending message");
-            quit = 1;
+            fprintf(stderr, "Error sending message to %s: %s\n",
+                    conn->address, strerror(errno));
+            conn->stats.write_errors++;
+            continue;
         }
 
-        quit = strcmp(send_msg, "bye") == 0;
+        // Only what the socket took, the client counts what it receives
+        if (conn->session.token != 0)
+            resume_buffer_push(&conn->session.sent, msg, status);
+
+        if (LOG_PACKETS)
+            log_packet(&LOG_QUEUES[LOG_QUEUE_LOOP], index, LOG_TX,
+                       conn->stats.packets_sent, msg, status, 1, now_ns(),
+                       0);
+
+        conn->stats.bytes_sent += status;
+        conn->stats.packets_sent++;
+    }
+
+    length = strlen(msg);
+    if (length > UINT16_MAX)
+        length = UINT16_MAX;
 
-        // Set global quit
-        if (quit) {
+    // Sent once their client resumes
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (PARKED[index].token != 0)
+            resume_buffer_push(&PARKED[index].sent, msg, length);
+    }
+}
+
+/**
+ * Read from stdin and send every complete line to all clients, "bye" quits
+ * the server after it has been sent.
+ *
+ * @param epfd The event loop.
+ */
+void handle_stdin(int epfd) {
+    static char line[STDIN_LINE_MAX + 1];
+    static size_t line_len = 0;
+    char *start, *end;
+    long bytes_read;
+
+    bytes_read = read(STDIN_FILENO, line + line_len,
+                      STDIN_LINE_MAX - line_len);
+
+    if (bytes_read <= 0) {
+        // Keep serving clients without stdin
+        epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        return;
+    }
+
+    line_len += bytes_read;
+    start = line;
+
+    while ((end = memchr(start, '\n', line + line_len - start)) != NULL) {
+        *end = '\0';
+
+        // Remove trailing carriage returns
+        start[strcspn(start, "\r")] = '\0';
+
+        send_to_all(start);
+        if (strcmp(start, "bye") == 0)
             set_flag_quit(1);
-            pthread_cancel(thread_receiver_id);
-        }
 
+        start = end + 1;
     }
 
-    pthread_exit(NULL);
+    line_len -= start - line;
+    memmove(line, start, line_len);
+
+    // A line filling the whole buffer is sent as it is
+    if (line_len == STDIN_LINE_MAX) {
+        line[line_len] = '\0';
+        send_to_all(line);
+        line_len = 0;
+    }
+}
+/**
+ * Print information about how to execute the program.
+ *
+ * @param program The name of the program.
+ */
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "options:\n"
+            "  --le                 use LE credit based flow control "
+            "instead of BR/EDR\n"
+            "  --psm PSM            PSM to use (default: 0x1001, LE: 0x0080)\n"
+            "  --credits N          LE credits to give the peer (needs "
+            "root, host-wide\n"
+            "                       until the program exits)\n"
+            "  --mps BYTES          LE MPS to use (needs root, host-wide "
+            "until the\n"
+            "                       program exits)\n"
+            "  --mtu BYTES          request this incoming and outgoing MTU\n"
+            "  --imtu BYTES         request this incoming MTU\n"
+            "  --omtu BYTES         request this outgoing MTU\n"
+            "  --mode MODE          BR/EDR channel mode: basic, ertm or "
+            "streaming\n"
+            "                       (default: basic)\n"
+            "  --tx-window N        ERTM transmit window, 1-16383 "
+            "(default: kernel default)\n"
+            "  --max-transmit N     ERTM transmissions of a frame before "
+            "giving up, 1-255\n"
+            "  --conn-interval MS   LE connection interval to apply after "
+            "connecting\n"
+            "                       (needs root)\n"
+            "  --conn-latency N     LE connection events the peripheral may "
+            "skip (default: 0)\n"
+            "  --supervision-timeout MS\n"
+            "                       LE supervision timeout (default: 420 or "
+            "what the interval\n"
+            "                       and latency need)\n"
+            "  --phy PHY            LE PHY to switch to after connecting: "
+            "1m, 2m or coded\n"
+            "                       (needs root)\n"
+            "  --data-length BYTES  LE link-layer payload size to request, "
+            "27-251 (needs root)\n"
+            "  --batch N            packets received per system call "
+            "(default: 16)\n"
+            "  --engine ENGINE      how packets are moved: batch "
+            "(recvmmsg/sendmmsg),\n"
+            "                       single (one system call per packet) or "
+            "uring (io_uring,\n"
+            "                       Linux 6.0 or later, default: batch)\n"
+            "  --bench              count received payloads and report "
+            "throughput\n"
+            "  --echo               echo every packet back, for the client's "
+            "--ping\n"
+            "  --timestamps         report the time received packets spend "
+            "in the kernel\n"
+            "  --recv-file FILE     store the file sent by the client's "
+            "--send-file in FILE\n"
+            "  --cpu CPU            pin the event loop to CPU\n"
+            "  --log-cpu CPU        pin the log writer thread to CPU\n"
+            "  --rt-prio N          run the event loop with SCHED_FIFO "
+            "priority N\n"
+            "  --mlock              lock all memory so it is never paged "
+            "out\n"
+            "  --report SECS        print the throughput of every connection "
+            "this often\n"
+            "  --metrics PATH       serve per-connection counters on a Unix "
+            "socket\n"
+            "  --verbosity LEVEL    0: no per-packet output, 1: messages "
+            "from the clients,\n"
+            "                       2: every packet (default: 1)\n"
+            "  --log-file FILE      write per-packet output to FILE instead "
+            "of stdout\n"
+            "  --capture FILE       record every packet in a binary capture "
+            "file\n"
+            "  --capture-payload BYTES\n"
+            "                       payload bytes to keep per packet in the "
+            "capture (default: 0)\n",
+            program);
 }
 
 int main(int argc, char **argv)
 {
-    struct sockaddr_l2 loc_addr = { 0 }, rem_addr = { 0 };
-    char buf[1024] = { 0 };
-    int s, client;
-    long status;
-    socklen_t opt = sizeof(rem_addr);
+    struct sockaddr_l2 loc_addr = { 0 };
+    struct epoll_event event = { .events = EPOLLIN };
+    struct epoll_event events[TOKEN_COUNT];
+    struct sigaction signal_action = { 0 };
+    struct itimerspec report_timer = { 0 };
+    struct itimerspec sample_timer = {
+        .it_value.tv_sec = METRICS_SAMPLE_SECONDS,
+        .it_interval.tv_sec = METRICS_SAMPLE_SECONDS
+    };
+    struct connection_info *conn;
+    int s, epfd, report_fd = -1, metrics_fd = -1, sample_fd = -1;
+    int arg, ready, index;
+    uint64_t token, expirations;
+    long status, cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    cpu_set_t cpus;
+    static struct option long_options[] = {
+        {"le",                  no_argument,       0, 'L'},
+        {"psm",                 required_argument, 0, 'P'},
+        {"credits",             required_argument, 0, 'C'},
+        {"mps",                 required_argument, 0, 'M'},
+        {"mtu",                 required_argument, 0, 'm'},
+        {"imtu",                required_argument, 0, 'I'},
+        {"omtu",                required_argument, 0, 'O'},
+        {"mode",                required_argument, 0, 'E'},
+        {"tx-window",           required_argument, 0, 'x'},
+        {"max-transmit",        required_argument, 0, 'A'},
+        {"conn-interval",       required_argument, 0, 'K'},
+        {"conn-latency",        required_argument, 0, 'l'},
+        {"supervision-timeout", required_argument, 0, 'T'},
+        {"phy",                 required_argument, 0, 'H'},
+        {"data-length",         required_argument, 0, 'D'},
+        {"batch",               required_argument, 0, 'B'},
+        {"engine",              required_argument, 0, 'g'},
+        {"bench",               no_argument,       0, 'b'},
+        {"echo",                no_argument,       0, 'e'},
+        {"timestamps",          no_argument,       0, 'S'},
+        {"recv-file",           required_argument, 0, 'f'},
+        {"cpu",                 required_argument, 0, 'U'},
+        {"log-cpu",             required_argument, 0, 'G'},
+        {"rt-prio",             required_argument, 0, 'Q'},
+        {"mlock",               no_argument,       0, 'N'},
+        {"report",              required_argument, 0, 'r'},
+        {"metrics",             required_argument, 0, 'u'},
+        {"verbosity",           required_argument, 0, 'v'},
+        {"log-file",            required_argument, 0, 'F'},
+        {"capture",             required_argument, 0, 'X'},
+        {"capture-payload",     required_argument, 0, 'Y'},
+        {0, 0, 0, 0}
+    };
+
+    while ((arg = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (arg) {
+            case 'L':
+                LE_MODE = 1;
+                break;
+            case 'P':
+                PSM = parse_number(argv[0], optarg);
+                break;
+            case 'C':
+                LE_CREDITS = parse_number(argv[0], optarg);
+                break;
+            case 'M':
+                LE_MPS = parse_number(argv[0], optarg);
+                break;
+            case 'm':
+                REQUEST_IMTU = REQUEST_OMTU = parse_number(argv[0], optarg);
+                break;
+            case 'I':
+                REQUEST_IMTU = parse_number(argv[0], optarg);
+                break;
+            case 'O':
+                REQUEST_OMTU = parse_number(argv[0], optarg);
+                break;
+            case 'E':
+                CHANNEL_MODE = parse_channel_mode(argv[0], optarg);
+                CHANNEL_MODE_SET = 1;
+                break;
+            case 'x':
+                TX_WINDOW = parse_number(argv[0], optarg);
+                break;
+            case 'A':
+                MAX_TRANSMIT = parse_number(argv[0], optarg);
+                break;
+            case 'K':
+                CONN_INTERVAL_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'l':
+                CONN_LATENCY = parse_number(argv[0], optarg);
+                break;
+            case 'T':
+                CONN_TIMEOUT_MS = parse_milliseconds(argv[0], optarg);
+                break;
+            case 'H':
+                LINK_PHY = parse_phy(argv[0], optarg);
+                break;
+            case 'D':
+                LINK_DATA_LENGTH = parse_number(argv[0], optarg);
+                break;
+            case 'B':
+                RECV_BATCH = parse_number(argv[0], optarg);
+                break;
+            case 'g':
+                ENGINE = parse_engine(argv[0], optarg);
+                break;
+            case 'b':
+                BENCH_MODE = 1;
+                break;
+            case 'e':
+                ECHO_MODE = 1;
+                break;
+            case 'S':
+                TIMESTAMPS = 1;
+                break;
+            case 'f':
+                RECV_FILE_PATH = optarg;
+                break;
+            case 'U':
+                LOOP_CPU = parse_number(argv[0], optarg);
+                break;
+            case 'G':
+                LOG_CPU = parse_number(argv[0], optarg);
+                break;
+            case 'Q':
+                RT_PRIORITY = parse_number(argv[0], optarg);
+                break;
+            case 'N':
+                MEMORY_LOCK = 1;
+                break;
+            case 'r':
+                REPORT_INTERVAL = parse_number(argv[0], optarg);
+                break;
+            case 'u':
+                METRICS_PATH = optarg;
+                break;
+            case 'v':
+                VERBOSITY = parse_number(argv[0], optarg);
+                break;
+            case 'F':
+                LOG_PATH = optarg;
+                break;
+            case 'X':
+                CAPTURE_PATH = optarg;
+                break;
+            case 'Y':
+                CAPTURE_SNAPLEN = parse_number(argv[0], optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(2);
+        }
+    }
+
+    if (BENCH_MODE && ECHO_MODE) {
+        fprintf(stderr, "--bench and --echo cannot be combined\n");
+        exit(2);
+    }
+
+    if (RECV_FILE_PATH != NULL && (BENCH_MODE || ECHO_MODE)) {
+        fprintf(stderr, "--recv-file cannot be combined with --bench or "
+                "--echo\n");
+        exit(2);
+    }
+
+    if (REQUEST_IMTU > 65535 || REQUEST_OMTU > 65535) {
+        fprintf(stderr, "MTU must be at most 65535 bytes\n");
+        exit(2);
+    }
+
+    if (RECV_BATCH < 1 || RECV_BATCH > 1024) {
+        fprintf(stderr, "batch size must be between 1 and 1024\n");
+        exit(2);
+    }
+
+    // Multishot receives carry no control messages, and file chunks are
+    // received straight into the file
+    if (ENGINE == &ENGINE_URING && (TIMESTAMPS || RECV_FILE_PATH != NULL)) {
+        fprintf(stderr, "--timestamps and --recv-file need the batch or "
+                "single engine\n");
+        exit(2);
+    }
+
+    if (LOOP_CPU >= cpu_count ||
+        LOG_CPU >= cpu_count) {
+        fprintf(stderr, "CPU must be below %ld\n", cpu_count);
+        exit(2);
+    }
+
+    if (RT_PRIORITY > sched_get_priority_max(SCHED_FIFO)) {
+        fprintf(stderr, "real-time priority must be between 1 and %d\n",
+                sched_get_priority_max(SCHED_FIFO));
+        exit(2);
+    }
+
+    if (VERBOSITY > VERBOSITY_PACKETS) {
+        fprintf(stderr, "verbosity must be at most %d\n", VERBOSITY_PACKETS);
+        exit(2);
+    }
+
+    if (CAPTURE_SNAPLEN > 65535) {
+        fprintf(stderr, "capture payload must be at most 65535 bytes\n");
+        exit(2);
+    }
+
+    if (PSM == 0)
+        PSM = LE_MODE ? PSM_LE_DEFAULT : PSM_BREDR_DEFAULT;
+
+    if (PSM > 0xffff) {
+        fprintf(stderr, "PSM must be at most 0xffff\n");
+        exit(2);
+    }
+
+    if ((LE_CREDITS > 0 || LE_MPS > 0) && !LE_MODE) {
+        fprintf(stderr, "--credits and --mps need --le\n");
+        exit(2);
+    }
+
+    if (LE_CREDITS > 0xffff || LE_MPS > 0xffff) {
+        fprintf(stderr, "credits and MPS must be at most 65535\n");
+        exit(2);
+    }
+
+    if ((CONN_INTERVAL_MS > 0 || CONN_LATENCY > 0 || CONN_TIMEOUT_MS > 0) &&
+        !LE_MODE) {
+        fprintf(stderr, "--conn-interval, --conn-latency and "
+                "--supervision-timeout need --le\n");
+        exit(2);
+    }
+
+    if ((CONN_LATENCY > 0 || CONN_TIMEOUT_MS > 0) && CONN_INTERVAL_MS == 0) {
+        fprintf(stderr, "--conn-latency and --supervision-timeout need "
+                "--conn-interval\n");
+        exit(2);
+    }
+
+    if ((LINK_PHY || LINK_DATA_LENGTH) && !LE_MODE) {
+        fprintf(stderr, "--phy and --data-length need --le\n");
+        exit(2);
+    }
+
+    if (LINK_DATA_LENGTH &&
+        (LINK_DATA_LENGTH < DATA_LENGTH_MIN ||
+         LINK_DATA_LENGTH > DATA_LENGTH_MAX)) {
+        fprintf(stderr, "data length must be between %d and %d bytes\n",
+                DATA_LENGTH_MIN, DATA_LENGTH_MAX);
+        exit(2);
+    }
+
+    if ((CHANNEL_MODE_SET || TX_WINDOW > 0 || MAX_TRANSMIT > 0) && LE_MODE) {
+        fprintf(stderr, "--mode, --tx-window and --max-transmit are for "
+                "BR/EDR, they cannot be combined with --le\n");
+        exit(2);
+    }
+
+    if ((TX_WINDOW > 0 || MAX_TRANSMIT > 0) &&
+        CHANNEL_MODE != L2CAP_MODE_ERTM) {
+        fprintf(stderr, "--tx-window and --max-transmit need --mode ertm\n");
+        exit(2);
+    }
+
+    if (TX_WINDOW > TX_WINDOW_MAX || MAX_TRANSMIT > MAX_TRANSMIT_MAX) {
+        fprintf(stderr, "tx window must be at most %d and max transmit at "
+                "most %d\n", TX_WINDOW_MAX, MAX_TRANSMIT_MAX);
+        exit(2);
+    }
+
+    if (CONN_INTERVAL_MS > 0 && make_conn_params(&CONN_REQUEST) < 0)
+        exit(2);
+
+    if (LE_MODE) {
+        // The knobs apply to the whole host, put them back on every exit
+        atexit(restore_le_flow_control);
+        if (set_le_flow_control(LE_CREDITS, LE_MPS) < 0)
+            exit(1);
+    }
 
     printf("Devices:\n");
     hci_for_each_dev(HCI_UP, dev_info, 0);
@@ -148,11 +2363,12 @@ int main(int argc, char **argv)
     // allocate socket
     s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
 
-    // bind socket to port 0x1001 of the first available
-    // bluetooth adapter
+    // bind socket to the PSM (0x1001 unless changed) of the first
+    // available bluetooth adapter
     loc_addr.l2_family = AF_BLUETOOTH;
     loc_addr.l2_bdaddr = *BDADDR_ANY;
-    loc_addr.l2_psm = htobs(0x1001);
+    loc_addr.l2_psm = htobs(PSM);
+    loc_addr.l2_bdaddr_type = LE_MODE ? BDADDR_LE_PUBLIC : BDADDR_BREDR;
 
     status = bind(s, (struct sockaddr *)&loc_addr, sizeof(loc_addr));
 
@@ -161,25 +2377,216 @@ int main(int argc, char **argv)
         exit(2);
     }
 
-    // put socket into listening mode
-    listen(s, 1);
+    if (LE_MODE && set_le_flowctl_mode(s) < 0) {
+        perror("Error selecting LE flow control");
+        exit(2);
+    }
 
-    // accept one connection
-    client = accept(s, (struct sockaddr *)&rem_addr, &opt);
+    // accepted connections inherit the MTUs of the listening socket
+    if (CHANNEL_MODE_SET && set_channel_mode(s) < 0) {
+        perror("Error selecting channel mode");
+        exit(2);
+    }
 
-    ba2str( &rem_addr.l2_bdaddr, buf );
-    fprintf(stderr, "accepted connection from %s\n", buf);
-    printf("Begin sending messages below.\n");
+    if (set_socket_mtu(s, REQUEST_IMTU, REQUEST_OMTU) < 0) {
+        perror("Error requesting MTU");
+        exit(2);
+    }
 
-    // Start threads to send and receive data
-    pthread_create(&thread_receiver_id, NULL, thread_receiver, (void *)&client);
-    pthread_create(&thread_sender_id, NULL, thread_sender, (void *)&client);
+    // put socket into listening mode, connections are accepted and served
+    // from a single event loop
+    for (index = 0; index < MAX_CLIENTS; index++)
+        CLIENTS[index].channel.socket = -1;
 
-    // Wait for threads to finish
-    pthread_join(thread_receiver_id, NULL);
-    pthread_join(thread_sender_id, NULL);
+    epfd = epoll_create1(0);
+    QUIT_EVENT_FD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
-    // close connection
-    close(client);
+    if (epfd < 0 || QUIT_EVENT_FD < 0 || set_nonblocking(s) < 0 ||
+        listen(s, MAX_CLIENTS) < 0) {
+        perror("Error setting up event loop");
+        exit(2);
+    }
+
+    event.data.u64 = TOKEN_LISTEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s, &event);
+    event.data.u64 = TOKEN_QUIT;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, QUIT_EVENT_FD, &event);
+
+    signal_action.sa_handler = handler_signal_interrupt;
+    sigemptyset(&signal_action.sa_mask);
+    sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGTERM, &signal_action, NULL);
+
+    // Writing to a client that just disconnected must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (BENCH_MODE) {
+        printf("Running benchmark, waiting for payloads.\n");
+    }
+    else if (ECHO_MODE) {
+        printf("Echoing packets back to the clients.\n");
+    }
+    else if (RECV_FILE_PATH != NULL) {
+        printf("Waiting for a file to store in %s.\n", RECV_FILE_PATH);
+    }
+    else {
+        // stdin that cannot be polled (e.g. a regular file) is not used
+        event.data.u64 = TOKEN_STDIN;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0)
+            printf("Begin sending messages below.\n");
+    }
+
+    if (CAPTURE_PATH != NULL &&
+        capture_open(CAPTURE_ROLE_SERVER,
+                     BENCH_MODE ? CAPTURE_MODE_BENCH :
+                     ECHO_MODE ? CAPTURE_MODE_ECHO :
+                     RECV_FILE_PATH ? CAPTURE_MODE_FILE : CAPTURE_MODE_TEXT,
+                     BDADDR_ANY, REQUEST_IMTU, REQUEST_OMTU) < 0) {
+        perror("Error creating capture file");
+        exit(2);
+    }
+
+    // Mapped before --mlock, which then locks it as well
+    if (buffer_pool_init(&BUFFER_POOL, pool_block_size(),
+                         pool_block_count(MAX_CLIENTS)) < 0) {
+        perror("Error allocating buffer pool");
+        exit(1);
+    }
+
+    if (setup_scheduling() < 0)
+        exit(1);
+
+    if (log_start(CAPTURE_ROLE_SERVER) < 0) {
+        perror("Error starting log writer");
+        exit(2);
+    }
+
+    // Pinned after the log writer started, which would inherit the CPU
+    if (LOOP_CPU >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(LOOP_CPU, &cpus);
+        errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (errno != 0) {
+            perror("Error pinning the event loop");
+            exit(1);
+        }
+    }
+
+    if (REPORT_INTERVAL > 0) {
+        report_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        report_timer.it_value.tv_sec = REPORT_INTERVAL;
+        report_timer.it_interval.tv_sec = REPORT_INTERVAL;
+
+        event.data.u64 = TOKEN_REPORT;
+        if (report_fd < 0 ||
+            timerfd_settime(report_fd, 0, &report_timer, NULL) < 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, report_fd, &event) < 0) {
+            perror("Error setting up report timer");
+            exit(2);
+        }
+    }
+
+    // Served from the event loop, which owns the counters, so the data path
+    // needs neither locks nor atomics
+    if (METRICS_PATH != NULL) {
+        metrics_fd = metrics_open(METRICS_PATH);
+        sample_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+        if (metrics_fd < 0 || sample_fd < 0 ||
+            timerfd_settime(sample_fd, 0, &sample_timer, NULL) < 0) {
+            perror("Error setting up metrics socket");
+            exit(2);
+        }
+
+        event.data.u64 = TOKEN_METRICS;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, metrics_fd, &event);
+        event.data.u64 = TOKEN_METRICS_SAMPLE;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sample_fd, &event);
+    }
+
+    while (!get_flag_quit()) {
+        ready = epoll_wait(epfd, events, TOKEN_COUNT, -1);
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+
+        if (ready < 0) {
+            perror("Error waiting for events");
+            break;
+        }
+
+        for (index = 0; index < ready; index++) {
+            token = events[index].data.u64;
+
+            if (token == TOKEN_QUIT) {
+                // The loop condition ends the event loop
+                continue;
+            }
+            else if (token == TOKEN_LISTEN) {
+                connection_accept(epfd, s);
+            }
+            else if (token == TOKEN_STDIN) {
+                handle_stdin(epfd);
+            }
+            else if (token == TOKEN_REPORT) {
+                if (read(report_fd, &expirations, sizeof(expirations)) > 0)
+                    print_interval_report(
+                        (double)REPORT_INTERVAL * expirations);
+            }
+            else if (token == TOKEN_METRICS) {
+                metrics_accept(epfd, metrics_fd);
+            }
+            else if (token == TOKEN_METRICS_SAMPLE) {
+                if (read(sample_fd, &expirations, sizeof(expirations)) > 0)
+                    metrics_sample(
+                        (double)METRICS_SAMPLE_SECONDS * expirations);
+            }
+            else if (token >= TOKEN_METRICS_CLIENT) {
+                metrics_answer(token - TOKEN_METRICS_CLIENT);
+            }
+            else {
+                conn = &CLIENTS[token];
+
+                // Closed by an earlier event in this batch
+                if (conn->channel.socket < 0)
+                    continue;
+
+                if (conn->waiting_writable)
+                    status = connection_flush(epfd, conn);
+                else
+                    status = connection_read(epfd, conn);
+
+                if (status < 0)
+                    connection_close(epfd, conn);
+            }
+        }
+    }
+
+    // close connections
+    for (index = 0; index < MAX_CLIENTS; index++) {
+        if (CLIENTS[index].channel.socket >= 0)
+            connection_close(epfd, &CLIENTS[index]);
+        if (PARKED[index].token != 0)
+            session_free(&PARKED[index]);
+    }
+
+    log_stop();
+    print_pool_stats("", &BUFFER_POOL);
+    buffer_pool_free(&BUFFER_POOL);
+
+    if (report_fd >= 0)
+        close(report_fd);
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+        unlink(METRICS_PATH);
+    }
+    for (index = 0; index < METRICS_CLIENTS; index++) {
+        if (METRICS_CLIENT_FDS[index] >= 0)
+            close(METRICS_CLIENT_FDS[index]);
+    }
+    if (sample_fd >= 0)
+        close(sample_fd);
+    close(QUIT_EVENT_FD);
+    close(epfd);
     close(s);
 }
@@ -0,0 +1,135 @@
+"""Reader for the capture files written by l2cap-client and l2cap-server
+(see --capture).
+
+Records are unpacked straight from the mapped file, nothing is copied or
+decoded as text before that. Timestamps are turned into wall clock time
+with the start times in the header.
+"""
+from typing import Iterator, NamedTuple, Union
+import mmap
+import struct
+
+# ------ [ Constants ] --------------------------------------------------------
+
+CAPTURE_MAGIC: bytes = b"L2CAPCAP"
+CAPTURE_VERSION: int = 2
+
+# Magic, version, header size, record size, snaplen, role, mode, LE,
+# reserved, PSM, incoming MTU, outgoing MTU, peer, monotonic start,
+# wall clock start
+CAPTURE_HEADER: struct.Struct = struct.Struct("<8sHHHHBBBBHHH6sQQ")
+
+# Timestamp, packet number, size, data bytes, connection, type, flags,
+# stack time
+CAPTURE_RECORD: struct.Struct = struct.Struct("<QIHHHBBI")
+
+# Data of connect and disconnect records: peer, incoming and outgoing MTU
+CAPTURE_CONNECTION: struct.Struct = struct.Struct("<6sHH")
+
+CAPTURE_ROLE_CLIENT: int = 0
+CAPTURE_ROLE_SERVER: int = 1
+
+RECORD_RECEIVED: int = 0
+RECORD_SENT: int = 1
+RECORD_CONNECT: int = 2
+RECORD_DISCONNECT: int = 3
+RECORD_SEND_TIMESTAMP: int = 4
+
+RECORD_FLAG_TEXT: int = 0x01
+
+
+class CaptureRecord(NamedTuple):
+    timestamp: float
+    peer: Union[str, None]
+    connection: int
+    kind: int
+    seq: int
+    length: int
+    data: bytes
+    text: bool
+
+
+# ------ [ Reader ] -----------------------------------------------------------
+
+
+def read_capture(path: str) -> Iterator[CaptureRecord]:
+    """Read the records of a capture file, in the order they were written.
+    A capture that was not closed ends at its first empty record.
+
+    :param path: The path to the capture file.
+    :return: The records.
+    """
+    with open(path, "rb") as file:
+        capture_map = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+
+    with capture_map:
+        view = memoryview(capture_map)
+        try:
+            yield from _read_records(view)
+        finally:
+            view.release()
+
+
+def _read_records(view: memoryview) -> Iterator[CaptureRecord]:
+    """Read the records of a mapped capture file.
+
+    :param view: The mapped file.
+    :return: The records.
+    """
+    if len(view) < CAPTURE_HEADER.size:
+        raise ValueError("not a capture file")
+
+    magic, version, header_size, record_size, _, role, _, _, _, _, _, _, \
+        peer, start_monotonic_ns, start_realtime_ns = \
+        CAPTURE_HEADER.unpack_from(view, 0)
+    if magic != CAPTURE_MAGIC:
+        raise ValueError("not a capture file")
+    if version != CAPTURE_VERSION or record_size != CAPTURE_RECORD.size:
+        raise ValueError("unsupported capture version " + str(version))
+
+    # The client has one peer, the server learns them from connect records
+    peers = {}
+    client_peer = format_address(peer) if role == CAPTURE_ROLE_CLIENT \
+        else None
+
+    position = header_size
+    while position + CAPTURE_RECORD.size <= len(view):
+        timestamp_ns, seq, length, data_len, connection, kind, flags, _ = \
+            CAPTURE_RECORD.unpack_from(view, position)
+        if timestamp_ns == 0:
+            break
+
+        data_start = position + CAPTURE_RECORD.size
+        position += (CAPTURE_RECORD.size + data_len + 7) & ~7
+        if data_start + data_len > len(view):
+            break
+
+        data = bytes(view[data_start:data_start + data_len])
+        if kind in (RECORD_CONNECT, RECORD_DISCONNECT) and \
+                data_len >= CAPTURE_CONNECTION.size:
+            peers[connection] = \
+                format_address(CAPTURE_CONNECTION.unpack_from(data)[0])
+
+        yield CaptureRecord(
+            timestamp=(start_realtime_ns + timestamp_ns -
+                       start_monotonic_ns) / 1e9,
+            peer=client_peer or peers.get(connection),
+            connection=connection,
+            kind=kind,
+            seq=seq,
+            length=length,
+            data=data,
+            text=bool(flags & RECORD_FLAG_TEXT))
+
+
+# ------ [ Helper Methods ] ---------------------------------------------------
+
+
+def format_address(bdaddr: bytes) -> str:
+    """Format a Bluetooth address as stored by BlueZ, least significant byte
+    first.
+
+    :param bdaddr: The 6 bytes of the address.
+    :return: The address, e.g. "B8:27:EB:12:34:56".
+    """
+    return ":".join("%02X" % byte for byte in reversed(bdaddr))
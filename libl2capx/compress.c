@@ -0,0 +1,332 @@
+/**
+ * Compression of framed SDUs for libl2capx, in the LZ4 block format. SDUs
+ * are at most 64 KiB, so the compressor keeps 16-bit positions and every
+ * match is in reach of the 16-bit offsets of the format.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "l2capx.h"
+
+// Limits of the LZ4 block format: the shortest match, the literals that
+// end every block and how close to the end the last match may start
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+// Longest run of SDUs sent raw after one that did not compress well
+#define COMPRESS_BACKOFF_MAX 256
+
+/**
+ * Read 4 bytes for the match finder.
+ * @param p The bytes.
+ * @return The bytes as one value.
+ */
+static uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Get the match finder slot of 4 bytes.
+ * @param sequence The bytes.
+ * @return The slot.
+ */
+static uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/**
+ * Write the part of a length that does not fit its token nibble.
+ *
+ * @param op Where to write.
+ * @param oend The end of the output.
+ * @param length The length minus the 15 in the nibble.
+ * @return The position after the length, NULL if the output is full.
+ */
+static uint8_t *lz4_write_length(uint8_t *op, uint8_t *oend, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+
+    if (op >= oend)
+        return NULL;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/**
+ * Write literals and the match that follows them as one sequence.
+ *
+ * @param op Where to write.
+ * @param oend The end of the output.
+ * @param literals The literals.
+ * @param count The number of literals.
+ * @param offset The distance back to the match, 0 for the last sequence.
+ * @param match The length of the match.
+ * @return The position after the sequence, NULL if the output is full.
+ */
+static uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *oend,
+                                   const uint8_t *literals, size_t count,
+                                   size_t offset, size_t match) {
+    uint8_t *token = op++;
+
+    if (token >= oend)
+        return NULL;
+
+    *token = (count < 15 ? count : 15) << 4;
+    if (count >= 15 && (op = lz4_write_length(op, oend, count - 15)) == NULL)
+        return NULL;
+
+    if ((size_t)(oend - op) < count)
+        return NULL;
+    memcpy(op, literals, count);
+    op += count;
+
+    if (offset == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    match -= LZ4_MIN_MATCH;
+    *token |= match < 15 ? match : 15;
+    if (match >= 15)
+        op = lz4_write_length(op, oend, match - 15);
+
+    return op;
+}
+
+/**
+ * Compress a block in the LZ4 block format with a greedy match finder.
+ *
+ * @param table The match finder table, 1 << COMPRESS_HASH_BITS positions.
+ * @param src The block, at most 65535 bytes.
+ * @param length The size of the block.
+ * @param dst Where to write the compressed block.
+ * @param size The room at dst.
+ * @return The size of the compressed block, 0 if it does not fit.
+ */
+size_t lz4_compress(uint16_t *table, const char *src, size_t length,
+                    char *dst, size_t size) {
+    const uint8_t *base = (const uint8_t *)src, *ip = base, *anchor = base;
+    const uint8_t *iend = base + length, *ref;
+    uint8_t *op = (uint8_t *)dst, *oend = op + size;
+    uint32_t sequence, slot;
+    size_t match;
+
+    memset(table, 0, sizeof(uint16_t) << COMPRESS_HASH_BITS);
+
+    while (length > LZ4_MF_LIMIT && ip <= iend - LZ4_MF_LIMIT) {
+        sequence = lz4_read32(ip);
+        slot = lz4_hash(sequence);
+        ref = base + table[slot];
+        table[slot] = ip - base;
+
+        if (ref >= ip || lz4_read32(ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        match = LZ4_MIN_MATCH;
+        while (ip + match < iend - LZ4_LAST_LITERALS && ref[match] == ip[match])
+            match++;
+
+        op = lz4_write_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                                match);
+        if (op == NULL)
+            return 0;
+
+        ip += match;
+        anchor = ip;
+    }
+
+    op = lz4_write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op != NULL ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/**
+ * Decompress a block in the LZ4 block format. Every length and offset is
+ * checked, a corrupt block fails instead of writing outside dst.
+ *
+ * @param src The compressed block.
+ * @param length The size of the compressed block.
+ * @param dst Where to write the block.
+ * @param size The room at dst.
+ * @return The size of the block, -1 if it is corrupt or does not fit.
+ */
+long lz4_decompress(const char *src, size_t length, char *dst, size_t size) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + length, *ref;
+    uint8_t *op = (uint8_t *)dst, *oend = op + size;
+    size_t count, offset;
+    uint8_t token, extra;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        count = token >> 4;
+        if (count == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                extra = *ip++;
+                count += extra;
+            } while (extra == 255);
+        }
+
+        if ((size_t)(iend - ip) < count || (size_t)(oend - op) < count)
+            return -1;
+        memcpy(op, ip, count);
+        ip += count;
+        op += count;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return -1;
+
+        count = token & 15;
+        if (count == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                extra = *ip++;
+                count += extra;
+            } while (extra == 255);
+        }
+        count += LZ4_MIN_MATCH;
+
+        if ((size_t)(oend - op) < count)
+            return -1;
+
+        // Byte by byte, the match may overlap what it produces
+        for (ref = op - offset; count > 0; count--)
+            *op++ = *ref++;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/**
+ * Set up the compressor of a session.
+ *
+ * @param comp The compressor.
+ * @param size The largest compressed SDU, the outgoing MTU.
+ * @param min_saving The smallest saving in percent that is worth sending an
+ * SDU compressed.
+ * @return 0 on success, -1 on failure.
+ */
+int compressor_init(struct compressor *comp, size_t size, long min_saving) {
+    memset(comp, 0, sizeof(*comp));
+
+    comp->buf = pool_get(&BUFFER_POOL, size);
+    if (comp->buf == NULL)
+        return -1;
+
+    comp->size = size;
+    comp->min_saving = min_saving;
+    return 0;
+}
+
+/**
+ * Release the buffer of a compressor.
+ * @param comp The compressor.
+ */
+void compressor_free(struct compressor *comp) {
+    pool_put(&BUFFER_POOL, comp->buf);
+    comp->buf = NULL;
+}
+
+/**
+ * Compress a framed SDU into the buffer of the compressor. SDUs that do not
+ * shrink by the minimum saving go out raw, and so do the next ones for a
+ * while: the pause doubles with every SDU that fails again, so traffic that
+ * does not compress costs little CPU, and ends once one compresses well.
+ *
+ * @param comp The compressor.
+ * @param sdu The framed SDU.
+ * @param length The size of the SDU.
+ * @return The size of the compressed SDU in comp->buf, 0 to send the SDU
+ * raw.
+ */
+size_t compressor_pack(struct compressor *comp, const char *sdu,
+                       size_t length) {
+    struct frame_lz4_header header = { FRAME_LZ4_MAGIC, length };
+    size_t limit, packed = 0;
+    int tried = 0;
+
+    comp->raw_bytes += length;
+
+    // Compressed SDUs have to end below this to be worth it
+    limit = length * (100 - comp->min_saving) / 100;
+    if (limit > comp->size)
+        limit = comp->size;
+
+    if (comp->skip > 0) {
+        comp->skip--;
+    }
+    else if (limit > sizeof(header)) {
+        tried = 1;
+        packed = lz4_compress(comp->table, sdu, length,
+                              comp->buf + sizeof(header),
+                              limit - sizeof(header));
+        if (packed > 0)
+            packed += sizeof(header);
+    }
+
+    if (packed == 0) {
+        if (tried && comp->backoff < COMPRESS_BACKOFF_MAX)
+            comp->backoff = comp->backoff > 0 ? comp->backoff * 2 : 1;
+        if (tried)
+            comp->skip = comp->backoff;
+
+        comp->bypassed++;
+        comp->wire_bytes += length;
+        return 0;
+    }
+
+    comp->backoff = 0;
+    comp->compressed++;
+    comp->wire_bytes += packed;
+    memcpy(comp->buf, &header, sizeof(header));
+    return packed;
+}
+
+/**
+ * Decompress an SDU sent by compressor_pack().
+ *
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @param out Where to write the framed SDU.
+ * @param size The room at out.
+ * @return The size of the framed SDU, 0 if the SDU is not compressed or -1
+ * if it is corrupt.
+ */
+long frame_inflate(const char *sdu, size_t length, char *out, size_t size) {
+    struct frame_lz4_header header;
+    long raw;
+
+    if (length < sizeof(header))
+        return 0;
+
+    memcpy(&header, sdu, sizeof(header));
+    if (header.magic != FRAME_LZ4_MAGIC)
+        return 0;
+
+    raw = lz4_decompress(sdu + sizeof(header), length - sizeof(header), out,
+                         size);
+    return raw == header.raw_length ? raw : -1;
+}
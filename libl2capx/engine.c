@@ -0,0 +1,446 @@
+/**
+ * Receive rings, send queues and the engines of libl2capx. The rings and
+ * queues are set up once per connection, the engines move the packets
+ * between them and the socket.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "l2capx.h"
+
+// Receive buffers start on a cache line
+#define RING_ALIGN 64
+
+// Control message space per received packet, room for its timestamp
+#define RING_CONTROL_SIZE CMSG_SPACE(sizeof(struct scm_timestamping))
+
+// Settings, see l2capx.h
+long RECV_BATCH = 16;
+
+/**
+ * Free the buffers of a receive ring.
+ * @param ring The ring.
+ */
+void receive_ring_free(struct receive_ring *ring) {
+    unsigned int index;
+
+    for (index = 0; ring->slots != NULL && index < ring->count; index++)
+        pool_put(&BUFFER_POOL, ring->slots[index]);
+
+    free(ring->slots);
+    free(ring->msgs);
+    free(ring->iovs);
+    free(ring->control);
+    ring->slots = NULL;
+    ring->msgs = NULL;
+    ring->iovs = NULL;
+    ring->control = NULL;
+}
+
+/**
+ * Allocate the buffers of a receive ring and point the message headers at
+ * them. With --timestamps every slot also gets room for control messages.
+ *
+ * @param ring The ring.
+ * @param count The number of packets per batch.
+ * @param packet_size The largest packet to receive.
+ * @return 0 on success, -1 on failure.
+ */
+int receive_ring_init(struct receive_ring *ring, unsigned int count,
+                      size_t packet_size) {
+    unsigned int index;
+
+    // One extra byte so text messages can always be null terminated
+    ring->count = count;
+    ring->slot_size = (packet_size + 1 + RING_ALIGN - 1) &
+                      ~(size_t)(RING_ALIGN - 1);
+    ring->slots = calloc(count, sizeof(*ring->slots));
+    ring->msgs = calloc(count, sizeof(*ring->msgs));
+    ring->iovs = calloc(count, sizeof(*ring->iovs));
+    ring->control = TIMESTAMPS ? calloc(count, RING_CONTROL_SIZE) : NULL;
+
+    for (index = 0; ring->slots != NULL && index < count; index++) {
+        ring->slots[index] = pool_get(&BUFFER_POOL, ring->slot_size);
+        if (ring->slots[index] == NULL)
+            break;
+    }
+
+    if (ring->slots == NULL || index < count || ring->msgs == NULL ||
+        ring->iovs == NULL || (TIMESTAMPS && ring->control == NULL)) {
+        receive_ring_free(ring);
+        return -1;
+    }
+
+    for (index = 0; index < count; index++) {
+        ring->iovs[index].iov_base = ring->slots[index];
+        ring->iovs[index].iov_len = packet_size;
+        ring->msgs[index].msg_hdr.msg_iov = &ring->iovs[index];
+        ring->msgs[index].msg_hdr.msg_iovlen = 1;
+        if (ring->control != NULL)
+            ring->msgs[index].msg_hdr.msg_control =
+                ring->control + index * RING_CONTROL_SIZE;
+    }
+
+    return 0;
+}
+
+/**
+ * Give every slot of a receive ring its full control message space again,
+ * the kernel shrinks it to what it used.
+ *
+ * @param ring The ring.
+ */
+void receive_ring_reset_control(struct receive_ring *ring) {
+    unsigned int index;
+
+    if (ring->control == NULL)
+        return;
+
+    for (index = 0; index < ring->count; index++)
+        ring->msgs[index].msg_hdr.msg_controllen = RING_CONTROL_SIZE;
+}
+
+/**
+ * Get the kernel receive timestamp of a packet.
+ *
+ * @param msg The message header the packet was received with.
+ * @return The realtime timestamp in nanoseconds, 0 if there is none.
+ */
+uint64_t packet_timestamp(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    struct scm_timestamping stamps;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+
+        // The software timestamp is the first of the three
+        memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+        return (uint64_t)stamps.ts[0].tv_sec * 1000000000ULL +
+               stamps.ts[0].tv_nsec;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the time a received packet spent between its kernel timestamp and the
+ * application.
+ *
+ * @param msg The message header the packet was received with.
+ * @param realtime_now The realtime clock when the batch was received.
+ * @return The delay in nanoseconds, 0 if the packet has no timestamp.
+ */
+uint64_t packet_stack_ns(struct msghdr *msg, uint64_t realtime_now) {
+    uint64_t stamp = packet_timestamp(msg);
+
+    return stamp > 0 && stamp < realtime_now ? realtime_now - stamp : 0;
+}
+
+/**
+ * Free the message headers of a send queue.
+ * @param queue The queue.
+ */
+void send_queue_free(struct send_queue *queue) {
+    free(queue->msgs);
+    free(queue->iovs);
+    queue->msgs = NULL;
+    queue->iovs = NULL;
+    queue->count = 0;
+}
+
+/**
+ * Allocate the message headers of a send queue.
+ *
+ * @param queue The queue.
+ * @param capacity The number of packets the queue holds.
+ * @return 0 on success, -1 on failure.
+ */
+int send_queue_init(struct send_queue *queue, unsigned int capacity) {
+    unsigned int index;
+
+    queue->capacity = capacity;
+    queue->count = 0;
+    queue->msgs = calloc(capacity, sizeof(*queue->msgs));
+    queue->iovs = calloc(capacity * SEND_IOV_MAX, sizeof(*queue->iovs));
+
+    if (queue->msgs == NULL || queue->iovs == NULL) {
+        send_queue_free(queue);
+        return -1;
+    }
+
+    for (index = 0; index < capacity; index++)
+        queue->msgs[index].msg_hdr.msg_iov =
+            &queue->iovs[index * SEND_IOV_MAX];
+
+    return 0;
+}
+
+/**
+ * Add a packet to the end of a send queue.
+ *
+ * @param queue The queue.
+ * @param iov The parts of the packet.
+ * @param iovcnt The number of parts, at most SEND_IOV_MAX.
+ * @return 0 on success, -1 if the queue is full.
+ */
+int send_queue_push(struct send_queue *queue, const struct iovec *iov,
+                    int iovcnt) {
+    struct msghdr *hdr;
+
+    if (queue->count == queue->capacity || iovcnt > SEND_IOV_MAX)
+        return -1;
+
+    hdr = &queue->msgs[queue->count++].msg_hdr;
+    memcpy(hdr->msg_iov, iov, iovcnt * sizeof(*iov));
+    hdr->msg_iovlen = iovcnt;
+
+    return 0;
+}
+
+/**
+ * Remove the packets the socket took from the front of a send queue and
+ * move the rest to the front, every header keeps its own iovecs.
+ *
+ * @param queue The queue.
+ * @param sent The number of packets sent.
+ */
+void send_queue_shift(struct send_queue *queue, unsigned int sent) {
+    struct msghdr *dst, *src;
+    unsigned int index;
+
+    for (index = sent; index < queue->count; index++) {
+        dst = &queue->msgs[index - sent].msg_hdr;
+        src = &queue->msgs[index].msg_hdr;
+        memcpy(dst->msg_iov, src->msg_iov,
+               src->msg_iovlen * sizeof(*src->msg_iov));
+        dst->msg_iovlen = src->msg_iovlen;
+    }
+    queue->count -= sent;
+}
+
+/**
+ * Submit the queued packets with a single sendmmsg() call without blocking
+ * and remove the packets the socket took from the queue. Whatever is left
+ * goes out with the next call, once the socket is writable again.
+ *
+ * @param s The socket.
+ * @param queue The queue.
+ * @param bytes Set to the number of bytes sent.
+ * @return The number of packets sent, 0 if the socket is full or -1 on
+ * failure. Until the next call queue->msgs[n].msg_len holds the size of
+ * sent packet n.
+ */
+long send_queue_submit(int s, struct send_queue *queue,
+                       unsigned long long *bytes) {
+    unsigned int index;
+    int sent;
+
+    *bytes = 0;
+    if (queue->count == 0)
+        return 0;
+
+    sent = sendmmsg(s, queue->msgs, queue->count, MSG_DONTWAIT);
+
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+               0 : -1;
+
+    for (index = 0; index < (unsigned int)sent; index++)
+        *bytes += queue->msgs[index].msg_len;
+
+    send_queue_shift(queue, sent);
+
+    return sent;
+}
+
+/**
+ * Pass the received packets of a ring to a consumer. A zero-length packet
+ * marks the end of the connection, the packets before it are still
+ * delivered.
+ *
+ * @param ring The ring.
+ * @param received The number of packets in the ring.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets delivered, 0 if the connection was closed.
+ */
+long receive_deliver(struct receive_ring *ring, int received,
+                     receive_callback callback, void *ctx) {
+    int count;
+
+    for (count = 0; count < received; count++)
+        if (ring->msgs[count].msg_len == 0)
+            break;
+
+    if (count > 0)
+        callback(ctx, ring->msgs, count);
+
+    return count < received ? 0 : count;
+}
+
+/**
+ * Receive the packets already queued on a non-blocking socket, up to the
+ * size of the ring, and pass them to a consumer.
+ *
+ * @param s The socket.
+ * @param ring The ring to receive into.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure, errno is EAGAIN when nothing was queued.
+ */
+long receive_batch(int s, struct receive_ring *ring,
+                   receive_callback callback, void *ctx) {
+    int received;
+
+    receive_ring_reset_control(ring);
+    received = recvmmsg(s, ring->msgs, ring->count, MSG_DONTWAIT, NULL);
+
+    if (received <= 0)
+        return -1;
+
+    return receive_deliver(ring, received, callback, ctx);
+}
+
+/**
+ * Receive the packets already queued on a non-blocking socket with one
+ * recvmsg() call per packet, up to the size of the ring, and pass them to a
+ * consumer.
+ *
+ * @param s The socket.
+ * @param ring The ring to receive into.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure, errno is EAGAIN when nothing was queued.
+ */
+long receive_single(int s, struct receive_ring *ring,
+                    receive_callback callback, void *ctx) {
+    unsigned int received = 0;
+    ssize_t length;
+
+    receive_ring_reset_control(ring);
+
+    while (received < ring->count) {
+        length = recvmsg(s, &ring->msgs[received].msg_hdr, MSG_DONTWAIT);
+        if (length < 0)
+            break;
+
+        ring->msgs[received++].msg_len = length;
+
+        // The end of the connection
+        if (length == 0)
+            break;
+    }
+
+    if (received == 0)
+        return -1;
+
+    return receive_deliver(ring, received, callback, ctx);
+}
+
+/**
+ * Submit the queued packets with one sendmsg() call per packet without
+ * blocking, until the socket is full, and remove the packets the socket
+ * took from the queue.
+ *
+ * @param s The socket.
+ * @param queue The queue.
+ * @param bytes Set to the number of bytes sent.
+ * @return The number of packets sent, 0 if the socket is full or -1 on
+ * failure. Until the next call queue->msgs[n].msg_len holds the size of
+ * sent packet n.
+ */
+long send_queue_submit_single(int s, struct send_queue *queue,
+                              unsigned long long *bytes) {
+    unsigned int sent = 0;
+    ssize_t length;
+
+    *bytes = 0;
+
+    while (sent < queue->count) {
+        length = sendmsg(s, &queue->msgs[sent].msg_hdr, MSG_DONTWAIT);
+        if (length < 0)
+            break;
+
+        queue->msgs[sent++].msg_len = length;
+        *bytes += length;
+    }
+
+    if (sent == 0 && queue->count > 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+               0 : -1;
+
+    send_queue_shift(queue, sent);
+
+    return sent;
+}
+
+// Entry points of the engines, they hand the socket and the ring of the
+// connection to the functions above
+
+static long batch_receive(struct connection *conn, receive_callback callback,
+                          void *ctx) {
+    return receive_batch(conn->socket, &conn->ring, callback, ctx);
+}
+
+static long batch_submit(struct connection *conn, struct send_queue *queue,
+                         unsigned long long *bytes) {
+    return send_queue_submit(conn->socket, queue, bytes);
+}
+
+static long single_receive(struct connection *conn, receive_callback callback,
+                           void *ctx) {
+    return receive_single(conn->socket, &conn->ring, callback, ctx);
+}
+
+static long single_submit(struct connection *conn, struct send_queue *queue,
+                          unsigned long long *bytes) {
+    return send_queue_submit_single(conn->socket, queue, bytes);
+}
+
+const struct engine ENGINE_BATCH = { "batch", batch_receive, batch_submit,
+                                     NULL, NULL };
+const struct engine ENGINE_SINGLE = { "single", single_receive,
+                                      single_submit, NULL, NULL };
+
+// Engines that can be selected, in the order they are listed
+const struct engine *const ENGINES[] = { &ENGINE_BATCH, &ENGINE_SINGLE,
+                                         &ENGINE_URING, NULL };
+
+const struct engine *ENGINE = &ENGINE_BATCH;
+
+/**
+ * Receive the packets already queued on a connection with its engine.
+ *
+ * @param conn The connection.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure, errno is EAGAIN when nothing was queued.
+ */
+long connection_receive(struct connection *conn, receive_callback callback,
+                        void *ctx) {
+    return conn->engine->receive(conn, callback, ctx);
+}
+
+/**
+ * Submit the queued packets of a connection with its engine.
+ *
+ * @param conn The connection.
+ * @param queue The queue.
+ * @param bytes Set to the number of bytes sent.
+ * @return The number of packets sent, 0 if the socket is full or -1 on
+ * failure.
+ */
+long connection_submit(struct connection *conn, struct send_queue *queue,
+                       unsigned long long *bytes) {
+    return conn->engine->submit(conn, queue, bytes);
+}
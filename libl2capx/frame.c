@@ -0,0 +1,143 @@
+/**
+ * Framing of small text messages for libl2capx: the sender coalesces them
+ * into one SDU of up to the outgoing MTU, the receiver walks the messages
+ * where they are in the receive buffer.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "l2capx.h"
+
+/**
+ * Allocate the SDU of a frame writer.
+ *
+ * @param writer The writer.
+ * @param size The size of the SDU, the outgoing MTU.
+ * @return 0 on success, -1 on failure.
+ */
+int frame_writer_init(struct frame_writer *writer, size_t size) {
+    writer->buf = pool_get(&BUFFER_POOL, size);
+    if (writer->buf == NULL)
+        return -1;
+
+    writer->size = size;
+    frame_writer_reset(writer);
+    return 0;
+}
+
+/**
+ * Release the SDU of a frame writer.
+ * @param writer The writer.
+ */
+void frame_writer_free(struct frame_writer *writer) {
+    pool_put(&BUFFER_POOL, writer->buf);
+    writer->buf = NULL;
+}
+
+/**
+ * Empty the SDU of a frame writer, once it was sent.
+ * @param writer The writer.
+ */
+void frame_writer_reset(struct frame_writer *writer) {
+    struct frame_header header = { .magic = FRAME_MAGIC };
+
+    memcpy(writer->buf, &header, sizeof(header));
+    writer->length = sizeof(header);
+    writer->count = 0;
+    writer->deadline_ns = 0;
+}
+
+/**
+ * Get the longest message that fits an SDU on its own.
+ *
+ * @param size The size of the SDU.
+ * @return The size of the message.
+ */
+size_t frame_message_max(size_t size) {
+    return size - sizeof(struct frame_header) - sizeof(struct frame_record);
+}
+
+/**
+ * Get the longest message that still fits behind the messages in an SDU.
+ *
+ * @param writer The writer.
+ * @return The size of the message, 0 when the SDU is full.
+ */
+size_t frame_room(const struct frame_writer *writer) {
+    if (writer->length + sizeof(struct frame_record) >= writer->size)
+        return 0;
+
+    return writer->size - writer->length - sizeof(struct frame_record);
+}
+
+/**
+ * Add a message to an SDU.
+ *
+ * @param writer The writer.
+ * @param message The message.
+ * @param length The size of the message.
+ * @param deadline_ns When the SDU has to be sent, kept from the first
+ * message.
+ * @return 0 on success, -1 if the message does not fit.
+ */
+int frame_append(struct frame_writer *writer, const char *message,
+                 size_t length, uint64_t deadline_ns) {
+    struct frame_record record = { .length = length };
+
+    if (writer->length + sizeof(record) + length > writer->size)
+        return -1;
+
+    if (writer->count == 0)
+        writer->deadline_ns = deadline_ns;
+
+    memcpy(writer->buf + writer->length, &record, sizeof(record));
+    memcpy(writer->buf + writer->length + sizeof(record), message, length);
+    writer->length += sizeof(record) + length;
+    writer->count++;
+    return 0;
+}
+
+/**
+ * Check whether an SDU carries framed messages.
+ *
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @return The offset of the first message for frame_next(), 0 if the SDU
+ * is not framed.
+ */
+size_t frame_start(const char *sdu, size_t length) {
+    struct frame_header header;
+
+    if (length < sizeof(header))
+        return 0;
+
+    memcpy(&header, sdu, sizeof(header));
+    return header.magic == FRAME_MAGIC ? sizeof(header) : 0;
+}
+
+/**
+ * Get the next message of a framed SDU, it is not copied.
+ *
+ * @param sdu The SDU.
+ * @param length The size of the SDU.
+ * @param offset The offset of the message, moved to the one after it.
+ * @param message Set to the start of the message inside the SDU.
+ * @return The size of the message, -1 after the last message or when the
+ * rest of the SDU is truncated.
+ */
+long frame_next(const char *sdu, size_t length, size_t *offset,
+                const char **message) {
+    struct frame_record record;
+
+    if (*offset + sizeof(record) > length)
+        return -1;
+
+    memcpy(&record, sdu + *offset, sizeof(record));
+    if (*offset + sizeof(record) + record.length > length)
+        return -1;
+
+    *message = sdu + *offset + sizeof(record);
+    *offset += sizeof(record) + record.length;
+    return record.length;
+}
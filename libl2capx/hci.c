@@ -0,0 +1,516 @@
+/**
+ * Adapter counters, LE connection parameters, PHY and data length of
+ * libl2capx, set through the HCI socket of the adapter that carries a link.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "l2capx.h"
+
+// Controller units and limits of the LE connection parameters
+#define CONN_INTERVAL_UNIT_MS 1.25
+#define CONN_INTERVAL_MIN 0x0006
+#define CONN_INTERVAL_MAX 0x0c80
+#define CONN_LATENCY_MAX 499
+#define CONN_TIMEOUT_UNIT_MS 10.0
+#define CONN_TIMEOUT_MIN 0x000a
+#define CONN_TIMEOUT_MAX 0x0c80
+#define CONN_TIMEOUT_DEFAULT 0x002a
+
+// Time to wait for the update to take effect in milliseconds, it waits for
+// an instant several connection events ahead
+#define CONN_UPDATE_TIMEOUT 5000
+
+// HCI commands and events for the LE PHY and data length, BlueZ headers do
+// not define them
+#define LE_OCF_SET_DATA_LENGTH 0x0022
+#define LE_OCF_READ_PHY 0x0030
+#define LE_OCF_SET_PHY 0x0032
+#define LE_EVT_DATA_LENGTH_CHANGE 0x07
+#define LE_EVT_PHY_UPDATE_COMPLETE 0x0c
+
+// Time to wait for HCI commands that complete right away in milliseconds
+#define HCI_COMMAND_TIMEOUT 1000
+
+typedef struct {
+    uint16_t handle;
+    uint8_t all_phys;
+    uint8_t tx_phys;
+    uint8_t rx_phys;
+    uint16_t phy_options;
+} __attribute__ ((packed)) le_set_phy_cmd;
+
+// Return parameters of LE Read PHY and LE PHY Update Complete event
+typedef struct {
+    uint8_t status;
+    uint16_t handle;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+} __attribute__ ((packed)) le_phy_reply;
+
+typedef struct {
+    uint16_t handle;
+    uint16_t tx_octets;
+    uint16_t tx_time;
+} __attribute__ ((packed)) le_set_data_length_cmd;
+
+typedef struct {
+    uint8_t status;
+    uint16_t handle;
+} __attribute__ ((packed)) le_set_data_length_reply;
+
+typedef struct {
+    uint16_t handle;
+    uint16_t max_tx_octets;
+    uint16_t max_tx_time;
+    uint16_t max_rx_octets;
+    uint16_t max_rx_time;
+} __attribute__ ((packed)) le_data_length_event;
+
+// Settings, see l2capx.h
+double CONN_INTERVAL_MS = 0;
+long CONN_LATENCY = 0;
+double CONN_TIMEOUT_MS = 0;
+int LINK_PHY = 0;
+long LINK_DATA_LENGTH = 0;
+struct conn_params CONN_REQUEST = { 0 };
+
+/**
+ * Find the adapter that carries the link of a connected socket.
+ *
+ * @param s The connected socket.
+ * @param handle Set to the connection handle of the link.
+ * @return The adapter's device id, -1 on failure.
+ */
+int link_dev_id(int s, uint16_t *handle) {
+    struct l2cap_conninfo info;
+    struct sockaddr_l2 local = { 0 };
+    socklen_t len = sizeof(info);
+    char addr[18];
+    int dev_id;
+
+    if (getsockopt(s, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0)
+        return -1;
+
+    // The link belongs to the adapter with the socket's local address
+    len = sizeof(local);
+    if (getsockname(s, (struct sockaddr *)&local, &len) < 0)
+        return -1;
+
+    ba2str(&local.l2_bdaddr, addr);
+    dev_id = hci_devid(addr);
+    if (dev_id < 0)
+        return -1;
+
+    *handle = info.hci_handle;
+    return dev_id;
+}
+
+/**
+ * Open the adapter that carries the link of a connected socket.
+ *
+ * @param s The connected socket.
+ * @param handle Set to the connection handle of the link.
+ * @return The HCI device descriptor, -1 on failure.
+ */
+static int open_link_hci(int s, uint16_t *handle) {
+    int dev_id = link_dev_id(s, handle);
+
+    if (dev_id < 0)
+        return -1;
+
+    return hci_open_dev(dev_id);
+}
+
+/**
+ * Read the traffic counters of an adapter.
+ *
+ * @param dev_id The adapter's device id.
+ * @param stats Set to the counters.
+ * @return 0 on success, -1 on failure.
+ */
+int read_hci_stats(int dev_id, struct hci_dev_stats *stats) {
+    struct hci_dev_info di;
+
+    if (dev_id < 0 || hci_devinfo(dev_id, &di) < 0)
+        return -1;
+
+    *stats = di.stat;
+    return 0;
+}
+
+/**
+ * Print how much the traffic counters of an adapter went up. They count
+ * every link of the adapter, not only this channel. ACL packets are the
+ * fragments of L2CAP frames, including retransmitted ones.
+ *
+ * @param prefix Printed before the counters.
+ * @param before The counters at the start.
+ * @param after The counters at the end.
+ */
+void print_hci_stats(const char *prefix, const struct hci_dev_stats *before,
+                     const struct hci_dev_stats *after) {
+    printf("%sHCI: sent %u ACL packets (%u bytes), received %u ACL packets "
+           "(%u bytes), %u tx errors, %u rx errors\n", prefix,
+           after->acl_tx - before->acl_tx, after->byte_tx - before->byte_tx,
+           after->acl_rx - before->acl_rx, after->byte_rx - before->byte_rx,
+           after->err_tx - before->err_tx, after->err_rx - before->err_rx);
+}
+
+/**
+ * Convert connection parameters from the command line to controller units
+ * and fill in a supervision timeout that fits them if none was given.
+ *
+ * @param params Set to the parameters in controller units.
+ * @return 0 on success, -1 if the parameters are out of range.
+ */
+int make_conn_params(struct conn_params *params) {
+    long interval = (long)(CONN_INTERVAL_MS / CONN_INTERVAL_UNIT_MS + 0.5);
+    long timeout = (long)(CONN_TIMEOUT_MS / CONN_TIMEOUT_UNIT_MS + 0.5);
+    long needed;
+
+    if (interval < CONN_INTERVAL_MIN || interval > CONN_INTERVAL_MAX) {
+        fprintf(stderr, "connection interval must be between 7.5 and "
+                        "4000 ms\n");
+        return -1;
+    }
+
+    if (CONN_LATENCY > CONN_LATENCY_MAX) {
+        fprintf(stderr, "connection latency must be at most %d\n",
+                CONN_LATENCY_MAX);
+        return -1;
+    }
+
+    // The timeout has to be longer than twice the time the peripheral may
+    // stay silent, (1 + latency) * interval
+    needed = (1 + CONN_LATENCY) * interval / 4 + 1;
+    if (timeout == 0)
+        timeout = needed > CONN_TIMEOUT_DEFAULT ? needed
+                                                : CONN_TIMEOUT_DEFAULT;
+
+    if (timeout < CONN_TIMEOUT_MIN || timeout > CONN_TIMEOUT_MAX) {
+        fprintf(stderr, "supervision timeout must be between 100 and "
+                        "32000 ms\n");
+        return -1;
+    }
+
+    if (timeout < needed) {
+        fprintf(stderr, "supervision timeout must be more than %.0f ms for "
+                        "this interval and latency\n",
+                (1 + CONN_LATENCY) * interval * CONN_INTERVAL_UNIT_MS * 2);
+        return -1;
+    }
+
+    params->interval = interval;
+    params->latency = CONN_LATENCY;
+    params->timeout = timeout;
+    return 0;
+}
+
+/**
+ * Ask the controller to apply LE connection parameters to the link of a
+ * connected socket. It waits for the LE Connection Update Complete event,
+ * which carries the parameters actually in effect.
+ *
+ * @param s The connected socket.
+ * @param params The parameters to request, set to the ones in effect.
+ * @return 0 on success, -1 on failure.
+ */
+int update_conn_params(int s, struct conn_params *params) {
+    le_connection_update_cp cp = { 0 };
+    evt_le_connection_update_complete rp = { 0 };
+    struct hci_request rq = { 0 };
+    uint16_t handle;
+    int dd, result;
+
+    dd = open_link_hci(s, &handle);
+    if (dd < 0)
+        return -1;
+
+    cp.handle = htobs(handle);
+    cp.min_interval = htobs(params->interval);
+    cp.max_interval = htobs(params->interval);
+    cp.latency = htobs(params->latency);
+    cp.supervision_timeout = htobs(params->timeout);
+    cp.min_ce_length = htobs(0x0001);
+    cp.max_ce_length = htobs(0x0001);
+
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = OCF_LE_CONN_UPDATE;
+    rq.event = EVT_LE_CONN_UPDATE_COMPLETE;
+    rq.cparam = &cp;
+    rq.clen = LE_CONN_UPDATE_CP_SIZE;
+    rq.rparam = &rp;
+    rq.rlen = EVT_LE_CONN_UPDATE_COMPLETE_SIZE;
+
+    result = hci_send_req(dd, &rq, CONN_UPDATE_TIMEOUT);
+    hci_close_dev(dd);
+
+    if (result < 0)
+        return -1;
+
+    if (rp.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    params->interval = btohs(rp.interval);
+    params->latency = btohs(rp.latency);
+    params->timeout = btohs(rp.supervision_timeout);
+    return 0;
+}
+
+/**
+ * Print LE connection parameters.
+ *
+ * @param prefix Printed before the parameters.
+ * @param params The parameters in controller units.
+ */
+void print_conn_params(const char *prefix, const struct conn_params *params) {
+    printf("%sLE connection parameters: interval %.2f ms, latency %u, "
+           "supervision timeout %.0f ms\n", prefix,
+           params->interval * CONN_INTERVAL_UNIT_MS, params->latency,
+           params->timeout * CONN_TIMEOUT_UNIT_MS);
+}
+
+/**
+ * Get the name of an LE PHY.
+ *
+ * @param phy The PHY as reported by the controller.
+ * @return The name.
+ */
+static const char *phy_name(uint8_t phy) {
+    switch (phy) {
+        case LE_PHY_1M:
+            return "1M";
+        case LE_PHY_2M:
+            return "2M";
+        case LE_PHY_CODED:
+            return "Coded";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Ask the controller to use a PHY in both directions of a link. It waits for
+ * the LE PHY Update Complete event, which carries the PHYs in effect.
+ *
+ * @param dd The HCI device descriptor.
+ * @param handle The connection handle.
+ * @param phy The PHY to use.
+ * @param link Set to the PHYs in effect.
+ * @return 0 on success, -1 on failure.
+ */
+static int set_link_phy(int dd, uint16_t handle, uint8_t phy,
+                        struct link_settings *link) {
+    le_set_phy_cmd cp = { 0 };
+    le_phy_reply rp = { 0 };
+    struct hci_request rq = { 0 };
+
+    cp.handle = htobs(handle);
+    cp.tx_phys = 1 << (phy - 1);
+    cp.rx_phys = 1 << (phy - 1);
+
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = LE_OCF_SET_PHY;
+    rq.event = LE_EVT_PHY_UPDATE_COMPLETE;
+    rq.cparam = &cp;
+    rq.clen = sizeof(cp);
+    rq.rparam = &rp;
+    rq.rlen = sizeof(rp);
+
+    if (hci_send_req(dd, &rq, CONN_UPDATE_TIMEOUT) < 0)
+        return -1;
+
+    if (rp.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    link->tx_phy = rp.tx_phy;
+    link->rx_phy = rp.rx_phy;
+    return 0;
+}
+
+/**
+ * Read the PHYs a link uses.
+ *
+ * @param dd The HCI device descriptor.
+ * @param handle The connection handle.
+ * @param link Set to the PHYs in effect.
+ * @return 0 on success, -1 on failure.
+ */
+static int read_link_phy(int dd, uint16_t handle, struct link_settings *link) {
+    uint16_t cp = htobs(handle);
+    le_phy_reply rp = { 0 };
+    struct hci_request rq = { 0 };
+
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = LE_OCF_READ_PHY;
+    rq.cparam = &cp;
+    rq.clen = sizeof(cp);
+    rq.rparam = &rp;
+    rq.rlen = sizeof(rp);
+
+    if (hci_send_req(dd, &rq, HCI_COMMAND_TIMEOUT) < 0)
+        return -1;
+
+    if (rp.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    link->tx_phy = rp.tx_phy;
+    link->rx_phy = rp.rx_phy;
+    return 0;
+}
+
+/**
+ * Ask the controller to send link-layer payloads of up to a number of bytes
+ * on a link. The peer's answer arrives in an LE Data Length Change event,
+ * which only comes when the data length of the link changes.
+ *
+ * @param dd The HCI device descriptor.
+ * @param handle The connection handle.
+ * @param octets The payload size.
+ * @param link Set to the data length in effect, unless it did not change.
+ * @return 0 on success, -1 on failure.
+ */
+static int set_link_data_length(int dd, uint16_t handle, uint16_t octets,
+                                struct link_settings *link) {
+    le_set_data_length_cmd cp = { 0 };
+    le_set_data_length_reply rp = { 0 };
+    const le_data_length_event *event;
+    const evt_le_meta_event *meta;
+    struct hci_request rq = { 0 };
+    struct hci_filter filter;
+    struct pollfd pfd = { .fd = dd, .events = POLLIN };
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    uint64_t deadline;
+    int64_t remaining;
+    ssize_t length;
+
+    // Set before the command so the event cannot slip past, the request
+    // restores this filter when it is done
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+    if (setsockopt(dd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0)
+        return -1;
+
+    // Air time of the largest packet on the 1M PHY, which also covers 2M
+    cp.handle = htobs(handle);
+    cp.tx_octets = htobs(octets);
+    cp.tx_time = htobs((octets + 14) * 8);
+
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = LE_OCF_SET_DATA_LENGTH;
+    rq.cparam = &cp;
+    rq.clen = sizeof(cp);
+    rq.rparam = &rp;
+    rq.rlen = sizeof(rp);
+
+    if (hci_send_req(dd, &rq, HCI_COMMAND_TIMEOUT) < 0)
+        return -1;
+
+    if (rp.status) {
+        errno = EIO;
+        return -1;
+    }
+
+    deadline = now_ns() + DATA_LENGTH_TIMEOUT * 1000000ULL;
+    while ((remaining = (int64_t)(deadline - now_ns())) > 0) {
+        if (poll(&pfd, 1, remaining / 1000000 + 1) <= 0)
+            break;
+
+        length = read(dd, buf, sizeof(buf));
+        if (length < 0)
+            return -1;
+
+        // Packet type, event header, subevent code, then the event
+        if (length < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE +
+                     (ssize_t)sizeof(*event))
+            continue;
+
+        meta = (const evt_le_meta_event *)(buf + 1 + HCI_EVENT_HDR_SIZE);
+        event = (const le_data_length_event *)meta->data;
+        if (meta->subevent != LE_EVT_DATA_LENGTH_CHANGE ||
+            btohs(event->handle) != handle)
+            continue;
+
+        link->tx_octets = btohs(event->max_tx_octets);
+        link->tx_time = btohs(event->max_tx_time);
+        link->rx_octets = btohs(event->max_rx_octets);
+        link->rx_time = btohs(event->max_rx_time);
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Apply the PHY and data length from the command line to the link of a
+ * connected socket and find out what is in effect.
+ *
+ * @param s The connected socket.
+ * @param link Set to the settings in effect.
+ * @return 0 on success, -1 on failure.
+ */
+int update_link_settings(int s, struct link_settings *link) {
+    uint16_t handle;
+    int dd = open_link_hci(s, &handle);
+
+    if (dd < 0) {
+        perror("Error opening the adapter of the link");
+        return -1;
+    }
+
+    memset(link, 0, sizeof(*link));
+
+    if (LINK_PHY && set_link_phy(dd, handle, LINK_PHY, link) < 0) {
+        perror("Error setting LE PHY");
+        hci_close_dev(dd);
+        return -1;
+    }
+
+    if (LINK_DATA_LENGTH &&
+        set_link_data_length(dd, handle, LINK_DATA_LENGTH, link) < 0) {
+        perror("Error setting LE data length");
+        hci_close_dev(dd);
+        return -1;
+    }
+
+    // The PHY is reported with the data length even if it was not set
+    if (!LINK_PHY && read_link_phy(dd, handle, link) < 0)
+        perror("Error reading LE PHY");
+
+    hci_close_dev(dd);
+    return 0;
+}
+
+/**
+ * Print the PHY and data length of an LE link.
+ *
+ * @param prefix Printed before every line.
+ * @param link The settings in effect.
+ */
+void print_link_settings(const char *prefix,
+                         const struct link_settings *link) {
+    if (link->tx_phy)
+        printf("%sLE PHY: tx %s, rx %s\n", prefix, phy_name(link->tx_phy),
+               phy_name(link->rx_phy));
+
+    if (link->tx_octets)
+        printf("%sLE data length: tx %u bytes (%u us), rx %u bytes (%u us)\n",
+               prefix, link->tx_octets, link->tx_time, link->rx_octets,
+               link->rx_time);
+    else if (LINK_DATA_LENGTH)
+        printf("%sLE data length: unchanged, the link already used it or "
+               "the peer kept its own\n", prefix);
+}
@@ -0,0 +1,103 @@
+/**
+ * Log-linear latency histograms of libl2capx.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "l2capx.h"
+
+/**
+ * Get the histogram bucket for a value.
+ * @param value The value to find the bucket for.
+ * @return The bucket index.
+ */
+static int histogram_index(uint64_t value) {
+    int shift;
+
+    if (value < HIST_SUB_COUNT)
+        return (int)value;
+
+    shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT +
+           (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+/**
+ * Get the highest value that is counted in a histogram bucket.
+ * @param index The bucket index.
+ * @return The highest value of the bucket.
+ */
+static uint64_t histogram_bucket_max(int index) {
+    int shift;
+    uint64_t sub;
+
+    if (index < HIST_SUB_COUNT)
+        return (uint64_t)index;
+
+    shift = index / HIST_SUB_COUNT - 1;
+    sub = (uint64_t)(index % HIST_SUB_COUNT + HIST_SUB_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Record a value in a histogram.
+ * @param hist The histogram.
+ * @param value The value to record.
+ */
+void histogram_record(struct latency_histogram *hist, uint64_t value) {
+    hist->buckets[histogram_index(value)]++;
+    if (hist->count == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->sum += value;
+    hist->count++;
+}
+
+/**
+ * Get a percentile from a histogram.
+ * @param hist The histogram.
+ * @param percentile The percentile, 0-100.
+ * @return The upper bound of the bucket containing the percentile, never
+ * more than the highest recorded value.
+ */
+uint64_t histogram_percentile(const struct latency_histogram *hist,
+                              double percentile) {
+    uint64_t rank, seen = 0;
+    int index;
+
+    if (hist->count == 0)
+        return 0;
+
+    rank = (uint64_t)(percentile / 100.0 * (double)hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (index = 0; index < HIST_BUCKETS; index++) {
+        seen += hist->buckets[index];
+        if (seen >= rank)
+            break;
+    }
+
+    if (index >= HIST_BUCKETS || histogram_bucket_max(index) > hist->max)
+        return hist->max;
+
+    return histogram_bucket_max(index);
+}
+
+/**
+ * Print the percentiles of a histogram of nanoseconds in microseconds.
+ *
+ * @param label The start of the line.
+ * @param hist The histogram, not empty.
+ */
+void print_histogram(const char *label, const struct latency_histogram *hist) {
+    printf("%s (us): min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+           "p99.9 %.1f, max %.1f\n", label, hist->min / 1e3,
+           (double)hist->sum / hist->count / 1e3,
+           histogram_percentile(hist, 50) / 1e3,
+           histogram_percentile(hist, 90) / 1e3,
+           histogram_percentile(hist, 99) / 1e3,
+           histogram_percentile(hist, 99.9) / 1e3,
+           hist->max / 1e3);
+}
@@ -0,0 +1,741 @@
+/**
+ * libl2capx, the L2CAP transport shared by l2cap-client and l2cap-server.
+ *
+ * A connection is a connected L2CAP socket with the MTUs negotiated for it,
+ * a receive ring sized from them and the engine that moves its packets.
+ * ENGINE_BATCH takes a batch per recvmmsg() and sendmmsg() call,
+ * ENGINE_SINGLE one packet per call as the baseline, ENGINE_URING keeps a
+ * multishot receive queued in an io_uring. Waiting is left to the program,
+ * the client polls and the server runs an epoll event loop. The library
+ * also has the socket and HCI settings, the latency histograms, the log
+ * queues with the log writer and capture files, the framing and
+ * compression of small text messages, the traffic generator profiles of
+ * the benchmark, the buffers of resumable sessions, the pool the packet
+ * buffers come from and the scheduling of the data threads. rssi-sampler
+ * links it for the clocks, the quit flag and the argument helpers.
+ *
+ * The settings are globals the programs set from their options. Programs
+ * define print_usage(), the parse_*() helpers print it on invalid input.
+ */
+#ifndef L2CAPX_H
+#define L2CAPX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+// Fallbacks for BlueZ headers that predate the BT_MODE socket option
+#ifndef BT_MODE
+#define BT_MODE 15
+#endif
+#ifndef BT_MODE_LE_FLOWCTL
+#define BT_MODE_LE_FLOWCTL 0x03
+#endif
+
+// Default PSMs, LE uses the dynamic range 0x0080-0x00ff
+#define PSM_BREDR_DEFAULT 0x1001
+#define PSM_LE_DEFAULT 0x0080
+
+// Quit flag, setting it also signals QUIT_EVENT_FD to wake waiting threads
+// and event loops
+extern atomic_int FLAG_QUIT;
+extern int QUIT_EVENT_FD;
+
+// Longest line read from stdin
+#define STDIN_LINE_MAX 65536
+
+// Transport settings (see --le)
+extern int LE_MODE;
+extern long PSM;
+extern long LE_CREDITS;
+extern long LE_MPS;
+
+// BR/EDR channel mode and its ERTM settings, 0 keeps the kernel default
+// (see --mode)
+extern int CHANNEL_MODE;
+extern int CHANNEL_MODE_SET;
+extern long TX_WINDOW;
+extern long MAX_TRANSMIT;
+
+// Limits of the ERTM settings, windows above 63 need extended window
+// support on both sides
+#define TX_WINDOW_MAX 0x3fff
+#define MAX_TRANSMIT_MAX 0xff
+
+// LE connection parameters applied after connecting, an interval of 0 keeps
+// the controller's choice (see --conn-interval)
+extern double CONN_INTERVAL_MS;
+extern long CONN_LATENCY;
+extern double CONN_TIMEOUT_MS;
+
+// LE PHY and link-layer data length applied after connecting, 0 keeps the
+// controller's choice (see --phy and --data-length)
+extern int LINK_PHY;
+extern long LINK_DATA_LENGTH;
+
+// PHYs as reported by the controller, Set PHY takes them as bit 1 << (n - 1)
+#define LE_PHY_1M 0x01
+#define LE_PHY_2M 0x02
+#define LE_PHY_CODED 0x03
+
+// Link-layer payload limits, and the time to wait for the peer to accept a
+// new data length in milliseconds
+#define DATA_LENGTH_MIN 27
+#define DATA_LENGTH_MAX 251
+#define DATA_LENGTH_TIMEOUT 1000
+
+/**
+ * PHY and link-layer data length of an LE link, fields stay 0 while they
+ * are not known.
+ */
+struct link_settings {
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    uint16_t tx_octets;
+    uint16_t tx_time;
+    uint16_t rx_octets;
+    uint16_t rx_time;
+};
+
+/**
+ * LE connection parameters in controller units: the interval in 1.25 ms,
+ * the latency in connection events and the timeout in 10 ms.
+ */
+struct conn_params {
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+// LE connection parameters requested for every connection
+extern struct conn_params CONN_REQUEST;
+
+// Packets taken from a socket per system call (see --batch)
+extern long RECV_BATCH;
+
+// Kernel timestamps on the packets (see --timestamps)
+extern int TIMESTAMPS;
+
+// Requested MTUs, 0 keeps the kernel default (see --mtu)
+extern long REQUEST_IMTU;
+extern long REQUEST_OMTU;
+
+// Header stamped on every ping packet, echoed back unchanged by the server.
+// The previous round-trip time lets the server keep latency statistics.
+#define PING_MAGIC 0x474e4950
+struct ping_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t timestamp_ns;
+    uint64_t last_rtt_ns;
+} __attribute__((packed));
+
+// Header stamped on every benchmark payload that has room for it, so the
+// server can count the payloads lost in streaming mode
+#define BENCH_MAGIC 0x48434e42
+struct bench_header {
+    uint32_t magic;
+    uint32_t seq;
+} __attribute__((packed));
+
+// Benchmark payloads of the paced generator profiles carry their send time
+// after the benchmark header. A server started with --echo returns them, so
+// the client gets the round-trip time under load (see --bench-profile).
+struct load_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t timestamp_ns;
+} __attribute__((packed));
+
+// Traffic generator profiles of a benchmark (see --bench-profile)
+#define PROFILE_SATURATE 0
+#define PROFILE_CBR 1
+#define PROFILE_POISSON 2
+#define PROFILE_ONOFF 3
+#define PROFILE_RR 4
+#define PROFILE_REPLAY 5
+
+// Payload size distributions of a benchmark (see --bench-sizes)
+#define SIZES_FIXED 0
+#define SIZES_UNIFORM 1
+#define SIZES_EXP 2
+
+/**
+ * Payload sizes of a benchmark: min for SIZES_FIXED, min to max for
+ * SIZES_UNIFORM and an exponential distribution of the given mean, cut off
+ * at min and max, for SIZES_EXP.
+ */
+struct size_dist {
+    int kind;
+    long min;
+    long max;
+    double mean;
+};
+
+/**
+ * Generator of benchmark traffic: when the next payload is due and its
+ * size. Rates are in payloads per second. On/off sends at the rate for
+ * on_ms, then pauses for off_ms. Request/response waits for every reply
+ * and the rate, if any, paces the requests. A replay takes the sizes and
+ * gaps of the payloads sent in a capture file.
+ */
+struct traffic_profile {
+    int kind;
+    double rate;
+    double on_ms;
+    double off_ms;
+    const char *replay_path;
+    struct size_dist sizes;
+    uint64_t rng;
+    uint64_t next_ns;
+    uint64_t burst_end_ns;
+    char *replay;
+    size_t replay_size;
+    size_t replay_pos;
+    uint8_t replay_type;
+    uint64_t replay_start_ns;
+    uint64_t start_ns;
+};
+
+// Channels a benchmark is striped over at most (see --stripe)
+#define STRIPE_MAX 8
+
+// Header stamped on the payloads of a benchmark striped over several
+// channels (see --stripe). The sequence numbers count the payloads of the
+// whole stream, the server puts the channels of a stream back together by
+// its random id.
+#define STRIPE_MAGIC 0x50525453
+struct stripe_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t stream;
+    uint16_t channel;
+    uint16_t channels;
+} __attribute__((packed));
+
+// First packet of a file transfer (see --send-file and --recv-file), the
+// file follows in chunks of chunk_size bytes, in order
+#define FILE_MAGIC 0x454c4946
+#define FILE_FLAG_CHECKSUM 0x01
+struct file_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t reserved;
+} __attribute__((packed));
+
+// In front of every chunk when the transfer has FILE_FLAG_CHECKSUM, the CRC
+// is the CRC-32 of the chunk
+struct chunk_header {
+    uint32_t index;
+    uint32_t crc;
+} __attribute__((packed));
+
+// Sent back by the receiver once the whole file is stored
+#define FILE_ACK_MAGIC 0x4b434146
+struct file_ack {
+    uint32_t magic;
+    uint32_t bad_chunks;
+    uint64_t bytes;
+} __attribute__((packed));
+
+// First bytes of an SDU carrying text messages the sender coalesced (see
+// --frame). Every message follows as its record and the message itself, up
+// to the end of the SDU.
+#define FRAME_MAGIC 0x4d415246
+struct frame_header {
+    uint32_t magic;
+} __attribute__((packed));
+
+struct frame_record {
+    uint16_t length;
+} __attribute__((packed));
+
+// SDU carrying a framed SDU of raw_length bytes compressed in the LZ4 block
+// format (see --compress)
+#define FRAME_LZ4_MAGIC 0x5a4c5246
+struct frame_lz4_header {
+    uint32_t magic;
+    uint16_t raw_length;
+} __attribute__((packed));
+
+// Slots of the compressor's match finder
+#define COMPRESS_HASH_BITS 12
+
+/**
+ * Compressor of the framed SDUs of a session, with the counters that show
+ * what it gained. While skip is above 0 the SDUs go out raw.
+ */
+struct compressor {
+    uint16_t table[1 << COMPRESS_HASH_BITS];
+    char *buf;
+    size_t size;
+    long min_saving;
+    unsigned int skip;
+    unsigned int backoff;
+    unsigned long long raw_bytes;
+    unsigned long long wire_bytes;
+    unsigned long long compressed;
+    unsigned long long bypassed;
+};
+
+/**
+ * SDU being filled with framed messages. It has to be sent at deadline_ns,
+ * a bounded time after its first message, when it does not fill up before.
+ */
+struct frame_writer {
+    char *buf;
+    size_t size;
+    size_t length;
+    unsigned int count;
+    uint64_t deadline_ns;
+};
+
+// First packet of a resumable session (see --reconnect), from the client
+// with its token, 0 for a new session, and back from the server with the
+// token of the session. rx_seq counts the SDUs the side received in the
+// session, keep_seq is the first SDU it still has for resending, the peer
+// has lost the ones before it that it did not receive.
+#define RESUME_MAGIC 0x4d555352
+struct resume_header {
+    uint32_t magic;
+    uint32_t rx_seq;
+    uint32_t keep_seq;
+    uint32_t reserved;
+    uint64_t token;
+} __attribute__((packed));
+
+// SDUs and bytes a session keeps for resending after a reconnect
+#define RESUME_SLOTS 256
+#define RESUME_BUFFER_SIZE (64 << 10)
+
+/**
+ * SDUs a session sent last. SDU n is in slot n % RESUME_SLOTS, its bytes
+ * start at byte position pos, which wraps around data. An SDU is kept until
+ * newer ones take its slot or overwrite its bytes.
+ */
+struct resume_slot {
+    uint64_t pos;
+    uint16_t length;
+};
+
+struct resume_buffer {
+    char *data;
+    struct resume_slot slots[RESUME_SLOTS];
+    uint32_t next_seq;
+    uint64_t head;
+};
+
+// Log-linear histogram: every power of two is split into 2^HIST_SUB_BITS
+// equally wide buckets, which keeps the relative error below 1/32.
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct latency_histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+};
+
+// Log queues, one for every thread that logs packets: the client's
+// receiver and sender, the server's event loop
+#define LOG_QUEUE_COUNT 2
+
+// Connections in the log, the server identifies them by their slot
+#define LOG_CONN_COUNT 16
+
+// Per-packet output (see --verbosity): nothing, received text messages or
+// every packet
+#define VERBOSITY_QUIET 0
+#define VERBOSITY_MESSAGES 1
+#define VERBOSITY_PACKETS 2
+extern int VERBOSITY;
+
+// CPU of the log writer, -1 lets it run anywhere (see --log-cpu)
+extern long LOG_CPU;
+
+// SCHED_FIFO priority of the data threads, 0 keeps the default policy, and
+// whether all memory is locked (see --rt-prio and --mlock)
+extern long RT_PRIORITY;
+extern int MEMORY_LOCK;
+
+// Log file, stdout when not set (see --log-file)
+extern const char *LOG_PATH;
+
+// Capture file and the payload bytes kept per packet (see --capture)
+extern const char *CAPTURE_PATH;
+extern long CAPTURE_SNAPLEN;
+
+// Bytes in every log queue, a power of two
+#define LOG_QUEUE_SIZE (1 << 20)
+
+// Log record types
+#define LOG_RX 0
+#define LOG_TX 1
+#define LOG_CONNECT 2
+#define LOG_DISCONNECT 3
+#define LOG_TX_STAMP 4
+
+// Log record flags, the data of a text message is the whole message
+#define LOG_FLAG_TEXT 0x01
+
+/**
+ * Log record, followed by data_len bytes of packet data and padding up to a
+ * multiple of 8 bytes. Capture files store the records in the same layout.
+ * With --timestamps, stack_ns is the time the packet spent between the
+ * kernel timestamp and the application, 0 when unknown.
+ */
+struct log_record {
+    uint64_t timestamp_ns;
+    uint32_t seq;
+    uint16_t length;
+    uint16_t data_len;
+    uint16_t conn;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stack_ns;
+};
+
+#define LOG_RECORD_SIZE(data_len) \
+    ((sizeof(struct log_record) + (data_len) + 7) & ~(size_t)7)
+
+/**
+ * Data of LOG_CONNECT and LOG_DISCONNECT records.
+ */
+struct log_connection {
+    bdaddr_t peer;
+    uint16_t imtu;
+    uint16_t omtu;
+} __attribute__((packed));
+
+/**
+ * Single-producer single-consumer queue of log records. Only the producing
+ * thread moves head and only the log writer moves tail, so neither takes a
+ * lock. The positions count bytes and wrap around the buffer, records that
+ * do not fit are dropped instead of blocking the producer.
+ */
+struct log_queue {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) unsigned long long dropped;
+    char data[LOG_QUEUE_SIZE];
+};
+
+// Capture file header, followed by the log records. Fields are in host byte
+// order, timestamps come from the monotonic clock.
+#define CAPTURE_MAGIC "L2CAPCAP"
+#define CAPTURE_VERSION 2
+#define CAPTURE_ROLE_CLIENT 0
+#define CAPTURE_ROLE_SERVER 1
+#define CAPTURE_MODE_TEXT 0
+#define CAPTURE_MODE_BENCH 1
+#define CAPTURE_MODE_PING 2
+#define CAPTURE_MODE_ECHO 3
+#define CAPTURE_MODE_FILE 4
+
+struct capture_header {
+    char magic[8];
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t record_size;
+    uint16_t snaplen;
+    uint8_t role;
+    uint8_t mode;
+    uint8_t le;
+    uint8_t reserved;
+    uint16_t psm;
+    uint16_t imtu;
+    uint16_t omtu;
+    bdaddr_t peer;
+    uint64_t start_monotonic_ns;
+    uint64_t start_realtime_ns;
+};
+
+/**
+ * Capture file written through a memory mapping of its last chunk.
+ */
+struct capture_writer {
+    int fd;
+    char *map;
+    off_t map_offset;
+    size_t map_used;
+};
+
+// Log writer state, records are printed relative to LOG_TIME_START. The
+// peers are learned from the LOG_CONNECT records, LOG_ROLE is the side
+// given to log_start().
+extern struct log_queue LOG_QUEUES[LOG_QUEUE_COUNT];
+extern bdaddr_t LOG_PEERS[LOG_CONN_COUNT];
+extern FILE *LOG_OUTPUT;
+extern struct capture_writer CAPTURE;
+extern uint64_t LOG_TIME_START;
+extern atomic_int LOG_STOP;
+extern int LOG_RUNNING;
+extern int LOG_ROLE;
+extern pthread_t thread_log_writer_id;
+
+// What the data threads log, fixed when the log writer starts
+extern int LOG_MESSAGES;
+extern int LOG_PACKETS;
+extern size_t LOG_SNAPLEN;
+
+/**
+ * Slab of equal packet buffers. Free blocks are a lock-free stack: head and
+ * next hold the index of a block plus 1, head also a tag in its upper half
+ * that changes with every push and pop.
+ */
+struct buffer_pool {
+    char *slab;
+    size_t block_size;
+    unsigned int count;
+    _Atomic uint64_t head;
+    _Atomic uint32_t *next;
+    atomic_uint in_use;
+    atomic_uint high_water;
+    atomic_ullong heap_fallbacks;
+};
+
+// Packet buffers of every connection, set up by the programs at start
+extern struct buffer_pool BUFFER_POOL;
+
+/**
+ * Preallocated buffers and message headers for recvmmsg(), one slot per
+ * packet of a batch. The headers are set up once and reused for every batch,
+ * the slots are blocks of BUFFER_POOL.
+ */
+struct receive_ring {
+    unsigned int count;
+    size_t slot_size;
+    char **slots;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *control;
+};
+
+/**
+ * Consumer of a received batch, packet n is msgs[n].msg_hdr.msg_iov->iov_base
+ * and has a size of msgs[n].msg_len bytes. Slots have room for a terminating
+ * null after the packet.
+ */
+typedef void (*receive_callback)(void *ctx, struct mmsghdr *msgs,
+                                 unsigned int count);
+
+// Iovecs per queued packet, a header and a body
+#define SEND_IOV_MAX 2
+
+/**
+ * Packets waiting to be submitted with sendmmsg(), in order. The queue only
+ * references the data, which has to stay valid until the packet was sent.
+ */
+struct send_queue {
+    unsigned int capacity;
+    unsigned int count;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+};
+
+struct engine;
+
+/**
+ * Connected L2CAP channel. The receive ring is sized from the MTUs
+ * negotiated for it, and the engine moves its packets. receive_fd becomes
+ * readable when the engine has received packets, it is the socket unless
+ * the engine receives on its own, state belongs to the engine.
+ */
+struct connection {
+    int socket;
+    uint16_t imtu;
+    uint16_t omtu;
+    bdaddr_t peer;
+    struct receive_ring ring;
+    const struct engine *engine;
+    int receive_fd;
+    void *state;
+};
+
+/**
+ * Send and receive paths of a connection. Neither waits for the socket:
+ * receive() takes the packets already received, up to the size of the ring,
+ * and returns like receive_batch(). submit() writes what the socket takes
+ * and returns like send_queue_submit(). open() and close() set up and
+ * release the engine state of a connection, they may be NULL.
+ */
+struct engine {
+    const char *name;
+    long (*receive)(struct connection *conn, receive_callback callback,
+                    void *ctx);
+    long (*submit)(struct connection *conn, struct send_queue *queue,
+                   unsigned long long *bytes);
+    int (*open)(struct connection *conn);
+    void (*close)(struct connection *conn);
+};
+
+// Engines, the selectable ones in ENGINES, and the engine new connections
+// get (see --engine)
+extern const struct engine ENGINE_BATCH;
+extern const struct engine ENGINE_SINGLE;
+extern const struct engine ENGINE_URING;
+extern const struct engine *const ENGINES[];
+extern const struct engine *ENGINE;
+
+// Defined by every program, printed on invalid options
+void print_usage(const char *program);
+
+// Time, checksums, the quit flag and option parsing (util.c)
+uint64_t now_ns();
+uint64_t realtime_ns();
+uint64_t cpu_ns();
+void print_cpu_usage(const char *prefix, const struct engine *engine,
+                     uint64_t cpu, unsigned long long bytes);
+uint32_t crc32(const void *data, size_t len);
+int get_flag_quit();
+void set_flag_quit(int status);
+void handler_signal_interrupt(int sig);
+long long parse_number(const char *program, const char *arg);
+double parse_milliseconds(const char *program, const char *arg);
+int parse_phy(const char *program, const char *arg);
+int parse_channel_mode(const char *program, const char *arg);
+const struct engine *parse_engine(const char *program, const char *arg);
+
+// Latency histograms (histogram.c)
+void histogram_record(struct latency_histogram *hist, uint64_t value);
+uint64_t histogram_percentile(const struct latency_histogram *hist,
+                              double percentile);
+void print_histogram(const char *label, const struct latency_histogram *hist);
+
+// Log queues, the log writer and capture files (log.c)
+void log_packet(struct log_queue *queue, uint16_t conn, uint8_t type,
+                uint32_t seq, const char *packet, size_t length, int text,
+                uint64_t timestamp_ns, uint64_t stack_ns);
+void log_connection(struct log_queue *queue, uint16_t conn, uint8_t type,
+                    const bdaddr_t *peer, uint16_t imtu, uint16_t omtu,
+                    uint64_t timestamp_ns);
+int capture_open(uint8_t role, uint8_t mode, const bdaddr_t *peer,
+                 uint16_t imtu, uint16_t omtu);
+int log_start(uint8_t role);
+void log_sync();
+void log_stop();
+
+// Scheduling of the data threads (sched.c)
+void thread_attr_init(pthread_attr_t *attr, long cpu);
+int setup_scheduling();
+const char *cpu_name(long cpu, char *buf, size_t size);
+
+// Socket settings and connections (socket.c)
+int enable_timestamps(int s, int tx);
+int set_socket_mtu(int s, uint16_t imtu, uint16_t omtu);
+int set_channel_mode(int s);
+void print_channel_mode(const char *prefix, int s);
+int set_le_flow_control(long credits, long mps);
+void restore_le_flow_control();
+int set_le_flowctl_mode(int s);
+void print_le_flow_control();
+int connection_setup(struct connection *conn);
+void connection_free(struct connection *conn);
+
+// Adapter counters, LE connection parameters, PHY and data length (hci.c)
+int link_dev_id(int s, uint16_t *handle);
+int read_hci_stats(int dev_id, struct hci_dev_stats *stats);
+void print_hci_stats(const char *prefix, const struct hci_dev_stats *before,
+                     const struct hci_dev_stats *after);
+int make_conn_params(struct conn_params *params);
+int update_conn_params(int s, struct conn_params *params);
+void print_conn_params(const char *prefix, const struct conn_params *params);
+int update_link_settings(int s, struct link_settings *link);
+void print_link_settings(const char *prefix,
+                         const struct link_settings *link);
+
+// Coalescing of small messages into framed SDUs (frame.c)
+int frame_writer_init(struct frame_writer *writer, size_t size);
+void frame_writer_free(struct frame_writer *writer);
+void frame_writer_reset(struct frame_writer *writer);
+size_t frame_message_max(size_t size);
+size_t frame_room(const struct frame_writer *writer);
+int frame_append(struct frame_writer *writer, const char *message,
+                 size_t length, uint64_t deadline_ns);
+size_t frame_start(const char *sdu, size_t length);
+long frame_next(const char *sdu, size_t length, size_t *offset,
+                const char **message);
+
+// LZ4 compression of framed SDUs (compress.c)
+size_t lz4_compress(uint16_t *table, const char *src, size_t length,
+                    char *dst, size_t size);
+long lz4_decompress(const char *src, size_t length, char *dst, size_t size);
+int compressor_init(struct compressor *comp, size_t size, long min_saving);
+void compressor_free(struct compressor *comp);
+size_t compressor_pack(struct compressor *comp, const char *sdu,
+                       size_t length);
+long frame_inflate(const char *sdu, size_t length, char *out, size_t size);
+
+// Traffic generator profiles of the benchmark (profile.c)
+void parse_profile(const char *program, const char *arg,
+                   struct traffic_profile *profile);
+void parse_sizes(const char *program, const char *arg,
+                 struct size_dist *sizes);
+int profile_open(struct traffic_profile *profile);
+void profile_start(struct traffic_profile *profile, uint64_t start_ns);
+void profile_close(struct traffic_profile *profile);
+long profile_size(struct traffic_profile *profile);
+long profile_next(struct traffic_profile *profile, uint64_t *due_ns);
+void profile_restart(struct traffic_profile *profile, uint64_t time_ns);
+void print_profile(const char *prefix, const struct traffic_profile *profile);
+
+// Buffers of resumable sessions (resume.c)
+int resume_buffer_init(struct resume_buffer *buf);
+void resume_buffer_free(struct resume_buffer *buf);
+void resume_buffer_reset(struct resume_buffer *buf);
+void resume_buffer_push(struct resume_buffer *buf, const char *sdu,
+                        size_t length);
+uint32_t resume_buffer_first(const struct resume_buffer *buf);
+long resume_buffer_get(const struct resume_buffer *buf, uint32_t seq,
+                       char *out, size_t size);
+
+// Pool of the packet buffers (pool.c)
+size_t pool_block_size();
+unsigned int pool_block_count(unsigned int connections);
+int buffer_pool_init(struct buffer_pool *pool, size_t block_size,
+                     unsigned int count);
+void buffer_pool_free(struct buffer_pool *pool);
+void *pool_get(struct buffer_pool *pool, size_t size);
+void pool_put(struct buffer_pool *pool, void *buf);
+void print_pool_stats(const char *prefix, struct buffer_pool *pool);
+
+// Receive rings, send queues and the engines (engine.c)
+void receive_ring_free(struct receive_ring *ring);
+int receive_ring_init(struct receive_ring *ring, unsigned int count,
+                      size_t packet_size);
+void receive_ring_reset_control(struct receive_ring *ring);
+uint64_t packet_timestamp(struct msghdr *msg);
+uint64_t packet_stack_ns(struct msghdr *msg, uint64_t realtime_now);
+void send_queue_free(struct send_queue *queue);
+int send_queue_init(struct send_queue *queue, unsigned int capacity);
+int send_queue_push(struct send_queue *queue, const struct iovec *iov,
+                    int iovcnt);
+void send_queue_shift(struct send_queue *queue, unsigned int sent);
+long send_queue_submit(int s, struct send_queue *queue,
+                       unsigned long long *bytes);
+long receive_deliver(struct receive_ring *ring, int received,
+                     receive_callback callback, void *ctx);
+long receive_batch(int s, struct receive_ring *ring,
+                   receive_callback callback, void *ctx);
+long receive_single(int s, struct receive_ring *ring,
+                    receive_callback callback, void *ctx);
+long send_queue_submit_single(int s, struct send_queue *queue,
+                              unsigned long long *bytes);
+long connection_receive(struct connection *conn, receive_callback callback,
+                        void *ctx);
+long connection_submit(struct connection *conn, struct send_queue *queue,
+                       unsigned long long *bytes);
+
+#endif
@@ -0,0 +1,557 @@
+/**
+ * Log queues, the log writer thread and capture files of libl2capx. The
+ * data threads only push records to their queue, the log writer prints
+ * them and writes the capture file.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "l2capx.h"
+
+// Capture files grow by this much, the log writer maps one chunk at a time
+#define CAPTURE_CHUNK (4 << 20)
+
+// Settings, see l2capx.h
+int VERBOSITY = VERBOSITY_MESSAGES;
+const char *LOG_PATH = NULL;
+const char *CAPTURE_PATH = NULL;
+long CAPTURE_SNAPLEN = 0;
+struct log_queue LOG_QUEUES[LOG_QUEUE_COUNT];
+bdaddr_t LOG_PEERS[LOG_CONN_COUNT];
+FILE *LOG_OUTPUT = NULL;
+struct capture_writer CAPTURE = { .fd = -1 };
+uint64_t LOG_TIME_START = 0;
+atomic_int LOG_STOP = 0;
+int LOG_RUNNING = 0;
+int LOG_ROLE = CAPTURE_ROLE_CLIENT;
+pthread_t thread_log_writer_id;
+int LOG_MESSAGES = 0;
+int LOG_PACKETS = 0;
+size_t LOG_SNAPLEN = 0;
+
+/**
+ * Copy bytes into a log queue at a position, wrapping around the end.
+ *
+ * @param queue The queue.
+ * @param pos The position.
+ * @param src The bytes to copy.
+ * @param len The number of bytes.
+ */
+static void log_queue_copy_in(struct log_queue *queue, size_t pos,
+                              const void *src, size_t len) {
+    size_t offset = pos & (LOG_QUEUE_SIZE - 1);
+    size_t room = LOG_QUEUE_SIZE - offset;
+    size_t first = len < room ? len : room;
+
+    memcpy(queue->data + offset, src, first);
+    memcpy(queue->data, (const char *)src + first, len - first);
+}
+
+/**
+ * Copy bytes out of a log queue from a position, wrapping around the end.
+ *
+ * @param queue The queue.
+ * @param pos The position.
+ * @param dst The buffer to copy to.
+ * @param len The number of bytes.
+ */
+static void log_queue_copy_out(const struct log_queue *queue, size_t pos,
+                               void *dst, size_t len) {
+    size_t offset = pos & (LOG_QUEUE_SIZE - 1);
+    size_t room = LOG_QUEUE_SIZE - offset;
+    size_t first = len < room ? len : room;
+
+    memcpy(dst, queue->data + offset, first);
+    memcpy((char *)dst + first, queue->data, len - first);
+}
+
+/**
+ * Add a record to a log queue without blocking, the record is dropped when
+ * the queue is full. Only one thread may add records to a queue.
+ *
+ * @param queue The queue of the calling thread.
+ * @param record The record.
+ * @param data The data of the record, record->data_len bytes.
+ */
+static void log_queue_push(struct log_queue *queue,
+                           const struct log_record *record, const void *data) {
+    size_t head, tail, size = LOG_RECORD_SIZE(record->data_len);
+
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (size > LOG_QUEUE_SIZE - (head - tail)) {
+        queue->dropped++;
+        return;
+    }
+
+    log_queue_copy_in(queue, head, record, sizeof(*record));
+    log_queue_copy_in(queue, head + sizeof(*record), data, record->data_len);
+    atomic_store_explicit(&queue->head, head + size, memory_order_release);
+}
+
+/**
+ * Log a packet. Text messages are logged whole, other packets keep the
+ * first LOG_SNAPLEN bytes when capturing.
+ *
+ * @param queue The queue of the calling thread.
+ * @param conn The connection id.
+ * @param type LOG_RX, LOG_TX or LOG_TX_STAMP.
+ * @param seq The number of the packet in its direction.
+ * @param packet The packet, NULL to not keep any data.
+ * @param length The size of the packet.
+ * @param text Whether the packet is a text message.
+ * @param timestamp_ns The time the packet was sent or received.
+ * @param stack_ns The time between the kernel timestamp of the packet and the
+ * application, 0 when unknown.
+ */
+void log_packet(struct log_queue *queue, uint16_t conn, uint8_t type,
+                uint32_t seq, const char *packet, size_t length, int text,
+                uint64_t timestamp_ns, uint64_t stack_ns) {
+    struct log_record record = { 0 };
+
+    record.timestamp_ns = timestamp_ns;
+    record.stack_ns = stack_ns < UINT32_MAX ? stack_ns : UINT32_MAX;
+    record.seq = seq;
+    record.length = length;
+    record.conn = conn;
+    record.type = type;
+    record.flags = text ? LOG_FLAG_TEXT : 0;
+    if (packet != NULL)
+        record.data_len = text || length < LOG_SNAPLEN ? length : LOG_SNAPLEN;
+
+    log_queue_push(queue, &record, packet);
+}
+
+/**
+ * Log a connection being set up or closed.
+ *
+ * @param queue The queue of the calling thread.
+ * @param conn The connection id.
+ * @param type LOG_CONNECT or LOG_DISCONNECT.
+ * @param peer The address of the peer.
+ * @param imtu The incoming MTU.
+ * @param omtu The outgoing MTU.
+ * @param timestamp_ns The time of the event.
+ */
+void log_connection(struct log_queue *queue, uint16_t conn, uint8_t type,
+                    const bdaddr_t *peer, uint16_t imtu, uint16_t omtu,
+                    uint64_t timestamp_ns) {
+    struct log_record record = { 0 };
+    struct log_connection connection = { .imtu = imtu, .omtu = omtu };
+
+    connection.peer = *peer;
+    record.timestamp_ns = timestamp_ns;
+    record.conn = conn;
+    record.type = type;
+    record.data_len = sizeof(connection);
+
+    log_queue_push(queue, &record, &connection);
+}
+
+/**
+ * Read the oldest record of a log queue without removing it.
+ *
+ * @param queue The queue.
+ * @param record Set to the record.
+ * @return 1 if there was a record, 0 if the queue is empty.
+ */
+static int log_queue_peek(struct log_queue *queue, struct log_record *record) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (head == tail)
+        return 0;
+
+    log_queue_copy_out(queue, tail, record, sizeof(*record));
+    return 1;
+}
+
+/**
+ * Remove the oldest record of a log queue, after log_queue_peek().
+ *
+ * @param queue The queue.
+ * @param record The record returned by log_queue_peek().
+ * @param data Set to the data of the record, which is followed by zeros up
+ * to the padded size of the record and a terminating null.
+ */
+static void log_queue_pop(struct log_queue *queue,
+                          const struct log_record *record, char *data) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t size = LOG_RECORD_SIZE(record->data_len);
+
+    log_queue_copy_out(queue, tail + sizeof(*record), data, record->data_len);
+    memset(data + record->data_len, 0,
+           size - sizeof(*record) - record->data_len + 1);
+    atomic_store_explicit(&queue->tail, tail + size, memory_order_release);
+}
+
+/**
+ * Map the next chunk of a capture file, growing the file.
+ *
+ * @param writer The capture file.
+ * @return 0 on success, -1 on failure.
+ */
+static int capture_map_next(struct capture_writer *writer) {
+    if (writer->map != NULL) {
+        munmap(writer->map, CAPTURE_CHUNK);
+        writer->map = NULL;
+        writer->map_offset += CAPTURE_CHUNK;
+    }
+
+    if (ftruncate(writer->fd, writer->map_offset + CAPTURE_CHUNK) < 0)
+        return -1;
+
+    writer->map = mmap(NULL, CAPTURE_CHUNK, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, writer->fd, writer->map_offset);
+    if (writer->map == MAP_FAILED) {
+        writer->map = NULL;
+        return -1;
+    }
+
+    writer->map_used = 0;
+    return 0;
+}
+
+/**
+ * Append bytes to a capture file.
+ *
+ * @param writer The capture file.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int capture_write(struct capture_writer *writer, const void *data,
+                         size_t len) {
+    const char *bytes = data;
+    size_t room, part;
+
+    while (len > 0) {
+        if ((writer->map == NULL || writer->map_used == CAPTURE_CHUNK) &&
+            capture_map_next(writer) < 0)
+            return -1;
+
+        room = CAPTURE_CHUNK - writer->map_used;
+        part = len < room ? len : room;
+        memcpy(writer->map + writer->map_used, bytes, part);
+        writer->map_used += part;
+        bytes += part;
+        len -= part;
+    }
+
+    return 0;
+}
+
+/**
+ * Close a capture file, cutting it to the bytes written.
+ * @param writer The capture file.
+ */
+static void capture_close(struct capture_writer *writer) {
+    if (writer->fd < 0)
+        return;
+
+    if (writer->map != NULL)
+        munmap(writer->map, CAPTURE_CHUNK);
+
+    if (ftruncate(writer->fd, writer->map_offset + writer->map_used) < 0)
+        perror("Error truncating capture file");
+
+    close(writer->fd);
+    writer->fd = -1;
+    writer->map = NULL;
+}
+
+/**
+ * Create the capture file (CAPTURE_PATH) and write its header, before the
+ * log writer is started.
+ *
+ * @param role CAPTURE_ROLE_CLIENT or CAPTURE_ROLE_SERVER.
+ * @param mode One of the CAPTURE_MODE values.
+ * @param peer The address of the peer, BDADDR_ANY for the server.
+ * @param imtu The incoming MTU, requested for the server.
+ * @param omtu The outgoing MTU, requested for the server.
+ * @return 0 on success, -1 on failure.
+ */
+int capture_open(uint8_t role, uint8_t mode, const bdaddr_t *peer,
+                 uint16_t imtu, uint16_t omtu) {
+    struct capture_header header = { 0 };
+    struct timespec ts;
+
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(struct log_record);
+    header.snaplen = CAPTURE_SNAPLEN;
+    header.role = role;
+    header.mode = mode;
+    header.le = LE_MODE;
+    header.psm = PSM;
+    header.imtu = imtu;
+    header.omtu = omtu;
+    header.peer = *peer;
+    header.start_monotonic_ns = now_ns();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL +
+                               ts.tv_nsec;
+
+    CAPTURE.fd = open(CAPTURE_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+    if (CAPTURE.fd < 0)
+        return -1;
+
+    if (capture_write(&CAPTURE, &header, sizeof(header)) < 0) {
+        capture_close(&CAPTURE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Print a log record as one line with its time, type, peer and size.
+ *
+ * @param record The record.
+ * @param data The data of the record.
+ * @param address The address of the peer.
+ */
+static void log_render_packet(const struct log_record *record, const char *data,
+                              const char *address) {
+    static const char *types[] = { "rx", "tx", "connect", "disconnect",
+                                   "tx-stamp" };
+    struct log_connection connection;
+    double seconds = (double)(record->timestamp_ns - LOG_TIME_START) / 1e9;
+    char stack[32] = "";
+
+    if (record->type == LOG_CONNECT || record->type == LOG_DISCONNECT) {
+        memcpy(&connection, data, sizeof(connection));
+        fprintf(LOG_OUTPUT, "%.6f %s %s, MTU incoming %u, outgoing %u bytes\n",
+                seconds, types[record->type], address, connection.imtu,
+                connection.omtu);
+        return;
+    }
+
+    if (record->type == LOG_TX_STAMP) {
+        fprintf(LOG_OUTPUT, "%.6f %s %s #%u, stack %.1f us\n", seconds,
+                types[record->type], address, record->seq,
+                record->stack_ns / 1e3);
+        return;
+    }
+
+    if (record->stack_ns > 0)
+        snprintf(stack, sizeof(stack), ", stack %.1f us",
+                 record->stack_ns / 1e3);
+
+    fprintf(LOG_OUTPUT, "%.6f %s %s #%u %u bytes%s%s%s\n", seconds,
+            types[record->type & 1], address, record->seq, record->length,
+            stack, (record->flags & LOG_FLAG_TEXT) ? ": " : "",
+            (record->flags & LOG_FLAG_TEXT) ? data : "");
+}
+
+/**
+ * Print a log record. Unless every packet is logged, only received text
+ * messages are printed, as "Server: <message>" on the client and as
+ * "Client <address>: <message>" on the server.
+ *
+ * @param record The record.
+ * @param data The data of the record.
+ */
+static void log_render(const struct log_record *record, const char *data) {
+    char address[18] = "";
+
+    if (record->conn < LOG_CONN_COUNT)
+        ba2str(&LOG_PEERS[record->conn], address);
+
+    if (VERBOSITY < VERBOSITY_PACKETS) {
+        if (VERBOSITY != VERBOSITY_MESSAGES || record->type != LOG_RX ||
+            !(record->flags & LOG_FLAG_TEXT))
+            return;
+
+        if (LOG_ROLE == CAPTURE_ROLE_CLIENT)
+            fprintf(LOG_OUTPUT, "Server: %s\n", data);
+        else
+            fprintf(LOG_OUTPUT, "Client %s: %s\n", address, data);
+        return;
+    }
+
+    log_render_packet(record, data, address);
+}
+
+/**
+ * Render all queued log records and append them to the capture file, the
+ * queues are merged in time order.
+ *
+ * @return The number of records rendered.
+ */
+static long log_drain() {
+    static char data[UINT16_MAX + 8];
+    struct log_record record, next;
+    struct log_connection connection;
+    long rendered = 0;
+    int index, earliest;
+
+    for (;;) {
+        earliest = -1;
+        for (index = 0; index < LOG_QUEUE_COUNT; index++) {
+            if (log_queue_peek(&LOG_QUEUES[index], &next) &&
+                (earliest < 0 || next.timestamp_ns < record.timestamp_ns)) {
+                record = next;
+                earliest = index;
+            }
+        }
+
+        if (earliest < 0)
+            return rendered;
+
+        log_queue_pop(&LOG_QUEUES[earliest], &record, data);
+
+        if (record.type == LOG_CONNECT && record.conn < LOG_CONN_COUNT &&
+            record.data_len == sizeof(connection)) {
+            memcpy(&connection, data, sizeof(connection));
+            LOG_PEERS[record.conn] = connection.peer;
+        }
+
+        if (CAPTURE.fd >= 0 &&
+            (capture_write(&CAPTURE, &record, sizeof(record)) < 0 ||
+             capture_write(&CAPTURE, data, LOG_RECORD_SIZE(record.data_len) -
+                           sizeof(record)) < 0)) {
+            perror("Error writing capture file, capture stopped");
+            capture_close(&CAPTURE);
+        }
+
+        log_render(&record, data);
+        rendered++;
+    }
+}
+
+/**
+ * Thread to write the log records, polls the queues every millisecond while
+ * they are empty so producers never have to wake it.
+ *
+ * @param th_args The thread argument.
+ * @return Nothing
+ */
+static void *thread_log_writer(void *th_args) {
+    struct timespec pause = { 0, 1000000 };
+    int stopping;
+
+    (void)th_args;
+
+    for (;;) {
+        stopping = atomic_load_explicit(&LOG_STOP, memory_order_acquire);
+
+        if (log_drain() > 0)
+            continue;
+
+        if (stopping)
+            break;
+
+        fflush(LOG_OUTPUT);
+        nanosleep(&pause, NULL);
+    }
+
+    fflush(LOG_OUTPUT);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Open the log output and start the log writer, after capture_open() when
+ * capturing.
+ *
+ * @param role The side of the connection, CAPTURE_ROLE_CLIENT or
+ * CAPTURE_ROLE_SERVER.
+ * @return 0 on success, -1 on failure.
+ */
+int log_start(uint8_t role) {
+    pthread_attr_t attr;
+    int error;
+
+    LOG_ROLE = role;
+    LOG_OUTPUT = stdout;
+    if (LOG_PATH != NULL) {
+        LOG_OUTPUT = fopen(LOG_PATH, "w");
+        if (LOG_OUTPUT == NULL)
+            return -1;
+    }
+
+    // A capture has every packet, whatever is printed
+    LOG_MESSAGES = VERBOSITY >= VERBOSITY_MESSAGES || CAPTURE.fd >= 0;
+    LOG_PACKETS = VERBOSITY >= VERBOSITY_PACKETS || CAPTURE.fd >= 0;
+    LOG_SNAPLEN = CAPTURE.fd >= 0 ? (size_t)CAPTURE_SNAPLEN : 0;
+
+    // The log writer keeps the default policy, so it never competes with
+    // the data threads
+    thread_attr_init(&attr, LOG_CPU);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+
+    LOG_TIME_START = now_ns();
+    error = pthread_create(&thread_log_writer_id, &attr, thread_log_writer,
+                           NULL);
+    pthread_attr_destroy(&attr);
+
+    if (error != 0) {
+        if (LOG_OUTPUT != stdout)
+            fclose(LOG_OUTPUT);
+        errno = error;
+        return -1;
+    }
+
+    LOG_RUNNING = 1;
+    return 0;
+}
+
+/**
+ * Wait until the log writer has rendered every queued record, so output
+ * printed next appears after them.
+ */
+void log_sync() {
+    struct timespec pause = { 0, 100000 };
+    int index;
+
+    if (!LOG_RUNNING)
+        return;
+
+    for (index = 0; index < LOG_QUEUE_COUNT; index++) {
+        while (atomic_load_explicit(&LOG_QUEUES[index].tail,
+                                    memory_order_acquire) !=
+               atomic_load_explicit(&LOG_QUEUES[index].head,
+                                    memory_order_acquire))
+            nanosleep(&pause, NULL);
+    }
+
+    fflush(LOG_OUTPUT);
+}
+
+/**
+ * Stop the log writer after it has rendered every queued record, close the
+ * capture file and report the records that were dropped.
+ */
+void log_stop() {
+    unsigned long long dropped = 0;
+    int index;
+
+    if (!LOG_RUNNING)
+        return;
+
+    atomic_store_explicit(&LOG_STOP, 1, memory_order_release);
+    pthread_join(thread_log_writer_id, NULL);
+    LOG_RUNNING = 0;
+
+    capture_close(&CAPTURE);
+
+    for (index = 0; index < LOG_QUEUE_COUNT; index++)
+        dropped += LOG_QUEUES[index].dropped;
+
+    if (dropped > 0)
+        fprintf(stderr, "log: %llu records dropped, the log writer could not "
+                "keep up\n", dropped);
+
+    if (LOG_OUTPUT != stdout)
+        fclose(LOG_OUTPUT);
+}
@@ -0,0 +1,197 @@
+/**
+ * Buffer pool of libl2capx: one slab of equal blocks, sized from the MTU
+ * and aligned to cache lines, that the receive rings, the engines and the
+ * senders take their packet buffers from. The free blocks form a lock-free
+ * stack, so threads of different connections share the pool without a
+ * lock. Buffers that do not fit a block, or ask for one when the pool is
+ * empty, come from the heap and are counted.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "l2capx.h"
+
+// Blocks start on a cache line
+#define POOL_ALIGN 64
+
+// Index bits of the free list head, the rest counts the changes so a head
+// that was popped and pushed again in between is not taken for the same
+#define POOL_INDEX_MASK 0xffffffffULL
+#define POOL_TAG_ONE (POOL_INDEX_MASK + 1)
+
+// The pool every connection draws from, see l2capx.h
+struct buffer_pool BUFFER_POOL = { 0 };
+
+/**
+ * Get the block size for the MTUs requested with --mtu, the kernel default
+ * when none was requested. One extra byte keeps text messages null
+ * terminated.
+ *
+ * @return The size of a block.
+ */
+size_t pool_block_size() {
+    size_t mtu = L2CAP_DEFAULT_MTU;
+
+    if ((size_t)REQUEST_IMTU > mtu)
+        mtu = REQUEST_IMTU;
+    if ((size_t)REQUEST_OMTU > mtu)
+        mtu = REQUEST_OMTU;
+
+    return (mtu + 1 + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+}
+
+/**
+ * Get the number of blocks that connections take at most: the slots of
+ * their receive ring, the buffers of the io_uring engine and a few for the
+ * senders.
+ *
+ * @param connections The number of connections at the same time.
+ * @return The number of blocks.
+ */
+unsigned int pool_block_count(unsigned int connections) {
+    return connections * (5 * RECV_BATCH + 4);
+}
+
+/**
+ * Map the slab of a buffer pool and put every block on the free list. The
+ * pages are only backed once a block is used.
+ *
+ * @param pool The pool.
+ * @param block_size The size of a block, a multiple of the cache line.
+ * @param count The number of blocks.
+ * @return 0 on success, -1 on failure.
+ */
+int buffer_pool_init(struct buffer_pool *pool, size_t block_size,
+                     unsigned int count) {
+    unsigned int index;
+
+    memset(pool, 0, sizeof(*pool));
+
+    pool->slab = mmap(NULL, block_size * count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pool->next = calloc(count, sizeof(*pool->next));
+    if (pool->slab == MAP_FAILED || pool->next == NULL) {
+        if (pool->slab != MAP_FAILED)
+            munmap(pool->slab, block_size * count);
+        free(pool->next);
+        memset(pool, 0, sizeof(*pool));
+        return -1;
+    }
+
+    pool->block_size = block_size;
+    pool->count = count;
+
+    // Block n links to block n + 1, an index of 0 ends the list
+    for (index = 0; index < count; index++)
+        atomic_init(&pool->next[index], index + 2 <= count ? index + 2 : 0);
+    atomic_init(&pool->head, count > 0 ? 1 : 0);
+
+    return 0;
+}
+
+/**
+ * Unmap the slab of a buffer pool, once no block is in use any more.
+ * @param pool The pool.
+ */
+void buffer_pool_free(struct buffer_pool *pool) {
+    if (pool->slab != NULL)
+        munmap(pool->slab, pool->block_size * pool->count);
+    free(pool->next);
+    pool->slab = NULL;
+    pool->next = NULL;
+    pool->count = 0;
+}
+
+/**
+ * Count a buffer handed out and raise the high-water mark.
+ * @param pool The pool.
+ */
+static void pool_count_use(struct buffer_pool *pool) {
+    unsigned int in_use = atomic_fetch_add(&pool->in_use, 1) + 1;
+    unsigned int high = atomic_load(&pool->high_water);
+
+    while (in_use > high &&
+           !atomic_compare_exchange_weak(&pool->high_water, &high, in_use))
+        ;
+}
+
+/**
+ * Take a buffer from a pool. Without a free block that fits, the buffer
+ * comes from the heap, also before the pool was set up.
+ *
+ * @param pool The pool.
+ * @param size The size of the buffer.
+ * @return The buffer, aligned to a cache line, NULL on failure.
+ */
+void *pool_get(struct buffer_pool *pool, size_t size) {
+    uint64_t head = atomic_load(&pool->head), next;
+    uint32_t index;
+    void *buf;
+
+    while (size <= pool->block_size && (head & POOL_INDEX_MASK) != 0) {
+        index = (head & POOL_INDEX_MASK) - 1;
+
+        // The block may be taken meanwhile, the tag makes that fail below
+        next = atomic_load(&pool->next[index]);
+        next |= (head & ~POOL_INDEX_MASK) + POOL_TAG_ONE;
+
+        if (atomic_compare_exchange_weak(&pool->head, &head, next)) {
+            pool_count_use(pool);
+            return pool->slab + (size_t)index * pool->block_size;
+        }
+    }
+
+    buf = aligned_alloc(POOL_ALIGN, (size + POOL_ALIGN - 1) &
+                                    ~(size_t)(POOL_ALIGN - 1));
+    if (buf == NULL)
+        return NULL;
+
+    atomic_fetch_add(&pool->heap_fallbacks, 1);
+    pool_count_use(pool);
+    return buf;
+}
+
+/**
+ * Return a buffer taken with pool_get().
+ *
+ * @param pool The pool.
+ * @param buf The buffer, NULL is ignored.
+ */
+void pool_put(struct buffer_pool *pool, void *buf) {
+    char *block = buf;
+    uint64_t head, next;
+    uint32_t index;
+
+    if (buf == NULL)
+        return;
+
+    atomic_fetch_sub(&pool->in_use, 1);
+
+    if (pool->slab == NULL || block < pool->slab ||
+        block >= pool->slab + pool->block_size * pool->count) {
+        free(buf);
+        return;
+    }
+
+    index = (block - pool->slab) / pool->block_size;
+    head = atomic_load(&pool->head);
+    do {
+        atomic_store(&pool->next[index], head & POOL_INDEX_MASK);
+        next = ((head & ~POOL_INDEX_MASK) + POOL_TAG_ONE) | (index + 1);
+    } while (!atomic_compare_exchange_weak(&pool->head, &head, next));
+}
+
+/**
+ * Print how much of a buffer pool was used.
+ *
+ * @param prefix The prefix of the line.
+ * @param pool The pool.
+ */
+void print_pool_stats(const char *prefix, struct buffer_pool *pool) {
+    printf("%sBuffer pool: %u of %u blocks of %zu bytes in use, high water "
+           "%u, %llu heap fallbacks\n", prefix, atomic_load(&pool->in_use),
+           pool->count, pool->block_size, atomic_load(&pool->high_water),
+           atomic_load(&pool->heap_fallbacks));
+}
@@ -0,0 +1,416 @@
+/**
+ * Traffic generator profiles of the benchmark for libl2capx: when the next
+ * payload is due and how large it is. Saturate sends as fast as the socket
+ * takes payloads, the other profiles pace them, so the latency can be
+ * measured under a given load instead of only at saturation.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "l2capx.h"
+
+/**
+ * Exit with the usage, for an invalid profile or size distribution.
+ *
+ * @param program The name of the program.
+ * @param what What was invalid.
+ * @param arg The argument.
+ */
+static void profile_invalid(const char *program, const char *what,
+                            const char *arg) {
+    fprintf(stderr, "invalid %s: %s\n", what, arg);
+    print_usage(program);
+    exit(2);
+}
+
+/**
+ * Parse the numbers after the colon of a profile or size distribution.
+ *
+ * @param list The numbers, separated by commas.
+ * @param values Where to store them.
+ * @param count The number of values expected.
+ * @return 0 on success, -1 if there are not exactly count non-negative
+ * numbers.
+ */
+static int parse_values(const char *list, double *values, int count) {
+    char *end;
+    int index;
+
+    for (index = 0; index < count; index++) {
+        values[index] = strtod(list, &end);
+        if (end == list || !(values[index] >= 0))
+            return -1;
+
+        if (*end != (index + 1 < count ? ',' : '\0'))
+            return -1;
+        list = end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a traffic generator profile from a command line argument, exit with
+ * usage information if it is not valid: "saturate", "cbr:RATE",
+ * "poisson:RATE", "onoff:RATE,ON_MS,OFF_MS", "rr" or "rr:RATE", or
+ * "replay:FILE" for a capture file. The size distribution is kept.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @param profile The profile.
+ */
+void parse_profile(const char *program, const char *arg,
+                   struct traffic_profile *profile) {
+    const char *values = strchr(arg, ':');
+    size_t name = values != NULL ? (size_t)(values - arg) : strlen(arg);
+    double parsed[3];
+
+    if (values != NULL)
+        values++;
+
+    profile->rate = 0;
+    profile->on_ms = 0;
+    profile->off_ms = 0;
+    profile->replay_path = NULL;
+
+    if (strncmp(arg, "saturate", name) == 0 && name == 8 && !values) {
+        profile->kind = PROFILE_SATURATE;
+    }
+    else if (strncmp(arg, "cbr", name) == 0 && name == 3 && values &&
+             parse_values(values, parsed, 1) == 0 && parsed[0] > 0) {
+        profile->kind = PROFILE_CBR;
+        profile->rate = parsed[0];
+    }
+    else if (strncmp(arg, "poisson", name) == 0 && name == 7 && values &&
+             parse_values(values, parsed, 1) == 0 && parsed[0] > 0) {
+        profile->kind = PROFILE_POISSON;
+        profile->rate = parsed[0];
+    }
+    else if (strncmp(arg, "onoff", name) == 0 && name == 5 && values &&
+             parse_values(values, parsed, 3) == 0 && parsed[0] > 0 &&
+             parsed[1] > 0) {
+        profile->kind = PROFILE_ONOFF;
+        profile->rate = parsed[0];
+        profile->on_ms = parsed[1];
+        profile->off_ms = parsed[2];
+    }
+    else if (strncmp(arg, "rr", name) == 0 && name == 2 &&
+             (!values || parse_values(values, parsed, 1) == 0)) {
+        profile->kind = PROFILE_RR;
+        profile->rate = values ? parsed[0] : 0;
+    }
+    else if (strncmp(arg, "replay", name) == 0 && name == 6 && values &&
+             *values != '\0') {
+        profile->kind = PROFILE_REPLAY;
+        profile->replay_path = values;
+    }
+    else {
+        profile_invalid(program, "profile", arg);
+    }
+}
+
+/**
+ * Parse a payload size distribution from a command line argument, exit with
+ * usage information if it is not valid: "BYTES" or "fixed:BYTES",
+ * "uniform:MIN,MAX" or "exp:MEAN". A maximum of 0 stands for the outgoing
+ * MTU.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @param sizes The size distribution.
+ */
+void parse_sizes(const char *program, const char *arg,
+                 struct size_dist *sizes) {
+    double parsed[2];
+
+    memset(sizes, 0, sizeof(*sizes));
+
+    if (parse_values(arg, parsed, 1) == 0 ||
+        (strncmp(arg, "fixed:", 6) == 0 &&
+         parse_values(arg + 6, parsed, 1) == 0)) {
+        sizes->kind = SIZES_FIXED;
+        sizes->min = parsed[0];
+        sizes->max = parsed[0];
+    }
+    else if (strncmp(arg, "uniform:", 8) == 0 &&
+             parse_values(arg + 8, parsed, 2) == 0 &&
+             parsed[0] <= parsed[1]) {
+        sizes->kind = SIZES_UNIFORM;
+        sizes->min = parsed[0];
+        sizes->max = parsed[1];
+    }
+    else if (strncmp(arg, "exp:", 4) == 0 &&
+             parse_values(arg + 4, parsed, 1) == 0) {
+        sizes->kind = SIZES_EXP;
+        sizes->min = 1;
+        sizes->mean = parsed[0];
+    }
+    else {
+        profile_invalid(program, "size distribution", arg);
+    }
+
+    if (sizes->kind != SIZES_EXP && (sizes->min < 1 || sizes->max > 65535))
+        profile_invalid(program, "size distribution", arg);
+}
+
+/**
+ * Draw the next number of a profile's generator, xorshift64*.
+ *
+ * @param profile The profile.
+ * @return A number in [0, 1).
+ */
+static double profile_random(struct traffic_profile *profile) {
+    profile->rng ^= profile->rng >> 12;
+    profile->rng ^= profile->rng << 25;
+    profile->rng ^= profile->rng >> 27;
+
+    return (profile->rng * 2685821657736338717ULL >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Map the capture file of a replay and check that this build can read it.
+ *
+ * @param profile The profile.
+ * @return 0 on success, -1 on failure.
+ */
+static int profile_open_replay(struct traffic_profile *profile) {
+    struct capture_header header;
+    struct stat st;
+    int fd = open(profile->replay_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    profile->replay_size = st.st_size;
+    profile->replay = mmap(NULL, profile->replay_size, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+    close(fd);
+    if (profile->replay == MAP_FAILED) {
+        profile->replay = NULL;
+        return -1;
+    }
+
+    memcpy(&header, profile->replay, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CAPTURE_VERSION ||
+        header.record_size != sizeof(struct log_record) ||
+        header.header_size > profile->replay_size) {
+        profile_close(profile);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // What the client sent, the client's own or as the server received it
+    profile->replay_type = header.role == CAPTURE_ROLE_SERVER ? LOG_RX : LOG_TX;
+    profile->replay_pos = header.header_size;
+    profile->replay_start_ns = 0;
+    return 0;
+}
+
+/**
+ * Seed the generator of a profile and map the capture file of a replay,
+ * before connecting so a bad file fails early.
+ *
+ * @param profile The profile.
+ * @return 0 on success, -1 if the capture file of a replay cannot be read.
+ */
+int profile_open(struct traffic_profile *profile) {
+    profile->rng = (realtime_ns() ^ ((uint64_t)getpid() << 32)) | 1;
+    profile->replay = NULL;
+
+    if (profile->kind == PROFILE_REPLAY)
+        return profile_open_replay(profile);
+
+    return 0;
+}
+
+/**
+ * Start the traffic of a profile, the first payload is due at start_ns.
+ *
+ * @param profile The profile.
+ * @param start_ns The monotonic time to start at.
+ */
+void profile_start(struct traffic_profile *profile, uint64_t start_ns) {
+    profile->start_ns = start_ns;
+    profile->next_ns = start_ns;
+    profile->burst_end_ns = start_ns + (uint64_t)(profile->on_ms * 1e6);
+}
+
+/**
+ * Release the capture file of a replay.
+ * @param profile The profile.
+ */
+void profile_close(struct traffic_profile *profile) {
+    if (profile->replay != NULL)
+        munmap(profile->replay, profile->replay_size);
+    profile->replay = NULL;
+}
+
+/**
+ * Draw the size of a payload from the size distribution.
+ *
+ * @param profile The profile.
+ * @return The size in bytes.
+ */
+long profile_size(struct traffic_profile *profile) {
+    struct size_dist *sizes = &profile->sizes;
+    double size;
+
+    if (sizes->kind == SIZES_UNIFORM)
+        return sizes->min + (long)(profile_random(profile) *
+                                   (sizes->max - sizes->min + 1));
+
+    if (sizes->kind != SIZES_EXP)
+        return sizes->min;
+
+    size = round(-sizes->mean * log(1 - profile_random(profile)));
+    if (size < sizes->min)
+        return sizes->min;
+    return size > sizes->max ? sizes->max : (long)size;
+}
+
+/**
+ * Get the next payload of a replay from its capture file.
+ *
+ * @param profile The profile.
+ * @param due_ns Set to the time the payload is due.
+ * @return The size of the payload, -1 at the end of the capture.
+ */
+static long profile_next_replay(struct traffic_profile *profile,
+                                uint64_t *due_ns) {
+    struct log_record record;
+    size_t size;
+
+    while (profile->replay_pos + sizeof(record) <= profile->replay_size) {
+        memcpy(&record, profile->replay + profile->replay_pos,
+               sizeof(record));
+        size = LOG_RECORD_SIZE(record.data_len);
+        if (profile->replay_pos + size > profile->replay_size)
+            break;
+        profile->replay_pos += size;
+
+        if (record.type != profile->replay_type || record.length == 0)
+            continue;
+
+        if (profile->replay_start_ns == 0)
+            profile->replay_start_ns = record.timestamp_ns;
+
+        *due_ns = profile->start_ns + record.timestamp_ns -
+                  profile->replay_start_ns;
+        return record.length;
+    }
+
+    return -1;
+}
+
+/**
+ * Get the next payload of a profile: its size and when it is due. A
+ * saturating profile has every payload due at once.
+ *
+ * @param profile The profile.
+ * @param due_ns Set to the monotonic time the payload is due.
+ * @return The size of the payload, -1 when the profile has no more.
+ */
+long profile_next(struct traffic_profile *profile, uint64_t *due_ns) {
+    double gap_ns = profile->rate > 0 ? 1e9 / profile->rate : 0;
+
+    switch (profile->kind) {
+        case PROFILE_SATURATE:
+            *due_ns = 0;
+            return profile_size(profile);
+        case PROFILE_REPLAY:
+            return profile_next_replay(profile, due_ns);
+        case PROFILE_POISSON:
+            // Exponential gaps of the mean of the rate
+            gap_ns *= -log(1 - profile_random(profile));
+            break;
+        case PROFILE_ONOFF:
+            if (profile->next_ns >= profile->burst_end_ns) {
+                profile->next_ns = profile->burst_end_ns +
+                                   (uint64_t)(profile->off_ms * 1e6);
+                profile->burst_end_ns = profile->next_ns +
+                                        (uint64_t)(profile->on_ms * 1e6);
+            }
+            break;
+        case PROFILE_RR:
+            // Paced from the reply by profile_restart()
+            *due_ns = profile->next_ns;
+            return profile_size(profile);
+    }
+
+    *due_ns = profile->next_ns;
+    profile->next_ns += (uint64_t)gap_ns;
+    return profile_size(profile);
+}
+
+/**
+ * Schedule the next request of a request/response profile, after the reply
+ * to the last one or its timeout.
+ *
+ * @param profile The profile.
+ * @param time_ns The monotonic time of the reply.
+ */
+void profile_restart(struct traffic_profile *profile, uint64_t time_ns) {
+    profile->next_ns = time_ns +
+                       (profile->rate > 0 ? (uint64_t)(1e9 / profile->rate) :
+                                            0);
+}
+
+/**
+ * Print the parameters of a profile with the results it produced.
+ *
+ * @param prefix The start of the line.
+ * @param profile The profile.
+ */
+void print_profile(const char *prefix, const struct traffic_profile *profile) {
+    const struct size_dist *sizes = &profile->sizes;
+
+    printf("%sprofile: ", prefix);
+    switch (profile->kind) {
+        case PROFILE_SATURATE:
+            printf("saturate");
+            break;
+        case PROFILE_CBR:
+            printf("constant bit rate, %.1f payloads/s", profile->rate);
+            break;
+        case PROFILE_POISSON:
+            printf("Poisson arrivals, %.1f payloads/s on average",
+                   profile->rate);
+            break;
+        case PROFILE_ONOFF:
+            printf("on/off, %.1f payloads/s for %.1f ms, then %.1f ms off",
+                   profile->rate, profile->on_ms, profile->off_ms);
+            break;
+        case PROFILE_RR:
+            printf("request/response");
+            if (profile->rate > 0)
+                printf(", at most %.1f requests/s", profile->rate);
+            break;
+        case PROFILE_REPLAY:
+            printf("replay of %s, sizes from the capture\n",
+                   profile->replay_path);
+            return;
+    }
+
+    if (sizes->kind == SIZES_UNIFORM)
+        printf(", sizes uniform from %ld to %ld bytes\n", sizes->min,
+               sizes->max);
+    else if (sizes->kind == SIZES_EXP)
+        printf(", sizes exponential with a mean of %.1f bytes, %ld to %ld\n",
+               sizes->mean, sizes->min, sizes->max);
+    else
+        printf(", size %ld bytes\n", sizes->min);
+}
@@ -0,0 +1,111 @@
+/**
+ * Buffers of the SDUs a resumable session sent last, for libl2capx. After a
+ * reconnect the side resends the SDUs its peer did not receive from here.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "l2capx.h"
+
+/**
+ * Allocate an empty resume buffer.
+ *
+ * @param buf The buffer.
+ * @return 0 on success, -1 on failure.
+ */
+int resume_buffer_init(struct resume_buffer *buf) {
+    memset(buf, 0, sizeof(*buf));
+
+    buf->data = malloc(RESUME_BUFFER_SIZE);
+    return buf->data != NULL ? 0 : -1;
+}
+
+/**
+ * Release a resume buffer.
+ * @param buf The buffer.
+ */
+void resume_buffer_free(struct resume_buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+}
+
+/**
+ * Forget the SDUs of a resume buffer, for a new session.
+ * @param buf The buffer.
+ */
+void resume_buffer_reset(struct resume_buffer *buf) {
+    buf->next_seq = 0;
+    buf->head = 0;
+}
+
+/**
+ * Keep a copy of an SDU before it is sent, it becomes SDU next_seq.
+ *
+ * @param buf The buffer.
+ * @param sdu The SDU.
+ * @param length The size of the SDU, at most 65535 bytes.
+ */
+void resume_buffer_push(struct resume_buffer *buf, const char *sdu,
+                        size_t length) {
+    struct resume_slot *slot = &buf->slots[buf->next_seq % RESUME_SLOTS];
+    size_t start = buf->head % RESUME_BUFFER_SIZE;
+    size_t first = length < RESUME_BUFFER_SIZE - start ?
+                   length : RESUME_BUFFER_SIZE - start;
+
+    memcpy(buf->data + start, sdu, first);
+    memcpy(buf->data, sdu + first, length - first);
+
+    slot->pos = buf->head;
+    slot->length = length;
+    buf->head += length;
+    buf->next_seq++;
+}
+
+/**
+ * Get the first SDU a resume buffer still has, older ones were overwritten.
+ *
+ * @param buf The buffer.
+ * @return The number of the SDU, next_seq when the buffer is empty.
+ */
+uint32_t resume_buffer_first(const struct resume_buffer *buf) {
+    uint32_t seq = buf->next_seq > RESUME_SLOTS ?
+                   buf->next_seq - RESUME_SLOTS : 0;
+    uint64_t pos;
+
+    // Bytes of the oldest SDUs may have been overwritten before their slots
+    for (; seq < buf->next_seq; seq++) {
+        pos = buf->slots[seq % RESUME_SLOTS].pos;
+        if (buf->head - pos <= RESUME_BUFFER_SIZE)
+            break;
+    }
+
+    return seq;
+}
+
+/**
+ * Copy an SDU out of a resume buffer.
+ *
+ * @param buf The buffer.
+ * @param seq The number of the SDU.
+ * @param out Where to copy the SDU to.
+ * @param size The room at out.
+ * @return The size of the SDU, -1 if it is not kept or does not fit.
+ */
+long resume_buffer_get(const struct resume_buffer *buf, uint32_t seq,
+                       char *out, size_t size) {
+    const struct resume_slot *slot = &buf->slots[seq % RESUME_SLOTS];
+    size_t start, first;
+
+    if (seq >= buf->next_seq || seq < resume_buffer_first(buf) ||
+        slot->length > size)
+        return -1;
+
+    start = slot->pos % RESUME_BUFFER_SIZE;
+    first = slot->length < RESUME_BUFFER_SIZE - start ?
+            slot->length : RESUME_BUFFER_SIZE - start;
+    memcpy(out, buf->data + start, first);
+    memcpy(out + first, buf->data, slot->length - first);
+
+    return slot->length;
+}
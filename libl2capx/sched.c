@@ -0,0 +1,79 @@
+/**
+ * CPU affinity, real-time priority and memory locking of the threads of
+ * libl2capx programs.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "l2capx.h"
+
+// Settings, see l2capx.h
+long LOG_CPU = -1;
+long RT_PRIORITY = 0;
+int MEMORY_LOCK = 0;
+
+/**
+ * Initialize the attributes of a thread to start, pinned to a CPU.
+ *
+ * @param attr The attributes.
+ * @param cpu The CPU, -1 to let the thread run anywhere.
+ */
+void thread_attr_init(pthread_attr_t *attr, long cpu) {
+    cpu_set_t cpus;
+
+    pthread_attr_init(attr);
+    if (cpu < 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+/**
+ * Lock all memory of the process and switch the calling thread to
+ * SCHED_FIFO, as requested. Threads it starts afterwards inherit the
+ * policy, except the log writer.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int setup_scheduling() {
+    struct sched_param param = { .sched_priority = RT_PRIORITY };
+    int error;
+
+    // Buffers allocated later are locked as well
+    if (MEMORY_LOCK && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("Error locking memory");
+        return -1;
+    }
+
+    if (RT_PRIORITY > 0) {
+        error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0) {
+            errno = error;
+            perror("Error setting real-time priority");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Describe where a thread runs.
+ *
+ * @param cpu The CPU of the thread, -1 for any.
+ * @param buf The buffer for the description.
+ * @param size The size of the buffer.
+ * @return The description, in buf.
+ */
+const char *cpu_name(long cpu, char *buf, size_t size) {
+    if (cpu < 0)
+        snprintf(buf, size, "any CPU");
+    else
+        snprintf(buf, size, "CPU %ld", cpu);
+    return buf;
+}
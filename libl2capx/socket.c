@@ -0,0 +1,323 @@
+/**
+ * L2CAP socket settings and connection setup of libl2capx.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/net_tstamp.h>
+
+#include "l2capx.h"
+
+// Kernel knobs for LE credit based flow control, need root and debugfs
+#define DEBUGFS_BLUETOOTH "/sys/kernel/debug/bluetooth/"
+#define DEBUGFS_LE_MAX_CREDITS DEBUGFS_BLUETOOTH "l2cap_le_max_credits"
+#define DEBUGFS_LE_DEFAULT_MPS DEBUGFS_BLUETOOTH "l2cap_le_default_mps"
+
+// Settings, see l2capx.h
+int LE_MODE = 0;
+long PSM = 0;
+long LE_CREDITS = 0;
+long LE_MPS = 0;
+int CHANNEL_MODE = L2CAP_MODE_BASIC;
+int CHANNEL_MODE_SET = 0;
+long TX_WINDOW = 0;
+long MAX_TRANSMIT = 0;
+long REQUEST_IMTU = 0;
+long REQUEST_OMTU = 0;
+int TIMESTAMPS = 0;
+
+// Values of the LE flow control knobs before set_le_flow_control() changed
+// them, -1 when unchanged
+static long LE_CREDITS_BEFORE = -1;
+static long LE_MPS_BEFORE = -1;
+
+/**
+ * Turn on kernel software timestamps for the packets of a socket. Received
+ * packets carry theirs as a control message, the timestamps of sent packets
+ * are queued on the error queue with the number of the packet.
+ *
+ * @param s The socket.
+ * @param tx Whether to timestamp sent packets too.
+ * @return 0 on success, -1 on failure.
+ */
+int enable_timestamps(int s, int tx) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    if (tx)
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                 SOF_TIMESTAMPING_OPT_TSONLY;
+
+    return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * Request MTUs for a socket that is not yet connected. BR/EDR channels take
+ * both through L2CAP_OPTIONS, sockets that reject it only accept the
+ * receive MTU since the send MTU is decided by the peer.
+ *
+ * @param s The socket.
+ * @param imtu The incoming MTU to request, 0 to keep the default.
+ * @param omtu The outgoing MTU to request, 0 to keep the default.
+ * @return 0 on success, -1 on failure.
+ */
+int set_socket_mtu(int s, uint16_t imtu, uint16_t omtu) {
+    struct l2cap_options opts = {0};
+    socklen_t optlen = sizeof(opts);
+
+    if (imtu == 0 && omtu == 0)
+        return 0;
+
+    if (getsockopt(s, SOL_L2CAP, L2CAP_OPTIONS, &opts, &optlen) == 0) {
+        if (imtu > 0)
+            opts.imtu = imtu;
+        if (omtu > 0)
+            opts.omtu = omtu;
+        return setsockopt(s, SOL_L2CAP, L2CAP_OPTIONS, &opts, sizeof(opts));
+    }
+
+    if (imtu > 0)
+        return setsockopt(s, SOL_BLUETOOTH, BT_RCVMTU, &imtu, sizeof(imtu));
+
+    return 0;
+}
+
+/**
+ * Select the BR/EDR channel mode of a socket that is not yet connected. It
+ * goes through L2CAP_OPTIONS, since the kernel only takes BT_MODE when
+ * enhanced credit based flow control is enabled.
+ *
+ * @param s The socket.
+ * @return 0 on success, -1 on failure.
+ */
+int set_channel_mode(int s) {
+    struct l2cap_options opts = {0};
+    socklen_t optlen = sizeof(opts);
+
+    if (getsockopt(s, SOL_L2CAP, L2CAP_OPTIONS, &opts, &optlen) < 0)
+        return -1;
+
+    opts.mode = CHANNEL_MODE;
+    if (TX_WINDOW > 0)
+        opts.txwin_size = TX_WINDOW;
+    if (MAX_TRANSMIT > 0)
+        opts.max_tx = MAX_TRANSMIT;
+
+    return setsockopt(s, SOL_L2CAP, L2CAP_OPTIONS, &opts, sizeof(opts));
+}
+
+/**
+ * Get the name of an L2CAP channel mode.
+ *
+ * @param mode The mode.
+ * @return The name.
+ */
+static const char *channel_mode_name(uint8_t mode) {
+    switch (mode) {
+        case L2CAP_MODE_BASIC:
+            return "basic";
+        case L2CAP_MODE_ERTM:
+            return "ERTM";
+        case L2CAP_MODE_STREAMING:
+            return "streaming";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Print the channel mode a connected BR/EDR socket ended up with, the peer
+ * can turn down ERTM and streaming mode.
+ *
+ * @param prefix Printed before the mode.
+ * @param s The connected socket.
+ */
+void print_channel_mode(const char *prefix, int s) {
+    struct l2cap_options opts = {0};
+    socklen_t optlen = sizeof(opts);
+
+    if (getsockopt(s, SOL_L2CAP, L2CAP_OPTIONS, &opts, &optlen) < 0)
+        return;
+
+    if (opts.mode == L2CAP_MODE_ERTM)
+        printf("%sL2CAP mode: ERTM, tx window %u, max transmit %u\n",
+               prefix, opts.txwin_size, opts.max_tx);
+    else
+        printf("%sL2CAP mode: %s\n", prefix, channel_mode_name(opts.mode));
+}
+
+/**
+ * Write a value to a kernel knob.
+ *
+ * @param path The path to the knob.
+ * @param value The value to write.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_knob(const char *path, long value) {
+    FILE *file = fopen(path, "w");
+    int result;
+
+    if (file == NULL)
+        return -1;
+
+    result = fprintf(file, "%ld\n", value) < 0 ? -1 : 0;
+    if (fclose(file) != 0)
+        result = -1;
+
+    return result;
+}
+
+/**
+ * Read a value from a kernel knob.
+ *
+ * @param path The path to the knob.
+ * @return The value, or -1 if it could not be read.
+ */
+static long read_knob(const char *path) {
+    FILE *file = fopen(path, "r");
+    long value = -1;
+
+    if (file == NULL)
+        return -1;
+
+    if (fscanf(file, "%ld", &value) != 1)
+        value = -1;
+    fclose(file);
+
+    return value;
+}
+
+/**
+ * Configure LE credit based flow control for channels created from now on.
+ * The kernel takes the initial credits and the MPS from global knobs, a
+ * value of 0 keeps the current setting.
+ *
+ * @param credits The maximum number of credits to give the peer.
+ * @param mps The maximum PDU payload size.
+ * @return 0 on success, -1 on failure.
+ */
+int set_le_flow_control(long credits, long mps) {
+    if (credits > 0) {
+        LE_CREDITS_BEFORE = read_knob(DEBUGFS_LE_MAX_CREDITS);
+        if (write_knob(DEBUGFS_LE_MAX_CREDITS, credits) < 0) {
+            perror("Error setting LE credits (" DEBUGFS_LE_MAX_CREDITS ")");
+            return -1;
+        }
+    }
+
+    if (mps > 0) {
+        LE_MPS_BEFORE = read_knob(DEBUGFS_LE_DEFAULT_MPS);
+        if (write_knob(DEBUGFS_LE_DEFAULT_MPS, mps) < 0) {
+            perror("Error setting LE MPS (" DEBUGFS_LE_DEFAULT_MPS ")");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Put back the LE flow control knobs set_le_flow_control() changed. They
+ * apply to every LE channel of the host, not only to the program's.
+ */
+void restore_le_flow_control() {
+    if (LE_CREDITS_BEFORE >= 0 &&
+        write_knob(DEBUGFS_LE_MAX_CREDITS, LE_CREDITS_BEFORE) < 0)
+        perror("Error restoring LE credits (" DEBUGFS_LE_MAX_CREDITS ")");
+
+    if (LE_MPS_BEFORE >= 0 &&
+        write_knob(DEBUGFS_LE_DEFAULT_MPS, LE_MPS_BEFORE) < 0)
+        perror("Error restoring LE MPS (" DEBUGFS_LE_DEFAULT_MPS ")");
+
+    LE_CREDITS_BEFORE = -1;
+    LE_MPS_BEFORE = -1;
+}
+
+/**
+ * Select LE credit based flow control for a bound LE socket. Kernels that
+ * only accept BT_MODE with enhanced credit based flow control enabled reject
+ * the option, but they already use LE flow control for LE addresses.
+ *
+ * @param s The socket.
+ * @return 0 on success, -1 on failure.
+ */
+int set_le_flowctl_mode(int s) {
+    uint8_t mode = BT_MODE_LE_FLOWCTL;
+
+    if (setsockopt(s, SOL_BLUETOOTH, BT_MODE, &mode, sizeof(mode)) == 0)
+        return 0;
+
+    return errno == ENOPROTOOPT ? 0 : -1;
+}
+
+/**
+ * Print the LE flow control settings in effect, when the kernel exposes
+ * them.
+ */
+void print_le_flow_control() {
+    long credits = read_knob(DEBUGFS_LE_MAX_CREDITS);
+    long mps = read_knob(DEBUGFS_LE_DEFAULT_MPS);
+
+    if (credits < 0 || mps < 0)
+        return;
+
+    printf("LE flow control: max %ld credits, MPS %ld bytes\n", credits, mps);
+}
+
+/**
+ * Set up a connection for a connected socket: read the MTUs negotiated for
+ * it, allocate the receive ring from them and give it the engine selected
+ * with --engine.
+ *
+ * @param conn The connection, with the socket set.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_setup(struct connection *conn) {
+    struct l2cap_options opts = {0};
+    socklen_t optlen = sizeof(opts);
+    uint16_t mtu;
+
+    if (getsockopt(conn->socket, SOL_L2CAP, L2CAP_OPTIONS, &opts,
+                   &optlen) == 0) {
+        conn->imtu = opts.imtu;
+        conn->omtu = opts.omtu;
+    }
+    else {
+        optlen = sizeof(mtu);
+        if (getsockopt(conn->socket, SOL_BLUETOOTH, BT_RCVMTU, &mtu,
+                       &optlen) < 0)
+            return -1;
+        conn->imtu = mtu;
+
+        optlen = sizeof(mtu);
+        if (getsockopt(conn->socket, SOL_BLUETOOTH, BT_SNDMTU, &mtu,
+                       &optlen) < 0)
+            return -1;
+        conn->omtu = mtu;
+    }
+
+    conn->engine = ENGINE;
+    conn->receive_fd = conn->socket;
+
+    if (receive_ring_init(&conn->ring, RECV_BATCH, conn->imtu) < 0)
+        return -1;
+
+    if (conn->engine->open != NULL && conn->engine->open(conn) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Release the receive ring and the engine state of a connection, after a
+ * failed connection_setup() too. The socket is left to the caller.
+ *
+ * @param conn The connection.
+ */
+void connection_free(struct connection *conn) {
+    if (conn->engine != NULL && conn->engine->close != NULL)
+        conn->engine->close(conn);
+    receive_ring_free(&conn->ring);
+}
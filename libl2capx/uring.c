@@ -0,0 +1,679 @@
+/**
+ * The io_uring engine of libl2capx. A multishot receive stays queued on the
+ * socket and the kernel fills a ring of registered buffers as packets
+ * arrive, so taking a batch of packets costs no system call. Sends are
+ * submitted as a chain of linked sendmsg() requests, one io_uring_enter()
+ * per queue. Each direction has its own ring, so the client's receiver and
+ * sender threads never share one.
+ *
+ * Kernels and headers without multishot receives (before Linux 6.0) get
+ * ENGINE_BATCH instead, which waits for the socket in poll() or epoll.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "l2capx.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define URING_SUPPORTED 1
+#endif
+
+#ifdef URING_SUPPORTED
+
+// Entries of the send ring, longer queues are submitted in parts
+#define URING_SEND_ENTRIES 256
+
+// Entries of the receive ring, it only ever holds the multishot receive
+// and its cancellation
+#define URING_RECV_ENTRIES 4
+
+// Buffer group of the receive buffers, and the request tags
+#define URING_BUFFER_GROUP 0
+#define URING_TAG_RECV 1
+#define URING_TAG_CANCEL 2
+
+/**
+ * Submission and completion queues of an io_uring, mapped from the kernel.
+ * Only one thread uses a ring, it owns the SQ tail and the CQ head.
+ */
+struct uring {
+    int fd;
+    unsigned int entries;
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *map;
+    size_t map_size;
+    size_t sqes_size;
+};
+
+/**
+ * Engine state of a connection. The buffers delivered to the consumer are
+ * held until the next receive, like the slots of a receive ring.
+ */
+struct uring_state {
+    struct uring rx;
+    struct uring tx;
+    struct io_uring_buf_ring *buffers;
+    size_t buffers_size;
+    char **blocks;
+    unsigned int buffer_count;
+    uint16_t buffer_tail;
+    uint16_t *held;
+    unsigned int held_count;
+    int armed;
+    int error;
+};
+
+/**
+ * Set up an io_uring and map its queues.
+ *
+ * @param ring The ring.
+ * @param entries The number of submission queue entries.
+ * @param cq_entries The number of completion queue entries, 0 for the
+ * kernel default of twice the submission queue.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_init(struct uring *ring, unsigned int entries,
+                      unsigned int cq_entries) {
+    struct io_uring_params params = { 0 };
+    size_t sq_size, cq_size;
+    char *map;
+
+    if (cq_entries > 0) {
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // Both queues in one mapping, since Linux 5.4
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(map, ring->map_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->map = map;
+    ring->entries = params.sq_entries;
+    ring->sq_head = (atomic_uint *)(map + params.sq_off.head);
+    ring->sq_tail = (atomic_uint *)(map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(map + params.sq_off.array);
+    ring->cq_head = (atomic_uint *)(map + params.cq_off.head);
+    ring->cq_tail = (atomic_uint *)(map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Unmap the queues of an io_uring and close it.
+ * @param ring The ring.
+ */
+static void uring_free(struct uring *ring) {
+    if (ring->map == NULL)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->map, ring->map_size);
+    close(ring->fd);
+    ring->map = NULL;
+}
+
+/**
+ * Get the next free submission queue entry, cleared. It is submitted with
+ * the next uring_enter().
+ *
+ * @param ring The ring.
+ * @return The entry, NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned int tail = atomic_load_explicit(ring->sq_tail,
+                                             memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(ring->sq_head,
+                                             memory_order_acquire);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= ring->entries)
+        return NULL;
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+    return sqe;
+}
+
+/**
+ * Take back the newest submission queue entries, the kernel did not take
+ * them. Without SQPOLL it only reads the tail in uring_enter().
+ *
+ * @param ring The ring.
+ * @param count The number of entries.
+ */
+static void uring_unqueue(struct uring *ring, unsigned int count) {
+    atomic_fetch_sub_explicit(ring->sq_tail, count, memory_order_release);
+}
+
+/**
+ * Submit the new submission queue entries and wait for completions.
+ *
+ * @param ring The ring.
+ * @param submit The number of new entries.
+ * @param wait The number of completions to wait for.
+ * @return The number of entries submitted or -1 on failure.
+ */
+static int uring_enter(struct uring *ring, unsigned int submit,
+                       unsigned int wait) {
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                   wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * Get the oldest completion of a ring without waiting.
+ *
+ * @param ring The ring.
+ * @return The completion, NULL if there is none.
+ */
+static struct io_uring_cqe *uring_peek(struct uring *ring) {
+    unsigned int head = atomic_load_explicit(ring->cq_head,
+                                             memory_order_relaxed);
+
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * Hand the oldest completion of a ring back to the kernel.
+ * @param ring The ring.
+ */
+static void uring_advance(struct uring *ring) {
+    atomic_fetch_add_explicit(ring->cq_head, 1, memory_order_release);
+}
+
+/**
+ * Check whether the kernel has multishot receives. They came with Linux
+ * 6.0, as did IORING_OP_SEND_ZC, which the kernel reports in its probe.
+ *
+ * @param ring A ring.
+ * @return 1 if it has, 0 if not.
+ */
+static int uring_has_multishot(struct uring *ring) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (probe == NULL)
+        return 0;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) == 0 &&
+        probe->last_op >= IORING_OP_SEND_ZC)
+        supported = probe->ops[IORING_OP_SEND_ZC].flags &
+                    IO_URING_OP_SUPPORTED;
+
+    free(probe);
+    return supported != 0;
+}
+
+/**
+ * Give a receive buffer to the kernel, visible to it once the tail is
+ * published.
+ *
+ * @param state The engine state.
+ * @param id The buffer.
+ * @param size The size of the buffer.
+ */
+static void uring_buffer_add(struct uring_state *state, uint16_t id,
+                             size_t size) {
+    struct io_uring_buf *buf;
+
+    buf = &state->buffers->bufs[state->buffer_tail &
+                                (state->buffer_count - 1)];
+    buf->addr = (uintptr_t)state->blocks[id];
+    buf->len = size;
+    buf->bid = id;
+    state->buffer_tail++;
+}
+
+/**
+ * Publish the receive buffers added since the last call to the kernel.
+ * @param state The engine state.
+ */
+static void uring_buffer_publish(struct uring_state *state) {
+    atomic_store_explicit((_Atomic uint16_t *)&state->buffers->tail,
+                          state->buffer_tail, memory_order_release);
+}
+
+/**
+ * Register the receive buffers of a connection with its receive ring. Every
+ * buffer has the size of a receive ring slot, with room for a terminating
+ * null after the packet.
+ *
+ * @param conn The connection.
+ * @param state The engine state.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_buffers_init(struct connection *conn,
+                              struct uring_state *state) {
+    struct io_uring_buf_reg reg = { 0 };
+    unsigned int index;
+
+    // A power of two, so the kernel keeps receiving during a batch
+    state->buffer_count = 1;
+    while (state->buffer_count < 2 * conn->ring.count)
+        state->buffer_count <<= 1;
+
+    state->buffers_size = state->buffer_count * sizeof(struct io_uring_buf);
+    state->buffers = mmap(NULL, state->buffers_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state->buffers == MAP_FAILED) {
+        state->buffers = NULL;
+        return -1;
+    }
+
+    state->blocks = calloc(state->buffer_count, sizeof(*state->blocks));
+    state->held = calloc(conn->ring.count, sizeof(*state->held));
+    if (state->blocks == NULL || state->held == NULL)
+        return -1;
+
+    for (index = 0; index < state->buffer_count; index++) {
+        state->blocks[index] = pool_get(&BUFFER_POOL, conn->ring.slot_size);
+        if (state->blocks[index] == NULL)
+            return -1;
+    }
+
+    reg.ring_addr = (uintptr_t)state->buffers;
+    reg.ring_entries = state->buffer_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, state->rx.fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (index = 0; index < state->buffer_count; index++)
+        uring_buffer_add(state, index, conn->ring.slot_size);
+    uring_buffer_publish(state);
+
+    return 0;
+}
+
+/**
+ * Queue the multishot receive on the socket of a connection.
+ *
+ * @param conn The connection.
+ * @param state The engine state.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_arm(struct connection *conn, struct uring_state *state) {
+    struct io_uring_sqe *sqe = uring_sqe(&state->rx);
+
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->len = 0;
+    sqe->user_data = URING_TAG_RECV;
+
+    if (uring_enter(&state->rx, 1, 0) < 0)
+        return -1;
+
+    state->armed = 1;
+    return 0;
+}
+
+/**
+ * Cancel the multishot receive and wait until the kernel no longer writes to
+ * the receive buffers.
+ *
+ * @param state The engine state.
+ */
+static void uring_disarm(struct uring_state *state) {
+    struct io_uring_sqe *sqe = uring_sqe(&state->rx);
+    struct io_uring_cqe *cqe;
+    int cancelled = 0;
+
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_TAG_RECV;
+    sqe->user_data = URING_TAG_CANCEL;
+    if (uring_enter(&state->rx, 1, 0) < 0)
+        return;
+
+    while (state->armed || !cancelled) {
+        cqe = uring_peek(&state->rx);
+        if (cqe == NULL) {
+            if (uring_enter(&state->rx, 0, 1) < 0 && errno != EINTR)
+                return;
+            continue;
+        }
+
+        if (cqe->user_data == URING_TAG_CANCEL)
+            cancelled = 1;
+        else if (!(cqe->flags & IORING_CQE_F_MORE))
+            state->armed = 0;
+        uring_advance(&state->rx);
+    }
+}
+
+/**
+ * Release the io_uring engine state of a connection.
+ * @param conn The connection.
+ */
+static void uring_close(struct connection *conn) {
+    struct uring_state *state = conn->state;
+    unsigned int index;
+
+    if (state == NULL)
+        return;
+
+    if (state->armed)
+        uring_disarm(state);
+
+    uring_free(&state->tx);
+    uring_free(&state->rx);
+    if (state->buffers != NULL)
+        munmap(state->buffers, state->buffers_size);
+    for (index = 0; state->blocks != NULL && index < state->buffer_count;
+         index++)
+        pool_put(&BUFFER_POOL, state->blocks[index]);
+    free(state->blocks);
+    free(state->held);
+    free(state);
+    conn->state = NULL;
+}
+
+/**
+ * Set up the rings and receive buffers of a connection. When the kernel
+ * lacks what the engine needs, the connection gets ENGINE_BATCH instead.
+ *
+ * @param conn The connection, with the receive ring set up.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_open(struct connection *conn) {
+    static int warned = 0;
+    struct uring_state *state = calloc(1, sizeof(*state));
+    int status;
+
+    if (state == NULL)
+        return -1;
+    conn->state = state;
+
+    status = uring_init(&state->rx, URING_RECV_ENTRIES,
+                        4 * conn->ring.count);
+    if (status == 0 && !uring_has_multishot(&state->rx)) {
+        errno = ENOSYS;
+        status = -1;
+    }
+    if (status == 0)
+        status = uring_buffers_init(conn, state);
+    if (status == 0)
+        status = uring_init(&state->tx, URING_SEND_ENTRIES, 0);
+
+    // Armed right away, the ring only becomes readable once it receives
+    if (status == 0)
+        status = uring_arm(conn, state);
+
+    if (status < 0) {
+        if (!warned)
+            fprintf(stderr, "io_uring engine not available (%s), using "
+                    "the %s engine\n", strerror(errno), ENGINE_BATCH.name);
+        warned = 1;
+
+        uring_close(conn);
+        conn->engine = &ENGINE_BATCH;
+        return 0;
+    }
+
+    conn->receive_fd = state->rx.fd;
+    return 0;
+}
+
+/**
+ * Take the packets the multishot receive has completed, up to the size of
+ * the receive ring, and pass them to a consumer. The buffers of the previous
+ * batch go back to the kernel first.
+ *
+ * @param conn The connection.
+ * @param callback The consumer of the batch.
+ * @param ctx The argument for the consumer.
+ * @return The number of packets received, 0 if the connection was closed or
+ * -1 on failure, errno is EAGAIN when nothing was completed.
+ */
+static long uring_receive(struct connection *conn, receive_callback callback,
+                          void *ctx) {
+    struct uring_state *state = conn->state;
+    struct receive_ring *ring = &conn->ring;
+    struct io_uring_cqe *cqe;
+    unsigned int received = 0, index;
+    int ended = 0;
+    uint16_t id;
+
+    for (index = 0; index < state->held_count; index++)
+        uring_buffer_add(state, state->held[index], ring->slot_size);
+    if (state->held_count > 0)
+        uring_buffer_publish(state);
+    state->held_count = 0;
+
+    while (received < ring->count && (cqe = uring_peek(&state->rx)) != NULL) {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            state->armed = 0;
+
+        if (cqe->res >= 0) {
+            ring->msgs[received].msg_len = cqe->res;
+            ring->msgs[received].msg_hdr.msg_controllen = 0;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ring->iovs[received].iov_base = state->blocks[id];
+                state->held[state->held_count++] = id;
+            }
+            received++;
+        }
+        else if (cqe->res == -ENOBUFS) {
+            // Every buffer was taken, the receive is queued again below
+            uring_advance(&state->rx);
+            continue;
+        }
+        else {
+            state->error = -cqe->res;
+        }
+
+        uring_advance(&state->rx);
+
+        // Nothing follows the end of the connection or an error
+        if (cqe->res <= 0) {
+            ended = 1;
+            break;
+        }
+    }
+
+    // Ended early, start again, or the ring never becomes readable again
+    if (!state->armed && !ended && state->error == 0 &&
+        uring_arm(conn, state) < 0)
+        return -1;
+
+    if (received == 0) {
+        errno = state->error != 0 ? state->error : EAGAIN;
+        return -1;
+    }
+
+    return receive_deliver(ring, received, callback, ctx);
+}
+
+/**
+ * Submit the queued packets as a chain of linked sendmsg() requests and
+ * remove the packets the socket took from the queue. The requests do not
+ * wait for the socket, a full socket fails the request with EAGAIN and
+ * cancels the rest of the chain, so the packets are sent in order.
+ *
+ * @param conn The connection.
+ * @param queue The queue.
+ * @param bytes Set to the number of bytes sent.
+ * @return The number of packets sent, 0 if the socket or the ring is full
+ * or -1 on failure. Until the next call queue->msgs[n].msg_len holds the
+ * size of sent packet n.
+ */
+static long uring_submit(struct connection *conn, struct send_queue *queue,
+                         unsigned long long *bytes) {
+    struct uring_state *state = conn->state;
+    struct uring *tx = &state->tx;
+    struct io_uring_sqe *sqe, *last = NULL;
+    struct io_uring_cqe *cqe;
+    unsigned int count, index, submitted = 0, done = 0, sent = 0;
+    int error = 0, ret;
+
+    *bytes = 0;
+
+    count = queue->count < tx->entries ? queue->count : tx->entries;
+    if (count == 0)
+        return 0;
+
+    for (index = 0; index < count; index++) {
+        // A full submission queue ends the chain early
+        sqe = uring_sqe(tx);
+        if (sqe == NULL)
+            break;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->socket;
+        sqe->addr = (uintptr_t)&queue->msgs[index].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = index;
+        sqe->flags = IOSQE_IO_LINK;
+        last = sqe;
+    }
+
+    // A full ring is back-pressure like a full socket
+    if (last == NULL) {
+        errno = EBUSY;
+        return 0;
+    }
+    last->flags = 0;
+    count = index;
+
+    // Every request completes without waiting for the socket. Requests the
+    // kernel did not take yet are submitted again while waiting.
+    while (done < count) {
+        cqe = uring_peek(tx);
+        if (cqe == NULL) {
+            ret = uring_enter(tx, count - submitted, count - done);
+            if (ret >= 0) {
+                submitted += ret;
+            }
+            else if (errno != EINTR && submitted < count) {
+                // Busy completion queue, the rest stays in the send queue
+                // for the next call
+                uring_unqueue(tx, count - submitted);
+                count = submitted;
+                if (error == 0)
+                    error = errno;
+            }
+            else if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (cqe->res >= 0) {
+            queue->msgs[cqe->user_data].msg_len = cqe->res;
+            *bytes += cqe->res;
+            sent++;
+        }
+        else if (error == 0 && cqe->res != -ECANCELED) {
+            error = -cqe->res;
+        }
+
+        uring_advance(tx);
+        done++;
+    }
+
+    if (sent == 0) {
+        errno = error;
+        return error == EAGAIN || error == EWOULDBLOCK || error == EINTR ||
+               error == EBUSY ? 0 : -1;
+    }
+
+    send_queue_shift(queue, sent);
+
+    return sent;
+}
+
+const struct engine ENGINE_URING = { "uring", uring_receive, uring_submit,
+                                     uring_open, uring_close };
+
+#else
+
+/**
+ * Give the connection ENGINE_BATCH, these headers have no multishot
+ * receives.
+ *
+ * @param conn The connection.
+ * @return 0
+ */
+static int uring_open(struct connection *conn) {
+    static int warned = 0;
+
+    if (!warned)
+        fprintf(stderr, "io_uring engine not built in, using the %s "
+                "engine\n", ENGINE_BATCH.name);
+    warned = 1;
+
+    conn->engine = &ENGINE_BATCH;
+    return 0;
+}
+
+const struct engine ENGINE_URING = { "uring", NULL, NULL, uring_open, NULL };
+
+#endif
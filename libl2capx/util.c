@@ -0,0 +1,230 @@
+/**
+ * Clocks, CRC-32, the quit flag and the option parsing helpers of
+ * libl2capx.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "l2capx.h"
+
+// Quit flag, see l2capx.h
+atomic_int FLAG_QUIT = 0;
+int QUIT_EVENT_FD = -1;
+
+/**
+ * Get the current time from the monotonic clock.
+ * @return The time in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Get the current time from the realtime clock, the clock of the kernel
+ * timestamps.
+ * @return The time in nanoseconds.
+ */
+uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Get the CPU time the process has used so far, all threads together.
+ * @return The time in nanoseconds.
+ */
+uint64_t cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Print the CPU time a benchmark used and what it cost per MB moved, to
+ * compare the engines.
+ *
+ * @param prefix The start of the line.
+ * @param engine The engine of the connection.
+ * @param cpu The CPU time of the whole process in nanoseconds.
+ * @param bytes The bytes moved.
+ */
+void print_cpu_usage(const char *prefix, const struct engine *engine,
+                     uint64_t cpu, unsigned long long bytes) {
+    printf("%scpu: %.3f s with the %s engine, %.3f ms per MB\n", prefix,
+           cpu / 1e9, engine->name, bytes > 0 ? cpu / 1e6 / (bytes / 1e6) : 0);
+}
+
+/**
+ * Compute the CRC-32 of a buffer, the same as zlib's crc32(). The table is
+ * built on the first call, only one thread computes checksums.
+ *
+ * @param data The buffer.
+ * @param len The size of the buffer.
+ * @return The CRC.
+ */
+uint32_t crc32(const void *data, size_t len) {
+    static uint32_t table[256];
+    const unsigned char *bytes = data;
+    uint32_t crc = 0xffffffff, value;
+    int index, bit;
+
+    if (table[1] == 0) {
+        for (index = 0; index < 256; index++) {
+            value = index;
+            for (bit = 0; bit < 8; bit++)
+                value = (value >> 1) ^ (value & 1 ? 0xedb88320 : 0);
+            table[index] = value;
+        }
+    }
+
+    while (len-- > 0)
+        crc = (crc >> 8) ^ table[(crc ^ *bytes++) & 0xff];
+
+    return crc ^ 0xffffffff;
+}
+
+/**
+ * Get status of global quit flag.
+ * @return THe status of the quit flag.
+ */
+int get_flag_quit() {
+    return atomic_load_explicit(&FLAG_QUIT, memory_order_acquire) == 1;
+}
+
+/**
+ * Set status of global quit flag. Setting it wakes everything that waits on
+ * QUIT_EVENT_FD, so it is also safe to call from a signal handler.
+ */
+void set_flag_quit(int status) {
+    uint64_t wake = 1;
+    ssize_t result;
+
+    atomic_store_explicit(&FLAG_QUIT, status, memory_order_release);
+
+    if (status && QUIT_EVENT_FD >= 0) {
+        // Only fails when the counter is full, it is readable then anyway
+        result = write(QUIT_EVENT_FD, &wake, sizeof(wake));
+        (void)result;
+    }
+}
+
+/**
+ * Handler for interrupt signals to shut down the program in a controlled
+ * manner.
+ *
+ * @param sig The signal number.
+ */
+void handler_signal_interrupt(int sig) {
+    (void)sig;
+    set_flag_quit(1);
+}
+
+/**
+ * Parse a non-negative number from a command line argument, exit with usage
+ * information if it is not a valid number.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @return The parsed number.
+ */
+long long parse_number(const char *program, const char *arg) {
+    char *end = NULL;
+    long long value = strtoll(arg, &end, 0);
+
+    if (end == arg || *end != '\0' || value < 0) {
+        fprintf(stderr, "invalid number: %s\n", arg);
+        print_usage(program);
+        exit(2);
+    }
+
+    return value;
+}
+
+/**
+ * Parse a non-negative number of milliseconds, which may have a fraction,
+ * from a command line argument. Exit with usage information if it is not a
+ * valid number.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @return The parsed number of milliseconds.
+ */
+double parse_milliseconds(const char *program, const char *arg) {
+    char *end = NULL;
+    double value = strtod(arg, &end);
+
+    if (end == arg || *end != '\0' || !(value >= 0)) {
+        fprintf(stderr, "invalid number: %s\n", arg);
+        print_usage(program);
+        exit(2);
+    }
+
+    return value;
+}
+
+/**
+ * Parse an LE PHY from a command line argument, exit with usage information
+ * if it is not a known PHY.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @return The PHY.
+ */
+int parse_phy(const char *program, const char *arg) {
+    if (strcmp(arg, "1m") == 0)
+        return LE_PHY_1M;
+    if (strcmp(arg, "2m") == 0)
+        return LE_PHY_2M;
+    if (strcmp(arg, "coded") == 0)
+        return LE_PHY_CODED;
+
+    fprintf(stderr, "invalid PHY: %s\n", arg);
+    print_usage(program);
+    exit(2);
+}
+
+/**
+ * Parse a BR/EDR channel mode from a command line argument, exit with usage
+ * information if it is not a known mode.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @return The mode.
+ */
+int parse_channel_mode(const char *program, const char *arg) {
+    if (strcmp(arg, "basic") == 0)
+        return L2CAP_MODE_BASIC;
+    if (strcmp(arg, "ertm") == 0)
+        return L2CAP_MODE_ERTM;
+    if (strcmp(arg, "streaming") == 0)
+        return L2CAP_MODE_STREAMING;
+
+    fprintf(stderr, "invalid mode: %s\n", arg);
+    print_usage(program);
+    exit(2);
+}
+
+/**
+ * Parse an engine name.
+ *
+ * @param program The name of the program.
+ * @param arg The argument to parse.
+ * @return The engine.
+ */
+const struct engine *parse_engine(const char *program, const char *arg) {
+    int index;
+
+    for (index = 0; ENGINES[index] != NULL; index++)
+        if (strcmp(arg, ENGINES[index]->name) == 0)
+            return ENGINES[index];
+
+    fprintf(stderr, "invalid engine: %s\n", arg);
+    print_usage(program);
+    exit(2);
+}
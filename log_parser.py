@@ -1,7 +1,16 @@
+import functools
+import heapq
+import multiprocessing
 import os
 import sys
 import re
-from typing import List, Tuple
+import tempfile
+from datetime import datetime
+from typing import IO, Iterable, Iterator, List, Tuple, Union
+
+from l2cap_capture import CAPTURE_MAGIC, RECORD_CONNECT, \
+    RECORD_DISCONNECT, read_capture
+from rssi_shm import SAMPLE_CONNECTION, SHM_MAGIC, read_ring_file
 
 # ------ [ Constants ] --------------------------------------------------------
 
@@ -33,6 +42,43 @@ RE_SECT_ANON_STOP: str = r"^//stop$"
 RE_SECT_MEASUREMENT: str = RE_TIMED_MESSAGE + r"([^(]+) \((" + RE_BT_ADDR + \
                            r")\): (-?\d+) dBm"
 
+# Compiled once, a log has millions of lines
+PATTERN_CONNECTION_MONITOR_START: re.Pattern = \
+    re.compile(RE_CONNECTION_MONITOR_START)
+PATTERN_CONNECTION_MONITOR_END: re.Pattern = \
+    re.compile(RE_CONNECTION_MONITOR_END)
+PATTERN_SECT_NAMED_FROM_TO: re.Pattern = re.compile(RE_SECT_NAMED_FROM_TO)
+PATTERN_SECT_ANON_FROM_TO: re.Pattern = re.compile(RE_SECT_ANON_FROM_TO)
+PATTERN_SECT_ANON_FROM_TO_SHORT: re.Pattern = \
+    re.compile(RE_SECT_ANON_FROM_TO_SHORT)
+PATTERN_SECT_NEGATIVE_FROM: re.Pattern = re.compile(RE_SECT_NEGATIVE_FROM)
+PATTERN_SECT_NAMED_STOP: re.Pattern = re.compile(RE_SECT_NAMED_STOP)
+PATTERN_SECT_ANON_STOP: re.Pattern = re.compile(RE_SECT_ANON_STOP)
+PATTERN_SECT_MEASUREMENT: re.Pattern = re.compile(RE_SECT_MEASUREMENT)
+
+# Text every line of the patterns above contains, checked before the regex
+TEXT_CONNECTION_MONITOR_START: str = "Connected to device(s)!"
+TEXT_CONNECTION_MONITOR_END: str = "No connected devices..."
+TEXT_SECT_MARKER: str = "//"
+TEXT_MEASUREMENT: str = " dBm"
+
+LOCALTIME_FORMAT: str = "%Y-%m-%d %H:%M:%S"
+
+MEASUREMENTS_HEADER: Tuple[str, ...] = \
+    ("Localtime", "From", "To", "Bluetooth Address", "dBm")
+
+# Columns added when a capture file or an RSSI ring is among the inputs
+EVENTS_HEADER: Tuple[str, ...] = \
+    MEASUREMENTS_HEADER + ("Event", "Packet", "Bytes")
+
+# Events of the records of a capture file, by record type
+CAPTURE_EVENTS: Tuple[str, ...] = \
+    ("received", "sent", "connect", "disconnect", "send timestamp")
+
+FORMAT_TEXT: str = "text"
+FORMAT_CAPTURE: str = "capture"
+FORMAT_RSSI_RING: str = "rssi ring"
+
 
 # ------ [ Helper Methods ] ---------------------------------------------------
 
@@ -42,157 +88,296 @@ def print_program_usage() -> None:
 
     :return: Nothing
     """
-    print("usage: python3 log_parser.py <log_file_path> "
+    print("usage: python3 log_parser.py [--jobs <workers>] <log_file_path> "
           "[<log_file_path2> ...]")
 
 
+def get_file_format(file_path: str) -> str:
+    """Get the format of an input from its first bytes.
+
+    :param file_path: The path to the file.
+    :return: FORMAT_CAPTURE, FORMAT_RSSI_RING or FORMAT_TEXT.
+    """
+    with open(file_path, "rb") as file:
+        magic = file.read(8)
+
+    if magic == CAPTURE_MAGIC:
+        return FORMAT_CAPTURE
+    if magic == SHM_MAGIC:
+        return FORMAT_RSSI_RING
+    return FORMAT_TEXT
+
+
+def format_localtime(timestamp: float) -> str:
+    """Format a wall clock time like the timestamps of the log, with the
+    microseconds the binary formats have.
+
+    :param timestamp: Seconds since the epoch.
+    :return: The local time.
+    """
+    return datetime.fromtimestamp(timestamp).strftime(
+        LOCALTIME_FORMAT + ".%f")
+
+
+@functools.lru_cache(maxsize=4096)
+def parse_localtime(localtime: str) -> float:
+    """Get the wall clock time of a timestamp of the log, a log has many
+    lines in every second.
+
+    :param localtime: The local time, to the second.
+    :return: Seconds since the epoch.
+    """
+    return datetime.strptime(localtime, LOCALTIME_FORMAT).timestamp()
+
+
+def get_sort_key(measurement_row: tuple) -> float:
+    """Get the time to merge a row by.
+
+    :param measurement_row: The row, starting with its local time.
+    :return: Seconds since the epoch.
+    """
+    localtime = measurement_row[0]
+    return parse_localtime(localtime[:19]) + float("0" + localtime[19:])
+
+
 # ------ [ Log Parsing ] ------------------------------------------------------
 
 
-def get_connection_monitoring_sections(
-        raw_log_lines: List[str]) -> List[List[str]]:
-    """Get the "connection monitoring" sections from the raw log
+def get_section_change(log_line: str) -> \
+        Tuple[bool, Union[Tuple[str, str], Tuple[None, None], None]]:
+    """Get the section a line of a "connection monitoring" section starts
+    or stops.
 
-    :param raw_log_lines: A list of lines from the raw log.
-    :return: A list of sections from the raw log.
+    :param log_line: The line.
+    :return: Whether the line is a section line, and the nodes of the new
+    section, (None, None) when it stops one, or None when the line changes
+    nothing.
     """
-    monitoring_sections = []
+    if log_line.startswith(TEXT_SECT_MARKER):
+        match = PATTERN_SECT_NAMED_FROM_TO.search(log_line)
+        if match:
+            return True, (match.group(2), match.group(3))
+
+        match = PATTERN_SECT_ANON_FROM_TO.search(log_line)
+        if match:
+            return True, (match.group(1), match.group(2))
+
+        if PATTERN_SECT_NEGATIVE_FROM.search(log_line):
+            # Ignore, syntax doesn't contain opposite node
+            return True, None
+
+        if PATTERN_SECT_NAMED_STOP.search(log_line) or \
+                PATTERN_SECT_ANON_STOP.search(log_line):
+            return True, (None, None)
+
+    elif log_line.startswith(("A", "B", "a", "b")):
+        match = PATTERN_SECT_ANON_FROM_TO_SHORT.search(log_line)
+        if match:
+            return True, (match.group(1), match.group(2))
 
-    current_section_open = False
-    current_monitoring_section = []
+    return False, None
+
+
+def get_connection_monitoring_measurements(
+        raw_log_lines: Iterable[str]) -> \
+        Iterator[Tuple[str, str, str, str, str]]:
+    """Get the measurements of the "connection monitoring" sections of a
+    log, in one pass as the lines are read. Only the state of the section
+    the parser is in is kept, so memory use does not grow with the log.
+
+    :param raw_log_lines: The lines of the raw log, e.g. an open file.
+    :return: The measurements as tuples, in the order of the log.
+    """
+    monitoring = False
+    current_section = None, None
 
     for log_line in raw_log_lines:
-        if re.search(RE_CONNECTION_MONITOR_START, log_line):
-            current_section_open = True
-        elif re.search(RE_CONNECTION_MONITOR_END, log_line):
-            if not current_section_open:
+        # Every line of the monitor starts with a timestamp
+        if log_line[:1].isdigit():
+            if TEXT_CONNECTION_MONITOR_START in log_line and \
+                    PATTERN_CONNECTION_MONITOR_START.search(log_line):
+                monitoring = True
+                continue
+
+            if TEXT_CONNECTION_MONITOR_END in log_line and \
+                    PATTERN_CONNECTION_MONITOR_END.search(log_line):
+                monitoring = False
                 continue
 
-            monitoring_sections.append(current_monitoring_section.copy())
-            current_section_open = False
-            current_monitoring_section = []
+        if not monitoring:
+            continue
 
-        elif current_section_open:
-            current_monitoring_section.append(log_line)
+        is_section_line, section = get_section_change(log_line)
+        if is_section_line:
+            if section is not None:
+                current_section = section
+            continue
 
-    if current_section_open:
-        monitoring_sections.append(current_monitoring_section.copy())
+        if current_section[0] is None or current_section[1] is None or \
+                TEXT_MEASUREMENT not in log_line:
+            continue
 
-    return monitoring_sections
+        sect_measurement = PATTERN_SECT_MEASUREMENT.search(log_line)
+        if sect_measurement:
+            yield (sect_measurement.group(1), current_section[0],
+                   current_section[1], sect_measurement.group(3),
+                   sect_measurement.group(4))
 
 
-def get_connection_monitoring_measurements(
-        monitoring_sections: List[List[str]]) -> \
-        List[Tuple[str, str, str, str, str]]:
-    """Get all measurements from the "connection monitoring" sections as
-    a list of tuples.
+def get_capture_measurements(file_path: str) -> Iterator[tuple]:
+    """Get the packets and connections of a capture file as rows.
 
-    :param monitoring_sections: The raw "connection monitoring" sections.
-    :return: The measurements for each section as a list of tuples.
+    :param file_path: The path to the capture file.
+    :return: The rows, in the order of the capture.
     """
+    for record in read_capture(file_path):
+        is_connection = record.kind in (RECORD_CONNECT, RECORD_DISCONNECT)
+        yield (format_localtime(record.timestamp), "", "",
+               record.peer or "", "",
+               CAPTURE_EVENTS[record.kind]
+               if record.kind < len(CAPTURE_EVENTS) else str(record.kind),
+               "" if is_connection else record.seq,
+               "" if is_connection else record.length)
 
-    measurements = []
-    current_section = None, None
 
-    for section_num, log_section in enumerate(monitoring_sections):
-
-        for log_line in log_section:
-            sect_named_from_to = \
-                re.search(RE_SECT_NAMED_FROM_TO, log_line)
-            sect_anonymous_from_to = \
-                re.search(RE_SECT_ANON_FROM_TO, log_line)
-            sect_anonymous_from_to_short = \
-                re.search(RE_SECT_ANON_FROM_TO_SHORT, log_line)
-            sect_named_define_negative = \
-                re.search(RE_SECT_NEGATIVE_FROM, log_line)
-
-            sect_named_stop = \
-                re.search(RE_SECT_NAMED_STOP, log_line)
-            sect_anonymous_stop = \
-                re.search(RE_SECT_ANON_STOP, log_line)
-
-            if sect_named_from_to:
-                current_section = \
-                    sect_named_from_to.group(2), \
-                    sect_named_from_to.group(3)
-
-            elif sect_anonymous_from_to:
-                current_section = \
-                    sect_anonymous_from_to.group(1), \
-                    sect_anonymous_from_to.group(2)
-
-            elif sect_anonymous_from_to_short:
-                current_section = \
-                    sect_anonymous_from_to_short.group(1), \
-                    sect_anonymous_from_to_short.group(2)
-
-            elif sect_named_define_negative:
-                # Ignore, syntax doesn't contain opposite node
-                continue
+def get_rssi_ring_measurements(file_path: str) -> Iterator[tuple]:
+    """Get the samples of a ring of rssi-sampler as rows.
 
-            elif sect_named_stop:
-                current_section = None, None
+    :param file_path: The path to the ring, or a copy of it.
+    :return: The rows, oldest first.
+    """
+    for sample in read_ring_file(file_path):
+        yield (format_localtime(sample.timestamp), "", "", sample.address,
+               sample.rssi,
+               "rssi" if sample.source == SAMPLE_CONNECTION else "adv rssi",
+               "", "")
 
-            elif sect_anonymous_stop:
-                current_section = None, None
 
-            elif current_section[0] is not None and \
-                    current_section[1] is not None:
-                sect_measurement = re.search(RE_SECT_MEASUREMENT, log_line)
-                if sect_measurement:
-                    measurement_bt_addr = sect_measurement.group(3)
-                    measurement_dbm = sect_measurement.group(4)
-                    measurements.append(
-                        (sect_measurement.group(1), current_section[0],
-                         current_section[1], measurement_bt_addr,
-                         measurement_dbm))
+def get_file_measurements(file_path: str, file_format: str,
+                          with_events: bool) -> Iterator[tuple]:
+    """Get the rows of any input.
 
-    return measurements
+    :param file_path: The path to the file.
+    :param file_format: The format of the file.
+    :param with_events: Whether rows have the columns of EVENTS_HEADER.
+    :return: The rows, in the order of the file.
+    """
+    if file_format == FORMAT_CAPTURE:
+        yield from get_capture_measurements(file_path)
 
+    elif file_format == FORMAT_RSSI_RING:
+        yield from get_rssi_ring_measurements(file_path)
 
-# ------ [ Main Program ] -----------------------------------------------------
+    else:
+        with open(file_path) as file:
+            for measurement_row in \
+                    get_connection_monitoring_measurements(file):
+                yield measurement_row + ("rssi", "", "") if with_events \
+                    else measurement_row
 
 
-def run_parse_file(file_list: List[str]) -> None:
-    """Run program to read file.
+def write_file_measurements(job: Tuple[str, str, bool, str]) -> None:
+    """Write the rows of an input to a file as they are found, in a worker
+    process. Every line starts with the time to merge the row by.
 
-    :param file_list: The list of files to read.
+    :param job: The path, format and with_events of get_file_measurements,
+    then the path to write to.
     :return: Nothing
     """
-    measurements_header = \
-        ("Localtime", "From", "To", "Bluetooth Address", "dBm")
-    total_measurements = []
+    with open(job[3], "w") as output:
+        for measurement_row in get_file_measurements(*job[:3]):
+            output.write("%.6f," % get_sort_key(measurement_row) +
+                         ",".join(str(field) for field in measurement_row) +
+                         "\n")
 
-    for file_path in file_list:
-        with open(file_path) as file:
-            file_lines = file.readlines()
 
-        monitoring_sections = get_connection_monitoring_sections(file_lines)
-        total_measurements += \
-            get_connection_monitoring_measurements(monitoring_sections)
+def read_file_measurements(rows_file: IO[str]) -> Iterator[Tuple[float, str]]:
+    """Read the rows written by write_file_measurements().
+
+    :param rows_file: The open file.
+    :return: The times and the rows as printed.
+    """
+    for line in rows_file:
+        sort_key, _, measurement_line = line.partition(",")
+        yield float(sort_key), measurement_line
+
+
+# ------ [ Main Program ] -----------------------------------------------------
+
 
-    total_measurements.insert(0, measurements_header)
+def run_parse_file(file_list: List[str], jobs: int = 1) -> None:
+    """Run program to read file. With one job rows are printed as they are
+    found, file by file. With more the files are parsed in that many worker
+    processes and the rows of all files are printed in timestamp order. The
+    workers write their rows to temporary files, and the merge reads one
+    row of each at a time, so every input has to be in time order: the
+    monitor, the log writer of the L2CAP programs and rssi-sampler write
+    them that way.
 
-    for measurement_row in total_measurements:
-        print(f"{measurement_row[0]},{measurement_row[1]},"
-              f"{measurement_row[2]},{measurement_row[3]},"
-              f"{measurement_row[4]}")
+    :param file_list: The list of files to read.
+    :param jobs: The number of worker processes.
+    :return: Nothing
+    """
+    file_formats = [get_file_format(file_path) for file_path in file_list]
+    with_events = any(file_format != FORMAT_TEXT
+                      for file_format in file_formats)
+    print(",".join(EVENTS_HEADER if with_events else MEASUREMENTS_HEADER))
+
+    if jobs == 1:
+        for file_path, file_format in zip(file_list, file_formats):
+            for measurement_row in \
+                    get_file_measurements(file_path, file_format,
+                                          with_events):
+                print(",".join(str(field) for field in measurement_row))
+        return
+
+    with tempfile.TemporaryDirectory(prefix="log_parser-") as rows_directory:
+        rows_paths = [os.path.join(rows_directory, str(index) + ".csv")
+                      for index in range(len(file_list))]
+
+        with multiprocessing.Pool(min(jobs, len(file_list))) as pool:
+            pool.map(write_file_measurements,
+                     [(file_path, file_format, with_events, rows_path)
+                      for file_path, file_format, rows_path in
+                      zip(file_list, file_formats, rows_paths)],
+                     chunksize=1)
+
+        rows_files = [open(rows_path) for rows_path in rows_paths]
+        try:
+            for _, measurement_line in heapq.merge(
+                    *map(read_file_measurements, rows_files),
+                    key=lambda row: row[0]):
+                sys.stdout.write(measurement_line)
+        finally:
+            for rows_file in rows_files:
+                rows_file.close()
 
 
 if __name__ == '__main__':
     # Program Execution
-    if len(sys.argv) < 2:
+    file_args = sys.argv[1:]
+    parse_jobs = 1
+    if file_args[:1] in (["-j"], ["--jobs"]):
+        if len(file_args) < 2 or not file_args[1].isdigit():
+            print_program_usage()
+            sys.exit(1)
+
+        # 0 uses every core
+        parse_jobs = int(file_args[1]) or os.cpu_count() or 1
+        file_args = file_args[2:]
+
+    if len(file_args) < 1:
         print_program_usage()
         sys.exit(1)
 
     file_to_read = []
-    for file_arg in range(1, len(sys.argv)):
-        if not os.path.exists(sys.argv[file_arg]):
-            print(f"ArgFile '{sys.argv[file_arg]}' cannot be found.")
+    for file_arg in file_args:
+        if not os.path.exists(file_arg):
+            print(f"ArgFile '{file_arg}' cannot be found.")
             print_program_usage()
             sys.exit(1)
         else:
-            file_to_read.append(sys.argv[file_arg])
+            file_to_read.append(file_arg)
 
-    run_parse_file(file_to_read)
+    run_parse_file(file_to_read, parse_jobs)
 
@@ -10,8 +10,10 @@ https://www.bluetooth.com/bluetooth-resources/bluetooth-for-linux/
 """
 from typing import Dict, Callable, Union
 import argparse
+import os
 import random
 import re
+import subprocess
 import threading
 from enum import Enum, auto
 from datetime import datetime
@@ -30,6 +32,7 @@ from gi.repository import GLib
 
 from bluetooth_for_linux import bluetooth_constants, bluetooth_utils
 from bluetooth_for_linux.bluetooth_advertisement import Advertisement
+from rssi_shm import RssiRing, RssiSample
 
 # ------ [ Unique Device Information ] ----------------------------------------
 
@@ -85,6 +88,9 @@ device_find: str = "BT-ScatterNode-"
 # Connection goal
 devices_connect_to: int = 1
 
+# Seconds an RSSI sample from the sampler is used before it counts as stale
+rssi_sample_max_age: float = 3.0
+
 
 # ------ [ Constants ] --------------------------------------------------------
 
@@ -153,8 +159,13 @@ signal_scan_update: Union[SignalMatch, None] = None
 signal_adv_add: Union[SignalMatch, None] = None
 signal_adv_update: Union[SignalMatch, None] = None
 
+# RSSI sampler process (see --rssi-sampler) and its latest samples by address
+rssi_sampler: Union[subprocess.Popen, None] = None
+rssi_samples: Dict[str, RssiSample] = {}
+
 # Mutexes
 mutex_role_to_device: threading.Lock = Lock()
+mutex_rssi_samples: threading.Lock = Lock()
 
 
 # ------ [ Methods ] ----------------------------------------------------------
@@ -186,6 +197,8 @@ def handler_signal_interrupt(sig: int, frame: any) -> None:
     if len(devices_connected) > 0:
         connection_monitor_stop()
 
+    rssi_sampler_stop()
+
     current_step = ProgramStates.STEP_KILL_PROGRAM
     sys.exit(0)
 
@@ -484,8 +497,7 @@ def thread_check_seen_devices(bus: BusConnection) -> None:
                 elif devices_info[path]["seen"]:
                     continue
 
-                device_rssi: int = \
-                    get_device_property_value(bus, path, "RSSI")
+                device_rssi: int = get_device_rssi(bus, path, raw_data)
 
                 if device_rssi is not None:
                     devices_info[path]["seen"] = True
@@ -648,7 +660,7 @@ def thread_check_connected_devices(bus: BusConnection) -> None:
                     ")"
 
             rssi = "-"
-            prop_rssi = get_device_property_value(bus, path, "RSSI")
+            prop_rssi = get_device_rssi(bus, path, raw_properties)
             if prop_rssi is not None:
                 rssi = prop_rssi
 
@@ -657,6 +669,106 @@ def thread_check_connected_devices(bus: BusConnection) -> None:
         time.sleep(5)
 
 
+def thread_read_rssi_sampler(
+        process: subprocess.Popen, ring: RssiRing, rate: int) -> None:
+    """Read the RSSI sampler's shared memory ring until the sampler exits,
+    keeping the latest sample of every address.
+
+    :param process: The running RSSI sampler.
+    :param ring: The shared memory ring of the sampler.
+    :param rate: The samples per second of the sampler.
+    :return: Nothing
+    """
+    while process.poll() is None:
+        samples = ring.read()
+        if len(samples) > 0:
+            with mutex_rssi_samples:
+                for sample in samples:
+                    rssi_samples[sample.address] = sample
+
+        time.sleep(1 / rate)
+
+    ring.close()
+
+
+# ------ [ Methods - RSSI Sampler ] -------------------------------------------
+
+
+def rssi_sampler_start(sampler_path: str, rate: int) -> None:
+    """Start the RSSI sampler, it reads the RSSI from the controller
+    instead of polling BlueZ over DBus. It needs root (or CAP_NET_RAW).
+
+    :param sampler_path: The path to the rssi-sampler program.
+    :param rate: The samples per second.
+    :return: Nothing
+    """
+    global rssi_sampler
+
+    shm_name = "/rssi-sampler-" + str(os.getpid())
+    rssi_sampler = \
+        subprocess.Popen(
+            [sampler_path, "--scan", "--rate", str(rate),
+             "--shm", shm_name])
+
+    try:
+        ring = RssiRing(shm_name)
+    except (TimeoutError, ValueError):
+        rssi_sampler_stop()
+        raise
+
+    thread = Thread(target=thread_read_rssi_sampler,
+                    args=(rssi_sampler, ring, rate), daemon=True)
+    thread.start()
+    print_info_dated_msg("Start: RSSI sampler at", rate, "Hz")
+
+
+def rssi_sampler_stop() -> None:
+    """Stop the RSSI sampler if it is running.
+
+    :return: Nothing
+    """
+    global rssi_sampler
+
+    if rssi_sampler is None:
+        return
+
+    rssi_sampler.terminate()
+    try:
+        rssi_sampler.wait(timeout=2)
+    except subprocess.TimeoutExpired:
+        rssi_sampler.kill()
+
+    rssi_sampler = None
+
+
+def get_device_rssi(
+        bus: BusConnection, device_pth: str,
+        device_props: Dict[str, any]) -> Union[int, None]:
+    """Get the RSSI of a device, from the RSSI sampler when it is running,
+    otherwise from BlueZ over DBus.
+
+    :param bus: The DBus BusConnection used for communications.
+    :param device_pth: The DBus ObjectPath to the device.
+    :param device_props: The DBus properties dict for the device.
+    :return: The RSSI in dBm, None if the device has not been seen lately.
+    """
+    if rssi_sampler is None:
+        return get_device_property_value(bus, device_pth, "RSSI")
+
+    if "Address" not in device_props:
+        return None
+
+    address = \
+        bluetooth_utils.dbus_to_python(device_props["Address"]).upper()
+    with mutex_rssi_samples:
+        sample = rssi_samples.get(address)
+
+    if sample is None or time.time() - sample.timestamp > rssi_sample_max_age:
+        return None
+
+    return sample.rssi
+
+
 # ------ [ Methods - DBus & BlueZ ] -------------------------------------------
 
 
@@ -1543,6 +1655,13 @@ if __name__ == '__main__':
     parser.add_argument("-n", "--node", help="Node mode", nargs='?',
                         choices=['auto', 'central', 'peripheral'],
                         const="auto", default="auto", type=str)
+    parser.add_argument("-r", "--rssi-sampler",
+                        help="Read RSSI with the rssi-sampler program at "
+                             "this path instead of over DBus", nargs='?',
+                        const="./build/rssi-sampler", default=None, type=str)
+    parser.add_argument("--rssi-rate", help="RSSI samples per second",
+                        choices=range(10, 101), metavar="10-100",
+                        default=10, type=int)
     args = parser.parse_args()
 
     # Bus setup
@@ -1551,6 +1670,10 @@ if __name__ == '__main__':
     # Register signal handlers
     register_signal_handlers()
 
+    # Read RSSI from the controller
+    if args.rssi_sampler is not None:
+        rssi_sampler_start(args.rssi_sampler, args.rssi_rate)
+
     # Program Modes
     if args.program == "monitor":
         print("Program mode: Connection Monitor")
@@ -1586,4 +1709,5 @@ if __name__ == '__main__':
             print("Node mode: Peripheral")
             # TODO: Implement
 
+    rssi_sampler_stop()
     print("Done with program!")
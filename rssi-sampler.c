@@ -0,0 +1,637 @@
+/**
+ * Sample the RSSI of Bluetooth links straight from the controller, without
+ * going through BlueZ over D-Bus.
+ *
+ * Every tick the RSSI of each active connection is read with the HCI Read
+ * RSSI command. With --scan the LE Advertising Report events seen on a raw
+ * HCI socket are sampled as well. Every sample is printed as one line:
+ *
+ *     <wall clock seconds> <conn|adv> <address> <rssi>
+ *
+ * With --shm the samples are written to a ring in POSIX shared memory
+ * instead, together with the transmit power and link quality. The ring has
+ * a single writer and any number of readers that never block it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "libl2capx/l2capx.h"
+
+// Sample rate limits in Hz (see --rate)
+#define RATE_MIN 10
+#define RATE_MAX 100
+
+// Connections read per tick, the kernel reports at most this many
+#define MAX_CONNECTIONS 16
+
+// Advertisers remembered between ticks, the oldest is replaced when full
+#define MAX_ADVERTISERS 64
+
+// Timeout of HCI commands in milliseconds
+#define HCI_TIMEOUT 1000
+
+// Passive scan with a 10 ms interval and window, in units of 0.625 ms
+#define SCAN_INTERVAL 0x0010
+#define SCAN_WINDOW 0x0010
+
+// Advertising data type of the TX Power Level field
+#define AD_TYPE_TX_POWER 0x0a
+
+// Shared memory ring layout (see --shm), version 1
+#define SHM_MAGIC "RSSISHM"
+#define SHM_VERSION 1
+#define SHM_RECORDS 4096
+
+// Sample sources
+#define SAMPLE_CONNECTION 0
+#define SAMPLE_ADVERTISEMENT 1
+
+// Sample flags, set for the optional fields that hold a value
+#define SAMPLE_HAS_TX_POWER 0x01
+#define SAMPLE_HAS_LINK_QUALITY 0x02
+
+// One sample, it is also the record layout of the shared memory ring
+struct rssi_sample {
+    uint64_t timestamp_ns;
+    bdaddr_t bdaddr;
+    uint8_t source;
+    uint8_t flags;
+    int8_t rssi;
+    int8_t tx_power;
+    uint8_t link_quality;
+    uint8_t reserved;
+    uint16_t handle;
+    uint16_t padding;
+};
+
+_Static_assert(sizeof(struct rssi_sample) == 24, "sample record size");
+
+// Shared memory ring. The writer fills record head % capacity and then
+// publishes it by incrementing head, old records are overwritten. A reader
+// keeps its own position and, after copying out records, re-reads head and
+// only keeps records numbered above head - capacity, the others may have
+// been overwritten while it was copying.
+struct rssi_shm {
+    char magic[8];
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t record_size;
+    uint16_t reserved;
+    uint32_t capacity;
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) struct rssi_sample records[SHM_RECORDS];
+};
+
+// Sampler settings (see --device, --rate and --scan)
+int DEVICE_ID = -1;
+long RATE = RATE_MIN;
+int SCAN_MODE = 0;
+
+// Shared memory ring the samples go to instead of stdout (see --shm)
+const char *SHM_NAME = NULL;
+struct rssi_shm *SHM = NULL;
+
+// Latest advertising report of an advertiser
+struct advertiser {
+    struct rssi_sample sample;
+    int updated;
+    uint64_t last_seen;
+};
+
+struct advertiser ADVERTISERS[MAX_ADVERTISERS];
+int ADVERTISER_COUNT = 0;
+
+/**
+ * Create the shared memory ring and publish its header. The header is
+ * complete once the magic is set, readers wait for it.
+ *
+ * @param name The name of the shared memory object, e.g. "/rssi-sampler".
+ * @return 0 on success, -1 on failure.
+ */
+int shm_ring_open(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        perror("failed to create shared memory");
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(*SHM)) < 0) {
+        perror("failed to size shared memory");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    SHM = mmap(NULL, sizeof(*SHM), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (SHM == MAP_FAILED) {
+        perror("failed to map shared memory");
+        SHM = NULL;
+        shm_unlink(name);
+        return -1;
+    }
+
+    SHM->version = SHM_VERSION;
+    SHM->header_size = offsetof(struct rssi_shm, records);
+    SHM->record_size = sizeof(struct rssi_sample);
+    SHM->capacity = SHM_RECORDS;
+    atomic_store_explicit(&SHM->head, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(SHM->magic, SHM_MAGIC, sizeof(SHM->magic));
+    return 0;
+}
+
+/**
+ * Unmap and remove the shared memory ring, readers that still have it
+ * mapped keep their copy.
+ *
+ * @param name The name of the shared memory object.
+ */
+void shm_ring_close(const char *name) {
+    if (!SHM)
+        return;
+
+    munmap(SHM, sizeof(*SHM));
+    shm_unlink(name);
+    SHM = NULL;
+}
+
+/**
+ * Output one sample, to the shared memory ring or as a line on stdout.
+ *
+ * @param sample The sample.
+ */
+void emit_sample(const struct rssi_sample *sample) {
+    uint64_t head;
+    char addr[18];
+
+    if (SHM) {
+        head = atomic_load_explicit(&SHM->head, memory_order_relaxed);
+        SHM->records[head % SHM_RECORDS] = *sample;
+        atomic_store_explicit(&SHM->head, head + 1, memory_order_release);
+        return;
+    }
+
+    ba2str(&sample->bdaddr, addr);
+    printf("%llu.%06llu %s %s %d\n",
+           (unsigned long long)(sample->timestamp_ns / 1000000000ull),
+           (unsigned long long)(sample->timestamp_ns % 1000000000ull / 1000),
+           sample->source == SAMPLE_CONNECTION ? "conn" : "adv", addr,
+           sample->rssi);
+}
+
+/**
+ * Read the RSSI of every active connection of the adapter, the transmit
+ * power and the link quality are read when the shared memory ring is used.
+ *
+ * @param dd The HCI device descriptor.
+ * @return The number of connections sampled, -1 on failure.
+ */
+int sample_connections(int dd) {
+    struct hci_conn_list_req *list;
+    struct hci_conn_info *info;
+    struct rssi_sample sample;
+    int index, sampled = 0;
+
+    list = calloc(1, sizeof(*list) + MAX_CONNECTIONS * sizeof(*info));
+    if (!list)
+        return -1;
+
+    list->dev_id = DEVICE_ID;
+    list->conn_num = MAX_CONNECTIONS;
+
+    if (ioctl(dd, HCIGETCONNLIST, (void *) list) < 0) {
+        perror("failed to list connections");
+        free(list);
+        return -1;
+    }
+
+    for (index = 0; index < list->conn_num; index++) {
+        info = &list->conn_info[index];
+
+        // Read RSSI is only defined for ACL links, BR/EDR and LE alike
+        if (info->type != ACL_LINK && info->type != LE_LINK)
+            continue;
+
+        memset(&sample, 0, sizeof(sample));
+        sample.source = SAMPLE_CONNECTION;
+        sample.handle = info->handle;
+        bacpy(&sample.bdaddr, &info->bdaddr);
+
+        // The link can go away between listing and reading it
+        if (hci_read_rssi(dd, htobs(info->handle), &sample.rssi,
+                          HCI_TIMEOUT) < 0)
+            continue;
+
+        sample.timestamp_ns = realtime_ns();
+
+        // Current transmit power, and link quality which LE links lack
+        if (SHM && hci_read_transmit_power_level(dd, htobs(info->handle), 0x00,
+                                                 &sample.tx_power,
+                                                 HCI_TIMEOUT) == 0)
+            sample.flags |= SAMPLE_HAS_TX_POWER;
+
+        if (SHM && info->type == ACL_LINK &&
+            hci_read_link_quality(dd, htobs(info->handle),
+                                  &sample.link_quality, HCI_TIMEOUT) == 0)
+            sample.flags |= SAMPLE_HAS_LINK_QUALITY;
+
+        emit_sample(&sample);
+        sampled++;
+    }
+
+    free(list);
+    return sampled;
+}
+
+/**
+ * Remember an advertising report until the next tick, only the latest
+ * report of every advertiser is sampled.
+ *
+ * @param sample The sample of the report.
+ */
+void record_advertiser(const struct rssi_sample *sample) {
+    struct advertiser *slot = NULL;
+    int index;
+
+    for (index = 0; index < ADVERTISER_COUNT; index++) {
+        if (!bacmp(&ADVERTISERS[index].sample.bdaddr, &sample->bdaddr)) {
+            slot = &ADVERTISERS[index];
+            break;
+        }
+    }
+
+    if (!slot && ADVERTISER_COUNT < MAX_ADVERTISERS)
+        slot = &ADVERTISERS[ADVERTISER_COUNT++];
+
+    if (!slot) {
+        slot = &ADVERTISERS[0];
+        for (index = 1; index < ADVERTISER_COUNT; index++) {
+            if (ADVERTISERS[index].last_seen < slot->last_seen)
+                slot = &ADVERTISERS[index];
+        }
+    }
+
+    slot->sample = *sample;
+    slot->updated = 1;
+    slot->last_seen = now_ns();
+}
+
+/**
+ * Sample the advertisers heard since the last tick. The samples are stamped
+ * now, after the connection samples of the tick, so the output stays in
+ * time order.
+ */
+void sample_advertisers() {
+    uint64_t timestamp_ns = realtime_ns();
+    int index;
+
+    for (index = 0; index < ADVERTISER_COUNT; index++) {
+        if (!ADVERTISERS[index].updated)
+            continue;
+
+        ADVERTISERS[index].sample.timestamp_ns = timestamp_ns;
+        emit_sample(&ADVERTISERS[index].sample);
+        ADVERTISERS[index].updated = 0;
+    }
+}
+
+/**
+ * Find the TX Power Level field in advertising data.
+ *
+ * @param data The advertising data.
+ * @param length The number of bytes in data.
+ * @param tx_power Set to the advertised transmit power if it is found.
+ * @return 1 if the field was found, 0 if it was not.
+ */
+int find_tx_power(const uint8_t *data, size_t length, int8_t *tx_power) {
+    size_t offset = 0;
+
+    // Every field is its length, its type and then length - 1 bytes
+    while (offset + 1 < length && data[offset] > 0) {
+        if (offset + 1 + data[offset] > length)
+            return 0;
+
+        if (data[offset + 1] == AD_TYPE_TX_POWER && data[offset] == 2) {
+            *tx_power = (int8_t) data[offset + 2];
+            return 1;
+        }
+
+        offset += 1 + data[offset];
+    }
+
+    return 0;
+}
+
+/**
+ * Parse an LE Advertising Report event. One event carries one or more
+ * reports, each followed by its advertising data and then its RSSI.
+ *
+ * @param data The event parameters after the subevent code.
+ * @param length The number of bytes in data.
+ */
+void parse_advertising_report(const uint8_t *data, size_t length) {
+    const le_advertising_info *info;
+    struct rssi_sample sample;
+    size_t offset = 1;
+    uint8_t reports, index;
+
+    if (length < 1)
+        return;
+
+    reports = data[0];
+    for (index = 0; index < reports; index++) {
+        if (offset + LE_ADVERTISING_INFO_SIZE > length)
+            return;
+
+        info = (const le_advertising_info *) (data + offset);
+        offset += LE_ADVERTISING_INFO_SIZE + info->length;
+        if (offset + 1 > length)
+            return;
+
+        // Stamped when it is sampled at the next tick
+        memset(&sample, 0, sizeof(sample));
+        sample.source = SAMPLE_ADVERTISEMENT;
+        sample.rssi = (int8_t) data[offset];
+        bacpy(&sample.bdaddr, &info->bdaddr);
+        if (find_tx_power(info->data, info->length, &sample.tx_power))
+            sample.flags |= SAMPLE_HAS_TX_POWER;
+
+        record_advertiser(&sample);
+        offset++;
+    }
+}
+
+/**
+ * Read every HCI event queued on the scan socket.
+ *
+ * @param scan_fd The raw HCI socket.
+ * @return 0 when the socket is drained, -1 on failure.
+ */
+int read_scan_events(int scan_fd) {
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    const hci_event_hdr *hdr;
+    const evt_le_meta_event *meta;
+    ssize_t length;
+
+    while (1) {
+        length = recv(scan_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("failed to read HCI event");
+            return -1;
+        }
+
+        // Packet type, event header, then the LE subevent code
+        if (length < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE ||
+            buf[0] != HCI_EVENT_PKT)
+            continue;
+
+        hdr = (const hci_event_hdr *) (buf + 1);
+        if (hdr->evt != EVT_LE_META_EVENT)
+            continue;
+
+        meta = (const evt_le_meta_event *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+        if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+            continue;
+
+        parse_advertising_report(meta->data,
+                                 length - 1 - HCI_EVENT_HDR_SIZE -
+                                 EVT_LE_META_EVENT_SIZE);
+    }
+}
+
+/**
+ * Open a raw HCI socket that only receives LE meta events.
+ *
+ * @return The socket, -1 on failure.
+ */
+int open_scan_socket() {
+    struct hci_filter filter;
+    int scan_fd = hci_open_dev(DEVICE_ID);
+
+    if (scan_fd < 0) {
+        perror("failed to open HCI device");
+        return -1;
+    }
+
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+
+    if (setsockopt(scan_fd, SOL_HCI, HCI_FILTER, &filter,
+                   sizeof(filter)) < 0) {
+        perror("failed to set HCI filter");
+        hci_close_dev(scan_fd);
+        return -1;
+    }
+
+    return scan_fd;
+}
+
+/**
+ * Start a passive LE scan. Scanning is refused while BlueZ is discovering,
+ * the reports of its scan still reach the raw socket then.
+ *
+ * @param dd The HCI device descriptor.
+ * @return 1 if the scan was started here, 0 if it was not.
+ */
+int scan_start(int dd) {
+    if (hci_le_set_scan_parameters(dd, 0x00, htobs(SCAN_INTERVAL),
+                                   htobs(SCAN_WINDOW), 0x00, 0x00,
+                                   HCI_TIMEOUT) < 0 ||
+        hci_le_set_scan_enable(dd, 0x01, 0x00, HCI_TIMEOUT) < 0) {
+        fprintf(stderr, "could not start an LE scan (%s), sampling the "
+                        "reports of the running scan\n", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "options:\n"
+            "  --device hciN        adapter to sample (default: the first "
+            "one)\n"
+            "  --rate HZ            samples per second, %d-%d "
+            "(default: %d)\n"
+            "  --scan               also sample LE advertising reports\n"
+            "  --shm NAME           write the samples to a shared memory "
+            "ring instead of\n"
+            "                       stdout, e.g. /rssi-sampler\n",
+            program, RATE_MIN, RATE_MAX, RATE_MIN);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction signal_action = { 0 };
+    struct itimerspec sample_timer = { 0 };
+    struct pollfd fds[3];
+    int dd, timer_fd, scan_fd = -1, scanning = 0, arg, nfds, ready;
+    uint64_t expirations;
+    ssize_t result;
+    static struct option long_options[] = {
+        {"device", required_argument, 0, 'd'},
+        {"rate",   required_argument, 0, 'r'},
+        {"scan",   no_argument,       0, 's'},
+        {"shm",    required_argument, 0, 'S'},
+        {0, 0, 0, 0}
+    };
+
+    while ((arg = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (arg) {
+            case 'd':
+                DEVICE_ID = hci_devid(optarg);
+                if (DEVICE_ID < 0) {
+                    fprintf(stderr, "unknown device: %s\n", optarg);
+                    exit(2);
+                }
+                break;
+            case 'r':
+                RATE = parse_number(argv[0], optarg);
+                break;
+            case 's':
+                SCAN_MODE = 1;
+                break;
+            case 'S':
+                SHM_NAME = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(2);
+        }
+    }
+
+    if (RATE < RATE_MIN || RATE > RATE_MAX) {
+        fprintf(stderr, "rate must be between %d and %d Hz\n",
+                RATE_MIN, RATE_MAX);
+        exit(2);
+    }
+
+    if (DEVICE_ID < 0)
+        DEVICE_ID = hci_get_route(NULL);
+
+    if (DEVICE_ID < 0) {
+        fprintf(stderr, "no Bluetooth adapter found\n");
+        exit(1);
+    }
+
+    // Raw HCI sockets need CAP_NET_RAW
+    dd = hci_open_dev(DEVICE_ID);
+    if (dd < 0) {
+        perror("failed to open HCI device");
+        exit(1);
+    }
+
+    QUIT_EVENT_FD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (QUIT_EVENT_FD < 0) {
+        perror("failed to create quit event");
+        exit(1);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("failed to create sample timer");
+        exit(1);
+    }
+
+    sample_timer.it_interval.tv_nsec = 1000000000L / RATE;
+    sample_timer.it_value = sample_timer.it_interval;
+    if (timerfd_settime(timer_fd, 0, &sample_timer, NULL) < 0) {
+        perror("failed to start sample timer");
+        exit(1);
+    }
+
+    if (SHM_NAME && shm_ring_open(SHM_NAME) < 0)
+        exit(1);
+
+    // Command completions are read on dd, the reports on their own socket
+    if (SCAN_MODE) {
+        scan_fd = open_scan_socket();
+        if (scan_fd < 0)
+            exit(1);
+        scanning = scan_start(dd);
+    }
+
+    signal_action.sa_handler = handler_signal_interrupt;
+    sigemptyset(&signal_action.sa_mask);
+    sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGTERM, &signal_action, NULL);
+
+    // A closed pipe ends the sampler like an interrupt
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0] = (struct pollfd) { .fd = QUIT_EVENT_FD, .events = POLLIN };
+    fds[1] = (struct pollfd) { .fd = timer_fd, .events = POLLIN };
+    fds[2] = (struct pollfd) { .fd = scan_fd, .events = POLLIN };
+    nfds = SCAN_MODE ? 3 : 2;
+
+    while (!get_flag_quit()) {
+        ready = poll(fds, nfds, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("failed to wait for events");
+            break;
+        }
+
+        if (SCAN_MODE && (fds[2].revents & POLLIN) &&
+            read_scan_events(scan_fd) < 0)
+            break;
+
+        if (!(fds[1].revents & POLLIN))
+            continue;
+
+        // Missed ticks are not made up, the next sample is simply late
+        result = read(timer_fd, &expirations, sizeof(expirations));
+        (void)result;
+
+        if (sample_connections(dd) < 0)
+            break;
+
+        if (SCAN_MODE)
+            sample_advertisers();
+
+        if (!SHM && fflush(stdout) == EOF)
+            break;
+    }
+
+    if (scanning)
+        hci_le_set_scan_enable(dd, 0x00, 0x00, HCI_TIMEOUT);
+
+    if (scan_fd >= 0)
+        hci_close_dev(scan_fd);
+
+    shm_ring_close(SHM_NAME);
+    close(timer_fd);
+    close(QUIT_EVENT_FD);
+    hci_close_dev(dd);
+    return 0;
+}
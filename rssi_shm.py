@@ -0,0 +1,193 @@
+"""Reader for the shared memory ring written by rssi-sampler (see --shm).
+
+The sampler is the only writer. Every reader keeps its own position, so any
+number of readers can follow the ring without slowing the sampler down.
+Records are unpacked straight from the mapped memory, nothing is copied
+before that.
+"""
+from typing import List, NamedTuple, Union
+import mmap
+import os
+import struct
+import time
+
+# ------ [ Constants ] --------------------------------------------------------
+
+SHM_DIRECTORY: str = "/dev/shm/"
+SHM_MAGIC: bytes = b"RSSISHM\0"
+SHM_VERSION: int = 1
+
+# Magic, version, header size, record size, reserved, capacity
+SHM_HEADER: struct.Struct = struct.Struct("<8sHHHHI")
+
+# Offset of the number of records written so far
+SHM_HEAD: struct.Struct = struct.Struct("<Q")
+SHM_HEAD_OFFSET: int = 64
+
+# Timestamp, address, source, flags, RSSI, TX power, link quality,
+# reserved, handle, padding
+SHM_RECORD: struct.Struct = struct.Struct("<Q6sBBbbBBHH")
+
+SAMPLE_CONNECTION: int = 0
+SAMPLE_ADVERTISEMENT: int = 1
+
+SAMPLE_HAS_TX_POWER: int = 0x01
+SAMPLE_HAS_LINK_QUALITY: int = 0x02
+
+
+class RssiSample(NamedTuple):
+    timestamp: float
+    address: str
+    source: int
+    rssi: int
+    tx_power: Union[int, None]
+    link_quality: Union[int, None]
+    handle: int
+
+
+# ------ [ Reader ] -----------------------------------------------------------
+
+
+class RssiRing:
+    """A reader of the shared memory ring."""
+
+    def __init__(self, name: str, timeout: float = 5.0) -> None:
+        """Map the ring, waiting for the sampler to create it.
+
+        :param name: The name of the shared memory object, e.g.
+        "/rssi-sampler".
+        :param timeout: Seconds to wait for the sampler.
+        :return: Nothing
+        """
+        self._map = self._wait_for_map(SHM_DIRECTORY + name.lstrip("/"),
+                                       timeout)
+        self._view = memoryview(self._map)
+
+        _, version, self._header_size, self._record_size, _, \
+            self._capacity = SHM_HEADER.unpack_from(self._view, 0)
+        if version != SHM_VERSION or self._record_size != SHM_RECORD.size:
+            self.close()
+            raise ValueError("unsupported RSSI ring version " + str(version))
+
+        # Start with the oldest record still in the ring
+        self.position = max(0, self._head() - self._capacity + 1)
+        self.lost = 0
+
+    @staticmethod
+    def _wait_for_map(path: str, timeout: float) -> mmap.mmap:
+        """Map the ring once the sampler has published its header.
+
+        :param path: The path to the shared memory object.
+        :param timeout: Seconds to wait.
+        :return: The read-only mapping.
+        """
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                fd = os.open(path, os.O_RDONLY)
+                try:
+                    ring_map = mmap.mmap(fd, 0, access=mmap.ACCESS_READ)
+                finally:
+                    os.close(fd)
+
+                if ring_map[0:len(SHM_MAGIC)] == SHM_MAGIC:
+                    return ring_map
+                ring_map.close()
+            except (FileNotFoundError, ValueError):
+                # Not created, or not sized yet
+                pass
+
+            if time.monotonic() > deadline:
+                raise TimeoutError("no RSSI ring at " + path)
+            time.sleep(0.05)
+
+    def _head(self) -> int:
+        """Get the number of records written so far.
+
+        :return: The number of records.
+        """
+        return SHM_HEAD.unpack_from(self._view, SHM_HEAD_OFFSET)[0]
+
+    def read(self) -> List[RssiSample]:
+        """Read the records written since the last read. Records the sampler
+        overwrote before they were read are counted in lost.
+
+        :return: The new samples, oldest first.
+        """
+        head = self._head()
+        start = max(self.position, head - self._capacity + 1)
+        self.lost += start - self.position
+
+        records = [
+            SHM_RECORD.unpack_from(
+                self._view,
+                self._header_size +
+                (number % self._capacity) * self._record_size)
+            for number in range(start, head)]
+
+        # Drop the records the sampler may have overwritten while copying
+        overwritten = self._head() - self._capacity + 1 - start
+        if overwritten > 0:
+            records = records[overwritten:]
+            self.lost += min(overwritten, head - start)
+
+        self.position = head
+        return [make_sample(record) for record in records]
+
+    def close(self) -> None:
+        """Unmap the ring.
+
+        :return: Nothing
+        """
+        self._view.release()
+        self._map.close()
+
+
+def read_ring_file(path: str) -> List[RssiSample]:
+    """Read the records of a ring saved to a file, e.g. a copy of
+    /dev/shm/<name> taken during an experiment, or a live ring at once.
+
+    :param path: The path to the ring.
+    :return: The samples still in the ring, oldest first.
+    """
+    with open(path, "rb") as file:
+        ring_map = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+
+    with ring_map:
+        magic, version, header_size, record_size, _, capacity = \
+            SHM_HEADER.unpack_from(ring_map, 0)
+        if magic != SHM_MAGIC:
+            raise ValueError("not an RSSI ring")
+        if version != SHM_VERSION or record_size != SHM_RECORD.size:
+            raise ValueError("unsupported RSSI ring version " + str(version))
+
+        head = SHM_HEAD.unpack_from(ring_map, SHM_HEAD_OFFSET)[0]
+
+        # The record the sampler writes next may be half written
+        return [make_sample(SHM_RECORD.unpack_from(
+                    ring_map,
+                    header_size + (number % capacity) * record_size))
+                for number in range(max(0, head - capacity + 1), head)]
+
+
+# ------ [ Helper Methods ] ---------------------------------------------------
+
+
+def make_sample(record: tuple) -> RssiSample:
+    """Make a sample from an unpacked record.
+
+    :param record: The fields of the record.
+    :return: The sample.
+    """
+    timestamp_ns, bdaddr, source, flags, rssi, tx_power, link_quality, \
+        _, handle, _ = record
+
+    return RssiSample(
+        timestamp=timestamp_ns / 1e9,
+        address=":".join("%02X" % byte for byte in reversed(bdaddr)),
+        source=source,
+        rssi=rssi,
+        tx_power=tx_power if flags & SAMPLE_HAS_TX_POWER else None,
+        link_quality=link_quality if flags & SAMPLE_HAS_LINK_QUALITY
+        else None,
+        handle=handle)